@@ -0,0 +1,101 @@
+/**
+ * @file ascii.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Vectorized conversion of the data of ASCII mode transfers (TYPE A)
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef ASCII_H
+#define ASCII_H
+
+#include "utils.h"
+
+/**
+ * @brief Implementation of the conversions for a given instruction set
+ *
+ */
+typedef struct _ascii_impl
+{
+    const char *name;                                                          /*!< Name of the instruction set*/
+    int (*supported)();                                                        /*!< Returns 1 if the processor can run it*/
+    size_t (*encode)(const char *src, size_t len, char *dst);                  /*!< LF to CRLF, high bit cleared*/
+    size_t (*decode)(const char *src, size_t len, char *dst, int *cr_pending); /*!< CRLF to LF*/
+} ascii_impl;
+
+/**
+ * @brief Conversion state and buffer of a transfer, reused for all its blocks
+ *
+ */
+typedef struct _ascii_transcoder
+{
+    char *buf;      /*!< Converted block*/
+    size_t size;    /*!< Size of buf*/
+    int cr_pending; /*!< The last block received ended in CR, which is resolved with the next one*/
+} ascii_transcoder;
+
+/**
+ * @brief Allocate the buffer of a transcoder
+ *
+ * @param t Transcoder
+ * @param block Largest block that will be converted at once
+ * @return int less than 0 on error
+ */
+int ascii_transcoder_init(ascii_transcoder *t, size_t block);
+
+/**
+ * @brief Release the buffer of a transcoder
+ *
+ * @param t Transcoder
+ */
+void ascii_transcoder_free(ascii_transcoder *t);
+
+/**
+ * @brief Convert local text to network ASCII: LF becomes CRLF and the high bit of every byte is cleared
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination, at least 2 * len bytes
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_encode(const char *src, size_t len, char *dst);
+
+/**
+ * @brief Convert network ASCII to local text: CRLF becomes LF, even if the pair is split between two blocks
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination, at least len + 1 bytes
+ * @param cr_pending In: the previous block ended in CR. Out: this block ends in CR
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode(const char *src, size_t len, char *dst, int *cr_pending);
+
+/**
+ * @brief Write the CR that ended the last block of a transfer, if there was one
+ *
+ * @param dst Destination, at least 1 byte
+ * @param cr_pending Decoding state, it is cleared
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode_flush(char *dst, int *cr_pending);
+
+/**
+ * @brief Every implementation compiled in, from the slowest to the fastest
+ *
+ * @param n_impls Where to store the number of implementations
+ * @return const ascii_impl* Implementations
+ */
+const ascii_impl *ascii_implementations(int *n_impls);
+
+/**
+ * @brief Implementation selected for this processor
+ *
+ * @return const ascii_impl* Implementation used by ascii_encode and ascii_decode
+ */
+const ascii_impl *ascii_selected();
+
+#endif /*ASCII_H*/
@@ -44,4 +44,15 @@ IMPLEMENTED_COMMANDS
  */
 uintptr_t command_callback(serverconf *server_conf, session_info *session, request_info *command);
 
+/**
+ * @brief Finish the negotiation started by AUTH
+ *
+ * @param server_conf Server configuration
+ * @param session FTP session
+ * @param hs Handshake of the session, released if it is session->handshake
+ * @param status Result of the handshake
+ * @return uintptr_t CALLBACK_RET_DONT_SEND if the session is now secure, CALLBACK_RET_END_CONNECTION if not
+ */
+uintptr_t auth_handshake_done(serverconf *server_conf, session_info *session, handshake_state *hs, handshake_status status);
+
 #endif
\ No newline at end of file
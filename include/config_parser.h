@@ -11,6 +11,8 @@
 #define PARSER_H
 #include "utils.h"
 #include "network.h"
+#include "passive_pool.h"
+#include "crypto_pool.h"
 
 #define CONF_FILE "server.conf" /*!< configuration file*/
 
@@ -45,6 +47,55 @@
 #define PRIVATE_KEY_PATH "private_key_path" /*!< Path field to private key file*/
 #define PRIVATE_KEY_PATH_DEFAULT ""         /*!< Default value base directory*/
 #define PRIVATE_KEY_PATH_MAX XL_SZ + 1      /*!< Maximum size of server path to private key file*/
+
+#define ECDSA_CERTIFICATE_PATH "ecdsa_certificate_path" /*!< Path field to the ECDSA certificate, served besides the other one*/
+#define ECDSA_PRIVATE_KEY_PATH "ecdsa_private_key_path" /*!< Path field to the private key of the ECDSA certificate*/
+#define ECDSA_PATH_DEFAULT ""                           /*!< Default value, only the certificate of certificate_path*/
+
+#define SERVER_MODEL "server_model"  /*!< Field for the model that serves control connections*/
+#define SERVER_MODEL_DEFAULT "epoll" /*!< Default value, event loops with epoll*/
+
+#define REACTOR_THREADS "reactor_threads" /*!< Field for the number of event loop threads*/
+#define REACTOR_THREADS_DEFAULT 0         /*!< Default value, one event loop per core*/
+
+#define TRANSFER_WORKERS "transfer_workers" /*!< Field for the number of workers that serve data transfers*/
+#define TRANSFER_WORKERS_DEFAULT 0          /*!< Default value, two workers per core*/
+
+#define KTLS_OFFLOAD "ktls_offload" /*!< Field to let the kernel encrypt the downloads*/
+#define KTLS_OFFLOAD_DEFAULT 0      /*!< Default value, always encrypt in user space*/
+
+#define CLEAR_DATA_NETWORKS "clear_data_networks" /*!< Field for the networks whose sessions may use PROT C*/
+#define CLEAR_DATA_NETWORKS_DEFAULT ""            /*!< Default value, data connections are always encrypted*/
+#define CLEAR_NETS_MAX SMALL_SZ                   /*!< Maximum number of networks*/
+
+#define METRICS_PORT "metrics_port" /*!< Field for the loopback port where the metrics are served*/
+#define METRICS_PORT_DEFAULT 0      /*!< Default value, metrics are not served*/
+
+#define PASV_PORT_MIN "pasv_port_min" /*!< Field for the first port of the passive range*/
+#define PASV_PORT_MAX "pasv_port_max" /*!< Field for the last port of the passive range*/
+#define PASV_PORT_DEFAULT 0           /*!< Default value, the system chooses the passive ports*/
+
+#define TLS_MIN_VERSION "tls_min_version" /*!< Field for the oldest TLS version accepted*/
+#define TLS_MIN_VERSION_DEFAULT "1.2"     /*!< Default value, TLS 1.2*/
+#define TLS_MAX_VERSION "tls_max_version" /*!< Field for the newest TLS version accepted*/
+#define TLS_MAX_VERSION_DEFAULT "1.3"     /*!< Default value, TLS 1.3*/
+
+#define KEYSHARE_POOL_SIZE "keyshare_pool_size" /*!< Field for the ephemeral keys kept ready for every curve*/
+#define KEYSHARE_POOL_SIZE_DEFAULT 32           /*!< Default value*/
+#define KEYSHARE_POOL_SIZE_MAX 4096             /*!< Maximum keys ready for every curve*/
+
+#define CRYPTO_WORKERS "crypto_workers" /*!< Field for the number of workers that compute the RSA signatures*/
+#define CRYPTO_WORKERS_DEFAULT 0        /*!< Default value, one per crypto core*/
+#define CRYPTO_CORES "crypto_cores"     /*!< Field for the cores where the crypto workers are pinned*/
+#define CRYPTO_CORES_DEFAULT ""         /*!< Default value, signatures are computed by the thread of the handshake*/
+
+#define ACCEPT_SHARDS "accept_shards"   /*!< Field for the number of acceptors of the control port, each with its own socket*/
+#define ACCEPT_SHARDS_DEFAULT 0         /*!< Default value, one per core*/
+#define ACCEPT_SHARDS_MAX 64            /*!< Maximum number of acceptors*/
+#define LISTEN_BACKLOG "listen_backlog" /*!< Field for the connections queued in each socket of the control port*/
+#define LISTEN_BACKLOG_DEFAULT 128      /*!< Default value*/
+#define DEFER_ACCEPT "defer_accept"     /*!< Field for the seconds the kernel waits for the first data of a client before it is accepted*/
+#define DEFER_ACCEPT_DEFAULT 0          /*!< Default value, clients are accepted as soon as they connect*/
 /**
  * @brief Contains general information about the server, which includes the information parsed in server.conf
  *
@@ -53,7 +104,9 @@ typedef struct _serverconf
 {
     char server_root[SERVER_ROOT_MAX];           /*!< Root of the path where the files are searched*/
     int max_passive_ports;                       /*!< Maximum number of ports that can be opened in passive mode*/
-    sem_t free_passive_ports;                    /*!< How many more data ports can be opened*/
+    int pasv_port_min;                           /*!< First port of the passive range, 0 if the system chooses them*/
+    int pasv_port_max;                           /*!< Last port of the passive range, 0 if the system chooses them*/
+    passive_pool passive_ports;                  /*!< Listening sockets bound at startup for PASV*/
     char ftp_user[FTP_USER_MAX];                 /*!< Username associated with the ftp server*/
     char ftp_host[FTP_HOST_MAX];                 /*!< Host where the server will be deployed*/
     int max_sessions;                            /*!< Maximum concurrent FTP sessions*/
@@ -61,7 +114,25 @@ typedef struct _serverconf
     TLS *server_ctx;                             /*!< Contexto TLS general*/
     char certificate_path[CERTIFICATE_PATH_MAX]; /*!< Path to the x.509 certificate*/
     char private_key_path[PRIVATE_KEY_PATH_MAX]; /*!< Path to file with private key*/
+    char ecdsa_cert_path[CERTIFICATE_PATH_MAX];  /*!< Path to the ECDSA x.509 certificate, empty if there is none*/
+    char ecdsa_key_path[PRIVATE_KEY_PATH_MAX];   /*!< Path to the private key of the ECDSA certificate*/
     int daemon_mode;                             /*!< Indicates whether to run in daemon mode*/
+    int use_reactor;                             /*!< Control connections are served by epoll event loops instead of a thread each*/
+    int reactor_threads;                         /*!< Number of event loop threads, 0 for one per core*/
+    int transfer_workers;                        /*!< Number of workers that serve RETR, STOR and LIST, 0 for two per core*/
+    int ktls_offload;                            /*!< Indicates whether binary downloads may use kernel TLS and sendfile*/
+    ip_network clear_networks[CLEAR_NETS_MAX];   /*!< Networks whose authenticated sessions may use unencrypted data connections*/
+    int n_clear_networks;                        /*!< Number of networks in clear_networks*/
+    int metrics_port;                            /*!< Port of 127.0.0.1 where the metrics are served over HTTP, 0 to disable*/
+    unsigned short tls_min_version;              /*!< Oldest TLS version accepted, TLS_V10 to TLS_V13*/
+    unsigned short tls_max_version;              /*!< Newest TLS version accepted, TLS_V10 to TLS_V13*/
+    int keyshare_pool_size;                      /*!< Ephemeral keys generated ahead for every curve, 0 to generate them in the handshake*/
+    int crypto_workers;                          /*!< Number of workers that compute the RSA signatures, 0 for one per crypto core*/
+    int crypto_cores[CRYPTO_CORES_MAX];          /*!< Cores where the crypto workers are pinned*/
+    int n_crypto_cores;                          /*!< Number of cores in crypto_cores*/
+    int accept_shards;                           /*!< Acceptors of the control port, each with its own SO_REUSEPORT socket, 0 for one per core*/
+    int listen_backlog;                          /*!< Connections queued in each socket of the control port*/
+    int defer_accept;                            /*!< Seconds TCP_DEFER_ACCEPT waits for the first data of a client, 0 to disable*/
 } serverconf;
 
 /**
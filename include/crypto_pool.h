@@ -0,0 +1,60 @@
+/**
+ * @file crypto_pool.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Workers pinned to their own cores that compute the RSA signatures of the TLS handshakes in batches
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef CRYPTO_POOL_H
+#define CRYPTO_POOL_H
+
+#include "utils.h"
+#include "tlse.h"
+
+#define CRYPTO_CORES_MAX 64 /*!< Maximum number of cores for the crypto workers*/
+#define CRYPTO_BATCH_MAX 16 /*!< Maximum signatures a worker takes from the queue at once*/
+
+/**
+ * @brief Statistics of the crypto workers since they were started
+ *
+ */
+typedef struct _crypto_stats
+{
+    int workers;              /*!< Number of workers*/
+    long queued;              /*!< Signatures waiting for a worker right now*/
+    unsigned long signatures; /*!< Signatures computed*/
+    unsigned long batches;    /*!< Times a worker took signatures from the queue*/
+} crypto_stats;
+
+/**
+ * @brief Parse a comma separated list of cores and ranges of cores, e.g. "2,3" or "4-7"
+ *
+ * @param list List of cores
+ * @param cores Where to store the cores
+ * @param max_cores Maximum number of cores
+ * @return int Number of cores or -1 if the list is not valid
+ */
+int crypto_parse_cores(char *list, int *cores, int max_cores);
+
+/**
+ * @brief Start the crypto workers, from then on the handshakes wait for them to sign
+ *
+ * @param n_workers Number of workers, if less than 1 one per core of the list, none without cores
+ * @param cores Cores where the workers are pinned in turn, any core if there are none
+ * @param n_cores Number of cores
+ * @return int Number of workers started or -1 on error
+ */
+int crypto_pool_start(int n_workers, int *cores, int n_cores);
+
+/**
+ * @brief Collect the current statistics of the crypto workers
+ *
+ * @param stats Where to store them
+ */
+void crypto_pool_stats(crypto_stats *stats);
+
+#endif /*CRYPTO_POOL_H*/
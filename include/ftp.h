@@ -12,12 +12,14 @@
 #ifndef FTP_H
 #define FTP_H
 #include "utils.h"
+#include "network.h"
 
 #define MAX_FTP_COMMAND_NAME 4     /*!< Maximum size of FTP command*/
 #define MAX_COMMAND_ARG XL_SZ      /*!< Maximum size of its argument*/
 #define MAX_COMMAND_RESPONSE XL_SZ /*!< Maximum response size*/
 #define FTP_CONTROL_PORT 21        /*!< control FTP port*/
 #define FTP_DATA_PORT 20           /*!< FTP data port (active mode)*/
+#define COMMAND_READER_SIZE XXL_SZ /*!< Bytes of the control connection buffered per session, power of two*/
 /*Enum of strings in C: https://stackoverflow.com/questions/9907160/how-to-convert-enum-names-to-string-in-c*/
 #define IMPLEMENTED_COMMANDS /*!< FTP commands implemented*/                         \
     C(ABOR)                  /*!< Abort data transmission*/                          \
@@ -48,7 +50,9 @@
     C(AUTH)                  /*!< Indicates that secure connection will be used*/    \
     C(PBSZ)                  /*!< Indicates buffer size*/                            \
     C(PROT)                  /*!< Indicates security level*/                         \
-    C(FEAT)                  /*!< Additional server features*/
+    C(FEAT)                  /*!< Additional server features*/                       \
+    C(MLSD)                  /*!< Machine readable listing of a directory*/          \
+    C(MLST)                  /*!< Machine readable information of a file*/
 
 #define C(x) x, /*!< For each command, command name followed by a comma*/
 /**
@@ -61,12 +65,12 @@ typedef enum _imp_commands
 } imp_commands;
 #undef C
 
-#define DATA_CALLBACK(cmd) (cmd == LIST || cmd == STOR || cmd == RETR) /*!< Indicates if a command makes use of a data connection*/
+#define DATA_CALLBACK(cmd) (cmd == LIST || cmd == STOR || cmd == RETR || cmd == MLSD) /*!< Indicates if a command makes use of a data connection*/
 
 #define IGNORED_COMMANDS                                                                                      \
     C(ACCT)                                                                                                   \
     C(ADAT) C(ALLO) C(APPE) C(AVBL) C(CCC) C(CONF) C(CSID) C(DSIZ) C(ENC) C(EPRT) C(EPSV) C(HOST) C(LANG)     \
-        C(LPRT) C(LPSV) C(MDTM) C(MFCT) C(MFF) C(MFMT) C(MIC) C(MLSD) C(MLST) C(NLST) C(OPTS) C(REIN) C(REST) \
+        C(LPRT) C(LPSV) C(MDTM) C(MFCT) C(MFF) C(MFMT) C(MIC) C(NLST) C(OPTS) C(REIN) C(REST) \
             C(SITE) C(SMNT) C(SPSV) C(STAT) C(STOU) C(THMB) C(XCUP) C(XMKD) C(XPWD) C(XRCP) C(XRMD) C(XRSQ) C(XSEM) C(XSEN) /*!< FTP commands recognized but ignored*/
 #define C(x) x,                                                                                                             /*!< For each command, command name followed by a comma*/
 /**
@@ -94,6 +98,19 @@ typedef struct _request_info
     int response_len;                            /*!< Size of said response*/
 } request_info;
 
+/**
+ * @brief Commands received in the control connection and not served yet.
+ * A client may send several of them at once without waiting for the replies
+ *
+ */
+typedef struct _command_reader
+{
+    char buf[COMMAND_READER_SIZE]; /*!< Ring of received bytes*/
+    size_t start;                  /*!< Position of the first byte not consumed*/
+    size_t len;                    /*!< Bytes not consumed*/
+    int discard;                   /*!< The line being received was too long and is dropped up to its end*/
+} command_reader;
+
 /**
  * @brief Returns the value of enum imp_commands associated with name
  *
@@ -134,6 +151,44 @@ char *get_ign_command_name(ign_commands command);
  */
 void parse_ftp_command(request_info *ri, char *buff);
 
+/**
+ * @brief Empty the buffer of a control connection
+ *
+ * @param r Command reader
+ */
+void command_reader_init(command_reader *r);
+
+/**
+ * @brief Receive the bytes available in the control connection, appending them to the buffer
+ *
+ * @param r Command reader
+ * @param ctx TLS context of the connection, NULL if it is not encrypted
+ * @param fd Control connection
+ * @param flags srecv flags
+ * @return ssize_t Bytes received, 0 if the connection was closed, -1 on error (errno EAGAIN if the buffer is full)
+ */
+ssize_t command_reader_fill(command_reader *r, TLS *ctx, int fd, int flags);
+
+/**
+ * @brief Take the next complete line of the buffer, the rest stays queued for the following calls
+ *
+ * @param r Command reader
+ * @param line Destination, the line is terminated with a zero
+ * @param line_size Size of line
+ * @return ssize_t Size of the line, 0 if there is no complete line, -1 if the line was too long and has been dropped
+ */
+ssize_t command_reader_line(command_reader *r, char *line, size_t line_size);
+
+/**
+ * @brief Take the first complete line of a command out of the buffer, wherever it is queued.
+ * The lines before and after it stay queued in order
+ *
+ * @param r Command reader
+ * @param command Command to look for
+ * @return int 1 if a line of the command was found and dropped, 0 otherwise
+ */
+int command_reader_take(command_reader *r, imp_commands command);
+
 /**
  * @brief Sets a response to a command
  *
@@ -151,7 +206,7 @@ int set_command_response(request_info *ri, char *response, ...);
 #define CODE_150_LIST "150 Enviando listado de directorio\r\n" /*!< Display current directory listing*/
 
 #define CODE_200_OP_OK "200 Operacion correcta\r\n"                                                               /*!< Success message*/
-#define CODE_211_FEAT "211-Features adicionales:\r\n PASV\r\n SIZE\r\n AUTH TLS\r\n PROT\r\n PBSZ\r\n211 End\r\n" /*!< FEAT Features*/
+#define CODE_211_FEAT "211-Features adicionales:\r\n PASV\r\n SIZE\r\n AUTH TLS\r\n PROT\r\n PBSZ\r\n MLST type*;size*;modify*;perm*;UNIX.mode*;UNIX.uid*;UNIX.gid*;\r\n211 End\r\n" /*!< FEAT Features*/
 #define CODE_213_FILE_SIZE "213 Tamaño de archivo: %zd Bytes\r\n"                                                 /*!< File size*/
 #define CODE_214_HELP "214 Lista de comandos implementados: "                                                     /*!< list of implemented commands*/
 #define CODE_215_SYST "215 %s OS\r\n"                                                                             /*! <Operating system*/
@@ -164,6 +219,8 @@ int set_command_response(request_info *ri, char *response, ...);
 #define CODE_25O_FILE_OP_OK "250 Operacion sobre archivo correcta\r\n"                                            /*!< Operation performed on correct file*/
 #define CODE_250_DELE_OK "250 %s borrado correctamente\r\n"                                                       /*!< File deleted successfully*/
 #define CODE_250_CHDIR_OK "250 Cambiado al directorio %s\r\n"                                                     /*!< Change directory*/
+#define CODE_250_MLST "250-Listado de %s\r\n%s250 Fin\r\n"                                                        /*!< Facts of a file*/
+#define CODE_250_DATA_TRANSFER "250 Transferencia de datos terminada, conexion abierta: %zd Bytes\r\n"            /*!< Terminates a transfer in block mode*/
 #define CODE_257_PWD_OK "257 %s\r\n"                                                                              /*!< show the current directory*/
 #define CODE_257_MKD_OK "257 %s creado\r\n"                                                                       /*!< Indicates directory created successfully*/
 
@@ -173,6 +230,7 @@ int set_command_response(request_info *ri, char *response, ...);
 #define CODE_421_BAD_TLS_NEG "421 Error en la negociacion TLS\r\n"                                               /*!< Failure in TLS negotiation*/
 #define CODE_421_DATA_OPEN "421 Ya hay una conexion de datos activa\r\n"                                         /*! <Typically PORT or PASV ante*/
 #define CODE_421_BUSY_DATA "421 Hay una transmision de datos en curso, llame a a ABORT o espere a que acabe\r\n" /*!< Transmission in progress*/
+#define CODE_421_TOO_MANY_SESSIONS "421 Demasiadas sesiones abiertas, intentelo mas tarde\r\n"                   /*!< No free session slot*/
 #define CODE_425_CANNOT_OPEN_DATA "425 No se ha podido abrir conexion de datos: %s\r\n"                          /*!< Failed to open data connection*/
 #define CODE_430_INVALID_AUTH "430 Usuario o password incorrectos\r\n"                                           /*!< Authentication error*/
 #define CODE_431_INVALID_SEC "431 %s no aceptado, use TLS\r\n"                                                   /*!< Proposed mechanism error*/
@@ -180,14 +238,16 @@ int set_command_response(request_info *ri, char *response, ...);
 #define CODE_452_NO_SPACE "452 Espacio insuficiente\r\n"                                                         /*!< No space to transmit file*/
 
 #define CODE_500_UNKNOWN_CMD "500 Comando no reconocido\r\n"                                        /*!< Unrecognized command*/
+#define CODE_500_LINE_TOO_LONG "500 Linea de comando demasiado larga\r\n"                           /*!< Command line that does not fit in the buffer*/
 #define CODE_501_BAD_ARGS "501 Error de sintaxis en los argumentos\r\n"                             /*!< Unrecognized argument*/
 #define CODE_502_NOT_IMP_CMD "502 Comando no implementado\r\n"                                      /*!< Command not implemented*/
 #define CODE_503_BAD_SEQUENCE "503 Secuencia incorrecta de comandos\r\n"                            /*!< Commands received out of order*/
 #define CODE_504_UNSUPORTED_PARAM "504 Argumento no implementado\r\n"                               /*!< Argument not supported*/
+#define CODE_504_PORT_OTHER_HOST "504 El puerto debe ser del cliente de la conexion de control\r\n"  /*!< PORT to a host other than the client*/
 #define CODE_522_NO_TLS "522 Nivel de seguridad insuficiente\r\n"                                   /*!< Not authenticated*/
 #define CODE_530_NO_LOGIN "530 Usuario no logueado\r\n"                                             /*!< Require logged in user*/
 #define CODE_534_NO_CERT "534 No se ha dado un certificado\r\n"                                     /*!< Require client certificate*/
-#define CODE_536_INSUFFICIENT_SEC "536 Nivel de seguridad no aceptado, solo vale 'P' (private)\r\n" /*!< Requires higher security level*/
+#define CODE_536_INSUFFICIENT_SEC "536 Nivel de seguridad no aceptado, use 'P' (private)\r\n" /*!< Requires higher security level*/
 #define CODE_550_NO_ACCESS "550 No se puede acceder al archivo\r\n"                                 /*!< No file access*/
 #define CODE_550_NO_DELE "550 No se ha podido borrar el archivo: %s\r\n"                            /*!< Failed to delete file*/
 #endif
\ No newline at end of file
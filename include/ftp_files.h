@@ -12,10 +12,17 @@
 #ifndef FTP_FILES_H
 #define FTP_FILES_H
 
+#include <sys/eventfd.h>
 #include "utils.h"
 #include "network.h"
 #include "tlse.h"
+#include "ascii.h"
+#include "passive_pool.h"
 #define DATA_SOCKET_TIMEOUT 60 /*!< Maximum seconds of timeout in data connection*/
+#define BLOCK_HEADER 3         /*!< Bytes of a block header in MODE B: descriptor and 16 bit count*/
+#define BLOCK_MAX 0xFFFF       /*!< Maximum data bytes of a block*/
+#define BLOCK_EOF 64           /*!< Descriptor of the last block of a file*/
+#define BLOCK_RESTART 16       /*!< Descriptor of a block that carries a restart marker instead of data*/
 /**
  * @brief Defines the possible states of an FTP data connection
  *
@@ -24,9 +31,20 @@ typedef enum _data_conn_states
 {
     DATA_CONN_CLOSED,    /*!< There is no socket currently open*/
     DATA_CONN_AVAILABLE, /*!< There is a socket ready to transmit the data*/
-    DATA_CONN_BUSY       /*!< There is a data socket open, but it is already transmitting data*/
+    DATA_CONN_BUSY,      /*!< There is a data socket open, but it is already transmitting data*/
+    DATA_CONN_KEPT       /*!< Connection established in block mode, kept open for the next transfer*/
 } data_conn_states;
 
+/**
+ * @brief Formats of a directory listing
+ *
+ */
+typedef enum _list_format
+{
+    LIST_FORMAT_LS,  /*!< Lines of ls -l, used by LIST*/
+    LIST_FORMAT_MLSD /*!< Machine readable facts of RFC 3659, used by MLSD and MLST*/
+} list_format;
+
 /**
  * @brief Defines the information of an FTP data connection
  *
@@ -34,16 +52,19 @@ typedef enum _data_conn_states
 typedef struct _data_conn
 {
     int is_passive;                            /*!< Indicates if the connection is active or passive*/
-    int socket_fd;                             /*!< Socket descriptor in passive mode*/
+    int socket_fd;                             /*!< Socket descriptor in passive mode, it belongs to pasv*/
+    passive_port *pasv;                        /*!< Port taken from the passive pool, NULL if none*/
     int conn_fd;                               /*!< Connection descriptor in active and passive mode*/
     TLS *context;                              /*!< TLS data connection context*/
     char client_ip[sizeof("XXX.XXX.XXX.XXX")]; /*!< IP address of the client for a connection in active mode*/
     int client_port;                           /*!< Client port for a connection in active mode*/
     int abort;                                 /*!< Indicates that the current transmission should be aborted*/
+    int reusable;                              /*!< The connection can carry another transfer in block mode*/
     data_conn_states conn_state;               /*!< Data connection status*/
     sem_t mutex;                               /*!< Mutex for connection state change*/
     sem_t data_conn_sem;                       /*!< If set to 1, you can continue the data thread*/
     sem_t control_conn_sem;                    /*!< If set to 1, you can continue the control thread*/
+    int done_fd;                               /*!< eventfd written by the data thread when the transfer ends*/
 } data_conn;
 
 /**
@@ -65,13 +86,42 @@ void set_root_path(char *server_root);
 int get_real_path(char *current_dir, char *path, char *real_path);
 
 /**
- * @brief Returns a file with the output of ls
+ * @brief Formats a line of a listing
  *
- * @param path Unclean path
- * @param current_dir Current FTP session directory
- * @return FILE*Like any other FILE, however, it must be closed with pclose
+ * @param format Format of the line
+ * @param dir_fd Descriptor of the directory of the entry, to read symbolic links
+ * @param name Name of the entry
+ * @param st Information of the entry
+ * @param buf Destination buffer
+ * @param buf_len Size of the destination buffer
+ * @return int Characters written, 0 if they do not fit
  */
-FILE *list_directories(char *path, char *current_dir);
+int format_list_entry(list_format format, int dir_fd, char *name, struct stat *st, char *buf, size_t buf_len);
+
+/**
+ * @brief Streams the listing of a directory (or a single file) through a socket, without
+ * creating processes and without holding the whole listing in memory
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
+ * @param socket_fd Socket descriptor
+ * @param path Real path of the directory or file
+ * @param format Format of the lines
+ * @param ascii_mode Ascii mode, only applies to the ls format
+ * @param block_mode If not 0, send the listing in blocks ended by an EOF block (MODE B)
+ * @param abort_transfer Allows you to cancel transfer
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t send_listing(struct TLSContext *ctx, int socket_fd, char *path, list_format format, int ascii_mode, int block_mode, int *abort_transfer);
+
+/**
+ * @brief Fills the MLST response of a path: its facts, preceded by a space
+ *
+ * @param path Real path
+ * @param buf Destination buffer
+ * @param buf_len Size of the buffer
+ * @return int less than 0 on error
+ */
+int mlst_entry(char *path, char *buf, size_t buf_len);
 
 /**
  * @brief Opens a file, using current_dir to locate it
@@ -124,22 +174,46 @@ int ch_to_parent_dir(char *current_dir);
  * @param socket_fd Socket descriptor
  * @param buf to send
  * @param buf_len how much to send
- * @param ascii_mode If not 0, convert newlines to universal format
+ * @param ascii If not NULL, convert newlines to universal format in its buffer, which must hold 2 * buf_len bytes
+ * @param block_mode If not 0, split the content in blocks with header (MODE B)
  * @return ssize_t if less than 0, error
  */
-ssize_t send_buffer(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, int ascii_mode);
+ssize_t send_buffer(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, ascii_transcoder *ascii, int block_mode);
+
+/**
+ * @brief Send a single block of MODE B
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
+ * @param socket_fd Socket descriptor
+ * @param buf Data of the block
+ * @param buf_len Bytes of data, at most BLOCK_MAX
+ * @param descriptor Descriptor of the block, e.g. BLOCK_EOF
+ * @return ssize_t Data bytes sent, less than 0 on error
+ */
+ssize_t send_block(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, int descriptor);
+
+/**
+ * @brief Send a file with sendfile in blocks of MODE B, the headers are written between them
+ *
+ * @param socket_fd Socket descriptor, not encrypted in user space
+ * @param file_fd File descriptor
+ * @param abort_transfer Allows you to cancel transfer
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t sendfile_blocks(int socket_fd, int file_fd, int *abort_transfer);
 
 /**
  * @brief Send the content of f through a socket
  *
- * @param ctx TLS context
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
  * @param socket_fd Socket descriptor
  * @param f File to open
  * @param ascii_mode Ascii mode
+ * @param block_mode If not 0, send the file in blocks ended by an EOF block (MODE B)
  * @param abort_transfer Allows you to cancel transfer
  * @return ssize_t
  */
-ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode, int *abort_transfer);
+ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode, int block_mode, int *abort_transfer);
 
 /**
  * @brief Read content from un socket to un buffer
@@ -148,22 +222,62 @@ ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode
  * @param socket_fd Socket origin
  * @param dest Buffer destination
  * @param buf_len Buffer size
- * @param ascii_mode Ascii mode
+ * @param ascii If not NULL, convert CRLF to LF reading through its buffer, which must hold buf_len bytes
  * @return ssize_t reads
  */
-ssize_t read_to_buffer(struct TLSContext *ctx, int socket_fd, char *dest, size_t buf_len, int ascii_mode);
+ssize_t read_to_buffer(struct TLSContext *ctx, int socket_fd, char *dest, size_t buf_len, ascii_transcoder *ascii);
+
+/**
+ * @brief Move the contents of a socket to a file through a pipe, without copying them to user space
+ *
+ * @param socket_fd source socket
+ * @param file_fd Destination file
+ * @param abort_transfer Allows to abort the transfer
+ * @return ssize_t bytes read, less than 0 on error
+ */
+ssize_t splice_to_file(int socket_fd, int file_fd, int *abort_transfer);
+
+/**
+ * @brief Read the blocks of MODE B of a file until its EOF block
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted
+ * @param f Destination file
+ * @param socket_fd source socket
+ * @param buf Buffer of at least BLOCK_MAX + 1 bytes
+ * @param ascii If not NULL, convert CRLF to LF reading through its buffer
+ * @param abort_transfer Allows to abort the transfer
+ * @return ssize_t bytes written, less than 0 on error or if the connection is closed before the EOF block
+ */
+ssize_t read_blocks_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, char *buf, ascii_transcoder *ascii, int *abort_transfer);
 
 /**
  * @brief Read the contents of a socket to a file
  *
- * @param ctx TLS Context
+ * @param ctx TLS context, NULL if the connection is not encrypted
  * @param f Destination file.
  * @param socket_fd source socket
  * @param ascii_mode FTP transfer mode
+ * @param block_mode If not 0, the file comes in blocks and ends with an EOF block (MODE B), not when the connection is closed
  * @param abort_transfer Allows to abort the transfer
  * @return ssize_t bytes read
  */
-ssize_t read_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, int ascii_mode, int *abort_transfer);
+ssize_t read_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, int ascii_mode, int block_mode, int *abort_transfer);
+
+/**
+ * @brief Give the passive port of a data connection back to the pool, if it has one
+ *
+ * @param dc Data connection
+ * @param passive_ports Pool of passive ports
+ */
+void release_passive_port(data_conn *dc, passive_pool *passive_ports);
+
+/**
+ * @brief Close a data connection and give its passive port back, if any
+ *
+ * @param dc Data connection
+ * @param passive_ports Pool of passive ports
+ */
+void close_data_conn(data_conn *dc, passive_pool *passive_ports);
 
 /**
  * @brief Parse a port string of format xxx,xxx,xxx,xxx,ppp,ppp
@@ -176,14 +290,13 @@ ssize_t read_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, int ascii_m
 int parse_port_string(char *port_string, char *clt_ip, int *clt_port);
 
 /**
- * @brief Create a data socket for the client to connect to
+ * @brief Take a listening socket from the pool for the client to connect to
  *
- * @param srv_ip IP of the server
- * @param passive_port_count Semaphore with the number of data connections created
- * @param socket_fd Resulting socket
+ * @param passive_ports Pool of passive ports
+ * @param dc Data connection that keeps the socket
  * @return int less than 0 if error, otherwise port
  */
-int passive_data_socket_fd(char *srv_ip, sem_t *passive_port_count, int *socket_fd);
+int passive_data_socket_fd(passive_pool *passive_ports, data_conn *dc);
 
 /**
  * @brief Generates port string for PASV command
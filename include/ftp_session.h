@@ -43,7 +43,10 @@ typedef struct _session_info
     int authenticated;                    /*!< Indicates if the session user has already been successfully authenticated*/
     int secure;                           /*!< Indicates if the session is in safe mode*/
     int pbsz_sent;                        /*!< Indicates that the pbsz command has already been sent*/
+    int clear_data;                       /*!< Indicates that data connections are not encrypted (PROT C)*/
+    int block_mode;                       /*!< Indicates that transfers use block mode (MODE B) and keep the data connection*/
     TLS *context;                         /*!< TLS session context*/
+    handshake_state *handshake;           /*!< Negotiation started by AUTH that has not finished yet, NULL if none*/
     char *current_pkey;                   /*!< Clave*/
     char current_dir[MAX_PATH];           /*!< Current directory of the session user*/
     int n_attributes;                     /*!< Number of attributes currently in session*/
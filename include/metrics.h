@@ -0,0 +1,95 @@
+/**
+ * @file metrics.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Lock-free counters and histograms of the server, exposed in Prometheus text format on a loopback port
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "utils.h"
+#include "passive_pool.h"
+
+#define METRICS_SHARDS 16      /*!< Copies of the counters, threads are spread among them to avoid sharing cache lines*/
+#define METRICS_MAX_LABELS 64  /*!< Maximum values of the label of a histogram, enough for every FTP command*/
+#define METRICS_BUCKETS 16     /*!< Finite buckets of every histogram, one more counts the rest*/
+#define METRICS_IP "127.0.0.1" /*!< The metrics are only served on the loopback interface*/
+
+/**
+ * @brief Histograms of durations, each one with its own label
+ *
+ */
+typedef enum _metric_hist
+{
+    HIST_COMMAND,   /*!< Time to serve a command, label: command*/
+    HIST_HANDSHAKE, /*!< Duration of a TLS handshake, label: HANDSHAKE_CONTROL or HANDSHAKE_DATA*/
+    HIST_LIST,      /*!< Time to list a directory, label: list format*/
+    N_HISTS         /*!< Number of histograms*/
+} metric_hist;
+
+/**
+ * @brief Connections that negotiate TLS
+ *
+ */
+typedef enum _handshake_conn
+{
+    HANDSHAKE_CONTROL, /*!< AUTH TLS on the control connection*/
+    HANDSHAKE_DATA     /*!< Data connection*/
+} handshake_conn;
+
+/**
+ * @brief Nanoseconds of the monotonic clock, to measure durations
+ *
+ * @return uint64_t nanoseconds
+ */
+uint64_t metrics_clock();
+
+/**
+ * @brief Add a duration to a histogram
+ *
+ * @param hist Histogram
+ * @param label Value of its label, less than METRICS_MAX_LABELS
+ * @param ns Duration in nanoseconds
+ */
+void metrics_observe(metric_hist hist, int label, uint64_t ns);
+
+/**
+ * @brief Count the bytes moved by the data connection of a command
+ *
+ * @param command Command, value of imp_commands
+ * @param in Bytes received from the client
+ * @param out Bytes sent to the client
+ */
+void metrics_bytes(int command, uint64_t in, uint64_t out);
+
+/**
+ * @brief Count a control session that is opened or closed
+ *
+ * @param delta 1 when it is opened, -1 when it is closed
+ */
+void metrics_session(int delta);
+
+/**
+ * @brief Write every metric in Prometheus text exposition format
+ *
+ * @param f Destination
+ */
+void metrics_write(FILE *f);
+
+/**
+ * @brief Serve the metrics over HTTP on METRICS_IP from a thread of its own
+ *
+ * @param port Port, the metrics are not served if it is 0
+ * @param sessions Free session slots
+ * @param max_sessions Maximum number of sessions
+ * @param pasv_pool Pool of passive ports
+ * @return int less than 0 on error
+ */
+int metrics_start(int port, sem_t *sessions, int max_sessions, passive_pool *pasv_pool);
+
+#endif /*METRICS_H*/
@@ -21,13 +21,54 @@
 #include <resolv.h>       /*man resolver (3)*/
 #include <arpa/inet.h>    /*man inet(3)*/
 #include <netinet/tcp.h>  /*Tcp cork*/
+#include <linux/tls.h>    /*Kernel TLS*/
 #include <netdb.h>        /*Allows a protocol to be identified by name*/
+#include <poll.h>         /*Wait until a socket can be written*/
 #include "utils.h"
 #include "tlse.h"
 
 /*Strings associated with protocols*/
 #define TCP "tcp" /*!< tcp protocol*/
 #define UDP "udp" /*!< Protocol udp*/
+
+#define RESUMPTION_REPORT_INTERVAL 60 /*!< Seconds between two reports of the TLS resumption counters in the log*/
+#define TLS_QUEUE_MAX XXXL_SZ         /*!< Encrypted bytes queued in a connection before they must be sent*/
+#define TLS_SEND_TIMEOUT 60           /*!< Seconds to wait for a full socket when it has no send timeout of its own*/
+#define TLS_HANDSHAKE_TIMEOUT 10      /*!< Seconds a client has to complete a TLS handshake*/
+
+/**
+ * @brief Progress of a TLS handshake
+ *
+ */
+typedef enum _handshake_status
+{
+    HANDSHAKE_DONE,      /*!< The connection is established*/
+    HANDSHAKE_WANT_READ, /*!< More bytes of the client are needed, call again when the socket is readable*/
+    HANDSHAKE_FAILED     /*!< Protocol error, closed connection or deadline exceeded*/
+} handshake_status;
+
+/**
+ * @brief TLS handshake on the server side that can be resumed each time the socket becomes readable
+ *
+ */
+typedef struct _handshake_state
+{
+    struct TLSContext *context; /*!< Context being negotiated*/
+    int fd;                     /*!< Connection descriptor*/
+    uint64_t start;             /*!< When the handshake started, nanoseconds of metrics_clock*/
+    uint64_t deadline;          /*!< When the handshake fails if it has not finished, nanoseconds of metrics_clock*/
+} handshake_state;
+
+/**
+ * @brief IPv4 network in CIDR notation
+ *
+ */
+typedef struct _ip_network
+{
+    in_addr_t addr; /*!< Address of the network, network byte order*/
+    in_addr_t mask; /*!< Mask of the network, network byte order*/
+} ip_network;
+
 /******************************
 MANIPULATION AND CREATION OF SOCKETS
 *******************************/
@@ -58,6 +99,19 @@ int set_socket_timeouts(int socket_fd, int seconds);
  */
 int socket_srv(const char *proto_transp, int qlen, int puerto, char *ip_srv);
 
+/**
+ * @brief Create a listening TCP socket of the control port. Several of them can be bound to the same port
+ * with SO_REUSEPORT, and the kernel spreads the new connections among them
+ *
+ * @param qlen Connections queued in the socket
+ * @param puerto Port number where the socket will be opened
+ * @param ip_srv IP of the server
+ * @param reuse_port Share the port with other sockets of the same user
+ * @param defer_accept Seconds TCP_DEFER_ACCEPT waits for the first data of a client before it can be accepted, 0 to disable
+ * @return int file descriptor of the socket, less than 0 on error
+ */
+int socket_srv_shard(int qlen, int puerto, char *ip_srv, int reuse_port, int defer_accept);
+
 /**
  * @brief Create a client socket and bind on a specified port
  *
@@ -89,6 +143,45 @@ int socket_clt_connect(int socket_fd, char *ip_srv, int puerto_srv);
  */
 int socket_clt_connection(int puerto_clt, char *ip_clt, int puerto_srv, char *ip_srv);
 
+/**
+ * @brief Parse a comma separated list of IPv4 networks, e.g. "10.0.0.0/8, 192.168.1.7"
+ *
+ * @param list List of networks, a single address is a /32 network
+ * @param nets Where to store the networks
+ * @param max_nets Maximum number of networks
+ * @return int Number of networks or -1 if the list is not valid
+ */
+int parse_networks(char *list, ip_network *nets, int max_nets);
+
+/**
+ * @brief Check whether the other end of a connection belongs to one of the networks
+ *
+ * @param conn_fd Socket descriptor
+ * @param nets Networks
+ * @param n_nets Number of networks
+ * @return int 1 if it belongs, 0 if not
+ */
+int peer_in_networks(int conn_fd, ip_network *nets, int n_nets);
+
+/**
+ * @brief Accept a connection without encryption, rejecting those that do not come from
+ * the same host as the control connection
+ *
+ * @param sock_fd Listening socket
+ * @param control_fd Socket of the control connection
+ * @return int Connection descriptor, less than 0 on error
+ */
+int accept_same_peer(int sock_fd, int control_fd);
+
+/**
+ * @brief Check whether the other end of a connection has the given IPv4 address
+ *
+ * @param conn_fd Socket descriptor
+ * @param ip Address in dotted notation
+ * @return int 1 if it has it, 0 if not
+ */
+int peer_is_ip(int conn_fd, char *ip);
+
 /**
  * @brief Write the contents of the src_fd file to a socket
  *
@@ -109,7 +202,8 @@ int socket_dump_fd(int socket_fd, int src_fd);
 int read_from_file(const char *fname, char *buf, int max_len);
 
 /**
- * @brief Load key and certificate from server to context
+ * @brief Load key and certificate from server to context, RSA or ECDSA. Called once for each type,
+ * the context keeps both and each handshake uses the one the client accepts
  * https://github.com/eduardsui/tlse
  * @param context TLS context
  * @param fname Name of the pem file with certificate
@@ -120,25 +214,43 @@ int read_from_file(const char *fname, char *buf, int max_len);
 int load_keys(struct TLSContext *context, char *fname, char *priv_fname);
 
 /**
- * @brief Send bytes of TLS protocol that are pending to be sent
+ * @brief Wait until a socket can be written, up to its send timeout
+ *
+ * @param sock Socket
+ * @return int Greater than 0 if it can be written, less than 0 on error or timeout
+ */
+int wait_writable(int sock);
+
+/**
+ * @brief Send part of a buffer, waiting for room if the socket buffer is full
+ *
+ * @param sock Socket
+ * @param buf Bytes to send
+ * @param len Size of buf
+ * @param flags send flags
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t send_retry(int sock, const void *buf, size_t len, int flags);
+
+/**
+ * @brief Send bytes of TLS protocol that are pending to be sent.
+ * The socket may be nonblocking: a partial send leaves the rest queued in the context and waits for room
  * https://github.com/eduardsui/tlse
  * @param client_sock Socket to send to
  * @param context TLS context
- * @return int Error if less than 0
+ * @return int Bytes sent, less than 0 on error (the bytes not sent stay queued)
  */
 int send_pending(int client_sock, struct TLSContext *context);
 
 /**
- * @brief Digest a tls message from the socket
+ * @brief Digest a tls message from the socket, received straight into the buffer of the connection
  *
  * @param tls_context TLS context
  * @param conn_fd connection descriptor
- * @param buffer destination buffer
- * @param buf_len maximum buffer size
  * @param flags associated recv flags
- * @return int bytes read or less than 0 if error
+ * @return int bytes read or less than 0 if error (errno EPROTO if the records are not valid)
  */
-int digest_tls(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags);
+int digest_tls(struct TLSContext *tls_context, int conn_fd, int flags);
 
 /**
  * @brief Securely receive a message
@@ -149,17 +261,33 @@ int digest_tls(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t b
  * @param buf_len maximum buffer size
  * @param flags recv flags
  * @return int Greater than 0 if bytes read, 0 if TLS connection lost, -1 if error
+ * (errno EAGAIN with MSG_DONTWAIT if no complete record has arrived yet)
  */
 int srecv(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags);
 
 /**
- * @brief Securely sends the contents of a buffer
+ * @brief Securely receive exactly buf_len bytes, waiting for as many records as needed
+ *
+ * @param tls_context TLS context, NULL if the connection is not encrypted in user space
+ * @param conn_fd Connection descriptor
+ * @param buf destination buffer
+ * @param buf_len Bytes to receive
+ * @param flags recv flags
+ * @return int buf_len if all of them were received, less if the connection was closed or failed first
+ */
+int srecv_all(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags);
+
+/**
+ * @brief Securely sends the contents of a buffer, waiting for room in the socket when it is full.
+ * At most TLS_QUEUE_MAX encrypted bytes are queued in the connection at once, and none while the
+ * records are still growing (see tls_record_size) so that the first bytes of a transfer leave right away
  *
  * @param tls_context TLS context
  * @param conn_fd Connection descriptor
  * @param buf Buffer to send
  * @param buf_len Buffer size
  * @param flags send flags
+ * @return int Bytes sent (before encryption), less than 0 on error
  */
 int ssend(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags);
 
@@ -172,6 +300,66 @@ int ssend(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_le
  */
 int sclose(struct TLSContext **tls_context, int *fd);
 
+/**
+ * @brief Allow data connections to be handed to kernel TLS
+ *
+ * @param enabled 0 to always encrypt in user space
+ */
+void set_ktls_offload(int enabled);
+
+/**
+ * @brief Hand the encryption of an established connection to the kernel, so that
+ * plain send and sendfile can be used on the socket from now on
+ *
+ * @param tls_context TLS context of the connection, its keys must be exportable
+ * @param conn_fd Connection descriptor
+ * @return int 1 if the kernel encrypts the connection, 0 if it must keep using tlse
+ */
+int ktls_enable(struct TLSContext *tls_context, int conn_fd);
+
+/**
+ * @brief Send a close notify through a connection encrypted by the kernel
+ *
+ * @param conn_fd Connection descriptor
+ * @return int 1 if the connection was in kernel TLS, 0 otherwise
+ */
+int ktls_close_notify(int conn_fd);
+
+/**
+ * @brief Check if the kernel encrypts the output of a connection
+ *
+ * @param conn_fd Connection descriptor
+ * @return int 1 if it does
+ */
+int ktls_active(int conn_fd);
+
+/**
+ * @brief Start a server handshake on a connection, no byte is read yet
+ *
+ * @param hs Handshake to fill
+ * @param gen_context General TLS context
+ * @param conn_fd Connection descriptor
+ * @param timeout Seconds to complete the handshake
+ * @return int less than 0 on error
+ */
+int tls_handshake_start(handshake_state *hs, struct TLSContext *gen_context, int conn_fd, int timeout);
+
+/**
+ * @brief Advance a handshake with the bytes available in the socket, without blocking
+ *
+ * @param hs Handshake
+ * @return handshake_status HANDSHAKE_WANT_READ while the client has not sent everything
+ */
+handshake_status tls_handshake_step(handshake_state *hs);
+
+/**
+ * @brief Advance a handshake until it ends, waiting for the client at most until its deadline
+ *
+ * @param hs Handshake
+ * @return handshake_status HANDSHAKE_DONE or HANDSHAKE_FAILED
+ */
+handshake_status tls_handshake_run(handshake_state *hs);
+
 /**
  * @brief Accept a new client and perform the handshake
  *
@@ -180,9 +368,10 @@ int sclose(struct TLSContext **tls_context, int *fd);
  * @param sock_fd Listening socket
  * @param expected_pkey If not NULL, verify that the client certificate has a given public key
  * for use in the TLS connection, if not, reject the request
+ * @param control_ctx If not NULL, session of the control connection that the client may resume
  * @return int fd of the connection or -1 if error
  */
-int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext **context, int sock_fd, char *expected_pkey);
+int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext **context, int sock_fd, char *expected_pkey, struct TLSContext *control_ctx);
 
 /**
  * @brief Connect securely to a server
@@ -194,8 +383,17 @@ int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext *
  * @param clt_port Client port
  * @param srv_ip Server IP
  * @param clt_ip Client IP
+ * @param control_ctx If not NULL, session of the control connection that the client may resume
  * @return int 1 if all ok, -1 if error
  */
-int connect_and_handshake(struct TLSContext *gen_ctx, struct TLSContext **ctx, char *expected_pkey, int port, int clt_port, char *srv_ip, char *clt_ip);
+int connect_and_handshake(struct TLSContext *gen_ctx, struct TLSContext **ctx, char *expected_pkey, int port, int clt_port, char *srv_ip, char *clt_ip, struct TLSContext *control_ctx);
+
+/**
+ * @brief Counters of resumption of the control session by the data connections
+ *
+ * @param hits Where to store the handshakes that resumed it
+ * @param misses Where to store the full handshakes that could have resumed it
+ */
+void tls_resumption_stats(unsigned long *hits, unsigned long *misses);
 
 #endif /*RED_H*/
\ No newline at end of file
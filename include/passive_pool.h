@@ -0,0 +1,86 @@
+/**
+ * @file passive_pool.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Pool of listening sockets bound at startup and handed out to PASV through a lock-free free list
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef PASSIVE_POOL_H
+#define PASSIVE_POOL_H
+
+#include "utils.h"
+
+#define PASSIVE_BACKLOG 10     /*!< Pending connections of every passive socket*/
+#define PASSIVE_PORT_MAX 65535 /*!< Highest port of the passive range*/
+
+/**
+ * @brief Listening socket of the pool
+ *
+ */
+typedef struct _passive_port
+{
+    int fd;        /*!< Listening socket, it stays open while the server runs*/
+    int port;      /*!< Port where it listens*/
+    uint32_t next; /*!< Index + 1 of the next free port, 0 ends the list*/
+} passive_port;
+
+/**
+ * @brief Passive ports of the server
+ *
+ */
+typedef struct _passive_pool
+{
+    passive_port *ports; /*!< Every bound port*/
+    int n_ports;         /*!< Size of ports*/
+    uint64_t head;       /*!< Tag against ABA in the high half, index + 1 of the first free port in the low half*/
+    int n_free;          /*!< Ports in the free list*/
+} passive_pool;
+
+/**
+ * @brief Bind and listen on the passive ports
+ *
+ * @param pool Pool to initialize
+ * @param ip IP of the server
+ * @param port_min First port of the range, 0 to let the system choose every port
+ * @param port_max Last port of the range, 0 to let the system choose every port
+ * @param max_ports Maximum number of ports bound
+ * @return int Number of ports bound or less than 0 on error
+ */
+int passive_pool_init(passive_pool *pool, char *ip, int port_min, int port_max, int max_ports);
+
+/**
+ * @brief Take a free port, without system calls
+ *
+ * @param pool Pool
+ * @return passive_port* Port or NULL if all of them are in use
+ */
+passive_port *passive_pool_get(passive_pool *pool);
+
+/**
+ * @brief Give a port back, refusing the connections that arrived after the transfer
+ *
+ * @param pool Pool
+ * @param port Port obtained with passive_pool_get
+ */
+void passive_pool_put(passive_pool *pool, passive_port *port);
+
+/**
+ * @brief Number of free ports
+ *
+ * @param pool Pool
+ * @return int free ports
+ */
+int passive_pool_free(passive_pool *pool);
+
+/**
+ * @brief Close every port and release the pool
+ *
+ * @param pool Pool
+ */
+void passive_pool_destroy(passive_pool *pool);
+
+#endif /*PASSIVE_POOL_H*/
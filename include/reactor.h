@@ -0,0 +1,111 @@
+/**
+ * @file reactor.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Edge triggered epoll event loops that own the control connections
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <sys/epoll.h>
+#include "utils.h"
+
+#define REACTOR_MAX_EVENTS SMALL_SZ /*!< Maximum events returned by a single epoll_wait*/
+#define REACTOR_TIMEOUT_MS 500      /*!< Maximum time an event loop sleeps before checking the end flag*/
+
+/**
+ * @brief What the event loop must do with a connection after its handler returns
+ *
+ */
+typedef enum _reactor_ret
+{
+    REACTOR_FORGET = 0, /*!< The connection was released or handed to another thread, which will rearm or resume it*/
+    REACTOR_REARM = 1   /*!< Socket drained, wait for the next readable event*/
+} reactor_ret;
+
+/**
+ * @brief Connection registered in one of the event loops
+ *
+ */
+typedef struct _reactor_item
+{
+    int fd;                             /*!< Socket descriptor*/
+    int loop;                           /*!< Index of the event loop that owns the socket*/
+    void *data;                         /*!< User data associated with the connection*/
+    uint64_t deadline;                  /*!< Nanoseconds of CLOCK_MONOTONIC when the handler is called even without events, 0 if none*/
+    struct _reactor_item *next_timed;   /*!< Next connection of its loop with a deadline*/
+    struct _reactor_item *next_resumed; /*!< Next connection given back to its loop with reactor_resume*/
+} reactor_item;
+
+/**
+ * @brief Handler called from an event loop when a connection becomes readable or its deadline passes.
+ * Events are edge triggered and one-shot, so the handler must read until EAGAIN
+ *
+ * @param item Connection that became readable
+ * @return reactor_ret What to do with the connection afterwards
+ */
+typedef reactor_ret (*reactor_handler)(reactor_item *item);
+
+/**
+ * @brief Start the event loops, each in its own thread
+ *
+ * @param n_loops Number of event loops, if less than 1 one per online core is used
+ * @param handler Function called when a connection is readable
+ * @param end_flag The loops finish when it is set to a value other than 0
+ * @return int Number of loops started or -1 on error
+ */
+int reactor_start(int n_loops, reactor_handler handler, int *end_flag);
+
+/**
+ * @brief Register a new connection, event loops are assigned in round robin
+ *
+ * @param fd Socket descriptor
+ * @param data User data associated with the connection
+ * @return reactor_item* Registered connection or NULL on error
+ */
+reactor_item *reactor_add(int fd, void *data);
+
+/**
+ * @brief Wait again for events on a connection after it was handed to another thread
+ *
+ * @param item Connection
+ * @return int less than 0 on error
+ */
+int reactor_rearm(reactor_item *item);
+
+/**
+ * @brief Give a connection handed to another thread back to its event loop, which calls the handler
+ * from its own thread even if nothing new arrives, as requests may be queued already
+ *
+ * @param item Connection
+ */
+void reactor_resume(reactor_item *item);
+
+/**
+ * @brief Call the handler of a connection at a given time if it has not become readable before.
+ * Only from the thread of the event loop that owns the connection, while it is not handed to another thread
+ *
+ * @param item Connection
+ * @param deadline Nanoseconds of CLOCK_MONOTONIC, 0 to cancel
+ */
+void reactor_set_deadline(reactor_item *item, uint64_t deadline);
+
+/**
+ * @brief Unregister a connection and free the item. The descriptor is not closed
+ *
+ * @param item Connection
+ */
+void reactor_remove(reactor_item *item);
+
+/**
+ * @brief Wait for all the event loops to finish
+ *
+ */
+void reactor_join();
+
+#endif /*REACTOR_H*/
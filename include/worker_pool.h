@@ -0,0 +1,64 @@
+/**
+ * @file worker_pool.h
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Fixed size pool of transfer workers with per-worker queues and work stealing
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "utils.h"
+
+#define POOL_REPORT_INTERVAL 60 /*!< Seconds between two reports of the pool statistics in the log*/
+
+/**
+ * @brief Function executed by a worker, same signature as a thread function
+ *
+ */
+typedef void *(*pool_function)(void *);
+
+/**
+ * @brief Statistics of the pool since it was started
+ *
+ */
+typedef struct _pool_stats
+{
+    int workers;              /*!< Number of workers*/
+    long queued;              /*!< Jobs waiting in the queues right now*/
+    long busy;                /*!< Workers executing a job right now*/
+    unsigned long completed;  /*!< Jobs already started by a worker*/
+    unsigned long stolen;     /*!< Jobs taken from the queue of another worker*/
+    double avg_wait_ms;       /*!< Average time a job waited in the queue*/
+    double max_wait_ms;       /*!< Maximum time a job waited in the queue*/
+} pool_stats;
+
+/**
+ * @brief Start the worker threads
+ *
+ * @param n_workers Number of workers, if less than 1 two per online core are used
+ * @return int Number of workers started or -1 on error
+ */
+int worker_pool_start(int n_workers);
+
+/**
+ * @brief Queue a job, it will be executed by the first free worker
+ *
+ * @param function Function to execute
+ * @param args Argument of the function
+ * @return int less than 0 on error
+ */
+int worker_pool_submit(pool_function function, void *args);
+
+/**
+ * @brief Collect the current statistics of the pool
+ *
+ * @param stats Where to store them
+ */
+void worker_pool_stats(pool_stats *stats);
+
+#endif /*WORKER_POOL_H*/
@@ -104,6 +104,28 @@ if [ $respuesta ]; then
     openssl req -newkey rsa:2048 -nodes -keyout private_key.pem -x509 -days 365 -out certificate.pem
     sudo chmod 760 certificate.pem private_key.pem 
     ca_path=$(realpath certificate.pem)
+
+    # Segundo certificado ECDSA P-256, opcional
+    echo "El servidor puede usar ademas un certificado ECDSA P-256, con firmas mas rapidas que RSA para los clientes que lo admitan, quieres crearlo?
+Escribe 1 o 2:"
+    select respuesta in "Si" "No"; do
+        case $respuesta in
+            Si ) respuesta="1"; break;;
+            No ) respuesta=""; break;;
+        esac
+    done
+    if [ $respuesta ]; then
+        # La clave debe quedar en formato SEC1 (EC PRIVATE KEY), no PKCS#8
+        openssl ecparam -name prime256v1 -genkey -noout -out ecdsa_private_key.pem
+        openssl req -new -x509 -key ecdsa_private_key.pem -days 365 -out ecdsa_certificate.pem
+        sudo chmod 760 ecdsa_certificate.pem ecdsa_private_key.pem
+        # El cliente debe aceptar cualquiera de los dos certificados
+        cat certificate.pem ecdsa_certificate.pem > ca_bundle.pem
+        ca_path=$(realpath ca_bundle.pem)
+        echo "Anade a server.conf las siguientes lineas:"
+        echo "ecdsa_certificate_path=\"$(realpath ecdsa_certificate.pem)\""
+        echo "ecdsa_private_key_path=\"$(realpath ecdsa_private_key.pem)\""
+    fi
     cd ..
 fi
 
@@ -0,0 +1,236 @@
+/**
+ * @file aes_gcm_bench.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Known answer test and throughput of the AES-GCM of libtomcrypt, portable and with AES-NI
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "libtomcrypt.c" /*Built in, as tlse does, to reach gcm_state*/
+
+#define BENCH_RECORD 16384             /*!< Bytes of every message, the largest TLS record*/
+#define BENCH_SIZE (256 * 1024 * 1024) /*!< Bytes encrypted in each measure*/
+#define BENCH_ROUNDS 3                 /*!< Measures of each case, the best one is kept*/
+#define BENCH_CHECK_MAX 300            /*!< Longest random message compared between implementations*/
+#define BENCH_TAG 16                   /*!< Bytes of the tag*/
+#define BENCH_AAD 13                   /*!< Bytes of the additional data of a TLS 1.2 record*/
+#define BENCH_IV 12                    /*!< Bytes of the nonce of a TLS record*/
+
+/**
+ * @brief Known answer, test cases 4 and 16 of the GCM specification by McGrew and Viega
+ *
+ */
+typedef struct _gcm_kat
+{
+    const char *key; /*!< Key in hexadecimal*/
+    const char *iv;  /*!< Nonce in hexadecimal*/
+    const char *aad; /*!< Additional data in hexadecimal*/
+    const char *pt;  /*!< Plaintext in hexadecimal*/
+    const char *ct;  /*!< Expected ciphertext in hexadecimal*/
+    const char *tag; /*!< Expected tag in hexadecimal*/
+} gcm_kat;
+
+static const gcm_kat kats[] = {
+    {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+     "5bc94fbc3221a5db94fae95ae7121a47"},
+    {"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+     "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a721c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+     "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+     "76fc6ece0f4e1768cddf8853bb2d551b"}};
+
+/**
+ * @brief Seconds of the monotonic clock
+ *
+ * @return double seconds
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Decode a hexadecimal string
+ *
+ * @param hex String
+ * @param out Destination, strlen(hex) / 2 bytes
+ * @return unsigned long Bytes written
+ */
+unsigned long unhex(const char *hex, unsigned char *out)
+{
+    unsigned long n = strlen(hex) / 2;
+    unsigned int byte;
+    for (unsigned long i = 0; i < n; i++)
+    {
+        sscanf(&hex[2 * i], "%2x", &byte);
+        out[i] = byte;
+    }
+    return n;
+}
+
+/**
+ * @brief Encrypt or decrypt a message as tlse does with a record, reusing the scheduled state
+ *
+ * @param gcm State with the key already scheduled
+ * @param iv Nonce, BENCH_IV bytes
+ * @param aad Additional data
+ * @param aad_len Bytes of aad
+ * @param pt Plaintext
+ * @param len Bytes of the message
+ * @param ct Ciphertext
+ * @param tag Tag, BENCH_TAG bytes
+ * @param direction GCM_ENCRYPT or GCM_DECRYPT
+ * @return int CRYPT_OK on success
+ */
+int gcm_record(gcm_state *gcm, const unsigned char *iv, const unsigned char *aad, unsigned long aad_len,
+               unsigned char *pt, unsigned long len, unsigned char *ct, unsigned char *tag, int direction)
+{
+    unsigned long tag_len = BENCH_TAG;
+    int err;
+    if ((err = gcm_reset(gcm)) != CRYPT_OK || (err = gcm_add_iv(gcm, iv, BENCH_IV)) != CRYPT_OK ||
+        (err = gcm_add_aad(gcm, aad, aad_len)) != CRYPT_OK || (err = gcm_process(gcm, pt, len, ct, direction)) != CRYPT_OK)
+        return err;
+    return gcm_done(gcm, tag, &tag_len);
+}
+
+/**
+ * @brief Run the known answer tests with the implementation selected
+ *
+ * @param gcm State to use
+ * @param cipher Index of AES
+ * @return int 1 if every test passes
+ */
+int check_kats(gcm_state *gcm, int cipher)
+{
+    unsigned char key[32], iv[BENCH_IV], aad[64], pt[64], ct[64], expected[64], tag[BENCH_TAG], expected_tag[BENCH_TAG], out[64];
+    unsigned long key_len, aad_len, len;
+    for (int i = 0; i < sizeof(kats) / sizeof(kats[0]); i++)
+    {
+        key_len = unhex(kats[i].key, key);
+        unhex(kats[i].iv, iv);
+        aad_len = unhex(kats[i].aad, aad);
+        len = unhex(kats[i].pt, pt);
+        unhex(kats[i].ct, expected);
+        unhex(kats[i].tag, expected_tag);
+        if (gcm_init(gcm, cipher, key, key_len) != CRYPT_OK ||
+            gcm_record(gcm, iv, aad, aad_len, pt, len, ct, tag, GCM_ENCRYPT) != CRYPT_OK ||
+            memcmp(ct, expected, len) || memcmp(tag, expected_tag, BENCH_TAG))
+            return 0;
+        if (gcm_record(gcm, iv, aad, aad_len, out, len, ct, tag, GCM_DECRYPT) != CRYPT_OK ||
+            memcmp(out, pt, len) || memcmp(tag, expected_tag, BENCH_TAG))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Compare AES-NI with the portable code on random messages of every length up to BENCH_CHECK_MAX,
+ * so that the batches of four blocks end at every position
+ *
+ * @param portable State for the portable code
+ * @param ni State for AES-NI
+ * @param cipher Index of AES
+ * @return int 1 if both give the same ciphertext and tag
+ */
+int check_random(gcm_state *portable, gcm_state *ni, int cipher)
+{
+    unsigned char key[32], iv[BENCH_IV], aad[BENCH_CHECK_MAX], pt[BENCH_CHECK_MAX], ct[2][BENCH_CHECK_MAX], tag[2][BENCH_TAG];
+    int key_len;
+    for (unsigned long len = 0; len <= BENCH_CHECK_MAX; len++)
+    {
+        key_len = (len & 1) ? 32 : 16;
+        for (int i = 0; i < sizeof(key); i++)
+            key[i] = rand();
+        for (int i = 0; i < BENCH_IV; i++)
+            iv[i] = rand();
+        for (int i = 0; i < len; i++)
+            aad[i] = pt[i] = rand();
+        aesni_set_enabled(0);
+        gcm_init(portable, cipher, key, key_len);
+        aesni_set_enabled(1);
+        gcm_init(ni, cipher, key, key_len);
+        /*Counters that wrap their low 32 bits in the middle of a batch*/
+        iv[8] = iv[9] = iv[10] = 0xFF;
+        gcm_record(portable, iv, aad, len % 40, pt, len, ct[0], tag[0], GCM_ENCRYPT);
+        gcm_record(ni, iv, aad, len % 40, pt, len, ct[1], tag[1], GCM_ENCRYPT);
+        if (memcmp(ct[0], ct[1], len) || memcmp(tag[0], tag[1], BENCH_TAG))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Best throughput of a key size over BENCH_ROUNDS measures, encrypting records one after another
+ *
+ * @param gcm State to use
+ * @param cipher Index of AES
+ * @param key_len Bytes of the key
+ * @param buf Record, BENCH_RECORD bytes
+ * @return double MB/s
+ */
+double measure(gcm_state *gcm, int cipher, int key_len, unsigned char *buf)
+{
+    unsigned char key[32] = {0}, iv[BENCH_IV] = {0}, aad[BENCH_AAD] = {0}, tag[BENCH_TAG];
+    double best = 0, t;
+    gcm_init(gcm, cipher, key, key_len);
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        t = now();
+        for (unsigned long done = 0; done < BENCH_SIZE; done += BENCH_RECORD)
+        {
+            iv[BENCH_IV - 1]++; /*A new nonce per record, as TLS does*/
+            gcm_record(gcm, iv, aad, BENCH_AAD, buf, BENCH_RECORD, buf, tag, GCM_ENCRYPT);
+        }
+        t = now() - t;
+        best = (best > BENCH_SIZE / t / 1e6) ? best : BENCH_SIZE / t / 1e6;
+    }
+    return best;
+}
+
+/**
+ * @brief Check both implementations and compare their throughput on one core
+ *
+ * @return int 0 if every check passes
+ */
+int main()
+{
+    static unsigned char buf[BENCH_RECORD];
+    gcm_state *gcm = XMALLOC(sizeof(gcm_state)), *other = XMALLOC(sizeof(gcm_state));
+    int cipher, has_ni, ret = 0;
+    if (!gcm || !other || register_cipher(&aes_desc) < 0 || (cipher = find_cipher("aes")) < 0)
+        return 1;
+    aesni_set_enabled(1);
+    has_ni = aesni_enabled();
+    srand(1);
+
+    printf("AES-NI y PCLMULQDQ: %s\n", has_ni ? "disponibles" : "no disponibles");
+    printf("%-10s %8s %14s %14s\n", "", "vectores", "AES-128 MB/s", "AES-256 MB/s");
+    for (int ni = 0; ni <= has_ni; ni++)
+    {
+        aesni_set_enabled(ni);
+        if (!check_kats(gcm, cipher) || rijndael_test() != CRYPT_OK)
+        {
+            printf("%-10s %8s\n", ni ? "aes-ni" : "portable", "error");
+            ret = 1;
+            continue;
+        }
+        printf("%-10s %8s %14.0f %14.0f\n", ni ? "aes-ni" : "portable", "ok", measure(gcm, cipher, 16, buf), measure(gcm, cipher, 32, buf));
+    }
+    if (has_ni && !check_random(gcm, other, cipher))
+    {
+        printf("AES-NI da un resultado distinto al portable\n");
+        ret = 1;
+    }
+    XFREE(gcm);
+    XFREE(other);
+    return ret;
+}
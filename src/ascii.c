@@ -0,0 +1,365 @@
+/**
+ * @file ascii.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Vectorized conversion of the data of ASCII mode transfers (TYPE A)
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "ascii.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_X86 /*!< SSE2 and AVX2 implementations are compiled*/
+#endif
+
+#define LOW_7_BITS 0x7F /*!< Mask that clears the high bit*/
+
+static const ascii_impl *selected = NULL; /*!< Implementation used by ascii_encode and ascii_decode*/
+
+/**
+ * @brief Allocate the buffer of a transcoder
+ *
+ * @param t Transcoder
+ * @param block Largest block that will be converted at once
+ * @return int less than 0 on error
+ */
+int ascii_transcoder_init(ascii_transcoder *t, size_t block)
+{
+    t->cr_pending = 0;
+    t->size = 2 * block; /*Encoding may double the size*/
+    if (!(t->buf = malloc(t->size)))
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief Release the buffer of a transcoder
+ *
+ * @param t Transcoder
+ */
+void ascii_transcoder_free(ascii_transcoder *t)
+{
+    free(t->buf);
+    t->buf = NULL;
+    t->size = 0;
+}
+
+/**
+ * @brief LF to CRLF byte by byte
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination, at least 2 * len bytes
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_encode_scalar(const char *src, size_t len, char *dst)
+{
+    size_t o = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (src[i] == '\n') /*Server line breaks are \n*/
+            dst[o++] = '\r';
+        dst[o++] = src[i] & LOW_7_BITS;
+    }
+    return o;
+}
+
+/**
+ * @brief CRLF to LF byte by byte
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination, at least len + 1 bytes
+ * @param cr_pending The previous block ended in CR, updated for the next one
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode_scalar(const char *src, size_t len, char *dst, int *cr_pending)
+{
+    const char *end = src + len, *cr;
+    size_t o = 0;
+    if (!len)
+        return 0;
+    if (*cr_pending && *src != '\n') /*A CR alone is data*/
+        dst[o++] = '\r';
+    *cr_pending = 0;
+    /*The runs between two CR are copied whole, the CR is only kept when no LF follows it*/
+    while ((cr = memchr(src, '\r', end - src)))
+    {
+        memcpy(&dst[o], src, cr - src);
+        o += cr - src;
+        if ((src = cr + 1) == end)
+        {
+            *cr_pending = 1;
+            return o;
+        }
+        if (*src != '\n')
+            dst[o++] = '\r';
+    }
+    memcpy(&dst[o], src, end - src);
+    return o + (end - src);
+}
+
+/**
+ * @brief The processor can always run the scalar implementation
+ *
+ * @return int 1
+ */
+int ascii_scalar_supported()
+{
+    return 1;
+}
+
+#ifdef ASCII_X86
+/**
+ * @brief LF to CRLF 16 bytes at a time
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination, at least 2 * len bytes
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_encode_sse2(const char *src, size_t len, char *dst)
+{
+    const __m128i lf = _mm_set1_epi8('\n'), low = _mm_set1_epi8(LOW_7_BITS);
+    size_t i = 0, o = 0, p;
+    while (i + sizeof(__m128i) <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        /*Only a real LF is a line break, the high bit is cleared after comparing as in the scalar version*/
+        uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        /*The bytes after the first LF are garbage that the next store overwrites*/
+        _mm_storeu_si128((__m128i *)&dst[o], _mm_and_si128(v, low));
+        if (!m)
+        {
+            i += sizeof(__m128i);
+            o += sizeof(__m128i);
+            continue;
+        }
+        p = __builtin_ctz(m);
+        dst[o + p] = '\r';
+        dst[o + p + 1] = '\n';
+        i += p + 1;
+        o += p + 2;
+    }
+    return o + ascii_encode_scalar(&src[i], len - i, &dst[o]);
+}
+
+/**
+ * @brief CRLF to LF 16 bytes at a time
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination, at least len + 1 bytes
+ * @param cr_pending The previous block ended in CR, updated for the next one
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode_sse2(const char *src, size_t len, char *dst, int *cr_pending)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0, o = 0, p;
+    if (*cr_pending && len) /*CR at the end of the previous block*/
+    {
+        if (src[0] != '\n')
+            dst[o++] = '\r';
+        *cr_pending = 0;
+    }
+    /*The CR itself is never the last byte of the loop, so its successor is always available*/
+    while (i + sizeof(__m128i) < len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+        uint32_t m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        _mm_storeu_si128((__m128i *)&dst[o], v);
+        if (!m)
+        {
+            i += sizeof(__m128i);
+            o += sizeof(__m128i);
+            continue;
+        }
+        p = __builtin_ctz(m);
+        o += p;
+        i += p + 1;
+        if (src[i] != '\n') /*A CR alone is data*/
+            dst[o++] = '\r';
+    }
+    return o + ascii_decode_scalar(&src[i], len - i, &dst[o], cr_pending);
+}
+
+/**
+ * @brief The processor can run the SSE2 implementation
+ *
+ * @return int 1 if supported
+ */
+int ascii_sse2_supported()
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+/**
+ * @brief LF to CRLF 32 bytes at a time
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination, at least 2 * len bytes
+ * @return size_t Bytes written to dst
+ */
+__attribute__((target("avx2"))) size_t ascii_encode_avx2(const char *src, size_t len, char *dst)
+{
+    const __m256i lf = _mm256_set1_epi8('\n'), low = _mm256_set1_epi8(LOW_7_BITS);
+    size_t i = 0, o = 0, p;
+    while (i + sizeof(__m256i) <= len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        /*Only a real LF is a line break, the high bit is cleared after comparing as in the scalar version*/
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        /*The bytes after the first LF are garbage that the next store overwrites*/
+        _mm256_storeu_si256((__m256i *)&dst[o], _mm256_and_si256(v, low));
+        if (!m)
+        {
+            i += sizeof(__m256i);
+            o += sizeof(__m256i);
+            continue;
+        }
+        p = __builtin_ctz(m);
+        dst[o + p] = '\r';
+        dst[o + p + 1] = '\n';
+        i += p + 1;
+        o += p + 2;
+    }
+    return o + ascii_encode_scalar(&src[i], len - i, &dst[o]);
+}
+
+/**
+ * @brief CRLF to LF 32 bytes at a time
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination, at least len + 1 bytes
+ * @param cr_pending The previous block ended in CR, updated for the next one
+ * @return size_t Bytes written to dst
+ */
+__attribute__((target("avx2"))) size_t ascii_decode_avx2(const char *src, size_t len, char *dst, int *cr_pending)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0, o = 0, p;
+    if (*cr_pending && len) /*CR at the end of the previous block*/
+    {
+        if (src[0] != '\n')
+            dst[o++] = '\r';
+        *cr_pending = 0;
+    }
+    /*The CR itself is never the last byte of the loop, so its successor is always available*/
+    while (i + sizeof(__m256i) < len)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src[i]);
+        uint32_t m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        _mm256_storeu_si256((__m256i *)&dst[o], v);
+        if (!m)
+        {
+            i += sizeof(__m256i);
+            o += sizeof(__m256i);
+            continue;
+        }
+        p = __builtin_ctz(m);
+        o += p;
+        i += p + 1;
+        if (src[i] != '\n') /*A CR alone is data*/
+            dst[o++] = '\r';
+    }
+    return o + ascii_decode_scalar(&src[i], len - i, &dst[o], cr_pending);
+}
+
+/**
+ * @brief The processor can run the AVX2 implementation
+ *
+ * @return int 1 if supported
+ */
+int ascii_avx2_supported()
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif /*ASCII_X86*/
+
+static const ascii_impl implementations[] = {
+    {"scalar", ascii_scalar_supported, ascii_encode_scalar, ascii_decode_scalar},
+#ifdef ASCII_X86
+    {"sse2", ascii_sse2_supported, ascii_encode_sse2, ascii_decode_sse2},
+    {"avx2", ascii_avx2_supported, ascii_encode_avx2, ascii_decode_avx2},
+#endif
+}; /*!< Implementations from the slowest to the fastest*/
+
+/**
+ * @brief Every implementation compiled in, from the slowest to the fastest
+ *
+ * @param n_impls Where to store the number of implementations
+ * @return const ascii_impl* Implementations
+ */
+const ascii_impl *ascii_implementations(int *n_impls)
+{
+    *n_impls = sizeof(implementations) / sizeof(implementations[0]);
+    return implementations;
+}
+
+/**
+ * @brief Implementation selected for this processor
+ *
+ * @return const ascii_impl* Implementation used by ascii_encode and ascii_decode
+ */
+const ascii_impl *ascii_selected()
+{
+    const ascii_impl *impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    int n_impls;
+    if (impl)
+        return impl;
+    /*The fastest one the processor supports, every thread reaches the same result*/
+    ascii_implementations(&n_impls);
+    for (impl = &implementations[n_impls - 1]; !impl->supported(); impl--)
+        ;
+    __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+/**
+ * @brief Convert local text to network ASCII: LF becomes CRLF and the high bit of every byte is cleared
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination, at least 2 * len bytes
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_encode(const char *src, size_t len, char *dst)
+{
+    return ascii_selected()->encode(src, len, dst);
+}
+
+/**
+ * @brief Convert network ASCII to local text: CRLF becomes LF, even if the pair is split between two blocks
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination, at least len + 1 bytes
+ * @param cr_pending In: the previous block ended in CR. Out: this block ends in CR
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode(const char *src, size_t len, char *dst, int *cr_pending)
+{
+    return ascii_selected()->decode(src, len, dst, cr_pending);
+}
+
+/**
+ * @brief Write the CR that ended the last block of a transfer, if there was one
+ *
+ * @param dst Destination, at least 1 byte
+ * @param cr_pending Decoding state, it is cleared
+ * @return size_t Bytes written to dst
+ */
+size_t ascii_decode_flush(char *dst, int *cr_pending)
+{
+    if (!*cr_pending)
+        return 0;
+    *cr_pending = 0;
+    *dst = '\r';
+    return 1;
+}
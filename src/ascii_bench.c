@@ -0,0 +1,215 @@
+/**
+ * @file ascii_bench.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Microbenchmark of the ASCII mode conversions against the former byte by byte loops
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "ascii.h"
+
+#define BENCH_SIZE (64 * 1024 * 1024) /*!< Bytes of text converted in each measure*/
+#define BENCH_BLOCK (1024 * 1024)     /*!< Bytes converted at once, the size of a transfer block*/
+#define BENCH_LINE_MAX 120            /*!< Maximum length of a generated line*/
+#define BENCH_ROUNDS 5                /*!< Measures of each function, the best one is kept*/
+#define BENCH_CHECK_BLOCK_MAX 96      /*!< Largest block of the correctness check, three AVX2 registers*/
+
+/**
+ * @brief Conversion from local text to network ASCII as it was done in send_buffer
+ *
+ * @param src Local text
+ * @param len Bytes of src
+ * @param dst Destination
+ * @return size_t Bytes written
+ */
+size_t legacy_encode(const char *src, size_t len, char *dst)
+{
+    size_t new_buflen = 0;
+    for (int i = 0; i < len; i++)
+    {
+        if (src[i] == '\n')
+            dst[new_buflen++] = '\r';
+        dst[new_buflen++] = (src[i] & 0x7F);
+    }
+    return new_buflen;
+}
+
+/**
+ * @brief Conversion from network ASCII to local text as it was done in read_to_buffer
+ *
+ * @param src Network text
+ * @param len Bytes of src
+ * @param dst Destination
+ * @param cr_pending Not used, every CR was dropped
+ * @return size_t Bytes written
+ */
+size_t legacy_decode(const char *src, size_t len, char *dst, int *cr_pending)
+{
+    size_t new_buflen = 0;
+    for (int i = 0; i < len; i++)
+        if (src[i] != '\r')
+            dst[new_buflen++] = src[i];
+    return new_buflen;
+}
+
+/**
+ * @brief Seconds of the monotonic clock
+ *
+ * @return double seconds
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fill a buffer with printable lines of random length
+ *
+ * @param buf Buffer
+ * @param len Size of the buffer
+ * @param eol End of line, "\n" or "\r\n"
+ * @return size_t Bytes written
+ */
+size_t fill_text(char *buf, size_t len, const char *eol)
+{
+    size_t o = 0, eol_len = strlen(eol);
+    while (o + BENCH_LINE_MAX + eol_len <= len)
+    {
+        for (int n = rand() % BENCH_LINE_MAX; n > 0; n--)
+            buf[o++] = ' ' + rand() % ('~' - ' ');
+        memcpy(&buf[o], eol, eol_len);
+        o += eol_len;
+    }
+    return o;
+}
+
+/**
+ * @brief Convert a text block by block, as a transfer does
+ *
+ * @param encode Encoding function, NULL to decode
+ * @param decode Decoding function
+ * @param src Text
+ * @param len Bytes of text
+ * @param dst Destination
+ * @param block Bytes converted at once
+ * @return size_t Bytes written
+ */
+size_t convert(size_t (*encode)(const char *, size_t, char *), size_t (*decode)(const char *, size_t, char *, int *),
+               const char *src, size_t len, char *dst, size_t block)
+{
+    size_t o = 0;
+    int cr_pending = 0;
+    for (size_t i = 0; i < len; i += block)
+        o += encode ? encode(&src[i], MIN(block, len - i), &dst[o]) : decode(&src[i], MIN(block, len - i), &dst[o], &cr_pending);
+    return o + ascii_decode_flush(&dst[o], &cr_pending);
+}
+
+/**
+ * @brief Best throughput of a conversion over BENCH_ROUNDS measures
+ *
+ * @param encode Encoding function, NULL to decode
+ * @param decode Decoding function
+ * @param src Text
+ * @param len Bytes of text
+ * @param dst Destination
+ * @return double MB/s
+ */
+double measure(size_t (*encode)(const char *, size_t, char *), size_t (*decode)(const char *, size_t, char *, int *),
+               const char *src, size_t len, char *dst)
+{
+    double best = 0, t;
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+    {
+        t = now();
+        convert(encode, decode, src, len, dst, BENCH_BLOCK);
+        t = now() - t;
+        best = MAX(best, len / t / 1e6);
+    }
+    return best;
+}
+
+/**
+ * @brief Check that an implementation gives the same result as the scalar one for blocks
+ * of every small size, so that CRLF pairs are split at every position
+ *
+ * @param impl Implementation
+ * @param scalar Scalar implementation
+ * @param text Text with LF
+ * @param net Text with CRLF and single CRs
+ * @param len Bytes of both texts
+ * @param out Buffer for the result
+ * @param expected Buffer for the expected result
+ * @return int 1 if they match
+ */
+int check(const ascii_impl *impl, const ascii_impl *scalar, const char *text, const char *net, size_t len, char *out, char *expected)
+{
+    size_t n, m;
+    for (size_t block = 1; block <= BENCH_CHECK_BLOCK_MAX; block++)
+    {
+        n = convert(scalar->encode, NULL, text, len, expected, block);
+        m = convert(impl->encode, NULL, text, len, out, block);
+        if (n != m || memcmp(out, expected, n))
+            return 0;
+        n = convert(NULL, scalar->decode, net, len, expected, block);
+        m = convert(NULL, impl->decode, net, len, out, block);
+        if (n != m || memcmp(out, expected, n))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Compare the throughput of every implementation
+ *
+ * @return int 0 if every implementation converts correctly
+ */
+int main()
+{
+    int n_impls, ret = 0;
+    const ascii_impl *impls = ascii_implementations(&n_impls);
+    char *text = malloc(BENCH_SIZE), *net = malloc(BENCH_SIZE), *out = malloc(2 * BENCH_SIZE), *expected = malloc(2 * BENCH_SIZE);
+    size_t text_len, net_len, small_len = 4096;
+    if (!text || !net || !out || !expected)
+        return 1;
+    srand(1);
+    text_len = fill_text(text, BENCH_SIZE, "\n");
+    net_len = fill_text(net, BENCH_SIZE, "\r\n");
+    for (size_t i = 0; i < small_len; i += 1 + rand() % 7)
+        net[i] = '\r'; /*CRs alone and CRCRLF sequences*/
+    /*Bytes with the high bit set, also those whose low bits are LF or CR, which are not line breaks*/
+    for (size_t i = 0; i < small_len; i += 1 + rand() % 5)
+    {
+        text[i] = (i % 3) ? 0x80 | rand() : 0x80 | '\n';
+        net[i + 1] = (i % 3) ? 0x80 | rand() : 0x80 | '\r';
+    }
+
+    printf("Texto de %zu MB, bloques de %d KB, seleccionado: %s\n", text_len >> 20, BENCH_BLOCK >> 10, ascii_selected()->name);
+    printf("%-8s %14s %14s\n", "", "envio MB/s", "recepcion MB/s");
+    printf("%-8s %14.0f %14.0f\n", "antiguo", measure(legacy_encode, NULL, text, text_len, out), measure(NULL, legacy_decode, net, net_len, out));
+    for (int i = 0; i < n_impls; i++)
+    {
+        if (!impls[i].supported())
+        {
+            printf("%-8s %14s %14s\n", impls[i].name, "-", "-");
+            continue;
+        }
+        if (!check(&impls[i], &impls[0], text, net, small_len, out, expected))
+        {
+            printf("%-8s resultado distinto al escalar\n", impls[i].name);
+            ret = 1;
+            continue;
+        }
+        printf("%-8s %14.0f %14.0f\n", impls[i].name, measure(impls[i].encode, NULL, text, text_len, out),
+               measure(NULL, impls[i].decode, net, net_len, out));
+    }
+    free(text);
+    free(net);
+    free(out);
+    free(expected);
+    return ret;
+}
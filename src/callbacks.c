@@ -16,6 +16,8 @@
 #include "ftp_files.h"
 #include "config_parser.h"
 #include "authenticate.h"
+#include "worker_pool.h"
+#include "metrics.h"
 
 /*Define the array of callbacks*/
 #define C(x) x##_cb, /*!< Callback function name associated with an implemented command*/
@@ -61,29 +63,27 @@ uintptr_t command_callback(serverconf *server_conf, session_info *session, reque
  */
 typedef struct _data_thread_args
 {
-    pthread_t thread;        /*!< Thread used for data connection*/
     serverconf *server_conf; /*!< Server configuration*/
     session_info *session;   /*!< Sesion FTP*/
     request_info *command;   /*!< Command that generates callback*/
 } data_thread_args;
 
-#define DATA_cb(COMMAND)                                                            \
-    CALLBACK_RET COMMAND##_cb(CALLBACK_ARGUMENTS)                                   \
-    {                                                                               \
-        data_thread_args *args = malloc(sizeof(data_thread_args));                  \
-        if (!args)                                                                  \
-            return CALLBACK_RET_END_CONNECTION;                                     \
-        args->server_conf = server_conf;                                            \
-        args->session = session;                                                    \
-        args->command = command;                                                    \
-        if (pthread_create(&(args->thread), NULL, COMMAND##_cb_thread, args) == -1) \
-        {                                                                           \
-            free(args);                                                             \
-            return CALLBACK_RET_END_CONNECTION;                                     \
-        }                                                                           \
-        pthread_detach(args->thread);                                               \
-        return CALLBACK_RET_PROCEED;                                                \
-    } /*!< Acts as middleware between the data command callback and the data command thread*/
+#define DATA_cb(COMMAND)                                                \
+    CALLBACK_RET COMMAND##_cb(CALLBACK_ARGUMENTS)                       \
+    {                                                                   \
+        data_thread_args *args = malloc(sizeof(data_thread_args));      \
+        if (!args)                                                      \
+            return CALLBACK_RET_END_CONNECTION;                         \
+        args->server_conf = server_conf;                                \
+        args->session = session;                                        \
+        args->command = command;                                        \
+        if (worker_pool_submit(COMMAND##_cb_thread, args) < 0)          \
+        {                                                               \
+            free(args);                                                 \
+            return CALLBACK_RET_END_CONNECTION;                         \
+        }                                                               \
+        return CALLBACK_RET_PROCEED;                                    \
+    } /*!< Acts as middleware between the data command callback and the transfer worker that serves it*/
 /*Synchronization between two threads to advance at the same time after an event*/
 #define RENDEZVOUS(mut1, mut2) \
     {                          \
@@ -91,12 +91,26 @@ typedef struct _data_thread_args
         sem_wait(&(mut2));     \
         sem_post(&(mut1));     \
     } /*!< Two processes are synchronized using two mutex*/
+/*Close the data connection kept open by block mode*/
+#define CLOSE_KEPT_CONN(server_conf, dc)                          \
+    {                                                             \
+        if ((dc)->conn_state == DATA_CONN_KEPT)                   \
+            close_data_conn(dc, &((server_conf)->passive_ports)); \
+    } /*!< Must be called with the mutex of the data connection taken*/
+/*Final reply of a transfer*/
+#define TRANSFER_DONE_CODE(s) ((s)->block_mode ? CODE_250_DATA_TRANSFER : CODE_226_DATA_TRANSFER) /*!< In block mode the data connection stays open*/
+/*End of the work of a data thread*/
+#define TRANSFER_FINISHED(dc)             \
+    {                                     \
+        eventfd_write((dc)->done_fd, 1);  \
+        sem_post(&((dc)->data_conn_sem)); \
+    } /*!< The eventfd wakes the control thread from poll, the semaphore is the last access to the session*/
 /*Release the initial resources of a thread after a premature end*/
 #define THREAD_PREMATURE_EXIT(t)                                  \
     {                                                             \
         RENDEZVOUS(t->session->data_connection->data_conn_sem,    \
                    t->session->data_connection->control_conn_sem) \
-        sem_post(&(t->session->data_connection->data_conn_sem));  \
+        TRANSFER_FINISHED(t->session->data_connection)            \
         free(t);                                                  \
         return NULL;                                              \
     } /*!< Exits the execution of a thread at the beginning of it, freeing resources*/
@@ -111,26 +125,39 @@ typedef struct _data_thread_args
 int make_data_conn(serverconf *server_conf, session_info *session, request_info *command)
 {
     data_conn *dc = session->data_connection;
-    char *expected_public_key = get_client_public_key(session->context);
+    char *expected_public_key = session->context ? get_client_public_key(session->context) : NULL; /*No AUTH yet*/
     if (!session->authenticated)
         set_command_response(command, CODE_530_NO_LOGIN);
+    else if (dc->conn_state == DATA_CONN_KEPT) /*Block mode, the connection of the previous transfer is reused*/
+    {
+        dc->conn_state = DATA_CONN_BUSY;
+        return 1;
+    }
     else if (dc->conn_state != DATA_CONN_AVAILABLE || !expected_public_key) /*Absence of a PASV or PORT*/
         set_command_response(command, CODE_503_BAD_SEQUENCE);
+    else if (session->clear_data) /*PROT C, the data connection is not encrypted*/
+    {
+        if (dc->is_passive)
+            dc->conn_fd = accept_same_peer(dc->socket_fd, session->clt_fd);
+        else if ((dc->conn_fd = socket_clt_connection(FTP_DATA_PORT, server_conf->ftp_host, dc->client_port, dc->client_ip)) >= 0)
+            set_socket_timeouts(dc->conn_fd, DATA_SOCKET_TIMEOUT);
+    }
     else if (!dc->is_passive)
     {
         /*Connect, checking that the other end uses the same certificate as in the control connection*/
         dc->conn_fd = connect_and_handshake(server_conf->server_ctx, &(dc->context), expected_public_key,
-                                            dc->client_port, FTP_DATA_PORT, dc->client_ip, server_conf->ftp_host);
+                                            dc->client_port, FTP_DATA_PORT, dc->client_ip, server_conf->ftp_host, session->context);
         set_socket_timeouts(dc->conn_fd, DATA_SOCKET_TIMEOUT);
     }
     else /*passive mode*/
-        dc->conn_fd = tls_accept_and_handshake(server_conf->server_ctx, &(dc->context), dc->socket_fd, expected_public_key);
+        dc->conn_fd = tls_accept_and_handshake(server_conf->server_ctx, &(dc->context), dc->socket_fd, expected_public_key, session->context);
     /*Check all went well*/
     if (dc->conn_fd < 0)
         set_command_response(command, CODE_425_CANNOT_OPEN_DATA, strerror(errno));
     else /*All OK when establishing a secure connection*/
     {
         dc->conn_state = DATA_CONN_BUSY;
+        dc->reusable = 1;
         return 1;
     }
     return -1;
@@ -171,28 +198,39 @@ void *RETR_cb_thread(void *args)
         set_command_response(t_args->command, CODE_550_NO_ACCESS);
     else
     {
-        ssize_t sent = send_file(t_args->session->data_connection->context, t_args->session->data_connection->conn_fd,
-                                 f, t_args->session->ascii_mode, &(t_args->session->data_connection->abort));
+        struct TLSContext *ctx = t_args->session->data_connection->context;
+        /*Binary files can be sent with sendfile if the kernel takes over the encryption.
+        Connections kept in block mode stay in tlse, as the next transfer may be an upload*/
+        if (!t_args->session->ascii_mode && !t_args->session->block_mode && ktls_enable(ctx, t_args->session->data_connection->conn_fd))
+            ctx = NULL;
+        ssize_t sent = send_file(ctx, t_args->session->data_connection->conn_fd, f, t_args->session->ascii_mode,
+                                 t_args->session->block_mode, &(t_args->session->data_connection->abort));
         if (sent < 0)
+        {
+            t_args->session->data_connection->reusable = 0; /*The position in the stream of blocks is lost*/
             set_command_response(t_args->command, CODE_550_NO_ACCESS);
+        }
         else
-            set_command_response(t_args->command, CODE_226_DATA_TRANSFER, sent);
+        {
+            metrics_bytes(RETR, 0, sent);
+            set_command_response(t_args->command, TRANSFER_DONE_CODE(t_args->session), sent);
+        }
         fclose(f);
     }
-    sem_post(&(t_args->session->data_connection->data_conn_sem)); /*Indicate transmission finished*/
+    TRANSFER_FINISHED(t_args->session->data_connection) /*Indicate transmission finished*/
     free(t_args);
     return NULL;
 }
 
 /**
- * @brief List content of a path
+ * @brief Send the listing of a path through the data connection
  *
- * @param args Thread arguments
+ * @param t_args Thread arguments
+ * @param format Format of the listing
  * @return void*
  */
-void *LIST_cb_thread(void *args)
+void *send_listing_thread(data_thread_args *t_args, list_format format)
 {
-    data_thread_args *t_args = (data_thread_args *)args;
     CHECK_DATA_PORT(t_args) /*Create data connection*/
                             /*Get the element to give*/
     char path[XXL_SZ] = "";
@@ -206,24 +244,47 @@ void *LIST_cb_thread(void *args)
     /*Follow the marked concurrency protocol*/
     RENDEZVOUS(t_args->session->data_connection->data_conn_sem, t_args->session->data_connection->control_conn_sem)
     /*Start the transfer*/
-    FILE *f = list_directories(t_args->command->command_arg, t_args->session->current_dir);
-    if (!f)
+    uint64_t start = metrics_clock();
+    ssize_t sent = send_listing(t_args->session->data_connection->context, t_args->session->data_connection->conn_fd, path, format,
+                                t_args->session->ascii_mode, t_args->session->block_mode, &(t_args->session->data_connection->abort));
+    if (sent < 0)
+    {
+        t_args->session->data_connection->reusable = 0; /*The position in the stream of blocks is lost*/
         set_command_response(t_args->command, CODE_550_NO_ACCESS);
+    }
     else
     {
-        ssize_t sent = send_file(t_args->session->data_connection->context, t_args->session->data_connection->conn_fd,
-                                 f, t_args->session->ascii_mode, &(t_args->session->data_connection->abort));
-        if (sent < 0)
-            set_command_response(t_args->command, CODE_550_NO_ACCESS);
-        else
-            set_command_response(t_args->command, CODE_226_DATA_TRANSFER, sent);
-        pclose(f);
+        metrics_observe(HIST_LIST, format, metrics_clock() - start);
+        metrics_bytes(t_args->command->implemented_command, 0, sent);
+        set_command_response(t_args->command, TRANSFER_DONE_CODE(t_args->session), sent);
     }
-    sem_post(&(t_args->session->data_connection->data_conn_sem)); /*Indicate transmission finished*/
+    TRANSFER_FINISHED(t_args->session->data_connection) /*Indicate transmission finished*/
     free(t_args);
     return NULL;
 }
 
+/**
+ * @brief List content of a path
+ *
+ * @param args Thread arguments
+ * @return void*
+ */
+void *LIST_cb_thread(void *args)
+{
+    return send_listing_thread((data_thread_args *)args, LIST_FORMAT_LS);
+}
+
+/**
+ * @brief List content of a path in machine readable format
+ *
+ * @param args Thread arguments
+ * @return void*
+ */
+void *MLSD_cb_thread(void *args)
+{
+    return send_listing_thread((data_thread_args *)args, LIST_FORMAT_MLSD);
+}
+
 /**
  * @brief Receive a file from the client
  *
@@ -252,14 +313,20 @@ void *STOR_cb_thread(void *args)
     else /*read file*/
     {
         ssize_t sent = read_to_file(t_args->session->data_connection->context, f, t_args->session->data_connection->conn_fd,
-                                    t_args->session->ascii_mode, &(t_args->session->data_connection->abort));
+                                    t_args->session->ascii_mode, t_args->session->block_mode, &(t_args->session->data_connection->abort));
         if (sent < 0)
+        {
+            t_args->session->data_connection->reusable = 0; /*The position in the stream of blocks is lost*/
             set_command_response(t_args->command, CODE_451_DATA_CONN_LOST);
+        }
         else
-            set_command_response(t_args->command, CODE_226_DATA_TRANSFER, sent);
+        {
+            metrics_bytes(STOR, sent, 0);
+            set_command_response(t_args->command, TRANSFER_DONE_CODE(t_args->session), sent);
+        }
         fclose(f);
     }
-    sem_post(&(t_args->session->data_connection->data_conn_sem)); /*Indicate transmission finished*/
+    TRANSFER_FINISHED(t_args->session->data_connection) /*Indicate transmission finished*/
     free(t_args);
     return NULL;
 }
@@ -275,6 +342,11 @@ DATA_cb(RETR)
      */
     DATA_cb(LIST)
 
+    /**
+     * @brief Construct middleware function between the MLSD callback and a thread to serve it
+     */
+    DATA_cb(MLSD)
+
     /**
      * @brief Construct middleware function between the STOR callback and a thread to serve it
      */
@@ -317,12 +389,12 @@ uintptr_t PASV_cb(serverconf *server_conf, session_info *session, request_info *
     char port_string[sizeof("xxx,xxx,xxx,xxx,ppp,ppp")];
 
     MUTEX_DO(
-        session->data_connection->mutex,                              /*Atomic operation*/
+        session->data_connection->mutex, /*Atomic operation*/
+        CLOSE_KEPT_CONN(server_conf, session->data_connection)
         if (session->data_connection->conn_state != DATA_CONN_CLOSED) /*Open data connection*/
         set_command_response(command, CODE_421_DATA_OPEN);
-        /*Open and listen on a passive port*/
-        else if ((port = passive_data_socket_fd(server_conf->ftp_host, /*Failed to open socket*/
-                                                &(server_conf->free_passive_ports), &(session->data_connection->socket_fd))) == -1)
+        /*Take a port that is already listening*/
+        else if ((port = passive_data_socket_fd(&(server_conf->passive_ports), session->data_connection)) == -1) /*No free port*/
             set_command_response(command, CODE_425_CANNOT_OPEN_DATA, strerror(errno));
         else /*Generate PASV response string*/
         {
@@ -351,10 +423,13 @@ uintptr_t PORT_cb(serverconf *server_conf, session_info *session, request_info *
     }
     MUTEX_DO(
         session->data_connection->mutex, /*Protected operation*/
+        CLOSE_KEPT_CONN(server_conf, session->data_connection)
         if (session->data_connection->conn_state != DATA_CONN_CLOSED)
             set_command_response(command, CODE_421_DATA_OPEN); /*Intentar parsear port string*/
         else if (parse_port_string(command->command_arg, session->data_connection->client_ip, &(session->data_connection->client_port)) < 0)
             set_command_response(command, CODE_501_BAD_ARGS); /*Failed to parse port string*/
+        else if (!peer_is_ip(session->clt_fd, session->data_connection->client_ip))
+            set_command_response(command, CODE_504_PORT_OTHER_HOST); /*The server is not used to connect to third parties (FTP bounce)*/
         else {
             set_command_response(command, CODE_200_OP_OK); /*Port string successfully parsed*/
             session->data_connection->conn_state = DATA_CONN_AVAILABLE;
@@ -620,6 +695,26 @@ uintptr_t SIZE_cb(serverconf *server_conf, session_info *session, request_info *
     return CALLBACK_RET_PROCEED;
 }
 
+/**
+ * @brief Facts of a single file through the control connection
+ *
+ * @param server_conf Server configuration
+ * @param session FTP session
+ * @param command Command sent
+ * @return uintptr_t
+ */
+uintptr_t MLST_cb(serverconf *server_conf, session_info *session, request_info *command)
+{
+    char path[XXL_SZ], facts[XXL_SZ];
+    CHECK_USERNAME(session, command)
+    RESOLVE_PATH(session, command, path, 0)
+    if (mlst_entry(path, facts, sizeof(facts)) < 0)
+        set_command_response(command, CODE_550_NO_ACCESS);
+    else
+        set_command_response(command, CODE_250_MLST, path_no_root(path), facts);
+    return CALLBACK_RET_PROCEED;
+}
+
 /**
  * @brief Switch to binary or ascii mode
  *
@@ -689,7 +784,7 @@ uintptr_t NOOP_cb(serverconf *server_conf, session_info *session, request_info *
  *
  * @param server_conf Server configuration
  * @param session Session information
- * @param command Command that generates the callback, argument S, B, C or Z is expected
+ * @param command Command that generates the callback, argument S, B, C or Z is expected, S and B are supported
  * @return uintptr_t
  */
 uintptr_t MODE_cb(serverconf *server_conf, session_info *session, request_info *command)
@@ -698,8 +793,17 @@ uintptr_t MODE_cb(serverconf *server_conf, session_info *session, request_info *
     if (command->command_arg[0] == '\0')
         set_command_response(command, CODE_501_BAD_ARGS);
     else if (!strcmp(command->command_arg, "S")) /*Modo Stream*/
+    {
+        session->block_mode = 0; /*The end of file is the end of the connection again*/
+        MUTEX_DO(session->data_connection->mutex, CLOSE_KEPT_CONN(server_conf, session->data_connection))
         set_command_response(command, CODE_200_OP_OK);
-    else /*Currently only stream is supported*/
+    }
+    else if (!strcmp(command->command_arg, "B")) /*Block mode, the data connection is reused*/
+    {
+        session->block_mode = 1;
+        set_command_response(command, CODE_200_OP_OK);
+    }
+    else /*Compressed mode is not supported*/
         set_command_response(command, CODE_504_UNSUPORTED_PARAM);
     return CALLBACK_RET_PROCEED;
 }
@@ -806,19 +910,53 @@ uintptr_t AUTH_cb(serverconf *server_conf, session_info *session, request_info *
         set_command_response(command, CODE_431_INVALID_SEC, command->command_arg);
         return CALLBACK_RET_PROCEED;
     }
-    char *buf = alloca(XXXL_SZ);
+    handshake_state local_hs, *hs = server_conf->use_reactor ? malloc(sizeof(handshake_state)) : &local_hs;
     send(session->clt_fd, CODE_234_START_NEG, sizeof(CODE_234_START_NEG) - 1, MSG_NOSIGNAL);
-    session->context = tls_accept(server_conf->server_ctx);
-    tls_request_client_certificate(session->context);                          /*We need client certificate*/
-    digest_tls(session->context, session->clt_fd, buf, XXXL_SZ, MSG_NOSIGNAL); /*Send certificate request to client*/
-    digest_tls(session->context, session->clt_fd, buf, XXXL_SZ, MSG_NOSIGNAL); /*Receive client certificate*/
-    if (!tls_context_check_client_certificate(NULL, session->context))         /*Check client certificate*/
+    if (!hs)
+        return CALLBACK_RET_END_CONNECTION;
+    if (tls_handshake_start(hs, server_conf->server_ctx, session->clt_fd, TLS_HANDSHAKE_TIMEOUT) < 0)
     {
-        ssend(session->context, session->clt_fd, CODE_421_BAD_TLS_NEG, sizeof(CODE_421_BAD_TLS_NEG) - 1, MSG_NOSIGNAL);
+        if (hs != &local_hs)
+            free(hs);
+        return CALLBACK_RET_END_CONNECTION;
+    }
+    session->context = hs->context;
+    /*The event loop goes on with other clients and steps the negotiation as the records arrive*/
+    if (hs != &local_hs)
+    {
+        session->handshake = hs;
+        return CALLBACK_RET_DONT_SEND;
+    }
+    session->handshake = NULL;
+    return auth_handshake_done(server_conf, session, hs, tls_handshake_run(hs));
+}
+
+/**
+ * @brief Finish the negotiation started by AUTH
+ *
+ * @param server_conf Server configuration
+ * @param session FTP session
+ * @param hs Handshake of the session, released if it is session->handshake
+ * @param status Result of the handshake
+ * @return uintptr_t CALLBACK_RET_DONT_SEND if the session is now secure, CALLBACK_RET_END_CONNECTION if not
+ */
+uintptr_t auth_handshake_done(serverconf *server_conf, session_info *session, handshake_state *hs, handshake_status status)
+{
+    uint64_t start = hs->start;
+    if (hs == session->handshake)
+    {
+        free(hs);
+        session->handshake = NULL;
+    }
+    if (status != HANDSHAKE_DONE || !tls_context_check_client_certificate(NULL, session->context)) /*Check client certificate*/
+    {
+        if (status == HANDSHAKE_DONE)
+            ssend(session->context, session->clt_fd, CODE_421_BAD_TLS_NEG, sizeof(CODE_421_BAD_TLS_NEG) - 1, MSG_NOSIGNAL);
         tls_destroy_context(session->context);
         session->context = NULL;
         return CALLBACK_RET_END_CONNECTION;
     }
+    metrics_observe(HIST_HANDSHAKE, HANDSHAKE_CONTROL, metrics_clock() - start);
     session->secure = 1; /*flag activated*/
     return CALLBACK_RET_DONT_SEND;
 }
@@ -828,17 +966,32 @@ uintptr_t AUTH_cb(serverconf *server_conf, session_info *session, request_info *
  *
  * @param server_conf Server configuration
  * @param session FTP session
- * @param command Command that generates the callback, argument P is expected
+ * @param command Command that generates the callback, argument P is expected, C only
+ * from authenticated sessions of the networks allowed in the configuration
  * @return uintptr_t
  */
 uintptr_t PROT_cb(serverconf *server_conf, session_info *session, request_info *command)
 {
     if (!session->secure || !session->pbsz_sent)
+    {
         set_command_response(command, CODE_503_BAD_SEQUENCE);
-    else if (strcmp(command->command_arg, "P"))
+        return CALLBACK_RET_PROCEED;
+    }
+    /*A kept connection was opened with the previous protection level*/
+    MUTEX_DO(session->data_connection->mutex, CLOSE_KEPT_CONN(server_conf, session->data_connection))
+    if (!strcmp(command->command_arg, "P"))
+    {
+        session->clear_data = 0;
+        set_command_response(command, CODE_200_OP_OK);
+    }
+    else if (strcmp(command->command_arg, "C") || !session->authenticated ||
+             !peer_in_networks(session->clt_fd, server_conf->clear_networks, server_conf->n_clear_networks))
         set_command_response(command, CODE_536_INSUFFICIENT_SEC);
     else
+    {
+        session->clear_data = 1; /*Trusted network, data goes without encryption*/
         set_command_response(command, CODE_200_OP_OK);
+    }
     return CALLBACK_RET_PROCEED;
 }
 
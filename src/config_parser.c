@@ -22,6 +22,17 @@ int get_type(serverconf *server_conf, cfg_t *cfg);
 int get_certificate_path(serverconf *server_conf, cfg_t *cfg);
 int get_daemon_mode(serverconf *server_conf, cfg_t *cfg);
 int get_private_key_path(serverconf *server_conf, cfg_t *cfg);
+int get_ecdsa_keys(serverconf *server_conf, cfg_t *cfg);
+int get_server_model(serverconf *server_conf, cfg_t *cfg);
+int get_transfer_workers(serverconf *server_conf, cfg_t *cfg);
+int get_ktls_offload(serverconf *server_conf, cfg_t *cfg);
+int get_clear_data_networks(serverconf *server_conf, cfg_t *cfg);
+int get_metrics_port(serverconf *server_conf, cfg_t *cfg);
+int get_pasv_port_range(serverconf *server_conf, cfg_t *cfg);
+int get_tls_versions(serverconf *server_conf, cfg_t *cfg);
+int get_keyshare_pool_size(serverconf *server_conf, cfg_t *cfg);
+int get_crypto_workers(serverconf *server_conf, cfg_t *cfg);
+int get_accept_shards(serverconf *server_conf, cfg_t *cfg);
 
 /**
  * @brief Parse the information from the server.conf file to configure the server at startup
@@ -45,6 +56,24 @@ int parse_server_conf(serverconf *server_conf)
         CFG_STR(FTP_HOST, FTP_HOST_DEFAULT, CFGF_NONE),
         CFG_STR(CERTIFICATE_PATH, CERTIFICATE_PATH_DEFAULT, CFGF_NONE),
         CFG_STR(PRIVATE_KEY_PATH, PRIVATE_KEY_PATH_DEFAULT, CFGF_NONE),
+        CFG_STR(ECDSA_CERTIFICATE_PATH, ECDSA_PATH_DEFAULT, CFGF_NONE),
+        CFG_STR(ECDSA_PRIVATE_KEY_PATH, ECDSA_PATH_DEFAULT, CFGF_NONE),
+        CFG_STR(SERVER_MODEL, SERVER_MODEL_DEFAULT, CFGF_NONE),
+        CFG_INT(REACTOR_THREADS, REACTOR_THREADS_DEFAULT, CFGF_NONE),
+        CFG_INT(TRANSFER_WORKERS, TRANSFER_WORKERS_DEFAULT, CFGF_NONE),
+        CFG_INT(KTLS_OFFLOAD, KTLS_OFFLOAD_DEFAULT, CFGF_NONE),
+        CFG_STR(CLEAR_DATA_NETWORKS, CLEAR_DATA_NETWORKS_DEFAULT, CFGF_NONE),
+        CFG_INT(METRICS_PORT, METRICS_PORT_DEFAULT, CFGF_NONE),
+        CFG_INT(PASV_PORT_MIN, PASV_PORT_DEFAULT, CFGF_NONE),
+        CFG_INT(PASV_PORT_MAX, PASV_PORT_DEFAULT, CFGF_NONE),
+        CFG_STR(TLS_MIN_VERSION, TLS_MIN_VERSION_DEFAULT, CFGF_NONE),
+        CFG_STR(TLS_MAX_VERSION, TLS_MAX_VERSION_DEFAULT, CFGF_NONE),
+        CFG_INT(KEYSHARE_POOL_SIZE, KEYSHARE_POOL_SIZE_DEFAULT, CFGF_NONE),
+        CFG_INT(CRYPTO_WORKERS, CRYPTO_WORKERS_DEFAULT, CFGF_NONE),
+        CFG_STR(CRYPTO_CORES, CRYPTO_CORES_DEFAULT, CFGF_NONE),
+        CFG_INT(ACCEPT_SHARDS, ACCEPT_SHARDS_DEFAULT, CFGF_NONE),
+        CFG_INT(LISTEN_BACKLOG, LISTEN_BACKLOG_DEFAULT, CFGF_NONE),
+        CFG_INT(DEFER_ACCEPT, DEFER_ACCEPT_DEFAULT, CFGF_NONE),
         CFG_END()};
 
     /*Initialize the configuration and parse the file*/
@@ -54,7 +83,7 @@ int parse_server_conf(serverconf *server_conf)
         return -1;
 
     /*The structure is filled with the information obtained from the server.conf file*/
-    int res = 1 - 2 * (int)(get_server_root(server_conf, cfg) < 0 || get_ftp_user(server_conf, cfg) < 0 || get_max_passive_ports(server_conf, cfg) < 0 || get_ftp_host(server_conf, cfg) < 0 || get_type(server_conf, cfg) < 0 || get_private_key_path(server_conf, cfg) < 0 || get_certificate_path(server_conf, cfg) < 0 || get_daemon_mode(server_conf, cfg) < 0 || get_max_sessions(server_conf, cfg) < 0);
+    int res = 1 - 2 * (int)(get_server_root(server_conf, cfg) < 0 || get_ftp_user(server_conf, cfg) < 0 || get_max_passive_ports(server_conf, cfg) < 0 || get_ftp_host(server_conf, cfg) < 0 || get_type(server_conf, cfg) < 0 || get_private_key_path(server_conf, cfg) < 0 || get_certificate_path(server_conf, cfg) < 0 || get_ecdsa_keys(server_conf, cfg) < 0 || get_daemon_mode(server_conf, cfg) < 0 || get_max_sessions(server_conf, cfg) < 0 || get_server_model(server_conf, cfg) < 0 || get_transfer_workers(server_conf, cfg) < 0 || get_ktls_offload(server_conf, cfg) < 0 || get_clear_data_networks(server_conf, cfg) < 0 || get_metrics_port(server_conf, cfg) < 0 || get_pasv_port_range(server_conf, cfg) < 0 || get_tls_versions(server_conf, cfg) < 0 || get_keyshare_pool_size(server_conf, cfg) < 0 || get_crypto_workers(server_conf, cfg) < 0 || get_accept_shards(server_conf, cfg) < 0);
     cfg_free(cfg);
     return res;
 }
@@ -78,6 +107,225 @@ int get_type(serverconf *server_conf, cfg_t *cfg)
     return 1;
 }
 
+/**
+ * @brief Collect and clean server model and number of event loops
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_server_model(serverconf *server_conf, cfg_t *cfg)
+{
+    char *model = cfg_getstr(cfg, SERVER_MODEL);
+    if (!strcmp(model, "epoll"))
+        server_conf->use_reactor = 1;
+    else if (!strcmp(model, "threads"))
+        server_conf->use_reactor = 0;
+    else
+    {
+        printf("Modelo de servidor incorrecto, valores posibles 'epoll' y 'threads'\n");
+        return -1;
+    }
+    server_conf->reactor_threads = cfg_getint(cfg, REACTOR_THREADS);
+    /*CoE: negative values mean one event loop per core*/
+    if (server_conf->reactor_threads < 0)
+        server_conf->reactor_threads = REACTOR_THREADS_DEFAULT;
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the number of transfer workers
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_transfer_workers(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->transfer_workers = cfg_getint(cfg, TRANSFER_WORKERS);
+    /*CoE: negative values mean two workers per core*/
+    if (server_conf->transfer_workers < 0)
+        server_conf->transfer_workers = TRANSFER_WORKERS_DEFAULT;
+    return 1;
+}
+
+/**
+ * @brief Pick up kernel TLS offload mode
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_ktls_offload(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->ktls_offload = cfg_getint(cfg, KTLS_OFFLOAD);
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the networks allowed to use unencrypted data connections
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_clear_data_networks(serverconf *server_conf, cfg_t *cfg)
+{
+    if ((server_conf->n_clear_networks = parse_networks(cfg_getstr(cfg, CLEAR_DATA_NETWORKS), server_conf->clear_networks, CLEAR_NETS_MAX)) < 0)
+    {
+        printf("Lista de redes sin cifrado no valida, se esperan direcciones IPv4 con prefijo opcional separadas por comas\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the port of the metrics
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_metrics_port(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->metrics_port = cfg_getint(cfg, METRICS_PORT);
+    /*CoE: not a valid port*/
+    if (server_conf->metrics_port < 0 || server_conf->metrics_port > 0xFFFF)
+    {
+        printf("Puerto de metricas no valido\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the range of passive ports
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_pasv_port_range(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->pasv_port_min = cfg_getint(cfg, PASV_PORT_MIN);
+    server_conf->pasv_port_max = cfg_getint(cfg, PASV_PORT_MAX);
+    /*Without range the system chooses the ports*/
+    if (!server_conf->pasv_port_min && !server_conf->pasv_port_max)
+        return 1;
+    /*CoE: both ends must be valid ports in order*/
+    if (server_conf->pasv_port_min <= 0 || server_conf->pasv_port_min > server_conf->pasv_port_max || server_conf->pasv_port_max > PASSIVE_PORT_MAX)
+    {
+        printf("Rango de puertos pasivos no valido\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Translate a TLS version of the configuration
+ *
+ * @param version Version as written in server.conf, from "1.0" to "1.3"
+ * @return unsigned short TLS_V10 to TLS_V13, 0 if it is not valid
+ */
+unsigned short parse_tls_version(char *version)
+{
+    if (!strcmp(version, "1.0"))
+        return TLS_V10;
+    if (!strcmp(version, "1.1"))
+        return TLS_V11;
+    if (!strcmp(version, "1.2"))
+        return TLS_V12;
+    if (!strcmp(version, "1.3"))
+        return TLS_V13;
+    return 0;
+}
+
+/**
+ * @brief Collect and clean the range of TLS versions
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_tls_versions(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->tls_min_version = parse_tls_version(cfg_getstr(cfg, TLS_MIN_VERSION));
+    server_conf->tls_max_version = parse_tls_version(cfg_getstr(cfg, TLS_MAX_VERSION));
+    /*CoE: unknown versions or the newest older than the oldest*/
+    if (!server_conf->tls_min_version || !server_conf->tls_max_version || server_conf->tls_min_version > server_conf->tls_max_version)
+    {
+        printf("Rango de versiones TLS no valido, valores posibles '1.0', '1.1', '1.2' y '1.3'\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the size of the pools of ephemeral keys
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_keyshare_pool_size(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->keyshare_pool_size = cfg_getint(cfg, KEYSHARE_POOL_SIZE);
+    /*CoE: negative or too many keys*/
+    if (server_conf->keyshare_pool_size < 0 || server_conf->keyshare_pool_size > KEYSHARE_POOL_SIZE_MAX)
+    {
+        printf("Tamano de la reserva de claves efimeras no valido\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the crypto workers and their cores
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_crypto_workers(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->crypto_workers = cfg_getint(cfg, CRYPTO_WORKERS);
+    /*CoE: negative values mean one worker per core*/
+    if (server_conf->crypto_workers < 0)
+        server_conf->crypto_workers = CRYPTO_WORKERS_DEFAULT;
+    if ((server_conf->n_crypto_cores = crypto_parse_cores(cfg_getstr(cfg, CRYPTO_CORES), server_conf->crypto_cores, CRYPTO_CORES_MAX)) < 0)
+    {
+        printf("Lista de nucleos criptograficos no valida, se esperan numeros o rangos (2-3) separados por comas\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Collect and clean the number of acceptors of the control port, their backlog and TCP_DEFER_ACCEPT
+ *
+ * @param server_conf configuration structure
+ * @param cfg Parsing results
+ * @return int less than 0 on error
+ */
+int get_accept_shards(serverconf *server_conf, cfg_t *cfg)
+{
+    server_conf->accept_shards = cfg_getint(cfg, ACCEPT_SHARDS);
+    server_conf->listen_backlog = cfg_getint(cfg, LISTEN_BACKLOG);
+    server_conf->defer_accept = cfg_getint(cfg, DEFER_ACCEPT);
+    /*CoE: 0 or negative values mean one acceptor per core*/
+    if (server_conf->accept_shards < 1 && (server_conf->accept_shards = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        server_conf->accept_shards = 1;
+    server_conf->accept_shards = MIN(server_conf->accept_shards, ACCEPT_SHARDS_MAX);
+    if (server_conf->listen_backlog < 1)
+    {
+        printf("listen_backlog debe ser mayor que 0\n");
+        return -1;
+    }
+    if (server_conf->defer_accept < 0)
+        server_conf->defer_accept = DEFER_ACCEPT_DEFAULT;
+    return 1;
+}
+
 /**
  * @brief Collect and clean server root
  *
@@ -165,6 +413,38 @@ int get_private_key_path(serverconf *server_conf, cfg_t *cfg)
     return 1;
 }
 
+/**
+ * @brief Collect and clean the paths of the optional ECDSA certificate and its private key
+ *
+ * @param server_conf Server configuration
+ * @param cfg Parsing result
+ * @return int less than 0 on error
+ */
+int get_ecdsa_keys(serverconf *server_conf, cfg_t *cfg)
+{
+    char *cert = cfg_getstr(cfg, ECDSA_CERTIFICATE_PATH), *key = cfg_getstr(cfg, ECDSA_PRIVATE_KEY_PATH);
+
+    server_conf->ecdsa_cert_path[0] = server_conf->ecdsa_key_path[0] = '\0';
+    if (!*cert && !*key)
+        return 1;
+    if (!*cert || !*key)
+    {
+        printf("El certificado ECDSA y su clave privada deben indicarse juntos\n");
+        return -1;
+    }
+    if (strlen(cert) >= CERTIFICATE_PATH_MAX || strlen(key) >= PRIVATE_KEY_PATH_MAX)
+    {
+        printf("Path al certificado ECDSA o a su clave privada demasiado largo\n");
+        return -1;
+    }
+    if (!realpath(cert, server_conf->ecdsa_cert_path) || !realpath(key, server_conf->ecdsa_key_path))
+    {
+        printf("Path al certificado ECDSA o a su clave privada incorrecto\n");
+        return -1;
+    }
+    return 1;
+}
+
 /**
  * @brief Collect and clean ftp user
  *
@@ -199,8 +479,6 @@ int get_max_passive_ports(serverconf *server_conf, cfg_t *cfg)
     /*CoE: at least one port must be allowed in passive mode*/
     if (server_conf->max_passive_ports <= 0)
         server_conf->max_passive_ports = MAX_PASSIVE_PORTS_DEFAULT;
-    /*Open ports semaphore*/
-    sem_init(&(server_conf->free_passive_ports), 0, server_conf->max_passive_ports);
     return 1;
 }
 
@@ -0,0 +1,191 @@
+/**
+ * @file crypto_pool.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Workers pinned to their own cores that compute the RSA signatures of the TLS handshakes in batches
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#define _GNU_SOURCE /*!< Access to pthread_attr_setaffinity_np*/
+#include <sched.h>
+#include "crypto_pool.h"
+
+/**
+ * @brief Signature waiting for a worker, it lives in the stack of the handshake
+ *
+ */
+typedef struct _crypto_request
+{
+    struct TLSSignJob *job;        /*!< Signature to compute*/
+    sem_t done;                    /*!< Posted by the worker when the signature is ready*/
+    struct _crypto_request *next;  /*!< Next request in the queue*/
+} crypto_request;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER; /*!< Protects the queue*/
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;    /*!< Signals requests in the queue*/
+static crypto_request *queue_head = NULL;                       /*!< First request, workers take from here*/
+static crypto_request *queue_tail = NULL;                       /*!< Last request, handshakes add here*/
+static long queue_len = 0;                                      /*!< Requests in the queue*/
+static int n_crypto_workers = 0;                                /*!< Number of workers*/
+static unsigned long signatures = 0;                            /*!< Signatures computed*/
+static unsigned long batches = 0;                               /*!< Batches taken from the queue*/
+
+/**
+ * @brief Parse a comma separated list of cores and ranges of cores, e.g. "2,3" or "4-7"
+ *
+ * @param list List of cores
+ * @param cores Where to store the cores
+ * @param max_cores Maximum number of cores
+ * @return int Number of cores or -1 if the list is not valid
+ */
+int crypto_parse_cores(char *list, int *cores, int max_cores)
+{
+    char *copy = strcpy(alloca(strlen(list) + 1), list), *save, *item, *last;
+    int n_cores = 0, first, end;
+    for (item = strtok_r(copy, ", ", &save); item; item = strtok_r(NULL, ", ", &save))
+    {
+        if ((last = strchr(item, '-')))
+            *(last++) = '\0';
+        else
+            last = item;
+        if (!*item || !*last || !is_number(item, strlen(item)) || !is_number(last, strlen(last)))
+            return -1;
+        first = atoi(item);
+        end = atoi(last);
+        /*CoE: reversed ranges or cores that cpu_set_t cannot hold*/
+        if (first > end || end >= CPU_SETSIZE)
+            return -1;
+        for (int core = first; core <= end; core++)
+        {
+            if (n_cores == max_cores)
+                return -1;
+            cores[n_cores++] = core;
+        }
+    }
+    return n_cores;
+}
+
+/**
+ * @brief Wake up the handshake of a signature of the batch as soon as it is ready
+ *
+ * @param index Position of the signature in the batch
+ * @param arg Requests of the batch
+ */
+void crypto_request_done(int index, void *arg)
+{
+    sem_post(&(((crypto_request **)arg)[index]->done));
+}
+
+/**
+ * @brief Main loop of a worker: take every request queued, up to CRYPTO_BATCH_MAX, and sign them
+ *
+ * @param args Not used
+ * @return void* NULL
+ */
+void *crypto_worker_run(void *args)
+{
+    crypto_request *batch[CRYPTO_BATCH_MAX];
+    struct TLSSignJob *jobs[CRYPTO_BATCH_MAX];
+    int n;
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_head)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        /*During a storm of handshakes the requests pile up and are signed with a single import of the key*/
+        for (n = 0; n < CRYPTO_BATCH_MAX && queue_head; n++)
+        {
+            batch[n] = queue_head;
+            jobs[n] = queue_head->job;
+            queue_head = queue_head->next;
+        }
+        if (!queue_head)
+            queue_tail = NULL;
+        queue_len -= n;
+        pthread_mutex_unlock(&queue_mutex);
+
+        tls_sign_jobs_run(jobs, n, crypto_request_done, batch);
+        __atomic_fetch_add(&signatures, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&batches, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Executor of the signatures of tlse: queue the signature and sleep until a worker computes it
+ *
+ * @param job Signature to compute
+ */
+void crypto_pool_sign(struct TLSSignJob *job)
+{
+    crypto_request request = {.job = job, .next = NULL};
+    sem_init(&(request.done), 0, 0);
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail)
+        queue_tail->next = &request;
+    else
+        queue_head = &request;
+    queue_tail = &request;
+    queue_len++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    /*The request must outlive the worker's use of it, signals cannot cut the wait short*/
+    while (sem_wait(&(request.done)) < 0)
+        ;
+    sem_destroy(&(request.done));
+}
+
+/**
+ * @brief Start the crypto workers, from then on the handshakes wait for them to sign
+ *
+ * @param n_workers Number of workers, if less than 1 one per core of the list, none without cores
+ * @param cores Cores where the workers are pinned in turn, any core if there are none
+ * @param n_cores Number of cores
+ * @return int Number of workers started or -1 on error
+ */
+int crypto_pool_start(int n_workers, int *cores, int n_cores)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t set;
+    if (n_workers < 1 && (n_workers = n_cores) < 1)
+        return 0;
+    for (n_crypto_workers = 0; n_crypto_workers < n_workers; n_crypto_workers++)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (n_cores)
+        {
+            CPU_ZERO(&set);
+            CPU_SET(cores[n_crypto_workers % n_cores], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if (pthread_create(&thread, &attr, crypto_worker_run, NULL) != 0)
+        {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    tls_set_sign_executor(crypto_pool_sign);
+    return n_crypto_workers;
+}
+
+/**
+ * @brief Collect the current statistics of the crypto workers
+ *
+ * @param stats Where to store them
+ */
+void crypto_pool_stats(crypto_stats *stats)
+{
+    pthread_mutex_lock(&queue_mutex);
+    stats->queued = queue_len;
+    pthread_mutex_unlock(&queue_mutex);
+    stats->workers = n_crypto_workers;
+    stats->signatures = __atomic_load_n(&signatures, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&batches, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,174 @@
+/**
+ * @file ecc_bench.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Check of the fixed-base table of P-256 against the generic point multiplication, and speed of
+ * key generation and ECDSA signatures with and without it
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "libtomcrypt.c" /*Built in, as tlse does, to reach the table*/
+
+#define BENCH_CHECKS 200  /*!< Random keys compared between both multiplications*/
+#define BENCH_SECONDS 1.0 /*!< Duration of each measure*/
+#define BENCH_CURVE 32    /*!< Bytes of the curve, P-256*/
+
+/**
+ * @brief Seconds of the monotonic clock
+ *
+ * @return double seconds
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Public key of the private key of another one, with the multiplication in use
+ *
+ * @param key Key whose private part is used
+ * @param out Destination, its public key is overwritten
+ * @param prime Modulus of the curve
+ * @return int CRYPT_OK on success
+ */
+int public_key(ecc_key *key, ecc_key *out, void *prime)
+{
+    ecc_point *base = ltc_ecc_new_point();
+    int err;
+    if (!base)
+        return CRYPT_MEM;
+    if ((err = mp_read_radix(base->x, (char *)key->dp->Gx, 16)) == CRYPT_OK &&
+        (err = mp_read_radix(base->y, (char *)key->dp->Gy, 16)) == CRYPT_OK &&
+        (err = mp_set(base->z, 1)) == CRYPT_OK)
+        err = ltc_mp.ecc_ptmul(key->k, base, &out->pubkey, prime, 1);
+    ltc_ecc_del_point(base);
+    return err;
+}
+
+/**
+ * @brief Compare the keys made with the table with the generic multiplication of their private part,
+ * and verify signatures made with them
+ *
+ * @param dp Curve
+ * @param wprng Index of the PRNG
+ * @return int 1 if every check passes
+ */
+int check(const ltc_ecc_set_type *dp, int wprng)
+{
+    ecc_key key, other;
+    void *prime;
+    unsigned char hash[BENCH_CURVE] = {0}, sig[128];
+    unsigned long sig_len;
+    int ok = 1, stat;
+    if (mp_init(&prime) != CRYPT_OK || mp_read_radix(prime, (char *)dp->prime, 16) != CRYPT_OK)
+        return 0;
+    for (int i = 0; i < BENCH_CHECKS && ok; i++)
+    {
+        if (ecc_make_key_ex(NULL, wprng, &key, dp) != CRYPT_OK)
+            ok = 0;
+        else
+        {
+            if (ecc_make_key_ex(NULL, wprng, &other, dp) != CRYPT_OK)
+                ok = 0;
+            else
+            {
+                if (public_key(&key, &other, prime) != CRYPT_OK || mp_cmp(key.pubkey.x, other.pubkey.x) != LTC_MP_EQ ||
+                    mp_cmp(key.pubkey.y, other.pubkey.y) != LTC_MP_EQ)
+                    ok = 0;
+                ecc_free(&other);
+            }
+            hash[i % BENCH_CURVE] = i;
+            sig_len = sizeof(sig);
+            if (ok && (ecc_sign_hash(hash, BENCH_CURVE, sig, &sig_len, NULL, wprng, &key) != CRYPT_OK ||
+                       ecc_verify_hash(sig, sig_len, hash, BENCH_CURVE, &stat, &key) != CRYPT_OK || !stat))
+                ok = 0;
+            ecc_free(&key);
+        }
+    }
+    mp_clear(prime);
+    return ok;
+}
+
+/**
+ * @brief Key generations and signatures per second with the multiplication in use
+ *
+ * @param dp Curve
+ * @param wprng Index of the PRNG
+ * @param keys Destination of the keys per second
+ * @param sigs Destination of the signatures per second
+ */
+void measure(const ltc_ecc_set_type *dp, int wprng, double *keys, double *sigs)
+{
+    ecc_key key;
+    unsigned char hash[BENCH_CURVE] = {0}, sig[128];
+    unsigned long sig_len, n;
+    double t;
+
+    t = now();
+    for (n = 0; now() - t < BENCH_SECONDS; n++)
+    {
+        ecc_make_key_ex(NULL, wprng, &key, dp);
+        ecc_free(&key);
+    }
+    *keys = n / (now() - t);
+
+    ecc_make_key_ex(NULL, wprng, &key, dp);
+    t = now();
+    for (n = 0; now() - t < BENCH_SECONDS; n++)
+    {
+        sig_len = sizeof(sig);
+        ecc_sign_hash(hash, BENCH_CURVE, sig, &sig_len, NULL, wprng, &key);
+    }
+    *sigs = n / (now() - t);
+    ecc_free(&key);
+}
+
+/**
+ * @brief Measure P-256 with the generic multiplication, build the table, check it and measure again
+ *
+ * @return int 0 if every check passes
+ */
+int main()
+{
+    const ltc_ecc_set_type *dp = NULL;
+    double keys, sigs, start;
+    int wprng;
+
+    ltc_mp = ltm_desc;
+    if ((wprng = register_prng(&sprng_desc)) < 0)
+        return 1;
+    for (int i = 0; ltc_ecc_sets[i].size; i++)
+        if (ltc_ecc_sets[i].size == BENCH_CURVE)
+            dp = &ltc_ecc_sets[i];
+    if (!dp)
+        return 1;
+
+    printf("%-10s %8s %14s %14s\n", "P-256", "vectores", "claves/s", "firmas/s");
+    measure(dp, wprng, &keys, &sigs);
+    printf("%-10s %8s %14.0f %14.0f\n", "generica", "-", keys, sigs);
+
+    start = now();
+    if (ltc_ecc_fixed_base_init(dp) != CRYPT_OK)
+    {
+        printf("No se pudo construir la tabla de la base\n");
+        return 1;
+    }
+    start = now() - start;
+    if (!check(dp, wprng))
+    {
+        printf("%-10s %8s\n", "tabla", "error");
+        return 1;
+    }
+    measure(dp, wprng, &keys, &sigs);
+    printf("%-10s %8s %14.0f %14.0f\n", "tabla", "ok", keys, sigs);
+    printf("Tabla de %lu KiB construida en %.1f ms\n", (unsigned long)sizeof(ltc_fb_table) / 1024, start * 1e3);
+    return 0;
+}
@@ -12,100 +12,93 @@
 #include "utils.h"
 #include "ftp.h"
 
+#define OPCODE_TABLE_SIZE 128                                   /*!< Slots of each opcode table, power of two and more than twice the commands*/
+#define OPCODE_HASH(opcode) (((opcode) * 2654435761u) >> (32 - 7)) /*!< Slot of an opcode, Fibonacci hashing to the 7 bits of OPCODE_TABLE_SIZE*/
+
 /**
- * @brief Defines a key value pair
- * Created to save the name associated to an enum and the value of the enum itself
+ * @brief Command name packed in an integer, associated to the value of its enum
  *
  */
-typedef struct _keypair
+typedef struct _opcode_entry
 {
-    char *name; /*!< Field name*/
-    int index;  /*!< Index in an array*/
-} keypair;
+    uint32_t opcode; /*!< Up to four letters of the name in upper case, 0 if the slot is empty*/
+    int index;       /*!< Value of the enum*/
+} opcode_entry;
 
 #define C(x) #x, /*!< For each command, its name as a string and a comma*/
 
 char *imp_commands_names[] = {IMPLEMENTED_COMMANDS}; /*!< Array of strings with the names of the implemented commands*/
-keypair imp_commands_names_sorted[IMP_COMMANDS_TOP]; /*!< Array with the names of the implemented commands and their enum number*/
+opcode_entry imp_commands_table[OPCODE_TABLE_SIZE]; /*!< Hash table of the implemented commands by opcode*/
 char *ign_commands_names[] = {IGNORED_COMMANDS};     /*!< Array of strings with the names of only known commands*/
-keypair ign_commands_names_sorted[IGN_COMMANDS_TOP]; /*!< Array with the names of only known commands and their enum number*/
+opcode_entry ign_commands_table[OPCODE_TABLE_SIZE]; /*!< Hash table of the only known commands by opcode*/
 
 #undef C
 
-static int lists_setup = 0; /*!< Indicates if the arrays have already been sorted*/
+static pthread_once_t tables_setup = PTHREAD_ONCE_INIT; /*!< The tables are filled by the first thread that needs them*/
+
 /**
- * @brief Inserts an element in array
+ * @brief Pack a command name in an integer, ignoring the case
  *
- * @param idx Current size of the array + 1
- * @param array Array where to insert
- * @param elt Element to insert
+ * @param name Command name
+ * @param len Size of the name
+ * @return uint32_t Opcode, 0 if the name cannot be a command
  */
-void insert(int idx, keypair *array, char *elt)
+uint32_t pack_opcode(const char *name, size_t len)
 {
-    keypair kp;
-    kp.index = idx; /*Initial index of source array is value of enum*/
-    kp.name = elt;
-    array[idx] = kp; /*insert at end*/
-    for (; idx >= 1; idx--)
-    {
-        /*Put larger at the end*/
-        if (strcmp(kp.name, array[idx - 1].name) > 0)
-            return;
-        /*Mediante swaps*/
-        keypair aux = array[idx - 1];
-        array[idx - 1] = kp;
-        array[idx] = aux;
-    }
+    uint32_t opcode = 0;
+    if (!len || len > MAX_FTP_COMMAND_NAME)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+        opcode = (opcode << 8) | (unsigned char)toupper((unsigned char)name[i]);
+    return opcode;
 }
 
 /**
- * @brief Insert Sort
+ * @brief Insert the commands in an opcode table with linear probing
  *
- * @param source_array Unordered Array
- * @param array_dest Resulting ordered array
- * @param array_len Size of the array
+ * @param names Names of the commands, in the order of their enum
+ * @param n_names Number of names
+ * @param table Table to fill
  */
-void insert_sort(char *source_array[], keypair *array_dest, int array_len)
+void fill_opcode_table(char *names[], int n_names, opcode_entry *table)
 {
-    for (int i = 0; i < array_len; i++)
-        insert(i, array_dest, source_array[i]);
+    uint32_t opcode, slot;
+    for (int i = 0; i < n_names; i++)
+    {
+        opcode = pack_opcode(names[i], strlen(names[i]));
+        for (slot = OPCODE_HASH(opcode); table[slot].opcode; slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1))
+            ;
+        table[slot] = (opcode_entry){.opcode = opcode, .index = i};
+    }
 }
 
 /**
- * @brief Order the arrays with the commands
+ * @brief Fill the opcode tables with the commands
  *
  */
-void setup_command_lists()
+void setup_command_tables()
 {
-    insert_sort(imp_commands_names, imp_commands_names_sorted, IMP_COMMANDS_TOP);
-    insert_sort(ign_commands_names, ign_commands_names_sorted, IGN_COMMANDS_TOP);
-    lists_setup = 1;
+    fill_opcode_table(imp_commands_names, IMP_COMMANDS_TOP, imp_commands_table);
+    fill_opcode_table(ign_commands_names, IGN_COMMANDS_TOP, ign_commands_table);
 }
 
 /**
- * @brief Search an array by name with binary search
+ * @brief Search an opcode table
  *
- * @param name Name to search for
- * @param array Array container
- * @param arr_size Size of the array
- * @return int Index of the element or -1 if it is not
+ * @param opcode Packed name to search for
+ * @param table Opcode table
+ * @return int Value of the enum or -1 if it is not
  */
-int search_array(char *name, keypair *array, int arr_size)
+int search_opcode(uint32_t opcode, opcode_entry *table)
 {
-    if (!lists_setup)
-        setup_command_lists();
-    /*Binary search of the command*/
-    int bottom = 0, top = arr_size - 1, middle = (top + bottom) / 2, cmp;
-    for (cmp = strcmp(name, array[middle].name); bottom <= top; cmp = strcmp(name, array[middle].name))
-    {
-        if (!cmp)
-            return array[middle].index;
-        else if (cmp < 0)
-            top = middle - 1;
-        else
-            bottom = middle + 1;
-        middle = (top + bottom) / 2;
-    }
+    uint32_t slot;
+    pthread_once(&tables_setup, setup_command_tables);
+    if (!opcode)
+        return -1;
+    /*Few probes, the table is less than half full*/
+    for (slot = OPCODE_HASH(opcode); table[slot].opcode; slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1))
+        if (table[slot].opcode == opcode)
+            return table[slot].index;
     return -1;
 }
 
@@ -117,7 +110,7 @@ int search_array(char *name, keypair *array, int arr_size)
  */
 imp_commands get_imp_command_number(char *name)
 {
-    return (imp_commands)search_array(name, imp_commands_names_sorted, IMP_COMMANDS_TOP);
+    return (imp_commands)search_opcode(pack_opcode(name, strlen(name)), imp_commands_table);
 }
 
 /**
@@ -128,7 +121,7 @@ imp_commands get_imp_command_number(char *name)
  */
 ign_commands get_ign_command_number(char *name)
 {
-    return (ign_commands)search_array(name, ign_commands_names_sorted, IGN_COMMANDS_TOP);
+    return (ign_commands)search_opcode(pack_opcode(name, strlen(name)), ign_commands_table);
 }
 
 /**
@@ -162,24 +155,188 @@ char *get_ign_command_name(ign_commands command)
 void parse_ftp_command(request_info *ri, char *buff)
 {
     /*Pick up the command*/
-    size_t len = strcspn(buff, " \r\n");
-    strncpy(ri->command_name, buff, len);
-    ri->command_name[len] = '\0';
+    size_t len = strcspn(buff, " \r\n"), i;
+    uint32_t opcode = pack_opcode(buff, len);
+    for (i = 0; i < len && i < sizeof(ri->command_name) - 1; i++)
+        ri->command_name[i] = toupper((unsigned char)buff[i]);
+    ri->command_name[i] = '\0';
     /*Get the argument, if any*/
-    buff = &buff[len + 1];
-    len = strcspn(buff, "\r\n");
-    strncpy(ri->command_arg, buff, len);
+    buff = (buff[len] == ' ') ? &buff[len + 1] : &buff[len];
+    len = MIN(strcspn(buff, "\r\n"), MAX_COMMAND_ARG);
+    memcpy(ri->command_arg, buff, len);
     ri->command_arg[len] = '\0';
     /*Get the enum associated with the command, first search the list of implemented*/
-    ri->implemented_command = get_imp_command_number(ri->command_name);
+    ri->implemented_command = search_opcode(opcode, imp_commands_table);
     /*Check to see if it's at least one recognized command*/
     if (ri->implemented_command == -1)
-        ri->ignored_command = get_ign_command_number(ri->command_name);
+        ri->ignored_command = search_opcode(opcode, ign_commands_table);
     else
         ri->ignored_command = -1;
     return;
 }
 
+/**
+ * @brief Empty the buffer of a control connection
+ *
+ * @param r Command reader
+ */
+void command_reader_init(command_reader *r)
+{
+    r->start = 0;
+    r->len = 0;
+    r->discard = 0;
+}
+
+/**
+ * @brief Receive the bytes available in the control connection, appending them to the buffer
+ *
+ * @param r Command reader
+ * @param ctx TLS context of the connection, NULL if it is not encrypted
+ * @param fd Control connection
+ * @param flags srecv flags
+ * @return ssize_t Bytes received, 0 if the connection was closed, -1 on error (errno EAGAIN if the buffer is full)
+ */
+ssize_t command_reader_fill(command_reader *r, TLS *ctx, int fd, int flags)
+{
+    size_t end = (r->start + r->len) & (COMMAND_READER_SIZE - 1);
+    ssize_t read_b;
+    if (r->len == COMMAND_READER_SIZE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    /*Free space up to the end of the array or up to the first byte not consumed*/
+    if ((read_b = srecv(ctx, fd, &(r->buf[end]), (end < r->start) ? r->start - end : COMMAND_READER_SIZE - end, flags)) > 0)
+        r->len += read_b;
+    return read_b;
+}
+
+/**
+ * @brief Find the end of a line of the buffer
+ *
+ * @param r Command reader
+ * @param pos Bytes between the first byte not consumed and the beginning of the line
+ * @return size_t Bytes up to the end of the line from the first byte not consumed, including its LF, 0 if it is not complete
+ */
+size_t command_reader_eol(command_reader *r, size_t pos)
+{
+    size_t from = (r->start + pos) & (COMMAND_READER_SIZE - 1);
+    size_t first = MIN(r->len - pos, COMMAND_READER_SIZE - from); /*The line may continue at the beginning of the array*/
+    char *lf = memchr(&(r->buf[from]), '\n', first);
+    if (lf)
+        return pos + (lf - &(r->buf[from])) + 1;
+    if ((lf = memchr(r->buf, '\n', r->len - pos - first)))
+        return pos + first + (lf - r->buf) + 1;
+    return 0;
+}
+
+/**
+ * @brief Identify the command of a line of the buffer
+ *
+ * @param r Command reader
+ * @param pos Bytes between the first byte not consumed and the beginning of the line
+ * @param len Size of the line
+ * @return imp_commands Implemented command of the line, -1 if the command is not implemented
+ */
+imp_commands command_reader_command(command_reader *r, size_t pos, size_t len)
+{
+    char name[MAX_FTP_COMMAND_NAME + 1], c;
+    size_t i;
+    /*One letter more than any command, so that longer names are rejected*/
+    for (i = 0; i < len && i < sizeof(name); i++)
+    {
+        c = r->buf[(r->start + pos + i) & (COMMAND_READER_SIZE - 1)];
+        if (c == ' ' || c == '\r' || c == '\n')
+            break;
+        name[i] = c;
+    }
+    return (imp_commands)search_opcode(pack_opcode(name, i), imp_commands_table);
+}
+
+/**
+ * @brief Drop bytes from the beginning of the buffer
+ *
+ * @param r Command reader
+ * @param n Bytes to drop
+ */
+void command_reader_consume(command_reader *r, size_t n)
+{
+    r->start = (r->start + n) & (COMMAND_READER_SIZE - 1);
+    r->len -= n;
+}
+
+/**
+ * @brief Take the next complete line of the buffer, the rest stays queued for the following calls
+ *
+ * @param r Command reader
+ * @param line Destination, the line is terminated with a zero
+ * @param line_size Size of line
+ * @return ssize_t Size of the line, 0 if there is no complete line, -1 if the line was too long and has been dropped
+ */
+ssize_t command_reader_line(command_reader *r, char *line, size_t line_size)
+{
+    size_t len, first;
+    /*Remains of a line that was too long*/
+    if (r->discard)
+    {
+        if (!(len = command_reader_eol(r, 0)))
+        {
+            command_reader_consume(r, r->len);
+            return 0;
+        }
+        command_reader_consume(r, len);
+        r->discard = 0;
+    }
+    if (!(len = command_reader_eol(r, 0)))
+    {
+        /*The buffer is full and there is still no end of line*/
+        if (r->len == COMMAND_READER_SIZE)
+        {
+            command_reader_consume(r, r->len);
+            r->discard = 1;
+            return -1;
+        }
+        return 0;
+    }
+    if (len >= line_size)
+    {
+        command_reader_consume(r, len);
+        return -1;
+    }
+    first = MIN(len, COMMAND_READER_SIZE - r->start);
+    memcpy(line, &(r->buf[r->start]), first);
+    memcpy(&line[first], r->buf, len - first);
+    line[len] = '\0';
+    command_reader_consume(r, len);
+    return len;
+}
+
+/**
+ * @brief Take the first complete line of a command out of the buffer, wherever it is queued.
+ * The lines before and after it stay queued in order
+ *
+ * @param r Command reader
+ * @param command Command to look for
+ * @return int 1 if a line of the command was found and dropped, 0 otherwise
+ */
+int command_reader_take(command_reader *r, imp_commands command)
+{
+    size_t pos = 0, eol;
+    /*The remains of a line that was too long are not a command*/
+    if (r->discard && !(pos = command_reader_eol(r, 0)))
+        return 0;
+    for (; (eol = command_reader_eol(r, pos)); pos = eol)
+        if (command_reader_command(r, pos, eol - pos) == command)
+        {
+            /*The lines that follow take its place*/
+            for (size_t i = eol; i < r->len; i++)
+                r->buf[(r->start + pos + i - eol) & (COMMAND_READER_SIZE - 1)] = r->buf[(r->start + i) & (COMMAND_READER_SIZE - 1)];
+            r->len -= eol - pos;
+            return 1;
+        }
+    return 0;
+}
+
 /**
  * @brief Sets a response to a command
  *
@@ -9,7 +9,8 @@
  *
  */
 
-#define _DEFAULT_SOURCE /*!< Access to GNU functions*/
+#define _GNU_SOURCE /*!< Access to GNU functions, getdents64 among them*/
+#include <dirent.h>
 #include "utils.h"
 #include "network.h"
 #include "ftp.h"
@@ -18,9 +19,11 @@
 #define SEND_BUFFER 1024 * 1024                                                              /*!< send buffer size*/
 #define RECV_BUFFER 1024 * 1024                                                              /*!< receive buffer size*/
 #define IP_LEN sizeof("xxx.xxx.xxx.xxx")                                                     /*!< Size of ipv4*/
-#define LS_CMD "ls -l1 --numeric-uid-gid --hyperlink=never --time-style=iso --color=never '" /*!< Command ls*/
 #define IP_FIELD_LEN sizeof("xxx")                                                           /*!< Size of an ipv4 subfield*/
 #define VIRTUAL_ROOT "/"                                                                     /*!< Root*/
+#define LIST_BUFFER XXXL_SZ                                                                  /*!< Formatted listing lines sent at once*/
+#define LIST_DENTS_BUFFER XXXL_SZ                                                            /*!< Directory entries read at once*/
+#define LIST_RECENT_SECONDS (365 * 24 * 3600 / 2)                                            /*!< ls shows the time of files modified in the last six months*/
 
 static char root[SERVER_ROOT_MAX] = "";
 static size_t root_size;
@@ -95,25 +98,220 @@ int get_real_path(char *current_dir, char *path, char *real_path)
 }
 
 /**
- * @brief Returns a file with the output of ls
+ * @brief Writes the permissions of a file like ls does, e.g. drwxr-xr-x
  *
- * @param path Unclean path
- * @param current_dir Current FTP session directory
- * @return FILE*Like any other FILE, however, it must be closed with pclose
+ * @param mode Mode of the file
+ * @param buf Destination, at least 11 characters
  */
-FILE *list_directories(char *path, char *current_dir)
+void format_ls_mode(mode_t mode, char *buf)
 {
-    char *buff = alloca((sizeof(LS_CMD) + strlen(current_dir) + strlen(path) + 1) * sizeof(char));
-    if (!buff)
-        return NULL;
-    /*Recoger path*/
-    strcpy(buff, LS_CMD);
-    if (get_real_path(current_dir, path, &buff[strlen(buff)]) < 0)
-        return NULL;
-    strcat(buff, "'"); /*Quote from filename*/
-                       /*Call to ls, redirecting the output*/
-    FILE *output = popen(buff, "r");
-    return output;
+    const char *rwx = "rwxrwxrwx";
+    char type = '-';
+    if (S_ISDIR(mode))
+        type = 'd';
+    else if (S_ISLNK(mode))
+        type = 'l';
+    else if (S_ISCHR(mode))
+        type = 'c';
+    else if (S_ISBLK(mode))
+        type = 'b';
+    else if (S_ISFIFO(mode))
+        type = 'p';
+    else if (S_ISSOCK(mode))
+        type = 's';
+    buf[0] = type;
+    for (int i = 0; i < 9; i++)
+        buf[i + 1] = (mode & (1 << (8 - i))) ? rwx[i] : '-';
+    /*Special bits replace the execution bits*/
+    if (mode & S_ISUID)
+        buf[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID)
+        buf[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX)
+        buf[9] = (mode & S_IXOTH) ? 't' : 'T';
+    buf[10] = '\0';
+}
+
+/**
+ * @brief Writes the MLSD perm fact of a file for the user of the server
+ *
+ * @param st Information of the file
+ * @param buf Destination, at least 8 characters
+ */
+void format_mlsd_perm(struct stat *st, char *buf)
+{
+    int shift = (st->st_uid == geteuid()) ? 6 : (st->st_gid == getegid()) ? 3 : 0;
+    int bits = (st->st_mode >> shift) & 7;
+    *buf = '\0';
+    if (S_ISDIR(st->st_mode))
+    {
+        if (bits & 1)
+            strcat(buf, "e"); /*Enter*/
+        if (bits & 4)
+            strcat(buf, "l"); /*List*/
+        if ((bits & 3) == 3)
+            strcat(buf, "cmp"); /*Create files and directories, purge*/
+    }
+    else
+    {
+        if (bits & 4)
+            strcat(buf, "r"); /*Read*/
+        if (bits & 2)
+            strcat(buf, "adfw"); /*Append, delete, rename and write*/
+    }
+}
+
+/**
+ * @brief Formats a line of a listing
+ *
+ * @param format Format of the line
+ * @param dir_fd Descriptor of the directory of the entry, to read symbolic links
+ * @param name Name of the entry
+ * @param st Information of the entry
+ * @param buf Destination buffer
+ * @param buf_len Size of the destination buffer
+ * @return int Characters written, 0 if they do not fit
+ */
+int format_list_entry(list_format format, int dir_fd, char *name, struct stat *st, char *buf, size_t buf_len)
+{
+    char mode[sizeof("drwxrwxrwx")], date[SMALL_SZ], target[XXL_SZ];
+    struct tm tm;
+    ssize_t target_len;
+    int len;
+    if (format == LIST_FORMAT_MLSD)
+    {
+        char perm[TINY_SZ];
+        format_mlsd_perm(st, perm);
+        gmtime_r(&(st->st_mtime), &tm);
+        strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+        len = snprintf(buf, buf_len, "type=%s;size=%lld;modify=%s;perm=%s;UNIX.mode=0%o;UNIX.uid=%u;UNIX.gid=%u; %s\r\n",
+                       S_ISDIR(st->st_mode) ? "dir" : S_ISREG(st->st_mode) ? "file" : "OS.unix=special",
+                       (long long)st->st_size, date, perm, st->st_mode & 07777, st->st_uid, st->st_gid, name);
+    }
+    else
+    {
+        /*Same fields as ls -l --numeric-uid-gid --time-style=iso*/
+        format_ls_mode(st->st_mode, mode);
+        localtime_r(&(st->st_mtime), &tm);
+        if (time(NULL) - st->st_mtime < LIST_RECENT_SECONDS && st->st_mtime <= time(NULL))
+            strftime(date, sizeof(date), "%m-%d %H:%M", &tm);
+        else
+            strftime(date, sizeof(date), "%Y-%m-%d ", &tm);
+        if (S_ISLNK(st->st_mode) && (target_len = readlinkat(dir_fd, name, target, sizeof(target) - 1)) >= 0)
+            target[target_len] = '\0';
+        else
+            target[0] = '\0';
+        len = snprintf(buf, buf_len, "%s %lu %u %u %lld %s %s%s%s\n", mode, (unsigned long)st->st_nlink, st->st_uid, st->st_gid,
+                       (long long)st->st_size, date, name, target[0] ? " -> " : "", target);
+    }
+    return (len < 0 || len >= buf_len) ? 0 : len;
+}
+
+/**
+ * @brief Streams the listing of a directory (or a single file) through a socket, without
+ * creating processes and without holding the whole listing in memory
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
+ * @param socket_fd Socket descriptor
+ * @param path Real path of the directory or file
+ * @param format Format of the lines
+ * @param ascii_mode Ascii mode, only applies to the ls format
+ * @param block_mode If not 0, send the listing in blocks ended by an EOF block (MODE B)
+ * @param abort_transfer Allows you to cancel transfer
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t send_listing(struct TLSContext *ctx, int socket_fd, char *path, list_format format, int ascii_mode, int block_mode, int *abort_transfer)
+{
+    char out[LIST_BUFFER], dents[LIST_DENTS_BUFFER];
+    size_t out_len = 0;
+    ssize_t total = 0, sent_b, read_b;
+    struct stat st;
+    int dir_fd, aux = 0, len;
+    ascii_transcoder ascii, *transcoder = NULL;
+    if (!abort_transfer)
+        abort_transfer = &aux;
+
+    if ((dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        /*Listing of a single file*/
+        if (errno != ENOTDIR || lstat(path, &st) < 0)
+            return -1;
+        char *name = strrchr(path, '/') + 1;
+        int parent_fd = open(dirname(strdupa(path)), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        out_len = format_list_entry(format, parent_fd, name, &st, out, sizeof(out));
+        if (parent_fd >= 0)
+            close(parent_fd);
+    }
+    /*MLSD lines always end in CRLF*/
+    if (ascii_mode && format == LIST_FORMAT_LS)
+    {
+        if (ascii_transcoder_init(&ascii, LIST_BUFFER) < 0)
+        {
+            if (dir_fd >= 0)
+                close(dir_fd);
+            return -1;
+        }
+        transcoder = &ascii;
+    }
+
+    /*Entries are formatted as they are read and sent whenever the buffer fills*/
+    while (dir_fd >= 0 && !(*abort_transfer) && (read_b = getdents64(dir_fd, dents, sizeof(dents))) > 0)
+    {
+        for (ssize_t pos = 0; pos < read_b && !(*abort_transfer);)
+        {
+            struct dirent64 *entry = (struct dirent64 *)&dents[pos];
+            pos += entry->d_reclen;
+            /*Like ls -l, hidden entries are not listed in the ls format*/
+            if (entry->d_name[0] == '.' && (format == LIST_FORMAT_LS || !entry->d_name[1] || !strcmp(entry->d_name, "..")))
+                continue;
+            /*Machine readable listings describe the target of the links*/
+            if (fstatat(dir_fd, entry->d_name, &st, (format == LIST_FORMAT_LS) ? AT_SYMLINK_NOFOLLOW : 0) < 0 &&
+                fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                continue; /*Removed while listing*/
+            if (!(len = format_list_entry(format, dir_fd, entry->d_name, &st, &out[out_len], sizeof(out) - out_len)))
+            {
+                /*Line does not fit, flush and format it again*/
+                if ((sent_b = send_buffer(ctx, socket_fd, out, out_len, transcoder, block_mode)) < 0)
+                {
+                    /*The listing is incomplete, the client must not be told it was sent*/
+                    close(dir_fd);
+                    if (transcoder)
+                        ascii_transcoder_free(transcoder);
+                    return -1;
+                }
+                total += sent_b;
+                out_len = 0;
+                len = format_list_entry(format, dir_fd, entry->d_name, &st, out, sizeof(out));
+            }
+            out_len += len;
+        }
+    }
+    if (dir_fd >= 0)
+        close(dir_fd);
+    if (total >= 0 && out_len && !(*abort_transfer))
+        total = ((sent_b = send_buffer(ctx, socket_fd, out, out_len, transcoder, block_mode)) < 0) ? -1 : total + sent_b;
+    if (block_mode && total >= 0 && !(*abort_transfer) && send_block(ctx, socket_fd, NULL, 0, BLOCK_EOF) < 0)
+        total = -1;
+    if (transcoder)
+        ascii_transcoder_free(transcoder);
+    return total;
+}
+
+/**
+ * @brief Fills the MLST response of a path: its facts, preceded by a space
+ *
+ * @param path Real path
+ * @param buf Destination buffer
+ * @param buf_len Size of the buffer
+ * @return int less than 0 on error
+ */
+int mlst_entry(char *path, char *buf, size_t buf_len)
+{
+    struct stat st;
+    if (stat(path, &st) < 0 || buf_len < 2)
+        return -1;
+    buf[0] = ' ';
+    return format_list_entry(LIST_FORMAT_MLSD, AT_FDCWD, path_no_root(path), &st, &buf[1], buf_len - 1) ? 1 : -1;
 }
 
 /**
@@ -221,57 +419,121 @@ int ch_to_parent_dir(char *current_dir)
  * @param socket_fd Socket descriptor
  * @param buf to send
  * @param buf_len how much to send
- * @param ascii_mode If not 0, convert newlines to universal format
+ * @param ascii If not NULL, convert newlines to universal format in its buffer, which must hold 2 * buf_len bytes
+ * @param block_mode If not 0, split the content in blocks with header (MODE B)
  * @return ssize_t if less than 0, error
  */
-ssize_t send_buffer(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, int ascii_mode)
+ssize_t send_buffer(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, ascii_transcoder *ascii, int block_mode)
 {
     /*Transmission in VST ascii mode*/
-    if (ascii_mode)
+    if (ascii)
     {
-        char *ascii_buf = alloca(2 * buf_len); /*can grow up to twice*/
-        if (!ascii_buf)
+        buf_len = ascii_encode(buf, buf_len, ascii->buf); /*Send filtered content*/
+        buf = ascii->buf;
+    }
+    if (!block_mode)
+        return ssend(ctx, socket_fd, buf, buf_len, MSG_NOSIGNAL); /*send content*/
+    for (size_t sent = 0; sent < buf_len; sent += BLOCK_MAX)
+        if (send_block(ctx, socket_fd, &buf[sent], MIN(buf_len - sent, BLOCK_MAX), 0) < 0)
             return -1;
-        size_t new_buflen = 0;
-        for (int i = 0; i < buf_len; i++)
-        {
-            if (buf[i] == '\n') /*Server line breaks are \n*/
-                ascii_buf[new_buflen++] = '\r';
-            ascii_buf[new_buflen++] = (buf[i] & 0x7F); /*Most significant bit to 0 always*/
-        }
-        return ssend(ctx, socket_fd, ascii_buf, new_buflen, MSG_NOSIGNAL); /*Send filtered content*/
+    return buf_len;
+}
+
+/**
+ * @brief Send a single block of MODE B
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
+ * @param socket_fd Socket descriptor
+ * @param buf Data of the block
+ * @param buf_len Bytes of data, at most BLOCK_MAX
+ * @param descriptor Descriptor of the block, e.g. BLOCK_EOF
+ * @return ssize_t Data bytes sent, less than 0 on error
+ */
+ssize_t send_block(struct TLSContext *ctx, int socket_fd, char *buf, size_t buf_len, int descriptor)
+{
+    char header[BLOCK_HEADER] = {descriptor, buf_len >> 8, buf_len & 0xFF}; /*Count in network byte order*/
+    if (ssend(ctx, socket_fd, header, BLOCK_HEADER, MSG_NOSIGNAL | (buf_len ? MSG_MORE : 0)) != BLOCK_HEADER)
+        return -1;
+    return buf_len ? ssend(ctx, socket_fd, buf, buf_len, MSG_NOSIGNAL) : 0;
+}
+
+/**
+ * @brief Send a file with sendfile in blocks of MODE B, the headers are written between them
+ *
+ * @param socket_fd Socket descriptor, not encrypted in user space
+ * @param file_fd File descriptor
+ * @param abort_transfer Allows you to cancel transfer
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t sendfile_blocks(int socket_fd, int file_fd, int *abort_transfer)
+{
+    ssize_t total = 0, sent_b;
+    size_t block;
+    off_t size = file_size(file_fd);
+    while (total < size && !(*abort_transfer))
+    {
+        block = MIN(size - total, BLOCK_MAX);
+        char header[BLOCK_HEADER] = {0, block >> 8, block & 0xFF};
+        if (send(socket_fd, header, BLOCK_HEADER, MSG_NOSIGNAL | MSG_MORE) != BLOCK_HEADER)
+            return -1;
+        for (size_t left = block; left; left -= sent_b)
+            if ((sent_b = sendfile(socket_fd, file_fd, NULL, left)) <= 0)
+                return -1; /*Also if the file shrinks while it is sent*/
+        total += block;
     }
-    return ssend(ctx, socket_fd, buf, buf_len, MSG_NOSIGNAL); /*send content*/
+    return total;
 }
 
 /**
  * @brief Send the content of f through a socket
  *
- * @param ctx TLS context
+ * @param ctx TLS context, NULL if the connection is not encrypted in user space
  * @param socket_fd Socket descriptor
  * @param f File to open
  * @param ascii_mode Ascii mode
+ * @param block_mode If not 0, send the file in blocks ended by an EOF block (MODE B)
  * @param abort_transfer Allows you to cancel transfer
  * @return ssize_t
  */
-ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode, int *abort_transfer)
+ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode, int block_mode, int *abort_transfer)
 {
     int aux = 0;
     ssize_t sent_b, read_b, total = 0;
     char buf[SEND_BUFFER];
+    ascii_transcoder ascii;
     if (!abort_transfer)
         abort_transfer = &aux;
 
-    /*Send content of f in blocks*/
-    while (!(*abort_transfer) && (read_b = fread(buf, sizeof(char), SEND_BUFFER, f)))
+    /*Without encryption in user space, the file goes from the page cache to the socket*/
+    if (!ctx && !ascii_mode && block_mode)
+        total = sendfile_blocks(socket_fd, fileno(f), abort_transfer);
+    else if (!ctx && !ascii_mode)
     {
-        if (*abort_transfer)
-            return 0; /*You can change an external flag to cancel the transfer*/
-        if ((sent_b = send_buffer(ctx, socket_fd, buf, read_b, ascii_mode)) < 0)
+        while (!(*abort_transfer) && (sent_b = sendfile(socket_fd, fileno(f), NULL, SEND_BUFFER)) > 0)
+            total += sent_b;
+        return (sent_b < 0) ? -1 : total;
+    }
+    else
+    {
+        /*The converted blocks reuse the same buffer during the whole transfer*/
+        if (ascii_mode && ascii_transcoder_init(&ascii, SEND_BUFFER) < 0)
             return -1;
-        total += sent_b;
+
+        /*Send content of f in blocks*/
+        while (total >= 0 && !(*abort_transfer) && (read_b = fread(buf, sizeof(char), SEND_BUFFER, f)))
+        {
+            if ((sent_b = send_buffer(ctx, socket_fd, buf, read_b, ascii_mode ? &ascii : NULL, block_mode)) < 0)
+                total = -1;
+            else
+                total += sent_b;
+        }
+        if (ascii_mode)
+            ascii_transcoder_free(&ascii);
     }
-    return total; /*successful transfer*/
+    /*In block mode the end of the file is marked, the connection stays open*/
+    if (block_mode && total >= 0 && !(*abort_transfer) && send_block(ctx, socket_fd, NULL, 0, BLOCK_EOF) < 0)
+        return -1;
+    return total; /*The loop also ends when an external flag cancels the transfer*/
 }
 
 /**
@@ -281,54 +543,164 @@ ssize_t send_file(struct TLSContext *ctx, int socket_fd, FILE *f, int ascii_mode
  * @param socket_fd Socket origin
  * @param dest Buffer destination
  * @param buf_len Buffer size
- * @param ascii_mode Ascii mode
+ * @param ascii If not NULL, convert CRLF to LF reading through its buffer, which must hold buf_len bytes
  * @return ssize_t reads
  */
-ssize_t read_to_buffer(struct TLSContext *ctx, int socket_fd, char *dest, size_t buf_len, int ascii_mode)
+ssize_t read_to_buffer(struct TLSContext *ctx, int socket_fd, char *dest, size_t buf_len, ascii_transcoder *ascii)
 {
     /*Filter what is read from ascii to local (CRLF to LF)*/
-    if (ascii_mode)
+    if (ascii)
     {
-        char *ascii_buf = alloca(buf_len);
-        ssize_t n_read, new_buflen = 0;
-        if ((n_read = srecv(ctx, socket_fd, ascii_buf, buf_len, MSG_NOSIGNAL)) <= 0)
+        ssize_t n_read;
+        /*Room for a CR left from the previous block*/
+        if ((n_read = srecv(ctx, socket_fd, ascii->buf, MIN(buf_len - 1, ascii->size), MSG_NOSIGNAL)) <= 0)
             return n_read;
-        for (int i = 0; i < n_read; i++)
-            if (ascii_buf[i] != '\r')
-                dest[new_buflen++] = ascii_buf[i];
-        return new_buflen;
+        return ascii_decode(ascii->buf, n_read, dest, &(ascii->cr_pending));
     }
     return srecv(ctx, socket_fd, dest, buf_len, MSG_NOSIGNAL);
 }
 
+/**
+ * @brief Move the contents of a socket to a file through a pipe, without copying them to user space
+ *
+ * @param socket_fd source socket
+ * @param file_fd Destination file
+ * @param abort_transfer Allows to abort the transfer
+ * @return ssize_t bytes read, less than 0 on error
+ */
+ssize_t splice_to_file(int socket_fd, int file_fd, int *abort_transfer)
+{
+    int pipe_fd[2];
+    ssize_t read_b, written_b, total = 0;
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0)
+        return -1;
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, RECV_BUFFER); /*Fewer calls if the system allows it*/
+    while (total >= 0 && !(*abort_transfer) && (read_b = splice(socket_fd, NULL, pipe_fd[1], NULL, RECV_BUFFER, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+    {
+        /*Empty the pipe into the file*/
+        for (ssize_t left = read_b; left > 0 && total >= 0; left -= written_b)
+            if ((written_b = splice(pipe_fd[0], NULL, file_fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+                total = -1;
+        if (total >= 0)
+            total += read_b;
+    }
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    return total;
+}
+
+/**
+ * @brief Read the blocks of MODE B of a file until its EOF block
+ *
+ * @param ctx TLS context, NULL if the connection is not encrypted
+ * @param f Destination file
+ * @param socket_fd source socket
+ * @param buf Buffer of at least BLOCK_MAX + 1 bytes
+ * @param ascii If not NULL, convert CRLF to LF reading through its buffer
+ * @param abort_transfer Allows to abort the transfer
+ * @return ssize_t bytes written, less than 0 on error or if the connection is closed before the EOF block
+ */
+ssize_t read_blocks_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, char *buf, ascii_transcoder *ascii, int *abort_transfer)
+{
+    unsigned char header[BLOCK_HEADER];
+    ssize_t total = 0, len;
+    do
+    {
+        if (srecv_all(ctx, socket_fd, (char *)header, BLOCK_HEADER, MSG_NOSIGNAL) != BLOCK_HEADER)
+            return -1;
+        if (!(len = (header[1] << 8) | header[2]))
+            continue;
+        if (srecv_all(ctx, socket_fd, ascii ? ascii->buf : buf, len, MSG_NOSIGNAL) != len)
+            return -1;
+        if (header[0] & BLOCK_RESTART) /*Markers are not part of the file*/
+            continue;
+        if (ascii)
+            len = ascii_decode(ascii->buf, len, buf, &(ascii->cr_pending));
+        if (fwrite(buf, sizeof(char), len, f) != len)
+            return -1;
+        total += len;
+    } while (!(header[0] & BLOCK_EOF) && !(*abort_transfer));
+    return total;
+}
+
 /**
  * @brief Read the contents of a socket to a file
  *
- * @param ctx TLS Context
+ * @param ctx TLS context, NULL if the connection is not encrypted
  * @param f Destination file.
  * @param socket_fd source socket
  * @param ascii_mode FTP transfer mode
+ * @param block_mode If not 0, the file comes in blocks and ends with an EOF block (MODE B), not when the connection is closed
  * @param abort_transfer Allows to abort the transfer
  * @return ssize_t bytes read
  */
-ssize_t read_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, int ascii_mode, int *abort_transfer)
+ssize_t read_to_file(struct TLSContext *ctx, FILE *f, int socket_fd, int ascii_mode, int block_mode, int *abort_transfer)
 {
     int aux = 0;
     ssize_t sent_b, read_b, total = 0;
     char buf[RECV_BUFFER];
+    ascii_transcoder ascii;
     if (!abort_transfer)
         abort_transfer = &aux;
 
+    /*Without encryption, the data goes from the socket to the page cache*/
+    if (!ctx && !ascii_mode && !block_mode)
+        return splice_to_file(socket_fd, fileno(f), abort_transfer);
+
+    if (ascii_mode && ascii_transcoder_init(&ascii, RECV_BUFFER) < 0)
+        return -1;
+
+    /*The end of the file is marked by the last block instead of by closing the connection*/
+    if (block_mode)
+        total = read_blocks_to_file(ctx, f, socket_fd, buf, ascii_mode ? &ascii : NULL, abort_transfer);
     /*Read from buffer to buffer until finished or interrupted*/
-    while (!(*abort_transfer) && ((read_b = read_to_buffer(ctx, socket_fd, buf, RECV_BUFFER, ascii_mode)) > 0))
+    else
+        while (total >= 0 && !(*abort_transfer) && ((read_b = read_to_buffer(ctx, socket_fd, buf, RECV_BUFFER, ascii_mode ? &ascii : NULL)) > 0))
+        {
+            if ((sent_b = fwrite(buf, sizeof(char), read_b, f)) != read_b)
+                total = -1;
+            else
+                total += read_b;
+        }
+    if (ascii_mode)
     {
-        if ((sent_b = fwrite(buf, sizeof(char), read_b, f)) != read_b)
-            return -1;
-        total += read_b;
+        /*A CR at the very end had no LF behind it*/
+        if (total >= 0 && (read_b = ascii_decode_flush(buf, &(ascii.cr_pending))))
+            total = (fwrite(buf, sizeof(char), read_b, f) != read_b) ? -1 : total + read_b;
+        ascii_transcoder_free(&ascii);
     }
     return total;
 }
 
+/**
+ * @brief Give the passive port of a data connection back to the pool, if it has one
+ *
+ * @param dc Data connection
+ * @param passive_ports Pool of passive ports
+ */
+void release_passive_port(data_conn *dc, passive_pool *passive_ports)
+{
+    if (!dc->pasv)
+        return;
+    /*The socket stays open in the pool for the next PASV*/
+    passive_pool_put(passive_ports, dc->pasv);
+    dc->pasv = NULL;
+    dc->socket_fd = -1;
+}
+
+/**
+ * @brief Close a data connection and give its passive port back, if any
+ *
+ * @param dc Data connection
+ * @param passive_ports Pool of passive ports
+ */
+void close_data_conn(data_conn *dc, passive_pool *passive_ports)
+{
+    sclose(&(dc->context), &(dc->conn_fd));
+    release_passive_port(dc, passive_ports);
+    dc->conn_state = DATA_CONN_CLOSED;
+}
+
 /**
  * @brief Parse a port string of format xxx,xxx,xxx,xxx,ppp,ppp
  *
@@ -357,6 +729,7 @@ int parse_port_string(char *port_string, char *clt_ip, int *clt_port)
             return -1;
     }
     strncpy(clt_ip, start, len - 1); /*Copy IP omitting the , end*/
+    clt_ip[len - 1] = '\0';
 
     /*PUERTO*/
     *clt_port = 0;
@@ -376,27 +749,22 @@ int parse_port_string(char *port_string, char *clt_ip, int *clt_port)
 }
 
 /**
- * @brief Create a data socket for the client to connect to
+ * @brief Take a listening socket from the pool for the client to connect to
  *
- * @param srv_ip IP of the server
- * @param passive_port_count Semaphore with the number of data connections created
- * @param socket_fd Resulting socket
+ * @param passive_ports Pool of passive ports
+ * @param dc Data connection that keeps the socket
  * @return int less than 0 if error, otherwise port
  */
-int passive_data_socket_fd(char *srv_ip, sem_t *passive_port_count, int *socket_fd)
+int passive_data_socket_fd(passive_pool *passive_ports, data_conn *dc)
 {
     /*No data sockets available at this time*/
-    if (sem_trywait(passive_port_count) == -1 && errno == EAGAIN)
+    if (!(dc->pasv = passive_pool_get(passive_ports)))
+    {
+        errno = EAGAIN;
         return -1;
-    if ((*socket_fd = socket_srv("tcp", 10, 0, srv_ip)) < 0)
-        return *socket_fd;
-    /*Set a timeout*/
-    set_socket_timeouts(*socket_fd, DATA_SOCKET_TIMEOUT);
-    /*Return the port that has been found*/
-    struct sockaddr_in addrinfo;
-    socklen_t info_len = sizeof(struct sockaddr);
-    getsockname(*socket_fd, (struct sockaddr *)&addrinfo, &info_len);
-    return ntohs(addrinfo.sin_port);
+    }
+    dc->socket_fd = dc->pasv->fd;
+    return dc->pasv->port;
 }
 
 /**
@@ -24,8 +24,11 @@ void init_session_info(session_info *session, session_info *previous_session)
     {
         session->authenticated = 0;
         session->context = NULL;
+        session->handshake = NULL;
         session->secure = 0;
         session->pbsz_sent = 1;
+        session->clear_data = 0;
+        session->block_mode = 0;
         strcpy(session->current_dir, "/");
         return;
     }
@@ -33,7 +36,10 @@ void init_session_info(session_info *session, session_info *previous_session)
     session->authenticated = previous_session->authenticated;
     session->secure = previous_session->secure;
     session->pbsz_sent = previous_session->pbsz_sent;
+    session->clear_data = previous_session->clear_data;
+    session->block_mode = previous_session->block_mode;
     session->context = previous_session->context;
+    session->handshake = previous_session->handshake;
     session->ascii_mode = previous_session->ascii_mode;
     strcpy(session->current_dir, previous_session->current_dir);
     /*Inherit volatile attributes from the previous session*/
@@ -133,8 +139,7 @@ int free_attributes(session_info *session)
             free((void *)attr->val);
         }
     }
-    /*Close possible data connection and data socket*/
+    /*Close possible data connection, its passive socket goes back to the pool with close_data_conn*/
     sclose(&(session->data_connection->context), &(session->data_connection->conn_fd));
-    sclose(NULL, &(session->data_connection->socket_fd));
     return nfreed;
 }
\ No newline at end of file
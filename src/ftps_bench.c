@@ -0,0 +1,601 @@
+/**
+ * @file ftps_bench.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Load generator that speaks the FTPS dialect of the server: AUTH TLS with a client certificate,
+ * PBSZ 0, PROT P and the same certificate on every data connection
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "network.h"
+
+#define BENCH_DEFAULT_HOST "127.0.0.1"                        /*!< Server address*/
+#define BENCH_DEFAULT_PORT 21                                 /*!< Control port of the server*/
+#define BENCH_DEFAULT_SESSIONS 8                              /*!< Concurrent sessions*/
+#define BENCH_DEFAULT_OPS 50                                  /*!< Commands of the mix run by each session*/
+#define BENCH_DEFAULT_MIX "LIST:1,RETR:4,STOR:1,SIZE:2,CWD:2" /*!< Relative weight of each command*/
+#define BENCH_DEFAULT_FILE_SIZE (1024 * 1024)                 /*!< Bytes of the file uploaded by each session*/
+#define BENCH_DEFAULT_CERT "certs/ccert.pem"                  /*!< Client certificate*/
+#define BENCH_DEFAULT_KEY "certs/ckey.pem"                    /*!< Private key of the client certificate*/
+#define BENCH_REPLY_TIMEOUT 30                                /*!< Seconds without an answer before a session gives up*/
+#define BENCH_FILE_NAME "ftps_bench_%d.bin"                   /*!< File that each session uploads, downloads and deletes*/
+
+/**
+ * @brief Commands measured by the benchmark, the handshake is measured as one more
+ *
+ */
+typedef enum _bench_op
+{
+    OP_LIST,      /*!< Directory listing through a data connection*/
+    OP_RETR,      /*!< Download of the file of the session*/
+    OP_STOR,      /*!< Upload of the file of the session*/
+    OP_SIZE,      /*!< Size of the file of the session*/
+    OP_CWD,       /*!< Change to the root directory*/
+    OP_HANDSHAKE, /*!< TLS handshake, of the control or of a data connection*/
+    OP_HS_RSA,    /*!< Handshakes with the RSA certificate of the server*/
+    OP_HS_ECDSA,  /*!< Handshakes with the ECDSA certificate of the server*/
+    N_OPS         /*!< Number of measures*/
+} bench_op;
+
+static const char *op_names[N_OPS] = {"LIST", "RETR", "STOR", "SIZE", "CWD", "handshake", "hs RSA", "hs ECDSA"}; /*!< Names of the measures*/
+
+/**
+ * @brief Latencies of a measure
+ *
+ */
+typedef struct _bench_samples
+{
+    uint64_t *ns; /*!< Latency of each sample in nanoseconds*/
+    size_t n;     /*!< Number of samples*/
+    size_t cap;   /*!< Capacity of ns*/
+} bench_samples;
+
+/**
+ * @brief Options of a run, shared by every session
+ *
+ */
+typedef struct _bench_conf
+{
+    char *host;              /*!< Server address*/
+    int port;                /*!< Control port*/
+    int sessions;            /*!< Concurrent sessions*/
+    int ops;                 /*!< Commands run by each session*/
+    int weights[OP_CWD + 1]; /*!< Weight of each command in the mix*/
+    int total_weight;        /*!< Sum of the weights*/
+    size_t file_size;        /*!< Bytes of the file of each session*/
+    char *user;              /*!< User name*/
+    char *pass;              /*!< Password*/
+    unsigned short version;  /*!< TLS version of the client, TLS_V12 or TLS_V13*/
+    unsigned char schemes;   /*!< Signatures accepted from the server, TLS_SIGN_RSA, TLS_SIGN_ECDSA or 0 for both*/
+    char cert[XXXL_SZ];      /*!< Client certificate, PEM*/
+    int cert_len;            /*!< Bytes of cert*/
+    char key[XXXL_SZ];       /*!< Private key, PEM*/
+    int key_len;             /*!< Bytes of key*/
+} bench_conf;
+
+/**
+ * @brief State and results of a session
+ *
+ */
+typedef struct _bench_session
+{
+    int id;                       /*!< Number of the session*/
+    bench_conf *conf;             /*!< Options of the run*/
+    int fd;                       /*!< Control connection*/
+    struct TLSContext *ctx;       /*!< TLS context of the control connection*/
+    char in[XXL_SZ];              /*!< Bytes of the control connection not consumed yet*/
+    size_t in_len;                /*!< Bytes in in*/
+    char reply[XXL_SZ];           /*!< Last line of the last reply*/
+    char file[MEDIUM_SZ];         /*!< File of the session*/
+    char *data;                   /*!< Contents of the file of the session and transfer buffer*/
+    bench_samples samples[N_OPS]; /*!< Latencies*/
+    unsigned long long bytes;     /*!< Data bytes transferred*/
+    unsigned long errors;         /*!< Commands that failed*/
+    unsigned int seed;            /*!< Seed of the mix*/
+} bench_session;
+
+/**
+ * @brief Nanoseconds of the monotonic clock
+ *
+ * @return uint64_t nanoseconds
+ */
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Add a latency to a measure
+ *
+ * @param s Samples of the measure
+ * @param ns Latency in nanoseconds
+ */
+void add_sample(bench_samples *s, uint64_t ns)
+{
+    uint64_t *grown;
+    if (s->n == s->cap)
+    {
+        if (!(grown = realloc(s->ns, (s->cap ? 2 * s->cap : SMALL_SZ) * sizeof(uint64_t))))
+            return;
+        s->ns = grown;
+        s->cap = s->cap ? 2 * s->cap : SMALL_SZ;
+    }
+    s->ns[s->n++] = ns;
+}
+
+/**
+ * @brief Order of two latencies for qsort
+ *
+ * @param a First latency
+ * @param b Second latency
+ * @return int less than, equal to or greater than 0
+ */
+int cmp_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Percentile of a sorted set of latencies
+ *
+ * @param s Sorted samples
+ * @param p Percentile, between 0 and 1
+ * @return double milliseconds
+ */
+double percentile(bench_samples *s, double p)
+{
+    size_t i = (size_t)(p * s->n);
+    return s->n ? s->ns[MIN(i, s->n - 1)] / 1e6 : 0;
+}
+
+/**
+ * @brief Client TLS handshake over a connected socket, with the client certificate
+ *
+ * @param conf Options of the run, with the certificate
+ * @param fd Connected socket
+ * @return struct TLSContext* Established context or NULL on error
+ */
+struct TLSContext *bench_handshake(bench_conf *conf, int fd)
+{
+    struct TLSContext *ctx = tls_create_context(0, conf->version);
+    if (!ctx)
+        return NULL;
+    if (tls_set_signature_schemes(ctx, conf->schemes) < 0 || tls_load_certificates(ctx, (unsigned char *)conf->cert, conf->cert_len) <= 0 ||
+        tls_load_private_key(ctx, (unsigned char *)conf->key, conf->key_len) <= 0 ||
+        tls_client_connect(ctx) < 0 || send_pending(fd, ctx) < 0)
+    {
+        tls_destroy_context(ctx);
+        return NULL;
+    }
+    /*Until the Finished of the server arrives or the handshake fails*/
+    while (!tls_established(ctx) && digest_tls(ctx, fd, MSG_NOSIGNAL) > 0)
+        ;
+    if (tls_established(ctx) != 1)
+    {
+        tls_destroy_context(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+/**
+ * @brief Add the latency of a handshake, also to the measure of the certificate the server used
+ *
+ * @param s Session
+ * @param ctx Established context
+ * @param ns Latency in nanoseconds
+ */
+void add_handshake(bench_session *s, struct TLSContext *ctx, uint64_t ns)
+{
+    add_sample(&s->samples[OP_HANDSHAKE], ns);
+    add_sample(&s->samples[tls_peer_is_ecdsa(ctx) ? OP_HS_ECDSA : OP_HS_RSA], ns);
+}
+
+/**
+ * @brief Connect to a port of the server
+ *
+ * @param ip IP of the server
+ * @param port Port
+ * @return int Connected socket or less than 0 on error
+ */
+int bench_connect(char *ip, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return fd;
+    if (socket_clt_connect(fd, ip, port) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    set_socket_timeouts(fd, BENCH_REPLY_TIMEOUT);
+    return fd;
+}
+
+/**
+ * @brief Read a complete reply from the control connection, multiline replies included
+ *
+ * @param s Session, the last line is left in s->reply
+ * @return int Code of the reply or -1 if the connection failed
+ */
+int bench_reply(bench_session *s)
+{
+    char *eol;
+    ssize_t read_b;
+    size_t line_len;
+    while (1)
+    {
+        /*Consume the complete lines already received*/
+        while ((eol = memmem(s->in, s->in_len, "\r\n", 2)))
+        {
+            line_len = eol - s->in;
+            memcpy(s->reply, s->in, MIN(line_len, XXL_SZ - 1));
+            s->reply[MIN(line_len, XXL_SZ - 1)] = '\0';
+            memmove(s->in, eol + 2, s->in_len - line_len - 2);
+            s->in_len -= line_len + 2;
+            if (line_len >= 4 && isdigit(s->reply[0]) && isdigit(s->reply[1]) && isdigit(s->reply[2]) && s->reply[3] == ' ')
+                return atoi(s->reply);
+        }
+        if (s->in_len == XXL_SZ) /*Line too long*/
+            s->in_len = 0;
+        if ((read_b = srecv(s->ctx, s->fd, &s->in[s->in_len], XXL_SZ - s->in_len, MSG_NOSIGNAL)) <= 0)
+            return -1;
+        s->in_len += read_b;
+    }
+}
+
+/**
+ * @brief Send a command and read its reply
+ *
+ * @param s Session
+ * @param fmt Format of the command, without CRLF
+ * @return int Code of the reply or -1 if the connection failed
+ */
+int bench_command(bench_session *s, const char *fmt, ...)
+{
+    char cmd[XXL_SZ];
+    int len;
+    va_list args;
+    va_start(args, fmt);
+    len = vsnprintf(cmd, XXL_SZ - 2, fmt, args);
+    va_end(args);
+    if (len < 0 || len >= XXL_SZ - 2)
+        return -1;
+    strcpy(&cmd[len], "\r\n");
+    if (ssend(s->ctx, s->fd, cmd, len + 2, MSG_NOSIGNAL) < 0)
+        return -1;
+    return bench_reply(s);
+}
+
+/**
+ * @brief Open the control connection, negotiate TLS and log in
+ *
+ * @param s Session
+ * @return int less than 0 on error
+ */
+int bench_login(bench_session *s)
+{
+    uint64_t start;
+    if ((s->fd = bench_connect(s->conf->host, s->conf->port)) < 0 || bench_reply(s) != 220 || bench_command(s, "AUTH TLS") != 234)
+        return -1;
+    start = now_ns();
+    if (!(s->ctx = bench_handshake(s->conf, s->fd)))
+        return -1;
+    add_handshake(s, s->ctx, now_ns() - start);
+    if (bench_command(s, "USER %s", s->conf->user) != 331 || bench_command(s, "PASS %s", s->conf->pass) != 230 ||
+        bench_command(s, "PBSZ 0") != 200 || bench_command(s, "PROT P") != 200 || bench_command(s, "TYPE I") != 200)
+        return -1;
+    return 1;
+}
+
+/**
+ * @brief Run a command that uses a data connection: PASV, connection and handshake, transfer and final reply
+ *
+ * @param s Session
+ * @param op OP_LIST, OP_RETR or OP_STOR
+ * @return int less than 0 on error
+ */
+int bench_transfer(bench_session *s, bench_op op)
+{
+    int h[4], p[2], fd, ret = 1;
+    char ip[SMALL_SZ], *paren;
+    ssize_t n;
+    uint64_t start;
+    struct TLSContext *ctx;
+
+    if (bench_command(s, "PASV") != 227 || !(paren = strchr(s->reply, '(')) ||
+        sscanf(paren, "(%d,%d,%d,%d,%d,%d)", &h[0], &h[1], &h[2], &h[3], &p[0], &p[1]) != 6)
+        return -1;
+    snprintf(ip, SMALL_SZ, "%d.%d.%d.%d", h[0], h[1], h[2], h[3]);
+    if ((fd = bench_connect(ip, p[0] * 256 + p[1])) < 0)
+        return -1;
+    /*The server accepts the data connection once it has the command*/
+    if (op == OP_LIST)
+        n = ssend(s->ctx, s->fd, "LIST\r\n", sizeof("LIST\r\n") - 1, MSG_NOSIGNAL);
+    else
+    {
+        char cmd[XXL_SZ];
+        n = snprintf(cmd, XXL_SZ, "%s %s\r\n", op == OP_RETR ? "RETR" : "STOR", s->file);
+        n = ssend(s->ctx, s->fd, cmd, n, MSG_NOSIGNAL);
+    }
+    start = now_ns();
+    if (n < 0 || !(ctx = bench_handshake(s->conf, fd)))
+    {
+        close(fd);
+        return -1;
+    }
+    add_handshake(s, ctx, now_ns() - start);
+    if (bench_reply(s) != 150)
+        ret = -1;
+    else if (op == OP_STOR)
+    {
+        if (ssend(ctx, fd, s->data, s->conf->file_size, MSG_NOSIGNAL) < 0)
+            ret = -1;
+        else
+            s->bytes += s->conf->file_size;
+        tls_close_notify(ctx);
+        send_pending(fd, ctx);
+        shutdown(fd, SHUT_WR); /*The end of the file*/
+    }
+    else
+    {
+        while ((n = srecv(ctx, fd, s->data, MIN(MAX(s->conf->file_size, XXL_SZ), XXXL_SZ), MSG_NOSIGNAL)) > 0)
+            s->bytes += n;
+        ret = n < 0 ? -1 : 1;
+    }
+    if (ret > 0 && bench_reply(s) != 226)
+        ret = -1;
+    tls_destroy_context(ctx);
+    close(fd);
+    return ret;
+}
+
+/**
+ * @brief Pick a command of the mix
+ *
+ * @param s Session
+ * @return bench_op Command
+ */
+bench_op bench_pick(bench_session *s)
+{
+    int r = rand_r(&s->seed) % s->conf->total_weight;
+    bench_op op;
+    for (op = OP_LIST; r >= s->conf->weights[op]; op++)
+        r -= s->conf->weights[op];
+    return op;
+}
+
+/**
+ * @brief Main function of a session: log in, upload its file, run the mix and clean up
+ *
+ * @param args Session
+ * @return void* NULL
+ */
+void *bench_session_run(void *args)
+{
+    bench_session *s = args;
+    bench_op op;
+    uint64_t start;
+    int ret;
+
+    snprintf(s->file, MEDIUM_SZ, BENCH_FILE_NAME, s->id);
+    if (bench_login(s) < 0 || bench_transfer(s, OP_STOR) < 0) /*RETR and SIZE need the file*/
+    {
+        fprintf(stderr, "Sesion %d: fallo al iniciar (%s)\n", s->id, s->reply);
+        s->errors++;
+        sclose(&s->ctx, &s->fd);
+        return NULL;
+    }
+    for (int i = 0; i < s->conf->ops; i++)
+    {
+        start = now_ns();
+        switch (op = bench_pick(s))
+        {
+        case OP_SIZE:
+            ret = bench_command(s, "SIZE %s", s->file) == 213 ? 1 : -1;
+            break;
+        case OP_CWD:
+            ret = bench_command(s, "CWD /") == 250 ? 1 : -1;
+            break;
+        default:
+            ret = bench_transfer(s, op);
+        }
+        if (ret < 0)
+        {
+            s->errors++;
+            if (s->fd < 0 || !tls_established(s->ctx)) /*Nothing more can be done in this session*/
+                break;
+            continue;
+        }
+        add_sample(&s->samples[op], now_ns() - start);
+    }
+    bench_command(s, "DELE %s", s->file);
+    bench_command(s, "QUIT");
+    sclose(&s->ctx, &s->fd);
+    return NULL;
+}
+
+/**
+ * @brief Read the weights of the mix, e.g. LIST:1,RETR:4,STOR:1,SIZE:2,CWD:2
+ *
+ * @param conf Options where the weights are stored
+ * @param mix Mix
+ * @return int less than 0 if it is not valid
+ */
+int parse_mix(bench_conf *conf, char *mix)
+{
+    char *save = NULL, *item, *colon;
+    bench_op op;
+    memset(conf->weights, 0, sizeof(conf->weights));
+    conf->total_weight = 0;
+    for (item = strtok_r(mix, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        if (!(colon = strchr(item, ':')))
+            return -1;
+        *colon = '\0';
+        for (op = OP_LIST; op <= OP_CWD && strcasecmp(item, op_names[op]); op++)
+            ;
+        if (op > OP_CWD || (conf->weights[op] = atoi(colon + 1)) < 0)
+            return -1;
+        conf->total_weight += conf->weights[op];
+    }
+    return conf->total_weight > 0 ? 1 : -1;
+}
+
+/**
+ * @brief Print the usage of the program
+ *
+ * @param name Name of the program
+ */
+void usage(char *name)
+{
+    fprintf(stderr, "Uso: %s [-h host] [-p puerto] [-c sesiones] [-n comandos por sesion] [-m mezcla] [-s bytes del archivo]\n"
+                    "          [-u usuario] -w contrasena [-C certificado] [-K clave] [-v 1.2|1.3] [-a rsa|ecdsa]\n"
+                    "-u es por defecto el usuario que ejecuta el programa, -w es obligatorio\n"
+                    "-a limita la firma que se acepta del servidor, solo con TLS 1.3\n"
+                    "Mezcla por defecto: %s\n",
+            name, BENCH_DEFAULT_MIX);
+}
+
+/**
+ * @brief Open the sessions, wait for them and report handshakes per second, latencies and throughput
+ *
+ * @param argc Number of arguments
+ * @param argv Arguments
+ * @return int 0 if no command failed
+ */
+int main(int argc, char **argv)
+{
+    bench_conf conf = {.host = BENCH_DEFAULT_HOST, .port = BENCH_DEFAULT_PORT, .sessions = BENCH_DEFAULT_SESSIONS,
+                       .ops = BENCH_DEFAULT_OPS, .file_size = BENCH_DEFAULT_FILE_SIZE, .version = TLS_V12};
+    char mix[XL_SZ] = BENCH_DEFAULT_MIX, *cert = BENCH_DEFAULT_CERT, *key = BENCH_DEFAULT_KEY;
+    bench_session *sessions;
+    pthread_t *threads;
+    bench_samples total[N_OPS] = {0};
+    unsigned long long bytes = 0;
+    unsigned long errors = 0;
+    double elapsed;
+    uint64_t start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:c:n:m:s:u:w:C:K:v:a:")) != -1)
+        switch (opt)
+        {
+        case 'h':
+            conf.host = optarg;
+            break;
+        case 'p':
+            conf.port = atoi(optarg);
+            break;
+        case 'c':
+            conf.sessions = atoi(optarg);
+            break;
+        case 'n':
+            conf.ops = atoi(optarg);
+            break;
+        case 'm':
+            snprintf(mix, XL_SZ, "%s", optarg);
+            break;
+        case 's':
+            conf.file_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            conf.user = optarg;
+            break;
+        case 'w':
+            conf.pass = optarg;
+            break;
+        case 'C':
+            cert = optarg;
+            break;
+        case 'K':
+            key = optarg;
+            break;
+        case 'v':
+            conf.version = !strcmp(optarg, "1.3") ? TLS_V13 : !strcmp(optarg, "1.2") ? TLS_V12 : 0;
+            break;
+        case 'a':
+            conf.schemes = !strcasecmp(optarg, "rsa") ? TLS_SIGN_RSA : !strcasecmp(optarg, "ecdsa") ? TLS_SIGN_ECDSA : 0xFF;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    /*The server only accepts system users, so there is no anonymous default*/
+    if (!conf.user)
+    {
+        struct passwd *pw = getpwuid(getuid());
+        conf.user = pw ? pw->pw_name : NULL;
+    }
+    /*A TLS 1.2 client of tlse only offers RSA suites*/
+    if (!conf.user || !conf.pass || conf.sessions < 1 || conf.ops < 0 || parse_mix(&conf, mix) < 0 || !conf.version || conf.schemes == 0xFF ||
+        (conf.schemes && conf.version != TLS_V13))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((conf.cert_len = read_from_file(cert, conf.cert, XXXL_SZ)) <= 0 || (conf.key_len = read_from_file(key, conf.key, XXXL_SZ)) <= 0)
+    {
+        fprintf(stderr, "No se pudo leer el certificado %s o la clave %s\n", cert, key);
+        return 1;
+    }
+    if (!(sessions = calloc(conf.sessions, sizeof(bench_session))) || !(threads = calloc(conf.sessions, sizeof(pthread_t))))
+        return 1;
+    /*tlse initialises itself on first use, which is not safe from several threads at once*/
+    tls_init();
+    srand(time(NULL));
+    for (int i = 0; i < conf.sessions; i++)
+    {
+        sessions[i] = (bench_session){.id = i, .conf = &conf, .fd = -1, .seed = rand()};
+        if (!(sessions[i].data = malloc(MAX(conf.file_size, XXL_SZ))))
+            return 1;
+        for (size_t j = 0; j < conf.file_size; j++)
+            sessions[i].data[j] = rand_r(&sessions[i].seed);
+    }
+
+    /*All the sessions at the same time*/
+    start = now_ns();
+    for (int i = 0; i < conf.sessions; i++)
+        pthread_create(&threads[i], NULL, bench_session_run, &sessions[i]);
+    for (int i = 0; i < conf.sessions; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = (now_ns() - start) / 1e9;
+
+    /*Join the samples of every session*/
+    for (int i = 0; i < conf.sessions; i++)
+    {
+        for (int op = 0; op < N_OPS; op++)
+        {
+            for (size_t j = 0; j < sessions[i].samples[op].n; j++)
+                add_sample(&total[op], sessions[i].samples[op].ns[j]);
+            free(sessions[i].samples[op].ns);
+        }
+        bytes += sessions[i].bytes;
+        errors += sessions[i].errors;
+        free(sessions[i].data);
+    }
+    printf("%d sesiones, %d comandos por sesion, %.2f s, %lu errores\n", conf.sessions, conf.ops, elapsed, errors);
+    printf("Handshakes: %zu (%.1f/s)\n", total[OP_HANDSHAKE].n, total[OP_HANDSHAKE].n / elapsed);
+    for (int op = OP_HS_RSA; op <= OP_HS_ECDSA; op++)
+        if (total[op].n)
+            printf("  %-9s %zu (%.1f/s)\n", op == OP_HS_RSA ? "RSA:" : "ECDSA:", total[op].n, total[op].n / elapsed);
+    printf("Transferencia: %.1f MB en total (%.1f MB/s)\n", bytes / 1e6, bytes / 1e6 / elapsed);
+    printf("%-10s %8s %10s %10s %10s\n", "", "n", "p50 ms", "p99 ms", "p999 ms");
+    for (int op = 0; op < N_OPS; op++)
+    {
+        qsort(total[op].ns, total[op].n, sizeof(uint64_t), cmp_ns);
+        if (total[op].n)
+            printf("%-10s %8zu %10.3f %10.3f %10.3f\n", op_names[op], total[op].n,
+                   percentile(&total[op], 0.5), percentile(&total[op], 0.99), percentile(&total[op], 0.999));
+        free(total[op].ns);
+    }
+    free(sessions);
+    free(threads);
+    return errors ? 1 : 0;
+}
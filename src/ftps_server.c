@@ -7,6 +7,7 @@
  *
  *
  */
+#define _GNU_SOURCE             /*!< Access to pthread_attr_setaffinity_np*/
 #define _DEFAULT_SOURCE         /*!< Access to GNU functions*/
 #define _POSIX_C_SOURCE 200112L /*!< Access to POSIX functions*/
 #include "utils.h"
@@ -17,24 +18,60 @@
 #include "ftp_session.h"
 #include "config_parser.h"
 #include "ftp_files.h"
+#include "reactor.h"
+#include "worker_pool.h"
+#include "metrics.h"
 
 #define MAX_PASSWORD MEDIUM_SZ            /*!< Maximum password size*/
 #define USING_AUTHBIND "--using-authbind" /*!< Indicates current execution with authbind*/
 #define THREAD_CLOSE_WAIT 2               /*!< Maximum time to wait for a thread to close*/
 #define CONTROL_SOCKET_TIMEOUT 150        /*!< Maximum timeout of control connection*/
+#define SESSION_STACK_SIZE (256 * 1024)   /*!< Stack of the threads of the sessions, the transfers run in the workers*/
 //#define DEBUG
 
-void accept_loop(int socket_control_fd);
+#define BLOCKING_COMMAND(cmd) DATA_CALLBACK(cmd) /*!< Commands that can keep the thread busy for a long time*/
+
+/**
+ * @brief State of an FTP session that is kept between control requests
+ *
+ */
+typedef struct _session_state
+{
+    session_info sessions[2]; /*!< Sessions alternated between one request and the next*/
+    session_info *current;    /*!< Session of the request being served*/
+    session_info *previous;   /*!< Session of the previous request*/
+    data_conn dc;             /*!< Data connection of the session*/
+    request_info ri;          /*!< Request being served*/
+    command_reader reader;    /*!< Commands received and not served yet*/
+    reactor_item *item;       /*!< Registration in an event loop, NULL in the threads model*/
+    char buff[XXXL_SZ + 1];   /*!< Line of the request being served*/
+} session_state;
+
+void accept_loop();
+void *accept_shard(void *args);
+void accept_connections(int socket_control_fd);
+int shard_core(int shard);
+int session_thread_start(void *(*function)(void *), session_state *st);
 void set_ftp_credentials();
+session_state *session_create(int clt_fd);
+void session_destroy(session_state *st);
+int session_next_command(session_state *st);
+intptr_t session_dispatch(session_state *st);
 void *ftp_session_loop(void *args);
+reactor_ret session_readable(reactor_item *item);
+void *session_offload(void *args);
 void set_end_flag(int sig);
 void set_handlers();
-void data_callback_loop(session_info *session, request_info *ri, serverconf *server_conf, char *buf);
+void data_callback_loop(session_info *session, request_info *ri, serverconf *server_conf, command_reader *reader);
 void tls_start();
 
 serverconf server_conf; /*!< Global server configuration*/
 sem_t n_clients;        /*!< Controls that the number of FTP sessions is not exceeded*/
 int end = 0;            /*!< Indicates that the program must be terminated*/
+
+int control_fds[ACCEPT_SHARDS_MAX]; /*!< Sockets of the control port, one for each acceptor*/
+cpu_set_t session_cores;            /*!< Cores of the process, where the sessions run whichever acceptor opened them*/
+int pinned_shards = 0;              /*!< The acceptors are pinned to their own cores*/
 /**
  * @brief Application entry point
  *
@@ -63,11 +100,19 @@ int main(int argc, char *argv[])
     /*Set signal handlers*/
     set_handlers();
 
-    /*Now, we would have to create the control socket*/
-    int socket_control_fd = socket_srv("tcp", 10, FTP_CONTROL_PORT, server_conf.ftp_host);
-    if (socket_control_fd < 0)
-        errexit("Fallo al abrir socket de control %s\n", strerror(errno));
-    set_socket_timeouts(socket_control_fd, CONTROL_SOCKET_TIMEOUT);
+    /*Now, we would have to create the control sockets, several acceptors share the port*/
+    for (int i = 0; i < server_conf.accept_shards; i++)
+    {
+        if ((control_fds[i] = socket_srv_shard(server_conf.listen_backlog, FTP_CONTROL_PORT, server_conf.ftp_host, server_conf.accept_shards > 1, server_conf.defer_accept)) < 0)
+            errexit("Fallo al abrir socket de control %s\n", strerror(errno));
+        set_socket_timeouts(control_fds[i], CONTROL_SOCKET_TIMEOUT);
+    }
+
+    /*Bind the passive ports once, PASV only takes one of them*/
+    int n_pasv = passive_pool_init(&(server_conf.passive_ports), server_conf.ftp_host, server_conf.pasv_port_min, server_conf.pasv_port_max, server_conf.max_passive_ports);
+    if (n_pasv < 0)
+        errexit("Fallo al abrir los puertos pasivos %s\n", strerror(errno));
+    printf("Puertos pasivos abiertos: %d\n", n_pasv);
 
     /*Initialize the TLS context*/
     tls_start();
@@ -82,174 +127,455 @@ int main(int argc, char *argv[])
         daemon(1, 0);
 
     /*Request acceptance loop in control*/
-    accept_loop(socket_control_fd);
+    accept_loop();
 
     /*Release resources*/
-    sclose(&(server_conf.server_ctx), &socket_control_fd);
+    for (int i = 1; i < server_conf.accept_shards; i++)
+        close(control_fds[i]);
+    sclose(&(server_conf.server_ctx), &control_fds[0]);
     exit(0);
 }
 
 /**
- * @brief Loop of acceptance of new connections
+ * @brief Start the pools that serve the sessions and the acceptors of the control port, one of them in this thread
+ *
+ */
+void accept_loop()
+{
+    struct timespec timeout;
+    pthread_attr_t attr;
+    pthread_t thread;
+    cpu_set_t set;
+    int ret;
+
+    /*Set maximum number of clients*/
+    sem_init(&n_clients, 0, server_conf.max_sessions);
+    /*Counters of the server for the scraper*/
+    if (metrics_start(server_conf.metrics_port, &n_clients, server_conf.max_sessions, &(server_conf.passive_ports)) < 0)
+        errexit("Fallo al abrir el puerto de metricas %d: %s\n", server_conf.metrics_port, strerror(errno));
+    /*Event loops that will own the control connections*/
+    if (server_conf.use_reactor && reactor_start(server_conf.reactor_threads, session_readable, &end) < 0)
+        errexit("Fallo al crear los bucles de eventos: %s\n", strerror(errno));
+    /*Workers that serve the data transfers*/
+    if (worker_pool_start(server_conf.transfer_workers) < 0)
+        errexit("Fallo al crear los trabajadores de transferencias: %s\n", strerror(errno));
+    /*Signatures of the handshakes are computed on their own cores*/
+    if (crypto_pool_start(server_conf.crypto_workers, server_conf.crypto_cores, server_conf.n_crypto_cores) < 0)
+        errexit("Fallo al crear los trabajadores criptograficos: %s\n", strerror(errno));
+    /*Key pairs of the key exchange are generated off the handshake*/
+    if (tls_keyshare_pool_start(server_conf.keyshare_pool_size) < 0)
+        errexit("Fallo al iniciar la reserva de claves efimeras\n");
+    /*Several acceptors are pinned to their own cores, the sessions they open are not*/
+    pinned_shards = server_conf.accept_shards > 1 && !sched_getaffinity(0, sizeof(session_cores), &session_cores);
+    for (int i = 1; i < server_conf.accept_shards; i++)
+    {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pinned_shards)
+        {
+            CPU_ZERO(&set);
+            CPU_SET(shard_core(i), &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+        }
+        if ((ret = pthread_create(&thread, &attr, accept_shard, (void *)(intptr_t)i)) != 0)
+            errexit("Fallo al crear los hilos de aceptacion: %s\n", strerror(ret));
+        pthread_attr_destroy(&attr);
+    }
+    if (pinned_shards)
+    {
+        CPU_ZERO(&set);
+        CPU_SET(shard_core(0), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    accept_connections(control_fds[0]);
+
+    if (server_conf.use_reactor)
+        reactor_join();
+    /*Wait for all threads to finish, with a certain timeout*/
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_sec += THREAD_CLOSE_WAIT;
+    for (int i = 0; i < server_conf.max_sessions; i++)
+        if (sem_timedwait(&n_clients, &timeout) == -1)
+            break;
+    return;
+}
+
+/**
+ * @brief Thread of an acceptor of the control port other than the main one
+ *
+ * @param args Index of its socket in control_fds
+ * @return void* NULL
+ */
+void *accept_shard(void *args)
+{
+    accept_connections(control_fds[(intptr_t)args]);
+    return NULL;
+}
+
+/**
+ * @brief Core of an acceptor, the cores of the process are taken in turn
+ *
+ * @param shard Index of the acceptor
+ * @return int Core
+ */
+int shard_core(int shard)
+{
+    int n = shard % CPU_COUNT(&session_cores);
+    for (int core = 0; core < CPU_SETSIZE; core++)
+        if (CPU_ISSET(core, &session_cores) && !n--)
+            return core;
+    return 0;
+}
+
+/**
+ * @brief Loop of acceptance of new connections of one of the sockets of the control port.
+ * Acceptors do not wait for a free session slot, so every socket always has one in accept
  *
  * @param socket_control_fd Socket of incoming control connections
  */
-void accept_loop(int socket_control_fd)
+void accept_connections(int socket_control_fd)
 {
     struct sockaddr clt_info;
     size_t clt_info_size = sizeof(clt_info);
     intptr_t clt_fd;
-    pthread_t session_thread;
-    struct timespec timeout;
+    session_state *st;
 
-    /*Set maximum number of clients*/
-    sem_init(&n_clients, 0, server_conf.max_sessions);
     /*Perform accepts until the server is closed*/
     while (!end)
     {
-        /*Wait for a free slot and accept the next client*/
-        sem_wait(&n_clients);
+        /*Accept the next client and take a free slot for it*/
         clt_fd = accept(socket_control_fd, &clt_info, (socklen_t *)&clt_info_size);
         if (end)
         {
-            sem_post(&n_clients);
+            if (clt_fd >= 0)
+                close(clt_fd);
             break;
         }
+        if (clt_fd < 0)
+            continue;
+        if (sem_trywait(&n_clients) < 0)
+        {
+            send(clt_fd, CODE_421_TOO_MANY_SESSIONS, sizeof(CODE_421_TOO_MANY_SESSIONS) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(clt_fd);
+            continue;
+        }
         /*Greet the client*/
-        send(clt_fd, CODE_220_WELCOME_MSG, sizeof(CODE_220_WELCOME_MSG) - 1, 0);
-        /*Open each new request in a thread to start the session*/
-        if (end)
+        send(clt_fd, CODE_220_WELCOME_MSG, sizeof(CODE_220_WELCOME_MSG) - 1, MSG_NOSIGNAL);
+        if (!(st = session_create(clt_fd)))
         {
+            close(clt_fd);
             sem_post(&n_clients);
-            break;
+            continue;
+        }
+        /*Hand the connection to an event loop, or open each new request in a thread to start the session*/
+        if (server_conf.use_reactor)
+        {
+            if (!reactor_add(clt_fd, st))
+                session_destroy(st);
         }
-        session_thread = pthread_create(&session_thread, NULL, ftp_session_loop, (void *)clt_fd);
-        pthread_detach(session_thread); /*Convert to independent thread so you don't have to join*/
+        else if (session_thread_start(ftp_session_loop, st) != 0)
+            session_destroy(st);
     }
-    /*Wait for all threads to finish, with a certain timeout*/
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += THREAD_CLOSE_WAIT;
-    for (int i = 0; i < server_conf.max_sessions; i++)
-        if (sem_timedwait(&n_clients, &timeout) == -1)
-            break;
-    return;
+    /*The signal only interrupts one acceptor, the rest are woken up*/
+    for (int i = 0; i < server_conf.accept_shards; i++)
+        shutdown(control_fds[i], SHUT_RD);
 }
 
 /**
- * @brief Main loop for reception of FTP commands
+ * @brief Start a detached thread for a session, with a stack of SESSION_STACK_SIZE
  *
- * @param args Contains client descriptor
- * @return void*
+ * @param function Function of the thread
+ * @param st Session state, argument of the function
+ * @return int 0 on success, an error number otherwise
  */
-void *ftp_session_loop(void *args)
+int session_thread_start(void *(*function)(void *), session_state *st)
 {
-    char buff[XXXL_SZ + 1];
-    session_info s1, s2, *current = &s1, *previous = &s2, *aux;
-    request_info ri = {.command_arg = "", .command_name = "", .response = "", .response_len = 0, .implemented_command = NOOP};
-    intptr_t clt_fd = (intptr_t)args, cb_ret = CALLBACK_RET_PROCEED;
-    data_conn dc = {.socket_fd = -1, .conn_state = DATA_CONN_CLOSED, .abort = 0, .conn_fd = -1};
-    ssize_t read_b;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int ret;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /*Nothing large lives in their stacks, so many more sessions fit in the address space and in the limits*/
+    pthread_attr_setstacksize(&attr, SESSION_STACK_SIZE);
+    if (pinned_shards)
+        pthread_attr_setaffinity_np(&attr, sizeof(session_cores), &session_cores);
+    ret = pthread_create(&thread, &attr, function, st);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/**
+ * @brief Create the state of a new FTP session
+ *
+ * @param clt_fd Client descriptor (control connection)
+ * @return session_state* NULL if out of memory
+ */
+session_state *session_create(int clt_fd)
+{
+    session_state *st = malloc(sizeof(session_state));
+    if (!st)
+        return NULL;
+    st->ri = (request_info){.command_arg = "", .command_name = "", .response = "", .response_len = 0, .implemented_command = NOOP};
+    st->dc = (data_conn){.socket_fd = -1, .pasv = NULL, .conn_state = DATA_CONN_CLOSED, .abort = 0, .conn_fd = -1, .reusable = 0, .done_fd = eventfd(0, EFD_CLOEXEC)};
+    if (st->dc.done_fd < 0)
+    {
+        free(st);
+        return NULL;
+    }
+    st->item = NULL;
+    command_reader_init(&(st->reader));
+    st->current = &(st->sessions[0]);
+    st->previous = &(st->sessions[1]);
 
     /*FTP session: constant values*/
-    sem_init(&(dc.mutex), 0, 1);            /*Control concurrent access to the structure*/
-    sem_init(&(dc.data_conn_sem), 0, 0);    /*If set to 1, data callback has already finished data callback preparations*/
-    sem_init(&(dc.control_conn_sem), 0, 0); /*If 1, Data Callback has finished transmission and indicated return code*/
-    s1.data_connection = s2.data_connection = &dc;
-    s1.clt_fd = s2.clt_fd = clt_fd;
+    sem_init(&(st->dc.mutex), 0, 1);            /*Control concurrent access to the structure*/
+    sem_init(&(st->dc.data_conn_sem), 0, 0);    /*If set to 1, data callback has already finished data callback preparations*/
+    sem_init(&(st->dc.control_conn_sem), 0, 0); /*If 1, Data Callback has finished transmission and indicated return code*/
+    st->sessions[0].data_connection = st->sessions[1].data_connection = &(st->dc);
+    st->sessions[0].clt_fd = st->sessions[1].clt_fd = clt_fd;
 
     /*FTP session: variable attributes*/
-    init_session_info(current, NULL);
-    strcpy(current->current_dir, server_conf.server_root);
-    current->ascii_mode = server_conf.default_ascii;
+    init_session_info(st->current, NULL);
+    strcpy(st->current->current_dir, server_conf.server_root);
+    st->current->ascii_mode = server_conf.default_ascii;
+    metrics_session(1);
+    return st;
+}
+
+/**
+ * @brief Release the session attributes, close the connection and free a slot for a new client
+ *
+ * @param st Session state
+ */
+void session_destroy(session_state *st)
+{
+    reactor_remove(st->item);
+    free(st->current->handshake); /*Its context is closed with the connection*/
+    sclose(&(st->current->context), &(st->current->clt_fd));
+    free_attributes(st->current);
+    close_data_conn(&(st->dc), &(server_conf.passive_ports)); /*Kept open by block mode or left by PASV*/
+    sem_destroy(&(st->dc.mutex));
+    sem_destroy(&(st->dc.data_conn_sem));
+    sem_destroy(&(st->dc.control_conn_sem));
+    close(st->dc.done_fd);
+    free(st);
+    metrics_session(-1);
+    sem_post(&n_clients);
+}
+
+/**
+ * @brief Parse the next command received, if a whole line has already arrived
+ *
+ * @param st Session state, the request is left in it
+ * @return int 1 if there is a request to serve, 0 if more bytes are needed
+ */
+int session_next_command(session_state *st)
+{
+    ssize_t len;
+    while ((len = command_reader_line(&(st->reader), st->buff, sizeof(st->buff))) < 0)
+        ssend(st->current->context, st->current->clt_fd, CODE_500_LINE_TOO_LONG, sizeof(CODE_500_LINE_TOO_LONG) - 1, MSG_NOSIGNAL);
+    if (!len)
+        return 0;
+    parse_ftp_command(&(st->ri), st->buff);
+    return 1;
+}
+
+/**
+ * @brief Serve the request already parsed in the session state and send its response
+ *
+ * @param st Session state
+ * @return intptr_t Callback return value, CALLBACK_RET_END_CONNECTION if the session must end
+ */
+intptr_t session_dispatch(session_state *st)
+{
+    session_info *aux, *current = st->current;
+    request_info *ri = &(st->ri);
+    intptr_t cb_ret = CALLBACK_RET_PROCEED;
+#ifdef DEBUG
+    flog(LOG_DEBUG, "%s %s\n", ri->command_name, (!strcmp(ri->command_name, "PASS")) ? "XXXX" : ri->command_arg);
+#endif
+    if (ri->ignored_command == -1 && ri->implemented_command == -1) /*Unrecognized command*/
+        ssend(current->context, current->clt_fd, CODE_500_UNKNOWN_CMD, sizeof(CODE_500_UNKNOWN_CMD) - 1, MSG_NOSIGNAL);
+    else if (ri->implemented_command == -1) /*Command recognized but not implemented*/
+        ssend(current->context, current->clt_fd, CODE_502_NOT_IMP_CMD, sizeof(CODE_502_NOT_IMP_CMD) - 1, MSG_NOSIGNAL);
+    else if (DATA_CALLBACK(ri->implemented_command) && st->dc.conn_state == DATA_CONN_CLOSED) /*A data connection must have been initiated with PORT or PASV*/
+        ssend(current->context, current->clt_fd, CODE_503_BAD_SEQUENCE, sizeof(CODE_503_BAD_SEQUENCE) - 1, MSG_NOSIGNAL);
+    else /*Command implemented, call the callback and return response controlling the possible data connection*/
+    {
+        uint64_t start = metrics_clock();
+        cb_ret = command_callback(&server_conf, current, ri);
+        /*If it is a data transmission we enter a different loop*/
+        if (DATA_CALLBACK(ri->implemented_command) && cb_ret != CALLBACK_RET_END_CONNECTION)
+            data_callback_loop(current, ri, &server_conf, &(st->reader));
+        /*Send final response from callback*/
+        if (cb_ret == CALLBACK_RET_PROCEED || ri->implemented_command == QUIT)
+        {
+            ssend(current->context, current->clt_fd, ri->response, ri->response_len, ((cb_ret != CALLBACK_RET_PROCEED) & MSG_DONTWAIT) | MSG_NOSIGNAL);
+#ifdef DEBUG
+            flog(LOG_DEBUG, "-->%s\n", ri->response);
+#endif
+        }
+        metrics_observe(HIST_COMMAND, ri->implemented_command, metrics_clock() - start);
+        /*Commands sent in clear after AUTH must not be taken as protected*/
+        if (ri->implemented_command == AUTH)
+            command_reader_init(&(st->reader));
+        aux = st->previous;
+        st->previous = current;
+        st->current = aux;                            /*Current session becomes the previous session*/
+        init_session_info(st->current, st->previous); /*We fill it from the previous one removing attributes that expire*/
+    }
+    return cb_ret;
+}
+
+/**
+ * @brief Main loop for reception of FTP commands (threads model)
+ *
+ * @param args Session state
+ * @return void*
+ */
+void *ftp_session_loop(void *args)
+{
+    session_state *st = (session_state *)args;
+    intptr_t cb_ret = CALLBACK_RET_PROCEED;
+    ssize_t read_b;
 
     /*Main session loop*/
     while (!end && cb_ret != CALLBACK_RET_END_CONNECTION)
     {
-        /*Fetch next command checking the flag from time to time*/
-        while (!end && (((read_b = srecv(current->context, clt_fd, buff, XXXL_SZ, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) && (errno == EWOULDBLOCK || errno == EAGAIN)) && !usleep(1000))
+        /*Serve the commands already received, in order, before reading more*/
+        if (session_next_command(st))
+        {
+            cb_ret = session_dispatch(st);
+            continue;
+        }
+        /*Fetch more commands checking the flag from time to time*/
+        while (!end && (((read_b = command_reader_fill(&(st->reader), st->current->context, st->current->clt_fd, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) && (errno == EWOULDBLOCK || errno == EAGAIN)) && !usleep(1000))
             ;
         if (end || read_b <= 0)
             break;
-        buff[read_b] = '\0'; /*For security reasons we ensure a zero*/
-        parse_ftp_command(&ri, buff);
-#ifdef DEBUG
-        flog(LOG_DEBUG, "%s %s\n", ri.command_name, (!strcmp(ri.command_name, "PASS")) ? "XXXX" : ri.command_arg);
-#endif
-        if (ri.ignored_command == -1 && ri.implemented_command == -1) /*Unrecognized command*/
-            ssend(current->context, clt_fd, CODE_500_UNKNOWN_CMD, sizeof(CODE_500_UNKNOWN_CMD) - 1, MSG_NOSIGNAL);
-        else if (ri.implemented_command == -1) /*Command recognized but not implemented*/
-            ssend(current->context, clt_fd, CODE_502_NOT_IMP_CMD, sizeof(CODE_502_NOT_IMP_CMD) - 1, MSG_NOSIGNAL);
-        else /*Command implemented, call the callback and return response controlling the possible data connection*/
+    }
+    /*Release the session attributes and close the connection*/
+    session_destroy(st);
+    return NULL;
+}
+
+/**
+ * @brief Serve the commands of a control connection that became readable (epoll model).
+ * Reads until EAGAIN, as required by edge triggered events
+ *
+ * @param item Control connection, its data is the session state
+ * @return reactor_ret REACTOR_REARM when there is nothing more to read
+ */
+reactor_ret session_readable(reactor_item *item)
+{
+    session_state *st = (session_state *)item->data;
+    handshake_status status;
+    ssize_t read_b;
+
+    st->item = item;
+    while (!end)
+    {
+        /*Nothing is read as a command until the negotiation of AUTH ends*/
+        if (st->current->handshake)
         {
-            cb_ret = command_callback(&server_conf, current, &ri);
-            /*If it is a data transmission we enter a different loop*/
-            if (DATA_CALLBACK(ri.implemented_command) && cb_ret != CALLBACK_RET_END_CONNECTION)
-                data_callback_loop(current, &ri, &server_conf, buff);
-            /*Send final response from callback*/
-            if (cb_ret == CALLBACK_RET_PROCEED || ri.implemented_command == QUIT)
+            if ((status = tls_handshake_step(st->current->handshake)) == HANDSHAKE_WANT_READ)
             {
-                ssend(current->context, clt_fd, ri.response, ri.response_len, ((cb_ret != CALLBACK_RET_PROCEED) & MSG_DONTWAIT) | MSG_NOSIGNAL);
-#ifdef DEBUG
-                flog(LOG_DEBUG, "-->%s\n", ri.response);
-#endif
+                reactor_set_deadline(item, st->current->handshake->deadline);
+                return REACTOR_REARM;
             }
-            aux = previous;
-            previous = current;
-            current = aux;                        /*Current session becomes the previous session*/
-            init_session_info(current, previous); /*We fill it from the previous one removing attributes that expire*/
+            reactor_set_deadline(item, 0);
+            if (auth_handshake_done(&server_conf, st->current, st->current->handshake, status) == CALLBACK_RET_END_CONNECTION)
+                break;
+            continue;
         }
+        /*Serve the commands already received, in order, before reading more*/
+        if (!session_next_command(st))
+        {
+            if ((read_b = command_reader_fill(&(st->reader), st->current->context, st->current->clt_fd, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+                return REACTOR_REARM;
+            if (read_b <= 0)
+                break;
+            continue;
+        }
+        /*Data transfers would stall the event loop, they are served by another thread that gives the connection back*/
+        if (BLOCKING_COMMAND(st->ri.implemented_command) && st->dc.conn_state != DATA_CONN_CLOSED)
+        {
+            if (session_thread_start(session_offload, st) != 0)
+                break;
+            return REACTOR_FORGET;
+        }
+        if (session_dispatch(st) == CALLBACK_RET_END_CONNECTION)
+            break;
     }
     /*Release the session attributes and close the connection*/
-    sclose(&(current->context), &(current->clt_fd));
-    free_attributes(current);
-    sem_post(&n_clients);
+    session_destroy(st);
+    return REACTOR_FORGET;
+}
+
+/**
+ * @brief Serve a blocking command outside the event loop and give the connection back to it
+ *
+ * @param args Session state, with the request already parsed
+ * @return void* NULL
+ */
+void *session_offload(void *args)
+{
+    session_state *st = (session_state *)args;
+    if (session_dispatch(st) == CALLBACK_RET_END_CONNECTION || end)
+        session_destroy(st);
+    /*What arrived in the meantime is served by the loop, a handshake of AUTH must not run in this thread*/
+    else
+        reactor_resume(st->item);
     return NULL;
 }
 
 /**
  * @brief Waits for information from the data connection thread
- * and possible new control requests, of which only abort requests will be accepted
+ * and possible new control requests, of which only abort requests are served, the rest wait for the end of the transfer.
+ * The thread sleeps in poll until one of them arrives
  * @param session Contains session information
- * @param server_conf Contains port semaphore in passive mode
+ * @param server_conf Contains the pool of passive ports
  * @param ri It is updated with the responses of the data thread
- * @param buf Buffer to receive data
+ * @param reader Commands received in the control connection
  */
-void data_callback_loop(session_info *session, request_info *ri, serverconf *server_conf, char *buf)
+void data_callback_loop(session_info *session, request_info *ri, serverconf *server_conf, command_reader *reader)
 {
-    if (session->data_connection->conn_state == DATA_CONN_CLOSED) /*A data connection must have been initiated with PORT OR PASV*/
-    {
-        ssend(session->context, session->clt_fd, CODE_503_BAD_SEQUENCE, sizeof(CODE_503_BAD_SEQUENCE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
-        return;
-    }
+    struct pollfd fds[2] = {{.fd = session->clt_fd, .events = POLLIN}, {.fd = session->data_connection->done_fd, .events = POLLIN}};
+    eventfd_t done;
+    ssize_t read_b;
     /*When this semaphore is advanced, the initial shipping code 150 will have been filled in the client*/
     sem_wait(&(session->data_connection->data_conn_sem));
-    /*We send the response code*/
-    ssend(session->context, session->clt_fd, ri->response, ri->response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    /*We send the response code, unless the data thread failed before the transfer: its error is the final response*/
+    if (ri->response[0] == '1')
+        ssend(session->context, session->clt_fd, ri->response, ri->response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
     /*Wait for the data thread to start transmitting*/
     sem_post(&(session->data_connection->control_conn_sem));
     sem_wait(&(session->data_connection->data_conn_sem));
     /*Wait for the data thread to finish transmitting*/
-    while (sem_trywait(&(session->data_connection->data_conn_sem)) == -1)
+    while (!(fds[1].revents & POLLIN))
     {
-        /*Check if a new request has arrived*/
-        ssize_t len = srecv(session->context, session->clt_fd, buf, XXXL_SZ + 1, MSG_DONTWAIT | MSG_NOSIGNAL);
-        if (len != -1)
-        {
-            /*If it is ABORT, we activate the abort flag (atomic)*/
-            if (len >= sizeof("ABORT") && !memcmp(buf, "ABORT", sizeof("ABORT") - 1))
-                session->data_connection->abort = 1;
-            /*Ignore all other requests*/
-            else
-                ssend(session->context, session->clt_fd, CODE_421_BUSY_DATA, sizeof(CODE_421_BUSY_DATA) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
-        }
+        /*Read all that has arrived, poll does not see what the TLS layer already holds*/
+        while ((read_b = command_reader_fill(reader, session->context, session->clt_fd, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0)
+            ;
+        /*Closed connection or full queue, nothing more is read until the transfer ends*/
+        if (!read_b || (errno != EAGAIN && errno != EWOULDBLOCK) || reader->len == COMMAND_READER_SIZE)
+            fds[0].fd = -1;
+        /*An ABOR activates the abort flag (atomic) even if other requests were queued before it*/
+        if (command_reader_take(reader, ABOR))
+            session->data_connection->abort = 1;
+        poll(fds, 2, -1);
+    }
+    eventfd_read(session->data_connection->done_fd, &done);
+    sem_wait(&(session->data_connection->data_conn_sem));
+    /*In block mode a transfer that ended well leaves the connection ready for the next one*/
+    if (session->block_mode && session->data_connection->reusable && !session->data_connection->abort)
+    {
+        release_passive_port(session->data_connection, &(server_conf->passive_ports)); /*No more clients are accepted*/
+        session->data_connection->conn_state = DATA_CONN_KEPT;
     }
     /*Close the data socket and let the main thread send the last response*/
-    sclose(&(session->data_connection->context), &(session->data_connection->conn_fd));
-    sclose(NULL, &(session->data_connection->socket_fd));
-    /*If it was transmit in passive mode, there is a new free passive port*/
-    if (session->data_connection->conn_state != DATA_CONN_CLOSED && session->data_connection->is_passive)
-        sem_post(&(server_conf->free_passive_ports));
-    session->data_connection->conn_state = DATA_CONN_CLOSED;
+    else
+        close_data_conn(session->data_connection, &(server_conf->passive_ports));
     /*Raise the abort flag*/
     session->data_connection->abort = 0;
     return;
@@ -343,11 +669,17 @@ void tls_start()
 {
     tls_init();
     server_conf.server_ctx = tls_create_context(1, TLS_V12);
-    if (!server_conf.server_ctx)
+    if (!server_conf.server_ctx || tls_set_version_range(server_conf.server_ctx, server_conf.tls_min_version, server_conf.tls_max_version) < 0)
         errexit("Fallo al crear contexto TLS\n");
     if (!load_keys(server_conf.server_ctx, server_conf.certificate_path, server_conf.private_key_path))
     {
         tls_destroy_context(server_conf.server_ctx);
         errexit("Fallo al cargar la clave privada y/o certificado\n");
     }
+    if (server_conf.ecdsa_cert_path[0] && !load_keys(server_conf.server_ctx, server_conf.ecdsa_cert_path, server_conf.ecdsa_key_path))
+    {
+        tls_destroy_context(server_conf.server_ctx);
+        errexit("Fallo al cargar el certificado ECDSA y/o su clave privada\n");
+    }
+    set_ktls_offload(server_conf.ktls_offload);
 }
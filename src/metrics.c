@@ -0,0 +1,302 @@
+/**
+ * @file metrics.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Lock-free counters and histograms of the server, exposed in Prometheus text format on a loopback port
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "metrics.h"
+#include "network.h"
+#include "ftp.h"
+#include "ftp_files.h"
+#include "worker_pool.h"
+#include "crypto_pool.h"
+
+#define METRICS_QUEUE 8   /*!< Pending scrapes*/
+#define METRICS_TIMEOUT 5 /*!< Seconds a scraper may take to send its request*/
+#define METRICS_HTTP_HEADER "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n" /*!< Header of the answer*/
+
+/**
+ * @brief Counters written by a group of threads, each thread always uses the same one.
+ * Aligned so that two shards never share a cache line
+ *
+ */
+typedef struct _metrics_shard
+{
+    uint64_t buckets[N_HISTS][METRICS_MAX_LABELS][METRICS_BUCKETS + 1]; /*!< Observations of each bucket, the last one has no upper bound*/
+    uint64_t sum_ns[N_HISTS][METRICS_MAX_LABELS];                       /*!< Sum of the observations*/
+    uint64_t bytes[METRICS_MAX_LABELS][2];                              /*!< Bytes in (0) and out (1) of each command*/
+} __attribute__((aligned(64))) metrics_shard;
+
+/**
+ * @brief Description of a histogram for the exposition
+ *
+ */
+typedef struct _metrics_hist_info
+{
+    const char *name;          /*!< Name of the metric*/
+    const char *help;          /*!< Description*/
+    const char *label;         /*!< Name of the label*/
+    const char *const *values; /*!< Name of each value of the label*/
+    int n_values;              /*!< Number of values*/
+} metrics_hist_info;
+
+#define C(x) #x, /*!< For each command, its name as a string and a comma*/
+static const char *const command_names[] = {IMPLEMENTED_COMMANDS}; /*!< Label of each command*/
+#undef C
+static const char *const handshake_names[] = {[HANDSHAKE_CONTROL] = "control", [HANDSHAKE_DATA] = "data"}; /*!< Label of each connection*/
+static const char *const list_names[] = {[LIST_FORMAT_LS] = "LIST", [LIST_FORMAT_MLSD] = "MLSD"};         /*!< Label of each listing format*/
+
+static const metrics_hist_info hists[N_HISTS] = {
+    [HIST_COMMAND] = {"ftps_command_duration_seconds", "Time to serve a command, transfer included", "command", command_names, IMP_COMMANDS_TOP},
+    [HIST_HANDSHAKE] = {"ftps_tls_handshake_duration_seconds", "Duration of the TLS handshakes", "connection", handshake_names, 2},
+    [HIST_LIST] = {"ftps_list_duration_seconds", "Time to read and send a directory listing", "format", list_names, 2},
+}; /*!< Histograms*/
+
+static const uint64_t bucket_ns[METRICS_BUCKETS] = {100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+                                                    50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000,
+                                                    5000000000, 10000000000}; /*!< Upper bound of each bucket, from 100 us to 10 s*/
+
+static metrics_shard shards[METRICS_SHARDS];        /*!< Counters*/
+static __thread metrics_shard *thread_shard = NULL; /*!< Shard of the calling thread*/
+static unsigned int next_shard = 0;                 /*!< Shard given to the next thread that needs one*/
+static long sessions_active = 0;                    /*!< Control sessions open*/
+static int metrics_fd = -1;                         /*!< Listening socket of the metrics*/
+static sem_t *session_slots = NULL;                 /*!< Free session slots*/
+static int session_max = 0;                         /*!< Maximum number of sessions*/
+static passive_pool *passive_ports = NULL;           /*!< Pool of passive ports*/
+
+/**
+ * @brief Nanoseconds of the monotonic clock, to measure durations
+ *
+ * @return uint64_t nanoseconds
+ */
+uint64_t metrics_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Shard of the calling thread, assigned in round robin the first time
+ *
+ * @return metrics_shard* Shard
+ */
+metrics_shard *metrics_shard_get()
+{
+    if (!thread_shard)
+        thread_shard = &shards[__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % METRICS_SHARDS];
+    return thread_shard;
+}
+
+/**
+ * @brief Add a duration to a histogram
+ *
+ * @param hist Histogram
+ * @param label Value of its label, less than METRICS_MAX_LABELS
+ * @param ns Duration in nanoseconds
+ */
+void metrics_observe(metric_hist hist, int label, uint64_t ns)
+{
+    metrics_shard *shard = metrics_shard_get();
+    int b = 0;
+    if (label < 0 || label >= METRICS_MAX_LABELS)
+        return;
+    while (b < METRICS_BUCKETS && ns > bucket_ns[b])
+        b++;
+    /*Several threads may share the shard, but never a lock*/
+    __atomic_fetch_add(&(shard->buckets[hist][label][b]), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(shard->sum_ns[hist][label]), ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count the bytes moved by the data connection of a command
+ *
+ * @param command Command, value of imp_commands
+ * @param in Bytes received from the client
+ * @param out Bytes sent to the client
+ */
+void metrics_bytes(int command, uint64_t in, uint64_t out)
+{
+    metrics_shard *shard = metrics_shard_get();
+    if (command < 0 || command >= METRICS_MAX_LABELS)
+        return;
+    __atomic_fetch_add(&(shard->bytes[command][0]), in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(shard->bytes[command][1]), out, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count a control session that is opened or closed
+ *
+ * @param delta 1 when it is opened, -1 when it is closed
+ */
+void metrics_session(int delta)
+{
+    __atomic_fetch_add(&sessions_active, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Write a histogram adding up every shard, only the label values that were observed
+ *
+ * @param f Destination
+ * @param hist Histogram
+ */
+void metrics_write_hist(FILE *f, metric_hist hist)
+{
+    const metrics_hist_info *info = &hists[hist];
+    uint64_t count, sum_ns, buckets[METRICS_BUCKETS + 1];
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+    for (int l = 0; l < info->n_values; l++)
+    {
+        memset(buckets, 0, sizeof(buckets));
+        sum_ns = 0;
+        for (int s = 0; s < METRICS_SHARDS; s++)
+        {
+            for (int b = 0; b <= METRICS_BUCKETS; b++)
+                buckets[b] += __atomic_load_n(&(shards[s].buckets[hist][l][b]), __ATOMIC_RELAXED);
+            sum_ns += __atomic_load_n(&(shards[s].sum_ns[hist][l]), __ATOMIC_RELAXED);
+        }
+        /*Prometheus buckets are cumulative*/
+        for (int b = 1; b <= METRICS_BUCKETS; b++)
+            buckets[b] += buckets[b - 1];
+        if (!(count = buckets[METRICS_BUCKETS]))
+            continue;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+            fprintf(f, "%s_bucket{%s=\"%s\",le=\"%g\"} %lu\n", info->name, info->label, info->values[l], bucket_ns[b] / 1e9, buckets[b]);
+        fprintf(f, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %lu\n", info->name, info->label, info->values[l], count);
+        fprintf(f, "%s_sum{%s=\"%s\"} %.9f\n", info->name, info->label, info->values[l], sum_ns / 1e9);
+        fprintf(f, "%s_count{%s=\"%s\"} %lu\n", info->name, info->label, info->values[l], count);
+    }
+}
+
+/**
+ * @brief Write every metric in Prometheus text exposition format
+ *
+ * @param f Destination
+ */
+void metrics_write(FILE *f)
+{
+    int value;
+    pool_stats pool;
+    crypto_stats crypto;
+    unsigned long hits, misses;
+    unsigned int ready;
+    const char *curve;
+    uint64_t bytes[2];
+
+    fprintf(f, "# HELP ftps_sessions_active Control sessions open\n# TYPE ftps_sessions_active gauge\nftps_sessions_active %ld\n",
+            __atomic_load_n(&sessions_active, __ATOMIC_RELAXED));
+    fprintf(f, "# HELP ftps_sessions_max Maximum concurrent sessions\n# TYPE ftps_sessions_max gauge\nftps_sessions_max %d\n", session_max);
+    if (session_slots && !sem_getvalue(session_slots, &value))
+        fprintf(f, "# HELP ftps_session_slots_free Sessions that can still be accepted\n# TYPE ftps_session_slots_free gauge\nftps_session_slots_free %d\n", value);
+    if (passive_ports)
+        fprintf(f, "# HELP ftps_passive_ports_free Passive ports free in the pool\n# TYPE ftps_passive_ports_free gauge\nftps_passive_ports_free %d\n", passive_pool_free(passive_ports));
+
+    worker_pool_stats(&pool);
+    fprintf(f, "# HELP ftps_transfer_workers Workers that serve the data transfers\n# TYPE ftps_transfer_workers gauge\nftps_transfer_workers %d\n", pool.workers);
+    fprintf(f, "# HELP ftps_transfer_workers_busy Workers executing a transfer\n# TYPE ftps_transfer_workers_busy gauge\nftps_transfer_workers_busy %ld\n", pool.busy);
+    fprintf(f, "# HELP ftps_transfers_queued Transfers waiting for a worker\n# TYPE ftps_transfers_queued gauge\nftps_transfers_queued %ld\n", pool.queued);
+    fprintf(f, "# HELP ftps_transfers_started_total Transfers taken by a worker\n# TYPE ftps_transfers_started_total counter\nftps_transfers_started_total %lu\n", pool.completed);
+    fprintf(f, "# HELP ftps_transfers_stolen_total Transfers taken from the queue of another worker\n# TYPE ftps_transfers_stolen_total counter\nftps_transfers_stolen_total %lu\n", pool.stolen);
+
+    crypto_pool_stats(&crypto);
+    if (crypto.workers)
+    {
+        fprintf(f, "# HELP ftps_crypto_workers Workers that compute the signatures of the handshakes\n# TYPE ftps_crypto_workers gauge\nftps_crypto_workers %d\n", crypto.workers);
+        fprintf(f, "# HELP ftps_crypto_signatures_queued Signatures waiting for a crypto worker\n# TYPE ftps_crypto_signatures_queued gauge\nftps_crypto_signatures_queued %ld\n", crypto.queued);
+        fprintf(f, "# HELP ftps_crypto_signatures_total Signatures computed by the crypto workers\n# TYPE ftps_crypto_signatures_total counter\nftps_crypto_signatures_total %lu\n", crypto.signatures);
+        fprintf(f, "# HELP ftps_crypto_batches_total Batches of signatures taken from the queue\n# TYPE ftps_crypto_batches_total counter\nftps_crypto_batches_total %lu\n", crypto.batches);
+    }
+
+    tls_resumption_stats(&hits, &misses);
+    fprintf(f, "# HELP ftps_tls_resumptions_total Data handshakes that could resume the control session\n# TYPE ftps_tls_resumptions_total counter\n");
+    fprintf(f, "ftps_tls_resumptions_total{result=\"hit\"} %lu\nftps_tls_resumptions_total{result=\"miss\"} %lu\n", hits, misses);
+
+    if (tls_keyshare_pool_stats(0, NULL, NULL, NULL, NULL))
+    {
+        fprintf(f, "# HELP ftps_tls_keyshare_pool_ready Ephemeral key pairs ready for the handshakes by curve\n# TYPE ftps_tls_keyshare_pool_ready gauge\n");
+        for (unsigned int i = 0; tls_keyshare_pool_stats(i, &curve, &ready, &hits, &misses); i++)
+            fprintf(f, "ftps_tls_keyshare_pool_ready{curve=\"%s\"} %u\n", curve, ready);
+        fprintf(f, "# HELP ftps_tls_keyshare_pool_total Handshakes that took a ready key pair or found the pool empty\n# TYPE ftps_tls_keyshare_pool_total counter\n");
+        for (unsigned int i = 0; tls_keyshare_pool_stats(i, &curve, &ready, &hits, &misses); i++)
+            fprintf(f, "ftps_tls_keyshare_pool_total{curve=\"%s\",result=\"hit\"} %lu\nftps_tls_keyshare_pool_total{curve=\"%s\",result=\"exhausted\"} %lu\n", curve, hits, curve, misses);
+    }
+
+    fprintf(f, "# HELP ftps_data_bytes_total Bytes of the data connections by command\n# TYPE ftps_data_bytes_total counter\n");
+    for (int c = 0; c < IMP_COMMANDS_TOP; c++)
+    {
+        bytes[0] = bytes[1] = 0;
+        for (int s = 0; s < METRICS_SHARDS; s++)
+            for (int d = 0; d < 2; d++)
+                bytes[d] += __atomic_load_n(&(shards[s].bytes[c][d]), __ATOMIC_RELAXED);
+        if (bytes[0] || bytes[1])
+            fprintf(f, "ftps_data_bytes_total{command=\"%s\",direction=\"in\"} %lu\nftps_data_bytes_total{command=\"%s\",direction=\"out\"} %lu\n",
+                    command_names[c], bytes[0], command_names[c], bytes[1]);
+    }
+    for (metric_hist h = 0; h < N_HISTS; h++)
+        metrics_write_hist(f, h);
+}
+
+/**
+ * @brief Answer every connection to the metrics port with the current metrics
+ *
+ * @param args Not used
+ * @return void* NULL
+ */
+void *metrics_serve(void *args)
+{
+    int conn_fd;
+    char request[XL_SZ], *body;
+    size_t body_len;
+    FILE *f;
+    while (1)
+    {
+        if ((conn_fd = accept(metrics_fd, NULL, NULL)) < 0)
+            continue;
+        set_socket_timeouts(conn_fd, METRICS_TIMEOUT);
+        recv(conn_fd, request, XL_SZ, 0); /*Any path gets the metrics, the request is not parsed*/
+        if ((f = open_memstream(&body, &body_len)))
+        {
+            metrics_write(f);
+            fclose(f);
+            dprintf(conn_fd, METRICS_HTTP_HEADER, body_len);
+            send(conn_fd, body, body_len, MSG_NOSIGNAL);
+            free(body);
+        }
+        close(conn_fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Serve the metrics over HTTP on METRICS_IP from a thread of its own
+ *
+ * @param port Port, the metrics are not served if it is 0
+ * @param sessions Free session slots
+ * @param max_sessions Maximum number of sessions
+ * @param pasv_pool Pool of passive ports
+ * @return int less than 0 on error
+ */
+int metrics_start(int port, sem_t *sessions, int max_sessions, passive_pool *pasv_pool)
+{
+    pthread_t thread;
+    session_slots = sessions;
+    session_max = max_sessions;
+    passive_ports = pasv_pool;
+    if (!port)
+        return 1;
+    if ((metrics_fd = socket_srv(TCP, METRICS_QUEUE, port, METRICS_IP)) < 0)
+        return -1;
+    if (pthread_create(&thread, NULL, metrics_serve, NULL) != 0)
+    {
+        close(metrics_fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 1;
+}
@@ -11,6 +11,14 @@
 #include <syslog.h>
 #include <ctype.h>
 #include "network.h"
+#include "metrics.h"
+
+#define TLS_ALERT_RECORD 21 /*!< TLS record type of the alerts*/
+
+static int ktls_offload = 0;                /*!< Data connections may be handed to kernel TLS*/
+static unsigned long resumption_hits = 0;   /*!< Data handshakes that resumed the control session*/
+static unsigned long resumption_misses = 0; /*!< Data handshakes that could have resumed it but did not*/
+static time_t last_resumption_report = 0;   /*!< Last time the resumption counters were written to the log*/
 
 /**
  * @brief Read contents of a file into a buffer
@@ -32,7 +40,8 @@ int read_from_file(const char *fname, char *buf, int max_len)
 }
 
 /**
- * @brief Load key and certificate from server to context
+ * @brief Load key and certificate from server to context, RSA or ECDSA. Called once for each type,
+ * the context keeps both and each handshake uses the one the client accepts
  * https://github.com/eduardsui/tlse
  * @param context TLS context
  * @param fname Name of the pem file with certificate
@@ -46,7 +55,7 @@ int load_keys(struct TLSContext *context, char *fname, char *priv_fname)
     char buf2[0xFFFF];
     int size = read_from_file(fname, buf, 0xFFFF);        /*Read the certificate*/
     int size2 = read_from_file(priv_fname, buf2, 0xFFFF); /*read private key*/
-    if (size > 0 && context)
+    if (size > 0 && size2 > 0 && context)
     {
         return tls_load_certificates(context, (unsigned char *)buf, size) > 0      /*Load certificate*/
                && tls_load_private_key(context, (unsigned char *)buf2, size2) > 0; /*Load private key*/
@@ -55,43 +64,113 @@ int load_keys(struct TLSContext *context, char *fname, char *priv_fname)
 }
 
 /**
- * @brief Send bytes of TLS protocol that are pending to be sent
+ * @brief Wait until a socket can be written, up to its send timeout
+ *
+ * @param sock Socket
+ * @return int Greater than 0 if it can be written, less than 0 on error or timeout
+ */
+int wait_writable(int sock)
+{
+    struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+    struct timeval timeout = {0};
+    socklen_t len = sizeof(timeout);
+    int ms = TLS_SEND_TIMEOUT * 1000, ret;
+    /*The same limit that a blocking send would have*/
+    if (!getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, &len) && (timeout.tv_sec || timeout.tv_usec))
+        ms = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+    while ((ret = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+        ;
+    if (!ret)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (ret > 0 && (pfd.revents & (POLLERR | POLLHUP)))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+    return ret;
+}
+
+/**
+ * @brief Send part of a buffer, waiting for room if the socket buffer is full
+ *
+ * @param sock Socket
+ * @param buf Bytes to send
+ * @param len Size of buf
+ * @param flags send flags
+ * @return ssize_t Bytes sent, less than 0 on error
+ */
+ssize_t send_retry(int sock, const void *buf, size_t len, int flags)
+{
+    ssize_t sent;
+    while ((sent = send(sock, buf, len, flags | MSG_DONTWAIT)) < 0)
+        if (errno != EINTR && ((errno != EAGAIN && errno != EWOULDBLOCK) || wait_writable(sock) < 0))
+            return -1;
+    return sent;
+}
+
+/**
+ * @brief Send bytes of TLS protocol that are pending to be sent.
+ * The socket may be nonblocking: a partial send leaves the rest queued in the context and waits for room
  * https://github.com/eduardsui/tlse
  * @param client_sock Socket to send to
  * @param context TLS context
- * @return int Error if less than 0
+ * @return int Bytes sent, less than 0 on error (the bytes not sent stay queued)
  */
 int send_pending(int client_sock, struct TLSContext *context)
 {
     unsigned int out_buffer_len = 0;
-    const unsigned char *out_buffer = tls_get_write_buffer(context, &out_buffer_len); /*TLS bytes pending to be sent*/
-    int send_res = 0;
-    /*Normally send the bytes through the socket*/
-    send_res = send(client_sock, (char *)out_buffer, out_buffer_len, MSG_NOSIGNAL);
-    tls_buffer_clear(context);
-    return send_res;
+    const unsigned char *out_buffer;
+    ssize_t sent;
+    int total = 0;
+    /*Only what the kernel accepted leaves the queue, so the stream is never cut*/
+    while ((out_buffer = tls_get_write_buffer(context, &out_buffer_len)) && out_buffer_len)
+    {
+        if ((sent = send_retry(client_sock, out_buffer, out_buffer_len, MSG_NOSIGNAL)) < 0)
+            return -1;
+        tls_buffer_shift(context, sent);
+        total += sent;
+    }
+    return total;
 }
 
 /**
- * @brief Digest a tls message from the socket
+ * @brief Digest a tls message from the socket, received straight into the buffer of the connection
  *
  * @param tls_context TLS context
  * @param conn_fd connection descriptor
- * @param buffer destination buffer
- * @param buf_len maximum buffer size
  * @param flags associated recv flags
- * @return int bytes read or less than 0 if error
+ * @return int bytes read or less than 0 if error (errno EPROTO if the records are not valid)
  */
-int digest_tls(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags)
+int digest_tls(struct TLSContext *tls_context, int conn_fd, int flags)
 {
+    unsigned int room;
+    unsigned char *buf = tls_stream_buffer(tls_context, &room);
     ssize_t read_b;
-    if ((read_b = recv(conn_fd, buf, buf_len, flags)) > 0)
+    int recv_errno;
+    if (!buf)
     {
-        if (tls_consume_stream(tls_context, (unsigned char *)buf, read_b, NULL) < 0)
-            return -1;
-        if (send_pending(conn_fd, tls_context) < 0)
-            return -1;
+        errno = EPROTO;
+        return -1;
+    }
+    if ((read_b = recv(conn_fd, buf, room, flags)) <= 0)
+    {
+        /*Nothing arrived, an empty buffer goes back to the context*/
+        recv_errno = errno;
+        tls_consume_stream_buffer(tls_context, 0, NULL);
+        errno = recv_errno;
+        return read_b;
     }
+    if (tls_consume_stream_buffer(tls_context, read_b, NULL) < 0)
+    {
+        send_pending(conn_fd, tls_context); /*The alert tells the other end why, such as a version out of range*/
+        errno = EPROTO;
+        return -1;
+    }
+    if (send_pending(conn_fd, tls_context) < 0)
+        return -1;
     return read_b;
 }
 
@@ -104,35 +183,160 @@ int digest_tls(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t b
  * @param buf_len maximum buffer size
  * @param flags recv flags
  * @return int Greater than 0 if bytes read, 0 if TLS connection lost, -1 if error
+ * (errno EAGAIN with MSG_DONTWAIT if no complete record has arrived yet)
  */
 int srecv(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags)
 {
     if (!tls_context)
         return recv(conn_fd, buf, buf_len, flags);
-    char buf2[buf_len];
-    if (digest_tls(tls_context, conn_fd, buf2, buf_len, flags) < 0) /*Get TLS message and fill structure fields*/
-        return -1;
-    if (tls_established(tls_context))                                /*Correct TLS connection status*/
-        return tls_read(tls_context, (unsigned char *)buf, buf_len); /*Read to a decrypting buffer*/
-    return 0;
+    ssize_t read_b;
+    int ret;
+    /*Data already decrypted by a previous call*/
+    if (tls_established(tls_context) && (ret = tls_read(tls_context, (unsigned char *)buf, buf_len)) > 0)
+        return ret;
+    do
+    {
+        if ((read_b = digest_tls(tls_context, conn_fd, flags)) < 0) /*Get TLS message and fill structure fields*/
+            return -1;
+        if (!tls_established(tls_context)) /*Incorrect TLS connection status*/
+            return 0;
+        if ((ret = tls_read(tls_context, (unsigned char *)buf, buf_len)) > 0 || !read_b) /*Read to a decrypting buffer*/
+            return ret;
+        /*Only part of a record has arrived, wait for the rest unless the call must not block*/
+    } while (!(flags & MSG_DONTWAIT));
+    errno = EAGAIN;
+    return -1;
 }
 
 /**
- * @brief Securely sends the contents of a buffer
+ * @brief Securely receive exactly buf_len bytes, waiting for as many records as needed
+ *
+ * @param tls_context TLS context, NULL if the connection is not encrypted in user space
+ * @param conn_fd Connection descriptor
+ * @param buf destination buffer
+ * @param buf_len Bytes to receive
+ * @param flags recv flags
+ * @return int buf_len if all of them were received, less if the connection was closed or failed first
+ */
+int srecv_all(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags)
+{
+    ssize_t total, read_b;
+    for (total = 0; total < buf_len; total += read_b)
+        if ((read_b = srecv(tls_context, conn_fd, &buf[total], buf_len - total, flags)) <= 0)
+            break;
+    return total;
+}
+
+/**
+ * @brief Securely sends the contents of a buffer, waiting for room in the socket when it is full.
+ * At most TLS_QUEUE_MAX encrypted bytes are queued in the connection at once, and none while the
+ * records are still growing (see tls_record_size) so that the first bytes of a transfer leave right away
  *
  * @param tls_context TLS context
  * @param conn_fd Connection descriptor
  * @param buf Buffer to send
  * @param buf_len Buffer size
  * @param flags send flags
+ * @return int Bytes sent (before encryption), less than 0 on error
  */
 int ssend(struct TLSContext *tls_context, int conn_fd, char *buf, ssize_t buf_len, int flags)
 {
+    ssize_t written, total;
+    unsigned int queued;
+    /*Without TLS the buffer is sent as it is, even if it takes several sends*/
     if (!tls_context)
-        return send(conn_fd, buf, buf_len, flags);
-    if (tls_write(tls_context, (unsigned char *)buf, buf_len) < 0)
+    {
+        for (total = 0; total < buf_len; total += written)
+            if ((written = send_retry(conn_fd, &buf[total], buf_len - total, flags)) < 0)
+                return -1;
+        return buf_len;
+    }
+    /*tls_write encrypts at most one record on each call, of tls_record_size bytes*/
+    for (total = 0; total < buf_len; total += written)
+    {
+        if ((written = tls_write(tls_context, (unsigned char *)&buf[total], buf_len - total)) <= 0)
+            return -1;
+        /*Bound the ciphertext queued in the connection, small records are sent one by one*/
+        if (tls_get_write_buffer(tls_context, &queued) && (queued >= TLS_QUEUE_MAX || tls_record_size(tls_context) > (unsigned int)written) &&
+            send_pending(conn_fd, tls_context) < 0)
+            return -1;
+    }
+    if (send_pending(conn_fd, tls_context) < 0)
         return -1;
-    return send_pending(conn_fd, tls_context);
+    return buf_len;
+}
+
+/**
+ * @brief Allow data connections to be handed to kernel TLS
+ *
+ * @param enabled 0 to always encrypt in user space
+ */
+void set_ktls_offload(int enabled)
+{
+    ktls_offload = enabled;
+}
+
+/**
+ * @brief Hand the encryption of an established connection to the kernel, so that
+ * plain send and sendfile can be used on the socket from now on
+ *
+ * @param tls_context TLS context of the connection, its keys must be exportable
+ * @param conn_fd Connection descriptor
+ * @return int 1 if the kernel encrypts the connection, 0 if it must keep using tlse
+ */
+int ktls_enable(struct TLSContext *tls_context, int conn_fd)
+{
+    int ret;
+    /*Records already read by tlse would be lost for the kernel*/
+    if (!ktls_offload || !tls_context || tls_pending(tls_context))
+        return 0;
+    /*tlse only describes AES-128-GCM over TLS 1.2 to the kernel, other ciphers are rejected here*/
+    if ((ret = tls_make_ktls(tls_context, conn_fd)))
+    {
+        flog(LOG_DEBUG, "kTLS no disponible con %s, se cifra en espacio de usuario: %s\n", tls_cipher_name(tls_context),
+             ret == TLS_FEATURE_NOT_SUPPORTED ? "cifrado no soportado" : strerror(errno));
+        return 0;
+    }
+    /*The kernel has its own copy of the keys*/
+    tls_make_exportable(tls_context, 0);
+    return 1;
+}
+
+/**
+ * @brief Send a close notify through a connection encrypted by the kernel
+ *
+ * @param conn_fd Connection descriptor
+ * @return int 1 if the connection was in kernel TLS, 0 otherwise
+ */
+int ktls_close_notify(int conn_fd)
+{
+    char alert[] = {TLS_ALERT_WARNING, close_notify};
+    char cbuf[CMSG_SPACE(sizeof(unsigned char))] = {0};
+    struct iovec iov = {.iov_base = alert, .iov_len = sizeof(alert)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!ktls_offload || !ktls_active(conn_fd))
+        return 0;
+    /*Non data records are sent with their type in a control message*/
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = TLS_ALERT_RECORD;
+    sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+    return 1;
+}
+
+/**
+ * @brief Check if the kernel encrypts the output of a connection
+ *
+ * @param conn_fd Connection descriptor
+ * @return int 1 if it does
+ */
+int ktls_active(int conn_fd)
+{
+    struct tls12_crypto_info_aes_gcm_128 crypto_info;
+    socklen_t size = sizeof(crypto_info);
+    return !getsockopt(conn_fd, SOL_TLS, TLS_TX, &crypto_info, &size);
 }
 
 /**
@@ -148,8 +352,12 @@ int sclose(struct TLSContext **tls_context, int *fd)
         return -1;
     if (tls_context && *tls_context) /*If it is connection closure*/
     {
-        tls_close_notify(*tls_context);
-        send_pending(*fd, *tls_context);
+        /*Once the kernel owns the keys, the alert must be encrypted by it*/
+        if (!ktls_close_notify(*fd))
+        {
+            tls_close_notify(*tls_context);
+            send_pending(*fd, *tls_context);
+        }
         tls_destroy_context(*tls_context);
         *tls_context = NULL;
     }
@@ -159,25 +367,128 @@ int sclose(struct TLSContext **tls_context, int *fd)
 }
 
 /**
- * @brief Handshake TLS
+ * @brief Count a data handshake that could resume the control session, writing the counters
+ * to the log at most once every RESUMPTION_REPORT_INTERVAL
+ *
+ * @param resumed 1 if the session was resumed
+ */
+void count_resumption(int resumed)
+{
+    unsigned long hits, misses;
+    time_t now = time(NULL), last = __atomic_load_n(&last_resumption_report, __ATOMIC_RELAXED);
+    __atomic_fetch_add(resumed ? &resumption_hits : &resumption_misses, 1, __ATOMIC_RELAXED);
+    if (now - last < RESUMPTION_REPORT_INTERVAL || !__atomic_compare_exchange_n(&last_resumption_report, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    tls_resumption_stats(&hits, &misses);
+    flog(LOG_INFO, "Reanudacion de sesiones TLS en datos: %lu aciertos, %lu fallos (%.1f%% de aciertos)\n",
+         hits, misses, 100.0 * hits / (hits + misses));
+}
+
+/**
+ * @brief Counters of resumption of the control session by the data connections
+ *
+ * @param hits Where to store the handshakes that resumed it
+ * @param misses Where to store the full handshakes that could have resumed it
+ */
+void tls_resumption_stats(unsigned long *hits, unsigned long *misses)
+{
+    *hits = __atomic_load_n(&resumption_hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&resumption_misses, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Start a server handshake on a connection, no byte is read yet
+ *
+ * @param hs Handshake to fill
+ * @param gen_context General TLS context
+ * @param conn_fd Connection descriptor
+ * @param timeout Seconds to complete the handshake
+ * @return int less than 0 on error
+ */
+int tls_handshake_start(handshake_state *hs, struct TLSContext *gen_context, int conn_fd, int timeout)
+{
+    hs->fd = conn_fd;
+    hs->context = NULL;
+    hs->start = metrics_clock();
+    hs->deadline = hs->start + (uint64_t)timeout * 1000000000;
+    if (conn_fd < 0 || !(hs->context = tls_accept(gen_context))) /*Create a new context for the session*/
+        return -1;
+    tls_request_client_certificate(hs->context); /*We need client certificate*/
+    return 1;
+}
+
+/**
+ * @brief Advance a handshake with the bytes available in the socket, without blocking
+ *
+ * @param hs Handshake
+ * @return handshake_status HANDSHAKE_WANT_READ while the client has not sent everything
+ */
+handshake_status tls_handshake_step(handshake_state *hs)
+{
+    ssize_t read_b;
+    /*As many flights as the client sends, a fragmented handshake just takes more steps*/
+    while (tls_established(hs->context) == 0)
+    {
+        if ((read_b = digest_tls(hs->context, hs->fd, MSG_DONTWAIT)) > 0)
+            continue;
+        if (!read_b || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+            return HANDSHAKE_FAILED;
+        else if (errno != EINTR)
+            return (metrics_clock() < hs->deadline) ? HANDSHAKE_WANT_READ : HANDSHAKE_FAILED;
+    }
+    return (tls_established(hs->context) > 0) ? HANDSHAKE_DONE : HANDSHAKE_FAILED;
+}
+
+/**
+ * @brief Advance a handshake until it ends, waiting for the client at most until its deadline
+ *
+ * @param hs Handshake
+ * @return handshake_status HANDSHAKE_DONE or HANDSHAKE_FAILED
+ */
+handshake_status tls_handshake_run(handshake_state *hs)
+{
+    struct pollfd pfd = {.fd = hs->fd, .events = POLLIN};
+    handshake_status status;
+    uint64_t now;
+    while ((status = tls_handshake_step(hs)) == HANDSHAKE_WANT_READ)
+    {
+        /*The deadline bounds the whole handshake, not each read*/
+        if ((now = metrics_clock()) >= hs->deadline || (poll(&pfd, 1, (hs->deadline - now) / 1000000 + 1) < 0 && errno != EINTR))
+            return HANDSHAKE_FAILED;
+    }
+    return status;
+}
+
+/**
+ * @brief Handshake TLS of a data connection
  *
  * @param gen_context General TLS context
  * @param context TLS context to fill for the session
  * @param expected_pkey If not NULL, check that the public key of the certificate matches a certain one
  * @param conn_fd Connection created
- * @return int 1 if everything ok, 0 if client certificate failed, -1 if connection failed
+ * @param control_ctx If not NULL, established session the client may resume instead of a full handshake
+ * @return int 1 if everything ok, 0 if the handshake or the client certificate failed, -1 if there is no connection
  */
-int tls_handshake(struct TLSContext *gen_context, struct TLSContext **context, char *expected_pkey, int conn_fd)
+int tls_handshake(struct TLSContext *gen_context, struct TLSContext **context, char *expected_pkey, int conn_fd, struct TLSContext *control_ctx)
 {
-    char buf[XXXL_SZ];
-    if (conn_fd < 0)
+    handshake_state hs;
+    int resumable;
+    handshake_status status;
+    int started = tls_handshake_start(&hs, gen_context, conn_fd, TLS_HANDSHAKE_TIMEOUT);
+    *context = hs.context;
+    if (started < 0)
         return -1;
-    *context = tls_accept(gen_context); /*Create a new context for the session*/
-    if (!*context)
-        return -1;
-    tls_request_client_certificate(*context);                             /*We need client certificate*/
-    digest_tls(*context, conn_fd, buf, XXXL_SZ, MSG_NOSIGNAL);            /*Send certificate request to client*/
-    digest_tls(*context, conn_fd, buf, XXXL_SZ, MSG_NOSIGNAL);            /*Receive client certificate*/
+    tls_make_exportable(*context, ktls_offload);                   /*Keep the keys in case the kernel takes the connection*/
+    resumable = !tls_set_resumable_session(*context, control_ctx); /*RFC 4217 clients reuse the control session*/
+    status = tls_handshake_run(&hs);
+    if (resumable)
+        count_resumption(tls_session_resumed(*context));
+    metrics_observe(HIST_HANDSHAKE, HANDSHAKE_DATA, metrics_clock() - hs.start);
+    if (status != HANDSHAKE_DONE) /*Someone else may be next in the queue of the socket*/
+        return 0;
+    /*The resumed session was already authenticated with the certificate of the control connection*/
+    if (tls_session_resumed(*context))
+        return 1;
     return tls_context_check_client_certificate(expected_pkey, *context); /*Check correct certificate*/
 }
 
@@ -189,9 +500,10 @@ int tls_handshake(struct TLSContext *gen_context, struct TLSContext **context, c
  * @param sock_fd Listening socket
  * @param expected_pkey If not NULL, verify that the client certificate has a given public key
  * for use in the TLS connection, if not, reject the request
+ * @param control_ctx If not NULL, session of the control connection that the client may resume
  * @return int fd of the connection or -1 if error
  */
-int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext **context, int sock_fd, char *expected_pkey)
+int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext **context, int sock_fd, char *expected_pkey, struct TLSContext *control_ctx)
 {
     int conn_fd = -1, ret;
     do
@@ -203,7 +515,7 @@ int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext *
             close(conn_fd);
         }
         conn_fd = accept(sock_fd, NULL, 0);
-        ret = tls_handshake(gen_context, context, expected_pkey, conn_fd);
+        ret = tls_handshake(gen_context, context, expected_pkey, conn_fd, control_ctx);
         /*Do not accept certificate if the public key is not the expected one*/
     } while (!ret);
     if (ret < 0)
@@ -221,9 +533,10 @@ int tls_accept_and_handshake(struct TLSContext *gen_context, struct TLSContext *
  * @param clt_port Client port
  * @param srv_ip Server IP
  * @param clt_ip Client IP
+ * @param control_ctx If not NULL, session of the control connection that the client may resume
  * @return int 1 if all ok, -1 if error
  */
-int connect_and_handshake(struct TLSContext *gen_ctx, struct TLSContext **ctx, char *expected_pkey, int port, int clt_port, char *srv_ip, char *clt_ip)
+int connect_and_handshake(struct TLSContext *gen_ctx, struct TLSContext **ctx, char *expected_pkey, int port, int clt_port, char *srv_ip, char *clt_ip, struct TLSContext *control_ctx)
 {
     int conn_fd = -1, ret;
     do
@@ -235,7 +548,7 @@ int connect_and_handshake(struct TLSContext *gen_ctx, struct TLSContext **ctx, c
             close(conn_fd);
         }
         conn_fd = socket_clt_connection(clt_port, clt_ip, port, srv_ip); /*Connect to the server*/
-        ret = tls_handshake(gen_ctx, ctx, expected_pkey, conn_fd);
+        ret = tls_handshake(gen_ctx, ctx, expected_pkey, conn_fd, control_ctx);
         /*Do not accept certificate if the public key is not the expected one*/
     } while (!ret);
     if (ret < 0)
@@ -259,6 +572,97 @@ int set_socket_timeouts(int socket_fd, int seconds)
                setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout)));
 }
 
+/**
+ * @brief Parse a comma separated list of IPv4 networks, e.g. "10.0.0.0/8, 192.168.1.7"
+ *
+ * @param list List of networks, a single address is a /32 network
+ * @param nets Where to store the networks
+ * @param max_nets Maximum number of networks
+ * @return int Number of networks or -1 if the list is not valid
+ */
+int parse_networks(char *list, ip_network *nets, int max_nets)
+{
+    char *copy = strcpy(alloca(strlen(list) + 1), list), *save, *net, *prefix;
+    struct in_addr addr;
+    int n_nets = 0, bits;
+    for (net = strtok_r(copy, ", ", &save); net; net = strtok_r(NULL, ", ", &save))
+    {
+        bits = 32;
+        if ((prefix = strchr(net, '/')))
+        {
+            *(prefix++) = '\0';
+            if (!*prefix || !is_number(prefix, strlen(prefix)) || (bits = atoi(prefix)) > 32)
+                return -1;
+        }
+        if (n_nets == max_nets || !inet_aton(net, &addr))
+            return -1;
+        /*Shifting 32 bits is undefined*/
+        nets[n_nets].mask = bits ? htonl(0xFFFFFFFFu << (32 - bits)) : 0;
+        nets[n_nets].addr = addr.s_addr & nets[n_nets].mask;
+        n_nets++;
+    }
+    return n_nets;
+}
+
+/**
+ * @brief Check whether the other end of a connection belongs to one of the networks
+ *
+ * @param conn_fd Socket descriptor
+ * @param nets Networks
+ * @param n_nets Number of networks
+ * @return int 1 if it belongs, 0 if not
+ */
+int peer_in_networks(int conn_fd, ip_network *nets, int n_nets)
+{
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    if (getpeername(conn_fd, (struct sockaddr *)&peer, &len) < 0 || peer.sin_family != AF_INET)
+        return 0;
+    for (int i = 0; i < n_nets; i++)
+        if ((peer.sin_addr.s_addr & nets[i].mask) == nets[i].addr)
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief Accept a connection without encryption, rejecting those that do not come from
+ * the same host as the control connection
+ *
+ * @param sock_fd Listening socket
+ * @param control_fd Socket of the control connection
+ * @return int Connection descriptor, less than 0 on error
+ */
+int accept_same_peer(int sock_fd, int control_fd)
+{
+    struct sockaddr_in control, peer;
+    socklen_t len = sizeof(control);
+    int conn_fd;
+    if (getpeername(control_fd, (struct sockaddr *)&control, &len) < 0)
+        return -1;
+    /*Without TLS there is no certificate to tell the client apart from anyone else*/
+    while ((conn_fd = accept(sock_fd, (struct sockaddr *)&peer, (len = sizeof(peer), &len))) >= 0 &&
+           peer.sin_addr.s_addr != control.sin_addr.s_addr)
+        close(conn_fd);
+    return conn_fd;
+}
+
+/**
+ * @brief Check whether the other end of a connection has the given IPv4 address
+ *
+ * @param conn_fd Socket descriptor
+ * @param ip Address in dotted notation
+ * @return int 1 if it has it, 0 if not
+ */
+int peer_is_ip(int conn_fd, char *ip)
+{
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    struct in_addr addr;
+    if (!inet_aton(ip, &addr) || getpeername(conn_fd, (struct sockaddr *)&peer, &len) < 0 || peer.sin_family != AF_INET)
+        return 0;
+    return peer.sin_addr.s_addr == addr.s_addr;
+}
+
 int socket_proto(const char *proto_transp, struct sockaddr_in *sock_info, int puerto, char *ip);
 
 /**
@@ -288,12 +692,56 @@ int socket_srv(const char *proto_transp, int qlen, int puerto, char *ip_srv)
 
     /*We bind the socket to the information we have filled*/
     if (bind(socket_fd, (struct sockaddr *)&sock_info, sizeof(sock_info)) < 0)
+    {
+        close(socket_fd);
         return -2;
+    }
 
     /*If the socket is not udp, the listen is not needed; we try to do it with CdE*/
     if ((!proto_transp || !strcmp(proto_transp, TCP)) && listen(socket_fd, qlen) < 0)
+    {
+        close(socket_fd);
         return -3;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * @brief Create a listening TCP socket of the control port. Several of them can be bound to the same port
+ * with SO_REUSEPORT, and the kernel spreads the new connections among them
+ *
+ * @param qlen Connections queued in the socket
+ * @param puerto Port number where the socket will be opened
+ * @param ip_srv IP of the server
+ * @param reuse_port Share the port with other sockets of the same user
+ * @param defer_accept Seconds TCP_DEFER_ACCEPT waits for the first data of a client before it can be accepted, 0 to disable
+ * @return int file descriptor of the socket, less than 0 on error
+ */
+int socket_srv_shard(int qlen, int puerto, char *ip_srv, int reuse_port, int defer_accept)
+{
+    struct sockaddr_in sock_info;
+    int socket_fd;
 
+    if ((socket_fd = socket_proto(TCP, &sock_info, puerto, ip_srv)) < 0)
+        return socket_fd;
+    /*Both options must be set before the bind and the listen*/
+    if ((reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) ||
+        (defer_accept && setsockopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(int)) < 0))
+    {
+        close(socket_fd);
+        return -2;
+    }
+    if (bind(socket_fd, (struct sockaddr *)&sock_info, sizeof(sock_info)) < 0)
+    {
+        close(socket_fd);
+        return -2;
+    }
+    if (listen(socket_fd, qlen) < 0)
+    {
+        close(socket_fd);
+        return -3;
+    }
     return socket_fd;
 }
 
@@ -0,0 +1,152 @@
+/**
+ * @file passive_pool.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Pool of listening sockets bound at startup and handed out to PASV through a lock-free free list
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <poll.h>
+#include "passive_pool.h"
+#include "network.h"
+#include "ftp_files.h"
+
+#define HEAD_INDEX(head) ((uint32_t)(head))                                    /*!< Index + 1 of the first free port*/
+#define HEAD_NEXT(head, index) ((((head) >> 32) + 1) << 32 | (uint64_t)(index)) /*!< New head with the tag advanced*/
+
+/**
+ * @brief Open a listening socket on a port
+ *
+ * @param port Port to fill
+ * @param ip IP of the server
+ * @param number Port number, 0 to let the system choose it
+ * @return int less than 0 on error
+ */
+int passive_port_open(passive_port *port, char *ip, int number)
+{
+    struct sockaddr_in addrinfo;
+    socklen_t info_len = sizeof(addrinfo);
+    if ((port->fd = socket_srv("tcp", PASSIVE_BACKLOG, number, ip)) < 0)
+        return -1;
+    /*An accept without a client does not block the transfer forever*/
+    set_socket_timeouts(port->fd, DATA_SOCKET_TIMEOUT);
+    if (getsockname(port->fd, (struct sockaddr *)&addrinfo, &info_len) < 0)
+    {
+        close(port->fd);
+        return -1;
+    }
+    port->port = ntohs(addrinfo.sin_port);
+    return 1;
+}
+
+/**
+ * @brief Bind and listen on the passive ports
+ *
+ * @param pool Pool to initialize
+ * @param ip IP of the server
+ * @param port_min First port of the range, 0 to let the system choose every port
+ * @param port_max Last port of the range, 0 to let the system choose every port
+ * @param max_ports Maximum number of ports bound
+ * @return int Number of ports bound or less than 0 on error
+ */
+int passive_pool_init(passive_pool *pool, char *ip, int port_min, int port_max, int max_ports)
+{
+    int ranged = port_min > 0, number;
+    if (ranged && port_max - port_min + 1 < max_ports)
+        max_ports = port_max - port_min + 1;
+    if (!(pool->ports = calloc(max_ports, sizeof(passive_port))))
+        return -1;
+    /*Ports of the range already taken by someone else are skipped, without range the system picks every port*/
+    for (pool->n_ports = 0, number = port_min; pool->n_ports < max_ports && number <= port_max; number += ranged)
+    {
+        if (passive_port_open(&(pool->ports[pool->n_ports]), ip, number) < 0)
+        {
+            if (!ranged) /*Without range any failure is an error of the system*/
+                break;
+            continue;
+        }
+        pool->n_ports++;
+    }
+    if (!pool->n_ports)
+    {
+        free(pool->ports);
+        return -1;
+    }
+    /*Every port starts in the free list, in order*/
+    for (number = 0; number < pool->n_ports; number++)
+        pool->ports[number].next = (number + 1 < pool->n_ports) ? number + 2 : 0;
+    pool->head = 1;
+    pool->n_free = pool->n_ports;
+    return pool->n_ports;
+}
+
+/**
+ * @brief Take a free port, without system calls
+ *
+ * @param pool Pool
+ * @return passive_port* Port or NULL if all of them are in use
+ */
+passive_port *passive_pool_get(passive_pool *pool)
+{
+    uint64_t head = __atomic_load_n(&(pool->head), __ATOMIC_ACQUIRE), next;
+    passive_port *port;
+    do
+    {
+        if (!HEAD_INDEX(head)) /*No free ports*/
+            return NULL;
+        port = &(pool->ports[HEAD_INDEX(head) - 1]);
+        /*If another thread took the port first the tag changed and the exchange fails*/
+        next = HEAD_NEXT(head, __atomic_load_n(&(port->next), __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&(pool->head), &head, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_sub_fetch(&(pool->n_free), 1, __ATOMIC_RELAXED);
+    return port;
+}
+
+/**
+ * @brief Give a port back, refusing the connections that arrived after the transfer
+ *
+ * @param pool Pool
+ * @param port Port obtained with passive_pool_get
+ */
+void passive_pool_put(passive_pool *pool, passive_port *port)
+{
+    struct pollfd pending = {.fd = port->fd, .events = POLLIN};
+    uint64_t head = __atomic_load_n(&(pool->head), __ATOMIC_RELAXED);
+    int conn_fd;
+    /*The next client of the port must not find a connection meant for this one*/
+    while (poll(&pending, 1, 0) > 0 && (conn_fd = accept(port->fd, NULL, NULL)) >= 0)
+        close(conn_fd);
+    do
+        __atomic_store_n(&(port->next), HEAD_INDEX(head), __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&(pool->head), &head, HEAD_NEXT(head, port - pool->ports + 1), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&(pool->n_free), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Number of free ports
+ *
+ * @param pool Pool
+ * @return int free ports
+ */
+int passive_pool_free(passive_pool *pool)
+{
+    return __atomic_load_n(&(pool->n_free), __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Close every port and release the pool
+ *
+ * @param pool Pool
+ */
+void passive_pool_destroy(passive_pool *pool)
+{
+    for (int i = 0; i < pool->n_ports; i++)
+        close(pool->ports[i].fd);
+    free(pool->ports);
+    pool->ports = NULL;
+    pool->n_ports = pool->n_free = 0;
+    pool->head = 0;
+}
@@ -0,0 +1,300 @@
+/**
+ * @file reactor.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Edge triggered epoll event loops that own the control connections
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#define _DEFAULT_SOURCE /*!< Access to GNU functions*/
+#include "reactor.h"
+#include <sys/eventfd.h>
+
+#define REACTOR_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT) /*!< Events a connection waits for*/
+
+/**
+ * @brief Event loop information
+ *
+ */
+typedef struct _event_loop
+{
+    int epoll_fd;          /*!< epoll instance of the loop*/
+    pthread_t thread;      /*!< Thread running the loop*/
+    reactor_item *timed;   /*!< Connections with a deadline, only used by the thread of the loop*/
+    int wake_fd;           /*!< eventfd registered in the loop, written when a connection is resumed*/
+    pthread_mutex_t lock;  /*!< Protects resumed, the only field used by other threads*/
+    reactor_item *resumed; /*!< Connections given back by other threads, waiting for the handler*/
+} event_loop;
+
+static event_loop *loops = NULL;        /*!< Event loops*/
+static int n_loops_started = 0;         /*!< Number of event loops*/
+static unsigned int next_loop = 0;      /*!< Next loop to which a connection will be assigned*/
+static reactor_handler on_readable;     /*!< Handler of readable connections*/
+static int *reactor_end = NULL;         /*!< The loops finish when it is not 0*/
+
+/**
+ * @brief Nanoseconds of CLOCK_MONOTONIC
+ *
+ * @return uint64_t nanoseconds
+ */
+uint64_t reactor_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Take a connection out of the list of deadlines of its loop
+ *
+ * @param loop Event loop of the connection
+ * @param item Connection
+ */
+void timed_unlink(event_loop *loop, reactor_item *item)
+{
+    reactor_item **p;
+    for (p = &(loop->timed); *p && *p != item; p = &((*p)->next_timed))
+        ;
+    if (*p)
+        *p = item->next_timed;
+    item->next_timed = NULL;
+}
+
+/**
+ * @brief Call the handler of the connections whose deadline has passed
+ *
+ * @param loop Event loop
+ */
+void expire_deadlines(event_loop *loop)
+{
+    uint64_t now = reactor_clock();
+    struct epoll_event ev = {.events = 0};
+    reactor_item *item = loop->timed;
+    while (item)
+    {
+        if (item->deadline > now)
+        {
+            item = item->next_timed;
+            continue;
+        }
+        /*Disarmed, like after an event, so that no other event can reach the handler meanwhile*/
+        ev.data.ptr = item;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, item->fd, &ev);
+        reactor_set_deadline(item, 0);
+        if (on_readable(item) == REACTOR_REARM)
+            reactor_rearm(item);
+        item = loop->timed; /*The handler may have changed the list*/
+    }
+}
+
+/**
+ * @brief Call the handler of the connections given back to the loop by other threads
+ *
+ * @param loop Event loop
+ */
+void serve_resumed(event_loop *loop)
+{
+    eventfd_t count;
+    reactor_item *item, *next;
+    eventfd_read(loop->wake_fd, &count);
+    pthread_mutex_lock(&(loop->lock));
+    item = loop->resumed;
+    loop->resumed = NULL;
+    pthread_mutex_unlock(&(loop->lock));
+    for (; item; item = next)
+    {
+        next = item->next_resumed; /*The handler may free the item*/
+        if (on_readable(item) == REACTOR_REARM)
+            reactor_rearm(item);
+    }
+}
+
+/**
+ * @brief Main loop of an event loop thread
+ *
+ * @param args Event loop
+ * @return void* NULL
+ */
+void *event_loop_run(void *args)
+{
+    event_loop *loop = (event_loop *)args;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n_events;
+
+    while (!*reactor_end)
+    {
+        if ((n_events = epoll_wait(loop->epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_TIMEOUT_MS)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < n_events && !*reactor_end; i++)
+        {
+            reactor_item *item = (reactor_item *)events[i].data.ptr;
+            if (!item)
+            {
+                serve_resumed(loop);
+                continue;
+            }
+            /*One-shot events: the socket is disabled until it is explicitly rearmed*/
+            if (on_readable(item) == REACTOR_REARM)
+                reactor_rearm(item);
+        }
+        if (loop->timed)
+            expire_deadlines(loop);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the event loops, each in its own thread
+ *
+ * @param n_loops Number of event loops, if less than 1 one per online core is used
+ * @param handler Function called when a connection is readable
+ * @param end_flag The loops finish when it is set to a value other than 0
+ * @return int Number of loops started or -1 on error
+ */
+int reactor_start(int n_loops, reactor_handler handler, int *end_flag)
+{
+    if (n_loops < 1 && (n_loops = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        n_loops = 1;
+    if (!(loops = calloc(n_loops, sizeof(event_loop))))
+        return -1;
+    on_readable = handler;
+    reactor_end = end_flag;
+    for (n_loops_started = 0; n_loops_started < n_loops; n_loops_started++)
+    {
+        event_loop *loop = &loops[n_loops_started];
+        /*The eventfd is level triggered and has no item, it is told apart by its NULL pointer*/
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return -1;
+        if ((loop->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 || epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0)
+        {
+            close(loop->epoll_fd);
+            return -1;
+        }
+        pthread_mutex_init(&(loop->lock), NULL);
+        if (pthread_create(&(loop->thread), NULL, event_loop_run, loop) != 0)
+        {
+            close(loop->wake_fd);
+            close(loop->epoll_fd);
+            return -1;
+        }
+    }
+    return n_loops_started;
+}
+
+/**
+ * @brief Register a new connection, event loops are assigned in round robin
+ *
+ * @param fd Socket descriptor
+ * @param data User data associated with the connection
+ * @return reactor_item* Registered connection or NULL on error
+ */
+reactor_item *reactor_add(int fd, void *data)
+{
+    struct epoll_event ev = {.events = REACTOR_EVENTS};
+    reactor_item *item;
+    if (!n_loops_started || !(item = malloc(sizeof(reactor_item))))
+        return NULL;
+    item->fd = fd;
+    item->data = data;
+    item->deadline = 0;
+    item->next_timed = NULL;
+    item->next_resumed = NULL;
+    item->loop = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % n_loops_started;
+    ev.data.ptr = item;
+    if (epoll_ctl(loops[item->loop].epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        free(item);
+        return NULL;
+    }
+    return item;
+}
+
+/**
+ * @brief Wait again for events on a connection after it was handed to another thread
+ *
+ * @param item Connection
+ * @return int less than 0 on error
+ */
+int reactor_rearm(reactor_item *item)
+{
+    /*EPOLL_CTL_MOD checks the current state, so data that arrived while disarmed is not lost*/
+    struct epoll_event ev = {.events = REACTOR_EVENTS, .data.ptr = item};
+    return epoll_ctl(loops[item->loop].epoll_fd, EPOLL_CTL_MOD, item->fd, &ev);
+}
+
+/**
+ * @brief Give a connection handed to another thread back to its event loop, which calls the handler
+ * from its own thread even if nothing new arrives, as requests may be queued already
+ *
+ * @param item Connection
+ */
+void reactor_resume(reactor_item *item)
+{
+    event_loop *loop = &loops[item->loop];
+    pthread_mutex_lock(&(loop->lock));
+    item->next_resumed = loop->resumed;
+    loop->resumed = item;
+    pthread_mutex_unlock(&(loop->lock));
+    eventfd_write(loop->wake_fd, 1);
+}
+
+/**
+ * @brief Call the handler of a connection at a given time if it has not become readable before.
+ * Only from the thread of the event loop that owns the connection, while it is not handed to another thread
+ *
+ * @param item Connection
+ * @param deadline Nanoseconds of CLOCK_MONOTONIC, 0 to cancel
+ */
+void reactor_set_deadline(reactor_item *item, uint64_t deadline)
+{
+    event_loop *loop = &loops[item->loop];
+    if (!item->deadline && deadline)
+    {
+        item->next_timed = loop->timed;
+        loop->timed = item;
+    }
+    else if (item->deadline && !deadline)
+        timed_unlink(loop, item);
+    item->deadline = deadline;
+}
+
+/**
+ * @brief Unregister a connection and free the item. The descriptor is not closed
+ *
+ * @param item Connection
+ */
+void reactor_remove(reactor_item *item)
+{
+    if (!item)
+        return;
+    epoll_ctl(loops[item->loop].epoll_fd, EPOLL_CTL_DEL, item->fd, NULL);
+    if (item->deadline) /*Only possible from the thread of its loop*/
+        timed_unlink(&loops[item->loop], item);
+    free(item);
+}
+
+/**
+ * @brief Wait for all the event loops to finish
+ *
+ */
+void reactor_join()
+{
+    for (int i = 0; i < n_loops_started; i++)
+    {
+        pthread_join(loops[i].thread, NULL);
+        pthread_mutex_destroy(&(loops[i].lock));
+        close(loops[i].wake_fd);
+        close(loops[i].epoll_fd);
+    }
+    free(loops);
+    loops = NULL;
+    n_loops_started = 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file rng_bench.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Cost of the random numbers of tlse read from /dev/urandom on every call and from the per-thread
+ * ChaCha20 generator, alone and inside complete TLS handshakes
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+int bench_random(unsigned char *key, int len);
+#include "tlse.c" /*Built in with TLS_USE_RANDOM_SOURCE=bench_random, to switch between sources*/
+
+#define BENCH_SECONDS 1.0    /*!< Duration of each measure*/
+#define BENCH_ROUNDS 16      /*!< Maximum flights of messages of a handshake*/
+#define BENCH_REPEAT 5       /*!< Measures of each handshake and source, alternating sources, the best one is kept*/
+#define BENCH_FILE_MAX 65536 /*!< Maximum size of the certificate and of the key*/
+
+static int use_drbg = 0;               /*!< Source of bench_random, 0 for /dev/urandom*/
+static unsigned long random_calls = 0; /*!< Calls to bench_random, from tls_random or from the sprng*/
+
+/**
+ * @brief Random source of tlse during the bench, the original read of /dev/urandom or the generator
+ *
+ * @param key Destination
+ * @param len Bytes
+ * @return int 1 on success
+ */
+int bench_random(unsigned char *key, int len)
+{
+    FILE *fp;
+    int key_len;
+    random_calls++;
+    if (use_drbg)
+        return tls_drbg_random(key, len);
+    fp = fopen("/dev/urandom", "r");
+    if (!fp)
+        return 0;
+    key_len = fread(key, 1, len, fp);
+    fclose(fp);
+    return key_len == len;
+}
+
+/**
+ * @brief Seconds of the monotonic clock
+ *
+ * @return double seconds
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Calls per second of tls_random with the source in use
+ *
+ * @param len Bytes of every call
+ * @return double calls per second
+ */
+double measure_calls(int len)
+{
+    unsigned char buf[64];
+    unsigned long n;
+    double t = now();
+    for (n = 0; now() - t < BENCH_SECONDS; n++)
+        if (!tls_random(buf, len))
+            return 0;
+    return n / (now() - t);
+}
+
+/**
+ * @brief Move the pending messages of one context to the other
+ *
+ * @param from Context that writes
+ * @param to Context that reads
+ * @return int less than 0 on error
+ */
+int pump(struct TLSContext *from, struct TLSContext *to)
+{
+    unsigned int len;
+    const unsigned char *buf = tls_get_write_buffer(from, &len);
+    int res = 0;
+    if (buf && len)
+        res = tls_consume_stream(to, buf, len, NULL);
+    tls_buffer_clear(from);
+    return res;
+}
+
+/**
+ * @brief Complete handshake between a client and a server in memory
+ *
+ * @param server_ctx Server context with the certificate and key loaded
+ * @param version TLS_V12 or TLS_V13
+ * @return int 1 if both ends got established
+ */
+int handshake(struct TLSContext *server_ctx, unsigned short version)
+{
+    struct TLSContext *client = tls_create_context(0, version), *server = tls_accept(server_ctx);
+    int ok = 0;
+    if (client && server && tls_client_connect(client) >= 0)
+        for (int i = 0; i < BENCH_ROUNDS && !ok; i++)
+        {
+            if (pump(client, server) < 0 || pump(server, client) < 0)
+                break;
+            ok = tls_established(client) && tls_established(server);
+        }
+    tls_destroy_context(client);
+    tls_destroy_context(server);
+    return ok;
+}
+
+/**
+ * @brief Handshakes per second with the source in use
+ *
+ * @param server_ctx Server context with the certificate and key loaded
+ * @param version TLS_V12 or TLS_V13
+ * @return double handshakes per second, 0 if one fails
+ */
+double measure_handshakes(struct TLSContext *server_ctx, unsigned short version)
+{
+    unsigned long n;
+    double t = now();
+    for (n = 0; now() - t < BENCH_SECONDS; n++)
+        if (!handshake(server_ctx, version))
+            return 0;
+    return n / (now() - t);
+}
+
+/**
+ * @brief Best handshakes per second of each source, and calls to the source per handshake
+ *
+ * @param server_ctx Server context with the certificate and key loaded
+ * @param version TLS_V12 or TLS_V13
+ * @param label Name of the version
+ * @param call_cost Seconds of a call to each source, indexed by use_drbg
+ */
+void compare_handshakes(struct TLSContext *server_ctx, unsigned short version, const char *label, double *call_cost)
+{
+    double best[2] = {0, 0}, rate;
+    unsigned long calls;
+
+    random_calls = 0;
+    if (!handshake(server_ctx, version))
+    {
+        printf("%-8s %12s\n", label, "error");
+        return;
+    }
+    calls = random_calls;
+    for (int r = 0; r < 2 * BENCH_REPEAT; r++)
+    {
+        use_drbg = r % 2;
+        rate = measure_handshakes(server_ctx, version);
+        best[use_drbg] = (best[use_drbg] > rate) ? best[use_drbg] : rate;
+    }
+    printf("%-8s %12lu %12.1f %12.1f %12.1f\n", label, calls, best[0], best[1], calls * (call_cost[0] - call_cost[1]) * 1e6);
+}
+
+/**
+ * @brief Read a whole file
+ *
+ * @param path Path of the file
+ * @param buf Destination, BENCH_FILE_MAX bytes
+ * @return int Bytes read, less than 1 on error
+ */
+int read_file(const char *path, unsigned char *buf)
+{
+    FILE *fp = fopen(path, "rb");
+    int len;
+    if (!fp)
+        return -1;
+    len = fread(buf, 1, BENCH_FILE_MAX, fp);
+    fclose(fp);
+    return len;
+}
+
+/**
+ * @brief Compare both sources calling tls_random and, with a certificate and its key as arguments,
+ * in handshakes of TLS 1.2 and 1.3
+ *
+ * @param argc Number of arguments
+ * @param argv Optional certificate and private key of the server, PEM
+ * @return int 0 on success
+ */
+int main(int argc, char **argv)
+{
+    static unsigned char cert[BENCH_FILE_MAX], key[BENCH_FILE_MAX];
+    struct TLSContext *server_ctx = NULL;
+    double rate[2], call_cost[2];
+    int cert_len, key_len;
+
+    tls_init();
+    if (argc == 3)
+    {
+        if ((cert_len = read_file(argv[1], cert)) < 1 || (key_len = read_file(argv[2], key)) < 1 ||
+            !(server_ctx = tls_create_context(1, TLS_V13)) || tls_load_certificates(server_ctx, cert, cert_len) <= 0 ||
+            tls_load_private_key(server_ctx, key, key_len) <= 0)
+        {
+            printf("No se pudo cargar el certificado y/o la clave privada\n");
+            return 1;
+        }
+    }
+    else if (argc != 1)
+    {
+        printf("Uso: %s [certificado clave_privada]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-12s %14s %14s\n", "", "32 B/s", "8 B/s");
+    for (use_drbg = 0; use_drbg <= 1; use_drbg++)
+    {
+        rate[use_drbg] = measure_calls(32);
+        printf("%-12s %14.0f %14.0f\n", use_drbg ? "chacha20" : "/dev/urandom", rate[use_drbg], measure_calls(8));
+        call_cost[use_drbg] = rate[use_drbg] ? 1 / rate[use_drbg] : 0;
+    }
+    if (server_ctx)
+    {
+        printf("\n%-8s %12s %12s %12s %12s\n", "", "llamadas/hs", "urandom hs/s", "chacha hs/s", "ahorro us/hs");
+        compare_handshakes(server_ctx, TLS_V12, "TLS 1.2", call_cost);
+        compare_handshakes(server_ctx, TLS_V13, "TLS 1.3", call_cost);
+    }
+    tls_destroy_context(server_ctx);
+    return 0;
+}
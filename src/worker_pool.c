@@ -0,0 +1,213 @@
+/**
+ * @file worker_pool.c
+ * @author Joaquín Jiménez López de Castro (joaquin.jimenezl@estudiante.uam.es)
+ * @brief Fixed size pool of transfer workers with per-worker queues and work stealing
+ * @version 1.0
+ * @date 10-16-2026
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "worker_pool.h"
+
+/**
+ * @brief Job waiting in a queue
+ *
+ */
+typedef struct _pool_job
+{
+    pool_function function;  /*!< Function to execute*/
+    void *args;              /*!< Argument of the function*/
+    struct timespec queued;  /*!< Moment in which the job was queued*/
+    struct _pool_job *next;  /*!< Next job in the queue*/
+} pool_job;
+
+/**
+ * @brief Queue of jobs of a worker
+ *
+ */
+typedef struct _pool_queue
+{
+    pthread_mutex_t mutex; /*!< Protects the queue*/
+    pool_job *head;        /*!< First job, the owner and thieves take from here*/
+    pool_job *tail;        /*!< Last job, new jobs are added here*/
+    long len;              /*!< Number of jobs in the queue*/
+    pthread_t thread;      /*!< Worker that owns the queue*/
+} pool_queue;
+
+static pool_queue *queues = NULL;        /*!< Queue of each worker*/
+static int n_workers_started = 0;        /*!< Number of workers*/
+static unsigned int next_queue = 0;      /*!< Queue to which the next job will be added*/
+static sem_t pending_jobs;               /*!< Jobs in all the queues, workers sleep on it*/
+static long busy_workers = 0;            /*!< Workers executing a job*/
+static unsigned long completed_jobs = 0; /*!< Jobs started by a worker*/
+static unsigned long stolen_jobs = 0;    /*!< Jobs taken from the queue of another worker*/
+static uint64_t total_wait_ns = 0;       /*!< Sum of the time every job waited in its queue*/
+static uint64_t max_wait_ns = 0;         /*!< Maximum time a job waited in its queue*/
+static time_t last_report = 0;           /*!< Last time statistics were written to the log*/
+
+/**
+ * @brief Take the first job of a queue
+ *
+ * @param queue Queue
+ * @return pool_job* NULL if the queue is empty
+ */
+pool_job *queue_pop(pool_queue *queue)
+{
+    pool_job *job;
+    pthread_mutex_lock(&(queue->mutex));
+    if ((job = queue->head))
+    {
+        if (!(queue->head = job->next))
+            queue->tail = NULL;
+        queue->len--;
+    }
+    pthread_mutex_unlock(&(queue->mutex));
+    return job;
+}
+
+/**
+ * @brief Nanoseconds elapsed since a moment
+ *
+ * @param since Moment
+ * @return uint64_t elapsed nanoseconds
+ */
+uint64_t elapsed_ns(struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000000 + now.tv_nsec - since->tv_nsec;
+}
+
+/**
+ * @brief Write the statistics of the pool to the log, at most once every POOL_REPORT_INTERVAL
+ *
+ */
+void pool_report()
+{
+    time_t now = time(NULL), last = __atomic_load_n(&last_report, __ATOMIC_RELAXED);
+    pool_stats stats;
+    if (now - last < POOL_REPORT_INTERVAL || !__atomic_compare_exchange_n(&last_report, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+    worker_pool_stats(&stats);
+    flog(LOG_INFO, "Pool de transferencias: %d trabajadores, %ld ocupados, %ld en cola, %lu completados, %lu robados, espera media %.3f ms, espera maxima %.3f ms\n",
+         stats.workers, stats.busy, stats.queued, stats.completed, stats.stolen, stats.avg_wait_ms, stats.max_wait_ms);
+}
+
+/**
+ * @brief Main loop of a worker: serve its own queue and steal from the others when it is empty
+ *
+ * @param args Index of the worker
+ * @return void* NULL
+ */
+void *worker_run(void *args)
+{
+    int self = (int)(intptr_t)args;
+    pool_job *job;
+    uint64_t wait_ns, max;
+
+    while (1)
+    {
+        /*There is at least one job in some queue for each unit of the semaphore*/
+        if (sem_wait(&pending_jobs) < 0)
+            continue;
+        job = queue_pop(&queues[self]);
+        for (int i = 1; !job; i = (i % n_workers_started) + 1) /*Steal from the rest, starting by the next one*/
+            if ((job = queue_pop(&queues[(self + i) % n_workers_started])) && i != n_workers_started)
+                __atomic_fetch_add(&stolen_jobs, 1, __ATOMIC_RELAXED);
+        /*Queue statistics*/
+        wait_ns = elapsed_ns(&(job->queued));
+        __atomic_fetch_add(&total_wait_ns, wait_ns, __ATOMIC_RELAXED);
+        for (max = __atomic_load_n(&max_wait_ns, __ATOMIC_RELAXED); wait_ns > max;)
+            if (__atomic_compare_exchange_n(&max_wait_ns, &max, wait_ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        __atomic_fetch_add(&completed_jobs, 1, __ATOMIC_RELAXED);
+        /*Execute the job*/
+        __atomic_fetch_add(&busy_workers, 1, __ATOMIC_RELAXED);
+        job->function(job->args);
+        __atomic_fetch_sub(&busy_workers, 1, __ATOMIC_RELAXED);
+        free(job);
+        pool_report();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start the worker threads
+ *
+ * @param n_workers Number of workers, if less than 1 two per online core are used
+ * @return int Number of workers started or -1 on error
+ */
+int worker_pool_start(int n_workers)
+{
+    pthread_attr_t attr;
+    if (n_workers < 1 && (n_workers = 2 * sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        n_workers = 1;
+    if (!(queues = calloc(n_workers, sizeof(pool_queue))))
+        return -1;
+    sem_init(&pending_jobs, 0, 0);
+    last_report = time(NULL);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (n_workers_started = 0; n_workers_started < n_workers; n_workers_started++)
+        pthread_mutex_init(&(queues[n_workers_started].mutex), NULL);
+    for (int i = 0; i < n_workers; i++)
+        if (pthread_create(&(queues[i].thread), &attr, worker_run, (void *)(intptr_t)i) != 0)
+        {
+            pthread_attr_destroy(&attr);
+            return -1;
+        }
+    pthread_attr_destroy(&attr);
+    return n_workers_started;
+}
+
+/**
+ * @brief Queue a job, it will be executed by the first free worker
+ *
+ * @param function Function to execute
+ * @param args Argument of the function
+ * @return int less than 0 on error
+ */
+int worker_pool_submit(pool_function function, void *args)
+{
+    pool_job *job;
+    pool_queue *queue;
+    if (!n_workers_started || !(job = malloc(sizeof(pool_job))))
+        return -1;
+    job->function = function;
+    job->args = args;
+    job->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &(job->queued));
+    /*Queues are filled in round robin, idle workers steal what the busy ones cannot serve*/
+    queue = &queues[__atomic_fetch_add(&next_queue, 1, __ATOMIC_RELAXED) % n_workers_started];
+    pthread_mutex_lock(&(queue->mutex));
+    if (queue->tail)
+        queue->tail->next = job;
+    else
+        queue->head = job;
+    queue->tail = job;
+    queue->len++;
+    pthread_mutex_unlock(&(queue->mutex));
+    sem_post(&pending_jobs);
+    return 1;
+}
+
+/**
+ * @brief Collect the current statistics of the pool
+ *
+ * @param stats Where to store them
+ */
+void worker_pool_stats(pool_stats *stats)
+{
+    unsigned long completed = __atomic_load_n(&completed_jobs, __ATOMIC_RELAXED);
+    stats->workers = n_workers_started;
+    stats->queued = 0;
+    for (int i = 0; i < n_workers_started; i++)
+        stats->queued += __atomic_load_n(&(queues[i].len), __ATOMIC_RELAXED);
+    stats->busy = __atomic_load_n(&busy_workers, __ATOMIC_RELAXED);
+    stats->completed = completed;
+    stats->stolen = __atomic_load_n(&stolen_jobs, __ATOMIC_RELAXED);
+    stats->avg_wait_ms = completed ? __atomic_load_n(&total_wait_ns, __ATOMIC_RELAXED) / 1e6 / completed : 0;
+    stats->max_wait_ms = __atomic_load_n(&max_wait_ns, __ATOMIC_RELAXED) / 1e6;
+}
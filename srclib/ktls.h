@@ -0,0 +1,13 @@
+/**
+ * @file ktls.h
+ * @brief Kernel TLS definitions used by tlse when compiled with WITH_KTLS.
+ * The uapi header of the running kernel is used instead of a private copy
+ *
+ */
+
+#ifndef KTLS_H
+#define KTLS_H
+
+#include <linux/tls.h>
+
+#endif /*KTLS_H*/
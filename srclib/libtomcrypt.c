@@ -13217,6 +13217,11 @@ void crypt_argchk(char *v, char *s, int d) {
  #endif
 #endif /* LTC_NO_MACS */
 
+/* AES-NI and PCLMULQDQ for AES and GCM when the CPU has them, checked at runtime */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LTC_NO_ASM)
+ #define LTC_AES_NI
+#endif
+
 /* Various tidbits of modern neatoness */
 #define LTC_BASE64
 
@@ -13283,6 +13288,9 @@ void crypt_argchk(char *v, char *s, int d) {
 /* use Shamir's trick for point mul (speeds up signature verification) */
  #define LTC_ECC_SHAMIR
 
+/* precomputed table of the base point of one 256 bit curve (speeds up key generation and signing) */
+ #define LTC_ECC_FIXED_BASE
+
  #if defined(TFM_LTC_DESC) && defined(LTC_MECC)
   #define LTC_MECC_ACCEL
  #endif
@@ -13997,6 +14005,10 @@ struct saferp_key {
 struct rijndael_key {
     ulong32 eK[60], dK[60];
     int     Nr;
+#ifdef LTC_AES_NI
+    unsigned char niK[2][15][16]; /* round keys of AES-NI, encryption then decryption */
+    int     ni;                   /* the key was scheduled for AES-NI */
+#endif
 };
 #endif
 
@@ -14613,6 +14625,13 @@ int rijndael_enc_setup(const unsigned char *key, int keylen, int num_rounds, sym
 int rijndael_enc_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey);
 void rijndael_enc_done(symmetric_key *skey);
 int rijndael_enc_keysize(int *keysize);
+#ifdef LTC_AES_NI
+int aesni_enabled(void);
+void aesni_set_enabled(int enabled);
+void aesni_setup(const unsigned char *key, int keylen, symmetric_key *skey);
+void aesni_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey);
+void aesni_ecb_decrypt(const unsigned char *ct, unsigned char *pt, symmetric_key *skey);
+#endif
 
 extern const struct ltc_cipher_descriptor rijndael_desc, aes_desc;
 extern const struct ltc_cipher_descriptor rijndael_enc_desc, aes_enc_desc;
@@ -15526,6 +15545,10 @@ typedef struct {
     ulong64       totlen,            /* 64-bit counter used for IV and AAD */
                   pttotlen;          /* 64-bit counter for the PT */
 
+ #ifdef LTC_AES_NI
+    int           clmul;             /* GHASH with PCLMULQDQ instead of the tables */
+ #endif
+
  #ifdef LTC_GCM_TABLES
     unsigned char PC[16][256][16]       /* 16 tables of 8x128 */
   #ifdef LTC_GCM_TABLES_SSE2
@@ -15565,6 +15588,10 @@ int gcm_memory(int cipher,
                unsigned char *tag, unsigned long *taglen,
                int direction);
 int gcm_test(void);
+ #ifdef LTC_AES_NI
+void aesni_gcm_mult_h(const unsigned char *H, unsigned char *I);
+void aesni_gcm_process(gcm_state *gcm, unsigned char *pt, unsigned char *ct, unsigned long blocks, int direction);
+ #endif
 #endif /* LTC_GCM_MODE */
 
 #ifdef LTC_PELICAN
@@ -16146,6 +16173,11 @@ void ltc_ecc_fp_tablelock(int lock);
 /* R = kG */
 int ltc_ecc_mulmod(void *k, ecc_point *G, ecc_point *R, void *modulus, int map);
 
+ #ifdef LTC_ECC_FIXED_BASE
+/* build the table of the base point of dp, ecc_make_key_ex uses it from then on for that curve */
+int ltc_ecc_fixed_base_init(const ltc_ecc_set_type *dp);
+ #endif
+
  #ifdef LTC_ECC_SHAMIR
 /* kA*A + kB*B = C */
 int ltc_ecc_mul2add(ecc_point *A, void *kA,
@@ -23816,6 +23848,193 @@ int ecc_make_key(prng_state *prng, int wprng, int keysize, ecc_key *key) {
     return err;
 }
 
+#ifdef LTC_ECC_FIXED_BASE
+ #define LTC_FB_SIZE       32                  /* bytes of a coordinate, only 256 bit curves */
+ #define LTC_FB_WINDOWS    (2 * LTC_FB_SIZE)   /* 4 bit windows of the scalar */
+
+/* entry [w][j] is j * 16^w * G as affine x || y in montgomery form, so kG takes one
+   mixed addition per window of k and no doubling at all */
+static unsigned char ltc_fb_table[LTC_FB_WINDOWS][16][2 * LTC_FB_SIZE];
+static const ltc_ecc_set_type *ltc_fb_dp = NULL;
+
+static int ltc_ecc_fixed_base_match(const ltc_ecc_set_type *dp) {
+    return (ltc_fb_dp != NULL) && (dp->size == ltc_fb_dp->size) && (strcmp(dp->prime, ltc_fb_dp->prime) == 0) &&
+           (strcmp(dp->Gx, ltc_fb_dp->Gx) == 0) && (strcmp(dp->Gy, ltc_fb_dp->Gy) == 0);
+}
+
+static int ltc_ecc_fixed_base_copy(ecc_point *src, ecc_point *dst) {
+    int err;
+    if (((err = mp_copy(src->x, dst->x)) != CRYPT_OK) || ((err = mp_copy(src->y, dst->y)) != CRYPT_OK)) {
+        return err;
+    }
+    return mp_copy(src->z, dst->z);
+}
+
+static int ltc_ecc_fixed_base_store(void *a, unsigned char *out) {
+    unsigned long len = mp_unsigned_bin_size(a);
+    if (len > LTC_FB_SIZE) {
+        return CRYPT_BUFFER_OVERFLOW;
+    }
+    zeromem(out, LTC_FB_SIZE);
+    return mp_to_unsigned_bin(a, out + LTC_FB_SIZE - len);
+}
+
+/**
+   Build the table of the base point of a curve, once
+   @param dp   The curve, its size must be LTC_FB_SIZE
+   @return CRYPT_OK on success
+ */
+int ltc_ecc_fixed_base_init(const ltc_ecc_set_type *dp) {
+    ecc_point *P, *Q, *T;
+    void      *modulus, *mu, *mp = NULL;
+    int       w, j, err;
+
+    LTC_ARGCHK(dp != NULL);
+    if (ltc_fb_dp != NULL) {
+        return CRYPT_OK;
+    }
+    if (dp->size != LTC_FB_SIZE) {
+        return CRYPT_INVALID_ARG;
+    }
+    if ((err = mp_init_multi(&modulus, &mu, NULL)) != CRYPT_OK) {
+        return err;
+    }
+    P = ltc_ecc_new_point();
+    Q = ltc_ecc_new_point();
+    T = ltc_ecc_new_point();
+    if ((P == NULL) || (Q == NULL) || (T == NULL)) {
+        err = CRYPT_MEM;
+        goto done;
+    }
+    if (((err = mp_read_radix(modulus, (char *)dp->prime, 16)) != CRYPT_OK) ||
+        ((err = mp_montgomery_setup(modulus, &mp)) != CRYPT_OK) ||
+        ((err = mp_montgomery_normalization(mu, modulus)) != CRYPT_OK)) {
+        goto done;
+    }
+
+    /* P = G in montgomery form */
+    if (((err = mp_read_radix(P->x, (char *)dp->Gx, 16)) != CRYPT_OK) ||
+        ((err = mp_read_radix(P->y, (char *)dp->Gy, 16)) != CRYPT_OK) ||
+        ((err = mp_mulmod(P->x, mu, modulus, P->x)) != CRYPT_OK) ||
+        ((err = mp_mulmod(P->y, mu, modulus, P->y)) != CRYPT_OK) ||
+        ((err = mp_copy(mu, P->z)) != CRYPT_OK)) {
+        goto done;
+    }
+
+    for (w = 0; w < LTC_FB_WINDOWS; w++) {
+        /* Q = j * P, P = 16^w * G */
+        for (j = 1; j < 16; j++) {
+            if (j == 1) {
+                err = ltc_ecc_fixed_base_copy(P, Q);
+            } else {
+                err = ltc_mp.ecc_ptadd(Q, P, Q, modulus, mp);
+            }
+            if ((err != CRYPT_OK) || ((err = ltc_ecc_fixed_base_copy(Q, T)) != CRYPT_OK)) {
+                goto done;
+            }
+            /* map leaves x and y out of montgomery form, put them back */
+            if (((err = ltc_mp.ecc_map(T, modulus, mp)) != CRYPT_OK) ||
+                ((err = mp_mulmod(T->x, mu, modulus, T->x)) != CRYPT_OK) ||
+                ((err = mp_mulmod(T->y, mu, modulus, T->y)) != CRYPT_OK) ||
+                ((err = ltc_ecc_fixed_base_store(T->x, ltc_fb_table[w][j])) != CRYPT_OK) ||
+                ((err = ltc_ecc_fixed_base_store(T->y, ltc_fb_table[w][j] + LTC_FB_SIZE)) != CRYPT_OK)) {
+                goto done;
+            }
+        }
+        for (j = 0; j < 4; j++) {
+            if ((err = ltc_mp.ecc_ptdbl(P, P, modulus, mp)) != CRYPT_OK) {
+                goto done;
+            }
+        }
+    }
+    ltc_fb_dp = dp;
+    err       = CRYPT_OK;
+done:
+    ltc_ecc_del_point(P);
+    ltc_ecc_del_point(Q);
+    ltc_ecc_del_point(T);
+    if (mp != NULL) {
+        mp_montgomery_free(mp);
+    }
+    mp_clear_multi(modulus, mu, NULL);
+    return err;
+}
+
+/**
+   R = kG with the table, mapped to affine
+   @param k        The scalar, less than the order of G
+   @param R        [out] Destination for kG
+   @param modulus  The modulus of the field the ECC curve is in
+   @return CRYPT_OK on success
+ */
+static int ltc_ecc_fixed_base_mulmod(void *k, ecc_point *R, void *modulus) {
+    unsigned char kb[LTC_FB_SIZE], entry[2 * LTC_FB_SIZE], mask;
+    ecc_point     Q;
+    void          *mp = NULL;
+    unsigned long len;
+    int           w, j, i, digit, first, err;
+
+    len = mp_unsigned_bin_size(k);
+    if (len > LTC_FB_SIZE) {
+        return CRYPT_INVALID_ARG;
+    }
+    zeromem(kb, sizeof(kb));
+    if ((err = mp_to_unsigned_bin(k, kb + LTC_FB_SIZE - len)) != CRYPT_OK) {
+        return err;
+    }
+    /* Q is affine, a NULL z makes the additions mixed */
+    Q.z = NULL;
+    if ((err = mp_init_multi(&Q.x, &Q.y, NULL)) != CRYPT_OK) {
+        return err;
+    }
+    if ((err = mp_montgomery_setup(modulus, &mp)) != CRYPT_OK) {
+        goto done;
+    }
+
+    first = 1;
+    for (w = 0; w < LTC_FB_WINDOWS; w++) {
+        digit = (kb[LTC_FB_SIZE - 1 - (w >> 1)] >> ((w & 1) << 2)) & 15;
+        /* read the whole window, so that the cache lines touched do not depend on the digit */
+        zeromem(entry, sizeof(entry));
+        for (j = 1; j < 16; j++) {
+            mask = (unsigned char)(0 - (unsigned int)(j == digit));
+            for (i = 0; i < 2 * LTC_FB_SIZE; i++) {
+                entry[i] |= ltc_fb_table[w][j][i] & mask;
+            }
+        }
+        if (digit == 0) {
+            continue;
+        }
+        if (((err = mp_read_unsigned_bin(Q.x, entry, LTC_FB_SIZE)) != CRYPT_OK) ||
+            ((err = mp_read_unsigned_bin(Q.y, entry + LTC_FB_SIZE, LTC_FB_SIZE)) != CRYPT_OK)) {
+            goto done;
+        }
+        /* k < order, so the partial sum is never Q nor -Q */
+        if (first) {
+            if (((err = mp_copy(Q.x, R->x)) != CRYPT_OK) || ((err = mp_copy(Q.y, R->y)) != CRYPT_OK) ||
+                ((err = mp_montgomery_normalization(R->z, modulus)) != CRYPT_OK)) {
+                goto done;
+            }
+            first = 0;
+        } else if ((err = ltc_mp.ecc_ptadd(R, &Q, R, modulus, mp)) != CRYPT_OK) {
+            goto done;
+        }
+    }
+    /* k == 0 has no affine point */
+    err = first ? CRYPT_ERROR : ltc_mp.ecc_map(R, modulus, mp);
+done:
+    if (mp != NULL) {
+        mp_montgomery_free(mp);
+    }
+    mp_clear_multi(Q.x, Q.y, NULL);
+ #ifdef LTC_CLEAN_STACK
+    zeromem(kb, sizeof(kb));
+    zeromem(entry, sizeof(entry));
+ #endif
+    return err;
+}
+#endif
+
 int ecc_make_key_ex(prng_state *prng, int wprng, ecc_key *key, const ltc_ecc_set_type *dp) {
     int           err;
     ecc_point     *base;
@@ -23886,7 +24105,13 @@ int ecc_make_key_ex(prng_state *prng, int wprng, ecc_key *key, const ltc_ecc_set
         }
     }
     /* make the public key */
-    if ((err = ltc_mp.ecc_ptmul(key->k, base, &key->pubkey, prime, 1)) != CRYPT_OK) {
+#ifdef LTC_ECC_FIXED_BASE
+    if (ltc_ecc_fixed_base_match(dp)) {
+        err = ltc_ecc_fixed_base_mulmod(key->k, &key->pubkey, prime);
+    } else
+#endif
+    err = ltc_mp.ecc_ptmul(key->k, base, &key->pubkey, prime, 1);
+    if (err != CRYPT_OK) {
         goto errkey;
     }
     key->type = PK_PRIVATE;
@@ -32083,6 +32308,15 @@ int SETUP(const unsigned char *key, int keylen, int num_rounds, symmetric_key *s
 
     skey->rijndael.Nr = 10 + ((keylen/8)-2)*2;
 
+#ifdef LTC_AES_NI
+    /* the key sizes TLS uses, AES-192 keeps the tables */
+    skey->rijndael.ni = keylen != 24 && aesni_enabled();
+    if (skey->rijndael.ni) {
+        aesni_setup(key, keylen, skey);
+        return CRYPT_OK;
+    }
+#endif
+
     /* setup the forward key */
     i                 = 0;
     rk                = skey->rijndael.eK;
@@ -32239,6 +32473,13 @@ int ECB_ENC(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
     LTC_ARGCHK(ct != NULL);
     LTC_ARGCHK(skey != NULL);
 
+#ifdef LTC_AES_NI
+    if (skey->rijndael.ni) {
+        aesni_ecb_encrypt(pt, ct, skey);
+        return CRYPT_OK;
+    }
+#endif
+
     Nr = skey->rijndael.Nr;
     rk = skey->rijndael.eK;
 
@@ -32418,6 +32659,13 @@ int ECB_DEC(const unsigned char *ct, unsigned char *pt, symmetric_key *skey)
     LTC_ARGCHK(ct != NULL);
     LTC_ARGCHK(skey != NULL);
 
+#ifdef LTC_AES_NI
+    if (skey->rijndael.ni) {
+        aesni_ecb_decrypt(ct, pt, skey);
+        return CRYPT_OK;
+    }
+#endif
+
     Nr = skey->rijndael.Nr;
     rk = skey->rijndael.dK;
 
@@ -32704,6 +32952,319 @@ int ECB_KS(int *keysize)
 /* $Date$ */
 
 
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ *
+ * Tom St Denis, tomstdenis@gmail.com, http://libtom.org
+ */
+
+/**
+   @file aesni.c
+   AES with the AES-NI instructions and GHASH with PCLMULQDQ, chosen at runtime.
+   The table based rijndael and GCM code stay as fallback for CPUs without them
+*/
+
+#ifdef LTC_AES_NI
+
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,pclmul,ssse3")))
+
+/* -1 until the CPU is checked, then 0 or 1 */
+static int aesni_state = -1;
+
+/**
+  Tell if AES-NI and PCLMULQDQ are used for the keys scheduled from now on
+  @return 1 if they are used
+*/
+int aesni_enabled(void)
+{
+   int state = __atomic_load_n(&aesni_state, __ATOMIC_RELAXED);
+   if (state < 0) {
+      __builtin_cpu_init();
+      state = __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+      __atomic_store_n(&aesni_state, state, __ATOMIC_RELAXED);
+   }
+   return state;
+}
+
+/**
+  Use or stop using AES-NI and PCLMULQDQ for the keys scheduled from now on, to compare with the portable code
+  @param enabled 0 to use the portable code, otherwise AES-NI if the CPU has it
+*/
+void aesni_set_enabled(int enabled)
+{
+   __atomic_store_n(&aesni_state, -1, __ATOMIC_RELAXED);
+   if (!enabled || !aesni_enabled()) {
+      __atomic_store_n(&aesni_state, 0, __ATOMIC_RELAXED);
+   }
+}
+
+/* one step of the key expansion, assist is the word given by AESKEYGENASSIST already broadcast */
+static AESNI_TARGET __m128i aesni_expand(__m128i key, __m128i assist)
+{
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+   return _mm_xor_si128(key, assist);
+}
+
+/* AESKEYGENASSIST needs the round constant as an immediate */
+#define AESNI_KEY128(rk, i, rcon) \
+   rk[i] = aesni_expand(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+#define AESNI_KEY256(rk, i, rcon) \
+   rk[i] = aesni_expand(rk[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff)); \
+   if (i < 14) rk[i + 1] = aesni_expand(rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa))
+
+/**
+  Schedule an AES key with AESKEYGENASSIST, the decryption keys with AESIMC
+  @param key    The symmetric key, 16 or 32 bytes
+  @param keylen The key length in bytes
+  @param skey   The key as scheduled, skey->rijndael.Nr already set
+*/
+AESNI_TARGET void aesni_setup(const unsigned char *key, int keylen, symmetric_key *skey)
+{
+   __m128i rk[15];
+   int Nr = skey->rijndael.Nr, i;
+
+   rk[0] = _mm_loadu_si128((const __m128i *)key);
+   if (keylen == 16) {
+      AESNI_KEY128(rk, 1, 0x01);
+      AESNI_KEY128(rk, 2, 0x02);
+      AESNI_KEY128(rk, 3, 0x04);
+      AESNI_KEY128(rk, 4, 0x08);
+      AESNI_KEY128(rk, 5, 0x10);
+      AESNI_KEY128(rk, 6, 0x20);
+      AESNI_KEY128(rk, 7, 0x40);
+      AESNI_KEY128(rk, 8, 0x80);
+      AESNI_KEY128(rk, 9, 0x1b);
+      AESNI_KEY128(rk, 10, 0x36);
+   } else {
+      rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+      AESNI_KEY256(rk, 2, 0x01);
+      AESNI_KEY256(rk, 4, 0x02);
+      AESNI_KEY256(rk, 6, 0x04);
+      AESNI_KEY256(rk, 8, 0x08);
+      AESNI_KEY256(rk, 10, 0x10);
+      AESNI_KEY256(rk, 12, 0x20);
+      AESNI_KEY256(rk, 14, 0x40);
+   }
+
+   /* the equivalent inverse cipher runs the rounds backwards with InvMixColumns applied to the inner keys */
+   for (i = 0; i <= Nr; i++) {
+      _mm_storeu_si128((__m128i *)skey->rijndael.niK[0][i], rk[i]);
+      _mm_storeu_si128((__m128i *)skey->rijndael.niK[1][i], (i == 0 || i == Nr) ? rk[Nr - i] : _mm_aesimc_si128(rk[Nr - i]));
+   }
+}
+
+/**
+  Encrypt a block with AES-NI
+  @param pt   The input plaintext (16 bytes)
+  @param ct   The output ciphertext (16 bytes)
+  @param skey The key as scheduled by aesni_setup
+*/
+AESNI_TARGET void aesni_ecb_encrypt(const unsigned char *pt, unsigned char *ct, symmetric_key *skey)
+{
+   __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)pt), _mm_loadu_si128((const __m128i *)skey->rijndael.niK[0][0]));
+   int r;
+   for (r = 1; r < skey->rijndael.Nr; r++) {
+      b = _mm_aesenc_si128(b, _mm_loadu_si128((const __m128i *)skey->rijndael.niK[0][r]));
+   }
+   b = _mm_aesenclast_si128(b, _mm_loadu_si128((const __m128i *)skey->rijndael.niK[0][r]));
+   _mm_storeu_si128((__m128i *)ct, b);
+}
+
+/**
+  Decrypt a block with AES-NI
+  @param ct   The input ciphertext (16 bytes)
+  @param pt   The output plaintext (16 bytes)
+  @param skey The key as scheduled by aesni_setup
+*/
+AESNI_TARGET void aesni_ecb_decrypt(const unsigned char *ct, unsigned char *pt, symmetric_key *skey)
+{
+   __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)ct), _mm_loadu_si128((const __m128i *)skey->rijndael.niK[1][0]));
+   int r;
+   for (r = 1; r < skey->rijndael.Nr; r++) {
+      b = _mm_aesdec_si128(b, _mm_loadu_si128((const __m128i *)skey->rijndael.niK[1][r]));
+   }
+   b = _mm_aesdeclast_si128(b, _mm_loadu_si128((const __m128i *)skey->rijndael.niK[1][r]));
+   _mm_storeu_si128((__m128i *)pt, b);
+}
+
+#ifdef LTC_GCM_MODE
+
+/* GHASH works on bit reflected values, byte swapped they can be multiplied as plain polynomials */
+#define GHASH_BSWAP(x) _mm_shuffle_epi8((x), _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15))
+
+/**
+  Carry-less product of two byte swapped elements of GF(2^128), without reducing
+  @param a  First factor
+  @param b  Second factor
+  @param lo Low half of the product, added to the value it has
+  @param hi High half of the product, added to the value it has
+*/
+static AESNI_TARGET void ghash_clmul_wide(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+   __m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+   *lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8)));
+   *hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8)));
+}
+
+/**
+  Reduce a 256 bit carry-less product to GF(2^128), as in the Intel carry-less multiplication white paper.
+  The reduction is linear, several products can be added before it
+  @param lo Low half of the product
+  @param hi High half of the product
+  @return The element, byte swapped
+*/
+static AESNI_TARGET __m128i ghash_reduce(__m128i lo, __m128i hi)
+{
+   __m128i t1, t2, t3;
+
+   /* shift the product one bit left, the reflection leaves it one bit short */
+   t1 = _mm_srli_epi32(lo, 31);
+   t2 = _mm_srli_epi32(hi, 31);
+   lo = _mm_slli_epi32(lo, 1);
+   hi = _mm_slli_epi32(hi, 1);
+   t3 = _mm_srli_si128(t1, 12);
+   t2 = _mm_slli_si128(t2, 4);
+   t1 = _mm_slli_si128(t1, 4);
+   lo = _mm_or_si128(lo, t1);
+   hi = _mm_or_si128(hi, t2);
+   hi = _mm_or_si128(hi, t3);
+
+   /* reduce modulo x^128 + x^7 + x^2 + x + 1 */
+   t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+   t2 = _mm_srli_si128(t1, 4);
+   t1 = _mm_slli_si128(t1, 12);
+   lo = _mm_xor_si128(lo, t1);
+   t3 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+   t3 = _mm_xor_si128(t3, t2);
+   lo = _mm_xor_si128(lo, t3);
+   return _mm_xor_si128(hi, lo);
+}
+
+/**
+  Multiply two byte swapped elements of GF(2^128) with PCLMULQDQ
+  @param a First factor
+  @param b Second factor
+  @return The product, byte swapped
+*/
+static AESNI_TARGET __m128i ghash_clmul(__m128i a, __m128i b)
+{
+   __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+   ghash_clmul_wide(a, b, &lo, &hi);
+   return ghash_reduce(lo, hi);
+}
+
+/**
+  GCM multiply by H with PCLMULQDQ
+  @param H The multiplier
+  @param I The value to multiply H by, replaced by the product
+*/
+AESNI_TARGET void aesni_gcm_mult_h(const unsigned char *H, unsigned char *I)
+{
+   __m128i x = GHASH_BSWAP(_mm_loadu_si128((const __m128i *)I));
+   __m128i h = GHASH_BSWAP(_mm_loadu_si128((const __m128i *)H));
+   _mm_storeu_si128((__m128i *)I, GHASH_BSWAP(ghash_clmul(x, h)));
+}
+
+/**
+  Encrypt or decrypt whole blocks of a GCM message with AES-NI, four counters at a time.
+  On entry gcm->buf holds the key stream of the current counter, as the portable loop expects,
+  and on return it holds the one of the counter after the last block
+  @param gcm       The GCM state, its cipher scheduled by aesni_setup
+  @param pt        The plaintext
+  @param ct        The ciphertext
+  @param blocks    Number of 16 byte blocks
+  @param direction Encrypt or Decrypt mode (GCM_ENCRYPT or GCM_DECRYPT)
+*/
+AESNI_TARGET void aesni_gcm_process(gcm_state *gcm, unsigned char *pt, unsigned char *ct, unsigned long blocks, int direction)
+{
+   const unsigned char (*rk)[16] = (const unsigned char (*)[16])gcm->K.rijndael.niK[0];
+   unsigned char *src = (direction == GCM_ENCRYPT) ? pt : ct, *dst = (direction == GCM_ENCRYPT) ? ct : pt;
+   unsigned char ctr_block[4][16];
+   __m128i x = GHASH_BSWAP(_mm_loadu_si128((const __m128i *)gcm->X));
+   __m128i cur = _mm_loadu_si128((const __m128i *)gcm->buf);
+   __m128i hp[4], next[4], c[4], key, in, out, lo, hi;
+   unsigned long i, j, n;
+   ulong32 ctr, next_ctr;
+   int r, Nr = gcm->K.rijndael.Nr;
+
+   /* powers H, H^2, H^3 and H^4 */
+   hp[0] = GHASH_BSWAP(_mm_loadu_si128((const __m128i *)gcm->H));
+   for (j = 1; j < 4; j++) {
+      hp[j] = ghash_clmul(hp[j - 1], hp[0]);
+   }
+
+   LOAD32H(ctr, gcm->Y + 12);
+   for (i = 0; i < blocks; i += n) {
+      n = MIN(blocks - i, 4);
+
+      /* key stream of the next n counters, encrypted in parallel */
+      key = _mm_loadu_si128((const __m128i *)rk[0]);
+      for (j = 0; j < n; j++) {
+         next_ctr = ctr + 1 + (ulong32)j;
+         XMEMCPY(ctr_block[j], gcm->Y, 12);
+         STORE32H(next_ctr, ctr_block[j] + 12);
+         next[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)ctr_block[j]), key);
+      }
+      for (r = 1; r < Nr; r++) {
+         key = _mm_loadu_si128((const __m128i *)rk[r]);
+         for (j = 0; j < n; j++) {
+            next[j] = _mm_aesenc_si128(next[j], key);
+         }
+      }
+      key = _mm_loadu_si128((const __m128i *)rk[Nr]);
+      for (j = 0; j < n; j++) {
+         next[j] = _mm_aesenclast_si128(next[j], key);
+      }
+
+      /* block j uses the counter j of the batch, the first one was encrypted by the previous batch */
+      lo = hi = _mm_setzero_si128();
+      for (j = 0; j < n; j++) {
+         in  = _mm_loadu_si128((const __m128i *)(src + 16 * (i + j)));
+         out = _mm_xor_si128(in, j ? next[j - 1] : cur);
+         _mm_storeu_si128((__m128i *)(dst + 16 * (i + j)), out);
+         c[j] = GHASH_BSWAP(direction == GCM_ENCRYPT ? out : in);
+      }
+      /* X = (X + C0)H^4 + C1H^3 + C2H^2 + C3H with a single reduction, one block at a time for the tail */
+      if (n == 4) {
+         ghash_clmul_wide(_mm_xor_si128(x, c[0]), hp[3], &lo, &hi);
+         ghash_clmul_wide(c[1], hp[2], &lo, &hi);
+         ghash_clmul_wide(c[2], hp[1], &lo, &hi);
+         ghash_clmul_wide(c[3], hp[0], &lo, &hi);
+         x = ghash_reduce(lo, hi);
+      } else {
+         for (j = 0; j < n; j++) {
+            x = ghash_clmul(_mm_xor_si128(x, c[j]), hp[0]);
+         }
+      }
+      cur = next[n - 1];
+      ctr += (ulong32)n;
+   }
+
+   STORE32H(ctr, gcm->Y + 12);
+   _mm_storeu_si128((__m128i *)gcm->buf, cur);
+   _mm_storeu_si128((__m128i *)gcm->X, GHASH_BSWAP(x));
+   gcm->pttotlen += blocks * CONST64(128);
+}
+
+#endif /* LTC_GCM_MODE */
+
+#endif /* LTC_AES_NI */
+
+/* $Source$ */
+/* $Revision$ */
+/* $Date$ */
+
+
 /* LibTomCrypt, modular cryptographic library -- Tom St Denis
  *
  * LibTomCrypt is a library that provides various cryptographic
@@ -33360,6 +33921,14 @@ int gcm_init(gcm_state *gcm, int cipher,
    gcm->totlen   = 0;
    gcm->pttotlen = 0;
 
+#ifdef LTC_AES_NI
+   /* PCLMULQDQ multiplies by H directly, the tables are not needed */
+   gcm->clmul = aesni_enabled();
+   if (gcm->clmul) {
+      return CRYPT_OK;
+   }
+#endif
+
 #ifdef LTC_GCM_TABLES
    /* setup tables */
 
@@ -33472,10 +34041,17 @@ int gcm_process(gcm_state *gcm,
    }
 
    x = 0;
+#ifdef LTC_AES_NI
+   /* whole blocks with AES-NI and PCLMULQDQ, the rest goes on below */
+   if (gcm->buflen == 0 && gcm->clmul && cipher_descriptor[gcm->cipher].ecb_encrypt == rijndael_ecb_encrypt && gcm->K.rijndael.ni) {
+      x = ptlen & ~15;
+      aesni_gcm_process(gcm, pt, ct, x / 16, direction);
+   }
+#endif
 #ifdef LTC_FAST
    if (gcm->buflen == 0) {
       if (direction == GCM_ENCRYPT) { 
-         for (x = 0; x < (ptlen & ~15); x += 16) {
+         for (; x < (ptlen & ~15); x += 16) {
              /* ctr encrypt */
              for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
                  *((LTC_FAST_TYPE*)(&ct[x + y])) = *((LTC_FAST_TYPE*)(&pt[x+y])) ^ *((LTC_FAST_TYPE*)(&gcm->buf[y]));
@@ -33493,7 +34069,7 @@ int gcm_process(gcm_state *gcm,
              }
          }
       } else {
-         for (x = 0; x < (ptlen & ~15); x += 16) {
+         for (; x < (ptlen & ~15); x += 16) {
              /* ctr encrypt */
              for (y = 0; y < 16; y += sizeof(LTC_FAST_TYPE)) {
                  *((LTC_FAST_TYPE*)(&gcm->X[y])) ^= *((LTC_FAST_TYPE*)(&ct[x+y]));
@@ -33577,6 +34153,14 @@ void gcm_mult_h(gcm_state *gcm, unsigned char *I)
    unsigned char T[16];
 #ifdef LTC_GCM_TABLES
    int x, y;
+#endif
+#ifdef LTC_AES_NI
+   if (gcm->clmul) {
+      aesni_gcm_mult_h(gcm->H, I);
+      return;
+   }
+#endif
+#ifdef LTC_GCM_TABLES
 #ifdef LTC_GCM_TABLES_SSE2
    asm("movdqa (%0),%%xmm0"::"r"(&gcm->PC[0][I[0]][0]));
    for (x = 1; x < 16; x++) {
@@ -79,11 +79,30 @@
 #undef TLS_ECDSA_SUPPORTED
 #endif
 
+#if defined(TLS_FORWARD_SECRECY) && !defined(_WIN32) && !defined(NO_TLS_KEYSHARE_POOL)
+// background generation of ephemeral keys (see tls_keyshare_pool_start)
+#include <pthread.h>
+#define TLS_KEYSHARE_POOL
+#if defined(__linux__) && !defined(SCHED_IDLE)
+// only declared with _GNU_SOURCE
+#define SCHED_IDLE 5
+#endif
+#endif
+
 #ifndef TLS_ECDSA_SUPPORTED
 // disable client ECDSA if not supported
 #undef TLS_CLIENT_ECDSA
 #endif
 
+#if defined(TLS_WITH_CHACHA20_POLY1305) && !defined(_WIN32) && !defined(NO_TLS_DRBG)
+// per-thread ChaCha20 generator (see tls_drbg_random)
+#include <pthread.h>
+#define TLS_DRBG
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+#endif
+
 #define TLS_DH_DEFAULT_P            "87A8E61DB4B6663CFFBBD19C651959998CEEF608660DD0F25D2CEED4435E3B00E00DF8F1D61957D4FAF7DF4561B2AA3016C3D91134096FAA3BF4296D830E9A7C209E0C6497517ABD5A8A9D306BCF67ED91F9E6725B4758C022E0B1EF4275BF7B6C5BFC11D45F9088B941F54EB1E59BB8BC39A0BF12307F5C4FDB70C581B23F76B63ACAE1CAA6B7902D52526735488A0EF13C6D9A51BFA4AB3AD8347796524D8EF6A167B5A41825D967E144E5140564251CCACB83E6B486F6B3CA3F7971506026C0B857F689962856DED4010ABD0BE621C3A3960A54E710C375F26375D7014103A4B54330C198AF126116D2276E11715F693877FAD7EF09CADB094AE91E1A1597"
 #define TLS_DH_DEFAULT_G            "3FB32C9B73134D0B2E77506660EDBD484CA7B18F21EF205407F4793A1A0BA12510DBC15077BE463FFF4FED4AAC0BB555BE3A6C1B0C6B47B1BC3773BF7E8C6F62901228F8C28CBB18A55AE31341000A650196F931C77A57F2DDF463E5E9EC144B777DE62AAAB8A8628AC376D282D6ED3864E67982428EBC831D14348F6F2F9193B5045AF2767164E1DFC967C1FB3F2E55A4BD1BFFE83B9C80D052B985D182EA0ADB2A3B7313D3FE14C8484B1E052588B9B7D2BBD2DF016199ECD06E1557CD0915B3353BBB64E0EC377FD028370DF92B52C7891428CDC67EB6184B523D1DB246C32F63078490F00EF8D647D148D47954515E2327CFEF98C582664B4C0F6CC41659"
 #define TLS_DHE_KEY_SIZE          2048
@@ -98,9 +117,24 @@
 //     #define TLS_DHE_KEY_SIZE          1024
 // #endif
 
+#if defined(TLS_SLAB_ALLOCATOR) && defined(_WIN32)
+#undef TLS_SLAB_ALLOCATOR
+#endif
+#ifdef TLS_SLAB_ALLOCATOR
+    // per-thread caches of size-class slabs (see tls_slab_malloc)
+    #include <pthread.h>
+    #include <sys/mman.h>
+    #define TLS_MALLOC(size)        tls_slab_malloc(size)
+    #define TLS_CALLOC(count, size) tls_slab_calloc(count, size)
+    #define TLS_REALLOC(ptr, size)  tls_slab_realloc(ptr, size)
+    #define TLS_FREE(ptr)           tls_slab_free(ptr)
+#endif
 #ifndef TLS_MALLOC
     #define TLS_MALLOC(size)        malloc(size)
 #endif
+#ifndef TLS_CALLOC
+    #define TLS_CALLOC(count, size) calloc(count, size)
+#endif
 #ifndef TLS_REALLOC
     #define TLS_REALLOC(ptr, size)  realloc(ptr, size)
 #endif
@@ -157,6 +191,8 @@
 #define TLS_MIN_FINISHED_OPAQUE_LEN 12
 
 #define TLS_BLOB_INCREMENT        0xFFF
+// record buffers kept by every connection for its next records (slab allocator only)
+#define TLS_ARENA_BLOCKS          4
 #define TLS_ASN1_MAXLEVEL         0xFF
 
 #define DTLS_COOKIE_SIZE          32
@@ -169,6 +205,12 @@
 #define TLS_MAX_RSA_KEY   2048
 
 #define TLS_MAXTLS_APP_SIZE      0x4000
+// room ensured by tls_stream_buffer: a whole record, with the largest expansion allowed for a ciphertext
+#define TLS_STREAM_RESERVE       (TLS_MAXTLS_APP_SIZE + 2048 + 5)
+// payload of the first application record, so that it fits one TCP segment with timestamps after the record overhead
+#define TLS_RECORD_SIZE_MIN      1369
+// seconds without writing before records start small again
+#define TLS_RECORD_IDLE          1
 // max 1 second sleep
 #define TLS_MAX_ERROR_SLEEP_uS    1000000
 // max 5 seconds context sleep
@@ -342,6 +384,148 @@ static inline void chacha_ivupdate(chacha_ctx *x, const u8 *iv, const u8 *aad, c
     x->input[15] = _private_tls_U8TO32_LITTLE(iv + 8) ^ _private_tls_U8TO32_LITTLE(aad + 4);
 }
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TLS_CHACHA_SIMD
+#include <immintrin.h>
+
+// Multi-block ChaCha20: every vector holds the same word of 4 (SSE2) or 8 (AVX2) consecutive blocks,
+// so the rounds run on all of them at once and the key stream is transposed back afterwards.
+#define CHACHA_ROTL_SSE2(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_SSE2(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 16); \
+    c = _mm_add_epi32(c, d); b = CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 12); \
+    a = _mm_add_epi32(a, b); d = CHACHA_ROTL_SSE2(_mm_xor_si128(d, a), 8); \
+    c = _mm_add_epi32(c, d); b = CHACHA_ROTL_SSE2(_mm_xor_si128(b, c), 7);
+
+#define CHACHA_ROTL_AVX2(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_AVX2(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8); \
+    c = _mm256_add_epi32(c, d); b = CHACHA_ROTL_AVX2(_mm256_xor_si256(b, c), 7);
+
+static __attribute__((target("sse2"))) void _private_tls_chacha_blocks_sse2(const u32 *input, const u8 *m, u8 *c, u32 blocks) {
+    __m128i x[16], j[16], t0, t1, t2, t3;
+    u32 b, i, g;
+
+    for (i = 0; i < 16; i++)
+        j[i] = _mm_set1_epi32((int)input[i]);
+    for (b = 0; b < blocks; b += 4) {
+        j[12] = _mm_add_epi32(_mm_set1_epi32((int)(input[12] + b)), _mm_set_epi32(3, 2, 1, 0));
+        for (i = 0; i < 16; i++)
+            x[i] = j[i];
+        for (i = 20; i > 0; i -= 2) {
+            CHACHA_QR_SSE2(x[0], x[4], x[8], x[12])
+            CHACHA_QR_SSE2(x[1], x[5], x[9], x[13])
+            CHACHA_QR_SSE2(x[2], x[6], x[10], x[14])
+            CHACHA_QR_SSE2(x[3], x[7], x[11], x[15])
+            CHACHA_QR_SSE2(x[0], x[5], x[10], x[15])
+            CHACHA_QR_SSE2(x[1], x[6], x[11], x[12])
+            CHACHA_QR_SSE2(x[2], x[7], x[8], x[13])
+            CHACHA_QR_SSE2(x[3], x[4], x[9], x[14])
+        }
+        for (i = 0; i < 16; i++)
+            x[i] = _mm_add_epi32(x[i], j[i]);
+        // words 4g..4g+3 of the 4 blocks, transposed to 16 bytes of each block
+        for (g = 0; g < 4; g++) {
+            t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+            t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+            t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+            t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+            x[4 * g]     = _mm_unpacklo_epi64(t0, t1);
+            x[4 * g + 1] = _mm_unpackhi_epi64(t0, t1);
+            x[4 * g + 2] = _mm_unpacklo_epi64(t2, t3);
+            x[4 * g + 3] = _mm_unpackhi_epi64(t2, t3);
+            for (i = 0; i < 4; i++)
+                _mm_storeu_si128((__m128i *)(c + 64 * i + 16 * g), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(m + 64 * i + 16 * g)), x[4 * g + i]));
+        }
+        m += 256;
+        c += 256;
+    }
+}
+
+static __attribute__((target("avx2"))) void _private_tls_chacha_blocks_avx2(const u32 *input, const u8 *m, u8 *c, u32 blocks) {
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, 14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    __m256i x[16], j[16], t0, t1, t2, t3;
+    u32 b, i, g;
+
+    for (i = 0; i < 16; i++)
+        j[i] = _mm256_set1_epi32((int)input[i]);
+    for (b = 0; b < blocks; b += 8) {
+        j[12] = _mm256_add_epi32(_mm256_set1_epi32((int)(input[12] + b)), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+        for (i = 0; i < 16; i++)
+            x[i] = j[i];
+        for (i = 20; i > 0; i -= 2) {
+            CHACHA_QR_AVX2(x[0], x[4], x[8], x[12])
+            CHACHA_QR_AVX2(x[1], x[5], x[9], x[13])
+            CHACHA_QR_AVX2(x[2], x[6], x[10], x[14])
+            CHACHA_QR_AVX2(x[3], x[7], x[11], x[15])
+            CHACHA_QR_AVX2(x[0], x[5], x[10], x[15])
+            CHACHA_QR_AVX2(x[1], x[6], x[11], x[12])
+            CHACHA_QR_AVX2(x[2], x[7], x[8], x[13])
+            CHACHA_QR_AVX2(x[3], x[4], x[9], x[14])
+        }
+        for (i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], j[i]);
+        // the transposition works inside each 128 bit lane: blocks 0-3 low, blocks 4-7 high
+        for (g = 0; g < 4; g++) {
+            t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+            t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+            t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+            t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+            x[4 * g]     = _mm256_unpacklo_epi64(t0, t1);
+            x[4 * g + 1] = _mm256_unpackhi_epi64(t0, t1);
+            x[4 * g + 2] = _mm256_unpacklo_epi64(t2, t3);
+            x[4 * g + 3] = _mm256_unpackhi_epi64(t2, t3);
+        }
+        // 32 bytes of a block join the same lane of two groups
+        for (i = 0; i < 4; i++) {
+            for (g = 0; g < 4; g += 2) {
+                t0 = _mm256_permute2x128_si256(x[4 * g + i], x[4 * (g + 1) + i], 0x20);
+                t1 = _mm256_permute2x128_si256(x[4 * g + i], x[4 * (g + 1) + i], 0x31);
+                _mm256_storeu_si256((__m256i *)(c + 64 * i + 16 * g), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(m + 64 * i + 16 * g)), t0));
+                _mm256_storeu_si256((__m256i *)(c + 64 * (i + 4) + 16 * g), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(m + 64 * (i + 4) + 16 * g)), t1));
+            }
+        }
+        m += 512;
+        c += 512;
+    }
+}
+
+// 2 with AVX2, 1 with SSE2, 0 without vectors; -1 until the CPU is checked
+static int _private_tls_simd_level = -1;
+
+static int _private_tls_simd(void) {
+    int level = __atomic_load_n(&_private_tls_simd_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("sse2") ? 1 : 0);
+        __atomic_store_n(&_private_tls_simd_level, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+
+// Encrypt as many whole blocks as the vector kernels take, without letting the 32 bit counter wrap
+static u32 _private_tls_chacha_simd(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes) {
+    int level = _private_tls_simd();
+    u32 blocks = bytes / CHACHA_BLOCKLEN;
+    if ((!level) || ((unsigned long long)x->input[12] + blocks > 0xFFFFFFFFULL))
+        return 0;
+    if (level == 2) {
+        blocks &= ~7U;
+        if (blocks)
+            _private_tls_chacha_blocks_avx2(x->input, m, c, blocks);
+    } else {
+        blocks &= ~3U;
+        if (blocks)
+            _private_tls_chacha_blocks_sse2(x->input, m, c, blocks);
+    }
+    x->input[12] += blocks;
+    return blocks * CHACHA_BLOCKLEN;
+}
+#endif
+
 static inline void chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 bytes) {
     u32 x0, x1, x2, x3, x4, x5, x6, x7;
     u32 x8, x9, x10, x11, x12, x13, x14, x15;
@@ -350,10 +534,24 @@ static inline void chacha_encrypt_bytes(chacha_ctx *x, const u8 *m, u8 *c, u32 b
     u8 *ctarget = NULL;
     u8 tmp[64];
     u_int i;
+#ifdef TLS_CHACHA_SIMD
+    u32 done;
+#endif
 
     if (!bytes)
         return;
 
+#ifdef TLS_CHACHA_SIMD
+    done = _private_tls_chacha_simd(x, m, c, bytes);
+    if (done == bytes) {
+        x->unused = 0;
+        return;
+    }
+    m += done;
+    c += done;
+    bytes -= done;
+#endif
+
     j0 = x->input[0];
     j1 = x->input[1];
     j2 = x->input[2];
@@ -599,6 +797,112 @@ void _private_tls_poly1305_init(poly1305_context *ctx, const unsigned char key[3
     st->final = 0;
 }
 
+#ifdef TLS_CHACHA_SIMD
+#define POLY1305_SIMD_MIN 256
+
+// out = a * b (partial) mod 2^130 - 5, in 26 bit limbs
+static void _private_tls_poly1305_mul(unsigned long out[5], const unsigned long a[5], const unsigned long b[5]) {
+    unsigned long long d0, d1, d2, d3, d4;
+    unsigned long s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5, c;
+
+    d0 = ((unsigned long long)a[0] * b[0]) + ((unsigned long long)a[1] * s4) + ((unsigned long long)a[2] * s3) + ((unsigned long long)a[3] * s2) + ((unsigned long long)a[4] * s1);
+    d1 = ((unsigned long long)a[0] * b[1]) + ((unsigned long long)a[1] * b[0]) + ((unsigned long long)a[2] * s4) + ((unsigned long long)a[3] * s3) + ((unsigned long long)a[4] * s2);
+    d2 = ((unsigned long long)a[0] * b[2]) + ((unsigned long long)a[1] * b[1]) + ((unsigned long long)a[2] * b[0]) + ((unsigned long long)a[3] * s4) + ((unsigned long long)a[4] * s3);
+    d3 = ((unsigned long long)a[0] * b[3]) + ((unsigned long long)a[1] * b[2]) + ((unsigned long long)a[2] * b[1]) + ((unsigned long long)a[3] * b[0]) + ((unsigned long long)a[4] * s4);
+    d4 = ((unsigned long long)a[0] * b[4]) + ((unsigned long long)a[1] * b[3]) + ((unsigned long long)a[2] * b[2]) + ((unsigned long long)a[3] * b[1]) + ((unsigned long long)a[4] * b[0]);
+
+                  c = (unsigned long)(d0 >> 26); out[0] = (unsigned long)d0 & 0x3ffffff;
+    d1 += c;      c = (unsigned long)(d1 >> 26); out[1] = (unsigned long)d1 & 0x3ffffff;
+    d2 += c;      c = (unsigned long)(d2 >> 26); out[2] = (unsigned long)d2 & 0x3ffffff;
+    d3 += c;      c = (unsigned long)(d3 >> 26); out[3] = (unsigned long)d3 & 0x3ffffff;
+    d4 += c;      c = (unsigned long)(d4 >> 26); out[4] = (unsigned long)d4 & 0x3ffffff;
+    out[0] += c * 5;  c = (out[0] >> 26); out[0] &= 0x3ffffff;
+    out[1] += c;
+}
+
+// d = a * r lane by lane, with s = 5 * r, followed by the same partial reduction as the scalar code
+#define POLY1305_MUL_AVX2(a, r, s) { \
+    __m256i d0, d1, d2, d3, d4, c; \
+    d0 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a[0], r[0]), _mm256_mul_epu32(a[1], s[4])), _mm256_add_epi64(_mm256_mul_epu32(a[2], s[3]), _mm256_mul_epu32(a[3], s[2]))), _mm256_mul_epu32(a[4], s[1])); \
+    d1 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a[0], r[1]), _mm256_mul_epu32(a[1], r[0])), _mm256_add_epi64(_mm256_mul_epu32(a[2], s[4]), _mm256_mul_epu32(a[3], s[3]))), _mm256_mul_epu32(a[4], s[2])); \
+    d2 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a[0], r[2]), _mm256_mul_epu32(a[1], r[1])), _mm256_add_epi64(_mm256_mul_epu32(a[2], r[0]), _mm256_mul_epu32(a[3], s[4]))), _mm256_mul_epu32(a[4], s[3])); \
+    d3 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a[0], r[3]), _mm256_mul_epu32(a[1], r[2])), _mm256_add_epi64(_mm256_mul_epu32(a[2], r[1]), _mm256_mul_epu32(a[3], r[0]))), _mm256_mul_epu32(a[4], s[4])); \
+    d4 = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epu32(a[0], r[4]), _mm256_mul_epu32(a[1], r[3])), _mm256_add_epi64(_mm256_mul_epu32(a[2], r[2]), _mm256_mul_epu32(a[3], r[1]))), _mm256_mul_epu32(a[4], r[0])); \
+                                    c = _mm256_srli_epi64(d0, 26); a[0] = _mm256_and_si256(d0, mask); \
+    d1 = _mm256_add_epi64(d1, c);   c = _mm256_srli_epi64(d1, 26); a[1] = _mm256_and_si256(d1, mask); \
+    d2 = _mm256_add_epi64(d2, c);   c = _mm256_srli_epi64(d2, 26); a[2] = _mm256_and_si256(d2, mask); \
+    d3 = _mm256_add_epi64(d3, c);   c = _mm256_srli_epi64(d3, 26); a[3] = _mm256_and_si256(d3, mask); \
+    d4 = _mm256_add_epi64(d4, c);   c = _mm256_srli_epi64(d4, 26); a[4] = _mm256_and_si256(d4, mask); \
+    a[0] = _mm256_add_epi64(a[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2))); \
+    c = _mm256_srli_epi64(a[0], 26); a[0] = _mm256_and_si256(a[0], mask); \
+    a[1] = _mm256_add_epi64(a[1], c); \
+}
+
+// the 4 blocks at m, one per 64 bit lane, split in 26 bit limbs
+#define POLY1305_LOAD_AVX2(mm, m) { \
+    __m256i x = _mm256_loadu_si256((const __m256i *)(m)), y = _mm256_loadu_si256((const __m256i *)((m) + 32)), lo, hi; \
+    lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(x, y), 0xD8); \
+    hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(x, y), 0xD8); \
+    mm[0] = _mm256_and_si256(lo, mask); \
+    mm[1] = _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask); \
+    mm[2] = _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask); \
+    mm[3] = _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask); \
+    mm[4] = _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit); \
+}
+
+// 4-way Poly1305: lane j accumulates blocks j, j+4, j+8... with r^4 and is multiplied by r^(4-j) at the end,
+// which adds up to the same polynomial as Horner's rule one block at a time
+static __attribute__((target("avx2"))) size_t _private_tls_poly1305_blocks_avx2(poly1305_state_internal_t *st, const unsigned char *m, size_t bytes) {
+    const __m256i mask = _mm256_set1_epi64x(0x3ffffff), hibit = _mm256_set1_epi64x(1 << 24);
+    unsigned long p[5][5], h[5], c;
+    unsigned long long lanes[4];
+    __m256i a[5], mm[5], r[5], s[5];
+    size_t done = bytes & ~(size_t)63;
+    int i, k;
+
+    // p[k] = r^k
+    for (i = 0; i < 5; i++)
+        p[1][i] = st->r[i];
+    for (k = 2; k <= 4; k++)
+        _private_tls_poly1305_mul(p[k], p[k - 1], p[1]);
+
+    for (i = 0; i < 5; i++) {
+        r[i] = _mm256_set1_epi64x((long long)p[4][i]);
+        s[i] = _mm256_set1_epi64x((long long)(p[4][i] * 5));
+    }
+    POLY1305_LOAD_AVX2(a, m);
+    for (i = 0; i < 5; i++)
+        a[i] = _mm256_add_epi64(a[i], _mm256_set_epi64x(0, 0, 0, (long long)st->h[i]));
+    for (m += 64, bytes -= 64; bytes >= 64; m += 64, bytes -= 64) {
+        POLY1305_MUL_AVX2(a, r, s);
+        POLY1305_LOAD_AVX2(mm, m);
+        for (i = 0; i < 5; i++)
+            a[i] = _mm256_add_epi64(a[i], mm[i]);
+    }
+
+    for (i = 0; i < 5; i++) {
+        r[i] = _mm256_set_epi64x((long long)p[1][i], (long long)p[2][i], (long long)p[3][i], (long long)p[4][i]);
+        s[i] = _mm256_mul_epu32(r[i], _mm256_set1_epi64x(5));
+    }
+    POLY1305_MUL_AVX2(a, r, s);
+    for (i = 0; i < 5; i++) {
+        _mm256_storeu_si256((__m256i *)lanes, a[i]);
+        h[i] = (unsigned long)(lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    }
+
+                      c = (h[0] >> 26); h[0] &= 0x3ffffff;
+    h[1] += c;        c = (h[1] >> 26); h[1] &= 0x3ffffff;
+    h[2] += c;        c = (h[2] >> 26); h[2] &= 0x3ffffff;
+    h[3] += c;        c = (h[3] >> 26); h[3] &= 0x3ffffff;
+    h[4] += c;        c = (h[4] >> 26); h[4] &= 0x3ffffff;
+    h[0] += c * 5;    c = (h[0] >> 26); h[0] &= 0x3ffffff;
+    h[1] += c;
+    for (i = 0; i < 5; i++)
+        st->h[i] = h[i];
+    return done;
+}
+#endif
+
 static void _private_tls_poly1305_blocks(poly1305_state_internal_t *st, const unsigned char *m, size_t bytes) {
     const unsigned long hibit = (st->final) ? 0 : (1UL << 24); /* 1 << 128 */
     unsigned long r0,r1,r2,r3,r4;
@@ -624,6 +928,19 @@ static void _private_tls_poly1305_blocks(poly1305_state_internal_t *st, const un
     h3 = st->h[3];
     h4 = st->h[4];
 
+#ifdef TLS_CHACHA_SIMD
+    if ((!st->final) && (bytes >= POLY1305_SIMD_MIN) && (_private_tls_simd() == 2)) {
+        size_t done = _private_tls_poly1305_blocks_avx2(st, m, bytes);
+        m += done;
+        bytes -= done;
+        h0 = st->h[0];
+        h1 = st->h[1];
+        h2 = st->h[2];
+        h3 = st->h[3];
+        h4 = st->h[4];
+    }
+#endif
+
     while (bytes >= poly1305_block_size) {
         /* h += m[i] */
         h0 += (_private_tls_U8TO32(m+ 0)     ) & 0x3ffffff;
@@ -964,6 +1281,11 @@ struct TLSContext {
     
     unsigned char *message_buffer;
     unsigned int message_buffer_len;
+    unsigned int message_buffer_size;
+#ifdef TLS_SLAB_ALLOCATOR
+    void *arena[TLS_ARENA_BLOCKS];
+    unsigned char arena_count;
+#endif
     uint64_t remote_sequence_number;
     uint64_t local_sequence_number;
     
@@ -973,9 +1295,14 @@ struct TLSContext {
     
     unsigned char *tls_buffer;
     unsigned int tls_buffer_len;
+    // application records written since the connection was last idle, and when the last one was
+    unsigned int write_records;
+    time_t last_write;
     
     unsigned char *application_buffer;
     unsigned int application_buffer_len;
+    // bytes at the front already taken by tls_read
+    unsigned int application_buffer_start;
     unsigned char is_child;
     unsigned char exportable;
     unsigned char *exportable_keys;
@@ -1013,6 +1340,22 @@ struct TLSContext {
     char *negotiated_alpn;
     unsigned int sleep_until;
     unsigned short tls13_version;
+    // TLS 1.2 session the client may resume with an abbreviated handshake (server-side)
+    unsigned char resumable_session[TLS_MAX_SESSION_ID];
+    unsigned char resumable_session_size;
+    unsigned short resumable_cipher;
+    unsigned char resumable_master_key[TLS_MASTER_SECRET_SIZE];
+    unsigned char resumed;
+    // versions a server accepts, 0 for no limit
+    unsigned short min_version;
+    unsigned short max_version;
+    // signature schemes a client offers (TLS_SIGN_RSA, TLS_SIGN_ECDSA), 0 for all of them
+    unsigned char sign_schemes;
+#ifdef TLS_ECDSA_SUPPORTED
+    // ECDSA schemes of the signature_algorithms of the client (bit 0: sha256, 1: sha384, 2: sha512)
+    unsigned char peer_ecdsa_hashes;
+    unsigned char peer_sig_algorithms;
+#endif
 #ifdef TLS_12_FALSE_START
     unsigned char false_start;
 #endif
@@ -1288,6 +1631,24 @@ struct TLSPacket *tls_build_finished(struct TLSContext *context);
 unsigned int _private_tls_hmac_message(unsigned char local, struct TLSContext *context, const unsigned char *buf, int buf_len, const unsigned char *buf2, int buf_len2, unsigned char *out, unsigned int outlen, uint64_t remote_sequence_number);
 int tls_random(unsigned char *key, int len);
 void tls_destroy_packet(struct TLSPacket *packet);
+#define TLS_CLIENT_SCHEMES  11
+
+// signature_algorithms of a TLS 1.3 client, limited to the families of sign_schemes; out may be NULL to count them
+static int _private_tls_client_schemes(struct TLSContext *context, unsigned short *out) {
+    static const unsigned short schemes[TLS_CLIENT_SCHEMES] = {0x0403, 0x0503, 0x0603, 0x0804, 0x0805, 0x0806, 0x0401, 0x0501, 0x0601, 0x0203, 0x0201};
+    int i;
+    int count = 0;
+    for (i = 0; i < TLS_CLIENT_SCHEMES; i++) {
+        // xx03 is ECDSA, the rest RSA
+        if ((context->sign_schemes) && (!(context->sign_schemes & (((schemes[i] & 0xFF) == 3) ? TLS_SIGN_ECDSA : TLS_SIGN_RSA))))
+            continue;
+        if (out)
+            out[count] = schemes[i];
+        count++;
+    }
+    return count;
+}
+
 struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrade);
 struct TLSPacket *tls_build_certificate(struct TLSContext *context);
 struct TLSPacket *tls_build_done(struct TLSContext *context);
@@ -1307,6 +1668,7 @@ void _private_tls_ecc_dhe_free(struct TLSContext *context);
 void _private_tls_dh_clear_key(DHKey *key);
 #endif
 
+struct TLSPacket *_private_tls_build_client_verify12(struct TLSContext *context);
 #ifdef WITH_TLS_13
 struct TLSPacket *tls_build_encrypted_extensions(struct TLSContext *context);
 struct TLSPacket *tls_build_certificate_verify(struct TLSContext *context);
@@ -1368,6 +1730,12 @@ void dtls_reset_cookie_secret() {
     tls_random(dtls_secret, sizeof(dtls_secret));
 }
 
+#ifdef TLS_USE_RANDOM_SOURCE
+static unsigned long _private_tls_sprng_read(unsigned char *out, unsigned long outlen, prng_state *prng) {
+    return tls_random(out, (int)outlen) ? outlen : 0;
+}
+#endif
+
 void tls_init() {
     if (dependecies_loaded)
         return;
@@ -1385,6 +1753,10 @@ void tls_init() {
 #endif
 #endif
     register_prng(&sprng_desc);
+#ifdef TLS_USE_RANDOM_SOURCE
+    // ECC keys, ECDSA nonces and PSS salts come from libtomcrypt's sprng: same source as tls_random
+    prng_descriptor[find_prng("sprng")].read = _private_tls_sprng_read;
+#endif
     register_hash(&sha256_desc);
     register_hash(&sha1_desc);
     register_hash(&sha384_desc);
@@ -1393,6 +1765,10 @@ void tls_init() {
     register_cipher(&aes_desc);
 #ifdef TLS_FORWARD_SECRECY
     init_curves();
+#ifdef LTC_ECC_FIXED_BASE
+    // every ECDHE key share and ECDSA signature on secp256r1 makes a key from the base point
+    ltc_ecc_fixed_base_init(&secp256r1.dp);
+#endif
 #endif
     dtls_reset_cookie_secret();
 }
@@ -1751,7 +2127,7 @@ int _private_tls_verify_rsa(struct TLSContext *context, unsigned int hash_type,
 #endif
 #ifdef WITH_TLS_13
     if ((context->version == TLS_V13) || (context->version == DTLS_V13))
-        err = rsa_verify_hash_ex(buffer, len, hash, hash_len, LTC_PKCS_1_PSS, hash_idx, 0, &rsa_stat, &key);
+        err = rsa_verify_hash_ex(buffer, len, hash, hash_len, LTC_PKCS_1_PSS, hash_idx, hash_len, &rsa_stat, &key);
     else
 #endif
         err = rsa_verify_hash_ex(buffer, len, hash, hash_len, LTC_PKCS_1_V1_5, hash_idx, 0, &rsa_stat, &key);
@@ -1785,20 +2161,83 @@ int _private_rsa_sign_hash_md5sha1(const unsigned char *in, unsigned long inlen,
 }
 #endif
 
+// private key step of a RSA signature, the hash is already computed
+struct TLSSignJob {
+    const unsigned char *der;
+    unsigned int der_len;
+    const unsigned char *hash;
+    unsigned long hash_len;
+    // md5 + sha1 digest of TLS 1.0/1.1, signed without DigestInfo
+    int md5_sha1;
+    int padding;
+    int hash_idx;
+    unsigned long salt_len;
+    unsigned char *out;
+    unsigned long *outlen;
+    int err;
+};
+
+static tls_sign_executor _private_tls_sign_executor = NULL;
+
+void tls_set_sign_executor(tls_sign_executor executor) {
+    _private_tls_sign_executor = executor;
+}
+
+void tls_sign_jobs_run(struct TLSSignJob **jobs, int count, tls_sign_done done, void *arg) {
+    rsa_key key;
+    const unsigned char *der = NULL;
+    unsigned int der_len = 0;
+    int i;
+    tls_init();
+    for (i = 0; i < count; i++) {
+        struct TLSSignJob *job = jobs[i];
+        // jobs of a batch usually share the key of the server, import it only once
+        if ((!der) || (der != job->der) || (der_len != job->der_len)) {
+            if (der)
+                rsa_free(&key);
+            der = NULL;
+            job->err = rsa_import(job->der, job->der_len, &key);
+            if (job->err) {
+                DEBUG_PRINT("Error importing RSA certificate (code: %i)\n", job->err);
+                if (done)
+                    done(i, arg);
+                continue;
+            }
+            der = job->der;
+            der_len = job->der_len;
+        }
+#ifdef TLS_LEGACY_SUPPORT
+        if (job->md5_sha1)
+            job->err = _private_rsa_sign_hash_md5sha1(job->hash, job->hash_len, job->out, job->outlen, &key);
+        else
+#endif
+            job->err = rsa_sign_hash_ex(job->hash, job->hash_len, job->out, job->outlen, job->padding, NULL, find_prng("sprng"), job->hash_idx, job->salt_len, &key);
+        if (done)
+            done(i, arg);
+    }
+    if (der)
+        rsa_free(&key);
+}
+
+// runs the job in the executor set by tls_set_sign_executor, or right here if there is none
+static int _private_tls_sign_job(struct TLSContext *context, struct TLSSignJob *job) {
+    job->der = context->private_key->der_bytes;
+    job->der_len = context->private_key->der_len;
+    if (_private_tls_sign_executor)
+        _private_tls_sign_executor(job);
+    else
+        tls_sign_jobs_run(&job, 1, NULL, NULL);
+    return job->err;
+}
+
 int _private_tls_sign_rsa(struct TLSContext *context, unsigned int hash_type, const unsigned char *message, unsigned int message_len, unsigned char *out, unsigned long *outlen) {
     if ((!outlen) || (!context) || (!out) || (!outlen) || (!context->private_key) || (!context->private_key->der_bytes) || (!context->private_key->der_len)) {
         DEBUG_PRINT("No private key set\n");
         return TLS_GENERIC_ERROR;
     }
     tls_init();
-    rsa_key key;
-    int err;
-    err = rsa_import(context->private_key->der_bytes, context->private_key->der_len, &key);
-    
-    if (err) {
-        DEBUG_PRINT("Error importing RSA certificate (code: %i)\n", err);
-        return TLS_GENERIC_ERROR;
-    }
+    struct TLSSignJob job;
+    int err = 0;
     int hash_idx = -1;
     unsigned char hash[TLS_MAX_HASH_LEN];
     unsigned int hash_len = 0;
@@ -1879,13 +2318,18 @@ int _private_tls_sign_rsa(struct TLSContext *context, unsigned int hash_type, co
             hash_len = 36;
             break;
     }
+    memset(&job, 0, sizeof(job));
+    job.hash = hash;
+    job.hash_len = hash_len;
+    job.out = out;
+    job.outlen = outlen;
 #ifdef TLS_LEGACY_SUPPORT
     if (hash_type == _md5_sha1) {
         if (err) {
             DEBUG_PRINT("Unsupported hash type: %i\n", hash_type);
             return TLS_GENERIC_ERROR;
         }
-        err = _private_rsa_sign_hash_md5sha1(hash, hash_len, out, outlen, &key);
+        job.md5_sha1 = 1;
     } else
 #endif
     {
@@ -1893,20 +2337,44 @@ int _private_tls_sign_rsa(struct TLSContext *context, unsigned int hash_type, co
             DEBUG_PRINT("Unsupported hash type: %i\n", hash_type);
             return TLS_GENERIC_ERROR;
         }
+        job.hash_idx = hash_idx;
+        job.padding = LTC_PKCS_1_V1_5;
 #ifdef WITH_TLS_13
-        if ((context->version == TLS_V13) || (context->version == DTLS_V13))
-            err = rsa_sign_hash_ex(hash, hash_len, out, outlen, LTC_PKCS_1_PSS, NULL, find_prng("sprng"), hash_idx, hash_type == sha256 ? 32 : 48, &key);
-        else
+        if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
+            job.padding = LTC_PKCS_1_PSS;
+            job.salt_len = hash_type == sha256 ? 32 : 48;
+        }
 #endif
-            err = rsa_sign_hash_ex(hash, hash_len, out, outlen, LTC_PKCS_1_V1_5, NULL, find_prng("sprng"), hash_idx, 0, &key);
     }
-    rsa_free(&key);
-    if (err)
+    if (_private_tls_sign_job(context, &job))
         return 0;
     
     return 1;
 }
 
+// PKCS#1 v1.5 signature of a digest already computed, such as the running hash of the handshake
+int _private_tls_sign_rsa_digest(struct TLSContext *context, unsigned int hash_type, const unsigned char *hash, unsigned int hash_len, unsigned char *out, unsigned long *outlen) {
+    if ((!context) || (!out) || (!outlen) || (!context->private_key) || (!context->private_key->der_bytes) || (!context->private_key->der_len)) {
+        DEBUG_PRINT("No private key set\n");
+        return TLS_GENERIC_ERROR;
+    }
+    tls_init();
+    int hash_idx = find_hash(hash_type == sha384 ? "sha384" : "sha256");
+    if ((hash_idx < 0) || ((hash_type != sha256) && (hash_type != sha384)))
+        return TLS_GENERIC_ERROR;
+    struct TLSSignJob job;
+    memset(&job, 0, sizeof(job));
+    job.hash = hash;
+    job.hash_len = hash_len;
+    job.padding = LTC_PKCS_1_V1_5;
+    job.hash_idx = hash_idx;
+    job.out = out;
+    job.outlen = outlen;
+    if (_private_tls_sign_job(context, &job))
+        return 0;
+    return 1;
+}
+
 #ifdef TLS_ECDSA_SUPPORTED
 static int _private_tls_is_point(ecc_key *key) {
     void *prime, *b, *t1, *t2;
@@ -3536,8 +4004,298 @@ void tls_destroy_certificate(struct TLSCertificate *cert) {
     }
 }
 
+#ifdef TLS_SLAB_ALLOCATOR
+// usable bytes of every size class; larger blocks go straight to malloc, or to mmap from TLS_SLAB_MAP
+static const unsigned int _private_tls_slab_sizes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 20480};
+#define TLS_SLAB_CLASSES        (sizeof(_private_tls_slab_sizes) / sizeof(_private_tls_slab_sizes[0]))
+#define TLS_SLAB_LARGE          0xFFFFFFFF
+#define TLS_SLAB_MAPPED         0xFFFFFFFE
+// mapped apart, so their pages are zero, only resident once touched and returned on free
+// (glibc raises its own threshold after the first frees and recycles contexts from the heap)
+#define TLS_SLAB_MAP            (64 * 1024)
+// blocks are carved on demand from chunks of this size, one chunk per class at a time
+#define TLS_SLAB_CHUNK          (64 * 1024)
+// blocks moved at once between a thread and the shared class, at most TLS_SLAB_BATCH_BYTES of them
+// (carving a block touches its first page); a thread keeps up to twice as many per class
+#define TLS_SLAB_BATCH          16
+#define TLS_SLAB_BATCH_BYTES    (8 * 1024)
+// bytes a thread keeps in all, so that many idle threads (one per session) do not hold the memory of the rest
+#define TLS_SLAB_CACHE_BYTES    (16 * 1024)
+
+// in front of every block, keeps the payload 16-byte aligned
+struct TLSSlabHeader {
+    unsigned int size_class;
+    unsigned int size;
+    unsigned long long reserved;
+};
+
+struct TLSSlabFree {
+    struct TLSSlabFree *next;
+};
+
+struct TLSSlabClass {
+    pthread_mutex_t lock;
+    struct TLSSlabFree *blocks;
+    unsigned char *chunk;
+    unsigned int chunk_left;
+};
+
+struct TLSSlabCache {
+    struct TLSSlabFree *blocks[TLS_SLAB_CLASSES];
+    unsigned int count[TLS_SLAB_CLASSES];
+    unsigned int bytes;
+    // 1 once registered for the flush at thread exit, 2 after it
+    unsigned char state;
+};
+
+static struct TLSSlabClass _private_tls_slab_classes[TLS_SLAB_CLASSES];
+static __thread struct TLSSlabCache _private_tls_slab_cache;
+static pthread_once_t _private_tls_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _private_tls_slab_key;
+
+static void _private_tls_slab_give_back(struct TLSSlabCache *cache, unsigned int size_class, unsigned int count) {
+    struct TLSSlabFree *first = cache->blocks[size_class];
+    struct TLSSlabFree *last = first;
+    unsigned int i;
+    if ((!first) || (!count))
+        return;
+    for (i = 1; (i < count) && (last->next); i++)
+        last = last->next;
+    cache->blocks[size_class] = last->next;
+    cache->count[size_class] -= i;
+    cache->bytes -= i * _private_tls_slab_sizes[size_class];
+    struct TLSSlabClass *slab = &_private_tls_slab_classes[size_class];
+    pthread_mutex_lock(&slab->lock);
+    last->next = slab->blocks;
+    slab->blocks = first;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+static void _private_tls_slab_thread_exit(void *arg) {
+    struct TLSSlabCache *cache = (struct TLSSlabCache *)arg;
+    unsigned int i;
+    for (i = 0; i < TLS_SLAB_CLASSES; i++)
+        _private_tls_slab_give_back(cache, i, cache->count[i]);
+    // later frees of this thread go straight to the shared classes
+    cache->state = 2;
+}
+
+static void _private_tls_slab_init() {
+    unsigned int i;
+    for (i = 0; i < TLS_SLAB_CLASSES; i++)
+        pthread_mutex_init(&_private_tls_slab_classes[i].lock, NULL);
+    pthread_key_create(&_private_tls_slab_key, _private_tls_slab_thread_exit);
+}
+
+static unsigned int _private_tls_slab_class(size_t size) {
+    unsigned int i;
+    for (i = 0; i < TLS_SLAB_CLASSES; i++) {
+        if (size <= _private_tls_slab_sizes[i])
+            return i;
+    }
+    return TLS_SLAB_LARGE;
+}
+
+static unsigned int _private_tls_slab_batch(unsigned int size_class) {
+    unsigned int batch = TLS_SLAB_BATCH_BYTES / _private_tls_slab_sizes[size_class];
+    if (batch > TLS_SLAB_BATCH)
+        return TLS_SLAB_BATCH;
+    return batch ? batch : 1;
+}
+
+// moves a batch of blocks of the shared class to the cache of the thread, carving new ones if needed
+static int _private_tls_slab_refill(struct TLSSlabCache *cache, unsigned int size_class) {
+    struct TLSSlabClass *slab = &_private_tls_slab_classes[size_class];
+    unsigned int block_size = sizeof(struct TLSSlabHeader) + _private_tls_slab_sizes[size_class];
+    unsigned int batch = _private_tls_slab_batch(size_class);
+    unsigned int i;
+    pthread_mutex_lock(&slab->lock);
+    for (i = 0; i < batch; i++) {
+        struct TLSSlabFree *block = slab->blocks;
+        if (block) {
+            slab->blocks = block->next;
+        } else {
+            if (slab->chunk_left < block_size) {
+                // the rest of the previous chunk is lost, less than a block
+                slab->chunk = (unsigned char *)malloc(TLS_SLAB_CHUNK);
+                if (!slab->chunk) {
+                    slab->chunk_left = 0;
+                    break;
+                }
+                slab->chunk_left = TLS_SLAB_CHUNK;
+            }
+            struct TLSSlabHeader *header = (struct TLSSlabHeader *)slab->chunk;
+            header->size_class = size_class;
+            block = (struct TLSSlabFree *)(header + 1);
+            slab->chunk += block_size;
+            slab->chunk_left -= block_size;
+        }
+        block->next = cache->blocks[size_class];
+        cache->blocks[size_class] = block;
+        cache->count[size_class]++;
+        cache->bytes += _private_tls_slab_sizes[size_class];
+    }
+    pthread_mutex_unlock(&slab->lock);
+    return i;
+}
+
+static void *_private_tls_slab_large(size_t size, int zero) {
+    struct TLSSlabHeader *header;
+    if (size >= TLS_SLAB_MAP) {
+        header = (struct TLSSlabHeader *)mmap(NULL, sizeof(struct TLSSlabHeader) + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (header == MAP_FAILED)
+            return NULL;
+        header->size_class = TLS_SLAB_MAPPED;
+    } else {
+        if (zero)
+            header = (struct TLSSlabHeader *)calloc(1, sizeof(struct TLSSlabHeader) + size);
+        else
+            header = (struct TLSSlabHeader *)malloc(sizeof(struct TLSSlabHeader) + size);
+        if (!header)
+            return NULL;
+        header->size_class = TLS_SLAB_LARGE;
+    }
+    header->size = size;
+    return header + 1;
+}
+
+void *tls_slab_malloc(size_t size) {
+    unsigned int size_class = _private_tls_slab_class(size);
+    struct TLSSlabHeader *header;
+    if (size_class == TLS_SLAB_LARGE)
+        return _private_tls_slab_large(size, 0);
+    struct TLSSlabCache *cache = &_private_tls_slab_cache;
+    if (!cache->state) {
+        pthread_once(&_private_tls_slab_once, _private_tls_slab_init);
+        pthread_setspecific(_private_tls_slab_key, cache);
+        cache->state = 1;
+    }
+    if ((!cache->blocks[size_class]) && (!_private_tls_slab_refill(cache, size_class)))
+        return NULL;
+    struct TLSSlabFree *block = cache->blocks[size_class];
+    cache->blocks[size_class] = block->next;
+    cache->count[size_class]--;
+    cache->bytes -= _private_tls_slab_sizes[size_class];
+    if (cache->state == 2)
+        _private_tls_slab_give_back(cache, size_class, cache->count[size_class]);
+    header = (struct TLSSlabHeader *)block - 1;
+    header->size = size;
+    return block;
+}
+
+void *tls_slab_calloc(size_t count, size_t size) {
+    if ((size) && (count > (size_t)-1 / size))
+        return NULL;
+    size *= count;
+    if (_private_tls_slab_class(size) == TLS_SLAB_LARGE)
+        return _private_tls_slab_large(size, 1);
+    void *ptr = tls_slab_malloc(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+void tls_slab_free(void *ptr) {
+    if (!ptr)
+        return;
+    struct TLSSlabHeader *header = (struct TLSSlabHeader *)ptr - 1;
+    unsigned int size_class = header->size_class;
+    if (size_class == TLS_SLAB_MAPPED) {
+        munmap(header, sizeof(struct TLSSlabHeader) + header->size);
+        return;
+    }
+    if (size_class == TLS_SLAB_LARGE) {
+        free(header);
+        return;
+    }
+    struct TLSSlabCache *cache = &_private_tls_slab_cache;
+    struct TLSSlabFree *block = (struct TLSSlabFree *)ptr;
+    block->next = cache->blocks[size_class];
+    cache->blocks[size_class] = block;
+    cache->count[size_class]++;
+    cache->bytes += _private_tls_slab_sizes[size_class];
+    // a thread that only frees (or has exited) does not keep the blocks of the others
+    if (cache->state != 1)
+        _private_tls_slab_give_back(cache, size_class, cache->count[size_class]);
+    else
+    if ((cache->count[size_class] > 2 * _private_tls_slab_batch(size_class)) || (cache->bytes > TLS_SLAB_CACHE_BYTES))
+        _private_tls_slab_give_back(cache, size_class, _private_tls_slab_batch(size_class));
+}
+
+void *tls_slab_realloc(void *ptr, size_t size) {
+    if (!ptr)
+        return tls_slab_malloc(size);
+    struct TLSSlabHeader *header = (struct TLSSlabHeader *)ptr - 1;
+    unsigned int size_class = header->size_class;
+    if (size_class == TLS_SLAB_LARGE) {
+        if ((_private_tls_slab_class(size) == TLS_SLAB_LARGE) && (size < TLS_SLAB_MAP)) {
+            header = (struct TLSSlabHeader *)realloc(header, sizeof(struct TLSSlabHeader) + size);
+            if (!header)
+                return NULL;
+            header->size = size;
+            return header + 1;
+        }
+    } else
+    if ((size_class != TLS_SLAB_MAPPED) && (size <= _private_tls_slab_sizes[size_class])) {
+        header->size = size;
+        return ptr;
+    }
+    void *new_ptr = tls_slab_malloc(size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, (header->size < size) ? header->size : size);
+    tls_slab_free(ptr);
+    return new_ptr;
+}
+
+// a free record buffer of the connection with room for size bytes, or a new one
+static void *_private_tls_arena_malloc(struct TLSContext *context, unsigned int size) {
+    unsigned int needed_class = _private_tls_slab_class(size);
+    if ((context) && (needed_class != TLS_SLAB_LARGE)) {
+        unsigned int best_class = TLS_SLAB_LARGE;
+        int best = -1;
+        int i;
+        // at most about twice the size asked for, so small requests do not take the large buffers
+        for (i = 0; i < context->arena_count; i++) {
+            unsigned int size_class = ((struct TLSSlabHeader *)context->arena[i] - 1)->size_class;
+            if ((size_class >= needed_class) && (size_class <= needed_class + 2) && (size_class < best_class)) {
+                best = i;
+                best_class = size_class;
+            }
+        }
+        if (best >= 0) {
+            void *ptr = context->arena[best];
+            context->arena[best] = context->arena[--context->arena_count];
+            ((struct TLSSlabHeader *)ptr - 1)->size = size;
+            return ptr;
+        }
+    }
+    return TLS_MALLOC(size);
+}
+
+// keeps the buffer for the next records of the connection, if there is room
+static void _private_tls_arena_free(struct TLSContext *context, void *ptr) {
+    if (!ptr)
+        return;
+    if ((context) && (context->arena_count < TLS_ARENA_BLOCKS) && (((struct TLSSlabHeader *)ptr - 1)->size_class < TLS_SLAB_CLASSES)) {
+        context->arena[context->arena_count++] = ptr;
+        return;
+    }
+    TLS_FREE(ptr);
+}
+
+static void _private_tls_arena_release(struct TLSContext *context) {
+    while (context->arena_count)
+        TLS_FREE(context->arena[--context->arena_count]);
+}
+#else
+#define _private_tls_arena_malloc(context, size)    TLS_MALLOC(size)
+#define _private_tls_arena_free(context, ptr)       TLS_FREE(ptr)
+#define _private_tls_arena_release(context)
+#endif
+
 struct TLSPacket *tls_create_packet(struct TLSContext *context, unsigned char type, unsigned short version, int payload_size_hint) {
-    struct TLSPacket *packet = (struct TLSPacket *)TLS_MALLOC(sizeof(struct TLSPacket));
+    struct TLSPacket *packet = (struct TLSPacket *)_private_tls_arena_malloc(context, sizeof(struct TLSPacket));
     if (!packet)
         return NULL;
     packet->broken = 0;
@@ -3545,10 +4303,10 @@ struct TLSPacket *tls_create_packet(struct TLSContext *context, unsigned char ty
         packet->size = payload_size_hint + 10;
     else
         packet->size = TLS_BLOB_INCREMENT;
-    packet->buf = (unsigned char *)TLS_MALLOC(packet->size);
+    packet->buf = (unsigned char *)_private_tls_arena_malloc(context, packet->size);
     packet->context = context;
     if (!packet->buf) {
-        TLS_FREE(packet);
+        _private_tls_arena_free(context, packet);
         return NULL;
     }
     if ((context) && (context->dtls))
@@ -3580,8 +4338,8 @@ struct TLSPacket *tls_create_packet(struct TLSContext *context, unsigned char ty
 void tls_destroy_packet(struct TLSPacket *packet) {
     if (packet) {
         if (packet->buf)
-            TLS_FREE(packet->buf);
-        TLS_FREE(packet);
+            _private_tls_arena_free(packet->context, packet->buf);
+        _private_tls_arena_free(packet->context, packet);
     }
 }
 
@@ -3742,9 +4500,9 @@ void tls_packet_update(struct TLSPacket *packet) {
                         length = packet->len - header_size + 8 + mac_size;
                     }
                     if (packet->context->crypto.created == 1) {
-                        unsigned char *buf = (unsigned char *)TLS_MALLOC(length);
+                        unsigned char *buf = (unsigned char *)_private_tls_arena_malloc(packet->context, length);
                         if (buf) {
-                            unsigned char *ct = (unsigned char *)TLS_MALLOC(length + header_size);
+                            unsigned char *ct = (unsigned char *)_private_tls_arena_malloc(packet->context, length + header_size);
                             if (ct) {
                                 unsigned int buf_pos = 0;
                                  memcpy(ct, packet->buf, header_size - 2);
@@ -3774,7 +4532,7 @@ void tls_packet_update(struct TLSPacket *packet) {
                                 
                                 //DEBUG_DUMP_HEX_LABEL("PT BUFFER", buf, length);
                                 _private_tls_crypto_encrypt(packet->context, buf, ct + header_size, length);
-                                TLS_FREE(packet->buf);
+                                _private_tls_arena_free(packet->context, packet->buf);
                                 packet->buf = ct;
                                 packet->len = length + header_size;
                                 packet->size = packet->len;
@@ -3782,7 +4540,7 @@ void tls_packet_update(struct TLSPacket *packet) {
                                 // invalidate packet
                                 memset(packet->buf, 0, packet->len);
                             }
-                            TLS_FREE(buf);
+                            _private_tls_arena_free(packet->context, buf);
                         } else {
                             // invalidate packet
                             memset(packet->buf, 0, packet->len);
@@ -3795,7 +4553,7 @@ void tls_packet_update(struct TLSPacket *packet) {
 #endif
                         // + 1 = type
                         int ct_size = length + header_size + 12 + TLS_MAX_TAG_LEN + 1;
-                        unsigned char *ct = (unsigned char *)TLS_MALLOC(ct_size);
+                        unsigned char *ct = (unsigned char *)_private_tls_arena_malloc(packet->context, ct_size);
                         if (ct) {
                             memset(ct, 0, ct_size);
                             // AEAD
@@ -3887,7 +4645,7 @@ void tls_packet_update(struct TLSPacket *packet) {
 #endif
                                 memcpy(ct, packet->buf, header_size - 2);
                             *(unsigned short *)&ct[header_size - 2] = htons(ct_pos - header_size);
-                            TLS_FREE(packet->buf);
+                            _private_tls_arena_free(packet->context, packet->buf);
                             packet->buf = ct;
                             packet->len = ct_pos;
                             packet->size = ct_pos;
@@ -3956,9 +4714,113 @@ int tls_packet_uint24(struct TLSPacket *packet, unsigned int i) {
     return tls_packet_append(packet, buf, 3);
 }
 
+#ifdef TLS_DRBG
+// 32 bytes of key and 8 of nonce
+#define TLS_DRBG_SEED_SIZE      (32 + CHACHA_NONCELEN)
+#define TLS_DRBG_BUFFER_SIZE    (16 * CHACHA_BLOCKLEN)
+// bytes returned before taking a new seed from the kernel
+#define TLS_DRBG_RESEED         (1024 * 1024)
+
+struct TLSDRBG {
+    chacha_ctx ctx;
+    unsigned char buffer[TLS_DRBG_BUFFER_SIZE];
+    unsigned int available;
+    unsigned int generated;
+    unsigned int fork_generation;
+    unsigned char seeded;
+};
+
+static __thread struct TLSDRBG _private_tls_drbg;
+// incremented in the child of every fork, so that no thread keeps the state of the parent
+static volatile unsigned int _private_tls_fork_generation = 0;
+static pthread_once_t _private_tls_drbg_once = PTHREAD_ONCE_INIT;
+
+static void _private_tls_drbg_forked() {
+    _private_tls_fork_generation++;
+}
+
+static void _private_tls_drbg_register_fork() {
+    pthread_atfork(NULL, NULL, _private_tls_drbg_forked);
+}
+
+static int _private_tls_drbg_entropy(unsigned char *out, int len) {
+#ifdef __linux__
+    while (len > 0) {
+        ssize_t n = getrandom(out, len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // ENOSYS on old kernels
+            break;
+        }
+        out += n;
+        len -= n;
+    }
+    if (!len)
+        return 1;
+#endif
+    FILE *fp = fopen("/dev/urandom", "r");
+    if (!fp)
+        return 0;
+    int read_len = fread(out, 1, len, fp);
+    fclose(fp);
+    return read_len == len;
+}
+
+static void _private_tls_drbg_rekey(struct TLSDRBG *drbg, const unsigned char *seed) {
+    chacha_keysetup(&drbg->ctx, seed, 256);
+    chacha_ivsetup(&drbg->ctx, seed + 32, NULL);
+}
+
+static int _private_tls_drbg_refill(struct TLSDRBG *drbg) {
+    if ((!drbg->seeded) || (drbg->generated >= TLS_DRBG_RESEED)) {
+        unsigned char seed[TLS_DRBG_SEED_SIZE];
+        pthread_once(&_private_tls_drbg_once, _private_tls_drbg_register_fork);
+        if (!_private_tls_drbg_entropy(seed, TLS_DRBG_SEED_SIZE))
+            return 0;
+        memset(&drbg->ctx, 0, sizeof(drbg->ctx));
+        _private_tls_drbg_rekey(drbg, seed);
+        memset(seed, 0, TLS_DRBG_SEED_SIZE);
+        drbg->seeded = 1;
+        drbg->generated = 0;
+    }
+    // fast key erasure: the first bytes of every block of output become the next key, so a later
+    // leak of the state does not reveal what was already returned
+    memset(drbg->buffer, 0, TLS_DRBG_BUFFER_SIZE);
+    chacha_encrypt_bytes(&drbg->ctx, drbg->buffer, drbg->buffer, TLS_DRBG_BUFFER_SIZE);
+    _private_tls_drbg_rekey(drbg, drbg->buffer);
+    memset(drbg->buffer, 0, TLS_DRBG_SEED_SIZE);
+    drbg->available = TLS_DRBG_BUFFER_SIZE - TLS_DRBG_SEED_SIZE;
+    return 1;
+}
+
+int tls_drbg_random(unsigned char *key, int len) {
+    struct TLSDRBG *drbg = &_private_tls_drbg;
+    unsigned int fork_generation = _private_tls_fork_generation;
+    if (drbg->fork_generation != fork_generation) {
+        drbg->fork_generation = fork_generation;
+        drbg->seeded = 0;
+        drbg->available = 0;
+    }
+    while (len > 0) {
+        if ((!drbg->available) && (!_private_tls_drbg_refill(drbg)))
+            return 0;
+        int size = (len < (int)drbg->available) ? len : (int)drbg->available;
+        unsigned char *out = drbg->buffer + TLS_DRBG_BUFFER_SIZE - drbg->available;
+        memcpy(key, out, size);
+        memset(out, 0, size);
+        key += size;
+        len -= size;
+        drbg->available -= size;
+        drbg->generated += size;
+    }
+    return 1;
+}
+#endif
+
 int tls_random(unsigned char *key, int len) {
 #ifdef TLS_USE_RANDOM_SOURCE
-    TLS_USE_RANDOM_SOURCE(key, len);
+    return TLS_USE_RANDOM_SOURCE(key, len);
 #else
 #ifdef __APPLE__
     for (int i = 0; i < len; i++) {
@@ -4235,6 +5097,10 @@ int _private_tls_write_app_data(struct TLSContext *context, const unsigned char
     if ((!buf) || (!buf_len))
         return 0;
     
+    if (context->application_buffer_start) {
+        memmove(context->application_buffer, context->application_buffer + context->application_buffer_start, context->application_buffer_len);
+        context->application_buffer_start = 0;
+    }
     int len = context->application_buffer_len + buf_len;
     context->application_buffer = (unsigned char *)TLS_REALLOC(context->application_buffer, len);
     if (!context->application_buffer) {
@@ -4313,10 +5179,24 @@ const unsigned char *tls_get_message(struct TLSContext *context, unsigned int *o
 
 void tls_buffer_clear(struct TLSContext *context) {
     if ((context) && (context->tls_buffer)) {
-        TLS_FREE(context->tls_buffer);
+        _private_tls_arena_free(context, context->tls_buffer);
         context->tls_buffer = NULL;
         context->tls_buffer_len = 0;
+        // everything sent and no record half read: an idle connection keeps no buffers
+        if (!context->message_buffer)
+            _private_tls_arena_release(context);
+    }
+}
+
+void tls_buffer_shift(struct TLSContext *context, unsigned int len) {
+    if ((!context) || (!context->tls_buffer))
+        return;
+    if (len >= context->tls_buffer_len) {
+        tls_buffer_clear(context);
+        return;
     }
+    memmove(context->tls_buffer, context->tls_buffer + len, context->tls_buffer_len - len);
+    context->tls_buffer_len -= len;
 }
 
 int tls_established(struct TLSContext *context) {
@@ -4338,9 +5218,10 @@ int tls_established(struct TLSContext *context) {
 
 void tls_read_clear(struct TLSContext *context) {
     if ((context) && (context->application_buffer)) {
-        TLS_FREE(context->application_buffer);
+        _private_tls_arena_free(context, context->application_buffer);
         context->application_buffer = NULL;
         context->application_buffer_len = 0;
+        context->application_buffer_start = 0;
     }
 }
 
@@ -4351,24 +5232,26 @@ int tls_read(struct TLSContext *context, unsigned char *buf, unsigned int size)
         if (context->application_buffer_len < size)
             size = context->application_buffer_len;
         
-        memcpy(buf, context->application_buffer, size);
+        memcpy(buf, context->application_buffer + context->application_buffer_start, size);
         if (context->application_buffer_len == size) {
-            TLS_FREE(context->application_buffer);
+            _private_tls_arena_free(context, context->application_buffer);
             context->application_buffer = NULL;
             context->application_buffer_len = 0;
+            context->application_buffer_start = 0;
             return size;
         }
+        // the rest is read from where it is, without moving it
         context->application_buffer_len -= size;
-        memmove(context->application_buffer, context->application_buffer + size, context->application_buffer_len);
+        context->application_buffer_start += size;
         return size;
     }
     return 0;
 }
 
 struct TLSContext *tls_create_context(unsigned char is_server, unsigned short version) {
-    struct TLSContext *context = (struct TLSContext *)TLS_MALLOC(sizeof(struct TLSContext));
+    // the pages of the cipher states are only touched once used
+    struct TLSContext *context = (struct TLSContext *)TLS_CALLOC(1, sizeof(struct TLSContext));
     if (context) {
-        memset(context, 0, sizeof(struct TLSContext));
         context->is_server = is_server;
         if ((version == DTLS_V13) || (version == DTLS_V12) || (version == DTLS_V10))
             context->dtls = 1;
@@ -4391,9 +5274,8 @@ struct TLSContext *tls_accept(struct TLSContext *context) {
     if ((!context) || (!context->is_server))
         return NULL;
     
-    struct TLSContext *child = (struct TLSContext *)TLS_MALLOC(sizeof(struct TLSContext));
+    struct TLSContext *child = (struct TLSContext *)TLS_CALLOC(1, sizeof(struct TLSContext));
     if (child) {
-        memset(child, 0, sizeof(struct TLSContext));
         child->is_server = 1;
         child->is_child = 1;
         child->dtls = context->dtls;
@@ -4414,6 +5296,8 @@ struct TLSContext *tls_accept(struct TLSContext *context) {
 #endif
         child->alpn = context->alpn;
         child->alpn_count = context->alpn_count;
+        child->min_version = context->min_version;
+        child->max_version = context->max_version;
     }
     return child;
 }
@@ -4478,6 +5362,226 @@ int tls_set_default_dhe_pg(struct TLSContext *context, const char *p_hex_str, co
 }
 #endif
 
+#ifdef TLS_KEYSHARE_POOL
+// ephemeral keys generated ahead of time by a background thread, so a handshake
+// pops a ready key pair instead of paying the scalar multiplication itself
+#define TLS_KEYSHARE_POOL_MAX   4096
+
+struct TLSKeySharePool {
+    struct ECCCurveParameters *curve;
+    // ring of ecc_key * (x25519: 32 byte secret followed by the 32 byte public key)
+    void **keys;
+    unsigned int head;
+    unsigned int count;
+    unsigned long popped;
+    unsigned long exhausted;
+};
+
+static struct TLSKeySharePool _private_tls_keyshare_pools[] = {
+#ifdef TLS_CURVE25519
+    {&x25519},
+#endif
+    {&secp256r1},
+    {&secp384r1}
+};
+#define TLS_KEYSHARE_POOLS  (sizeof(_private_tls_keyshare_pools) / sizeof(_private_tls_keyshare_pools[0]))
+
+static unsigned int _private_tls_keyshare_depth = 0;
+static pthread_mutex_t _private_tls_keyshare_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _private_tls_keyshare_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+#ifdef TLS_FORWARD_SECRECY
+// a new ephemeral key pair, an ecc_key * or a x25519 secret followed by its public key
+static void *_private_tls_keyshare_generate(const struct ECCCurveParameters *curve) {
+#ifdef TLS_CURVE25519
+    if (curve == &x25519) {
+        static const unsigned char basepoint[32] = {9};
+        unsigned char *key = (unsigned char *)TLS_MALLOC(64);
+        if (!key)
+            return NULL;
+        tls_random(key, 32);
+        key[0] &= 248;
+        key[31] &= 127;
+        key[31] |= 64;
+        curve25519(key + 32, key, basepoint);
+        return key;
+    }
+#endif
+    ecc_key *key = (ecc_key *)TLS_MALLOC(sizeof(ecc_key));
+    if (!key)
+        return NULL;
+    memset(key, 0, sizeof(ecc_key));
+    if (ecc_make_key_ex(NULL, find_prng("sprng"), key, (ltc_ecc_set_type *)&curve->dp)) {
+        TLS_FREE(key);
+        return NULL;
+    }
+    return key;
+}
+
+// takes a precomputed key pair of the curve, NULL if the pool is disabled or exhausted
+static void *_private_tls_keyshare_pop(const struct ECCCurveParameters *curve) {
+    void *key = NULL;
+#ifdef TLS_KEYSHARE_POOL
+    unsigned int i;
+    for (i = 0; i < TLS_KEYSHARE_POOLS; i++) {
+        struct TLSKeySharePool *pool = &_private_tls_keyshare_pools[i];
+        if (pool->curve != curve)
+            continue;
+        pthread_mutex_lock(&_private_tls_keyshare_lock);
+        if (!_private_tls_keyshare_depth) {
+            // pool not started
+            pthread_mutex_unlock(&_private_tls_keyshare_lock);
+            break;
+        }
+        if (pool->count) {
+            key = pool->keys[pool->head];
+            pool->head = (pool->head + 1) % _private_tls_keyshare_depth;
+            pool->count--;
+            pool->popped++;
+            pthread_cond_signal(&_private_tls_keyshare_cond);
+        } else {
+            pool->exhausted++;
+            // wake the filler too, in case it is waiting
+            pthread_cond_signal(&_private_tls_keyshare_cond);
+        }
+        pthread_mutex_unlock(&_private_tls_keyshare_lock);
+        break;
+    }
+#endif
+    return key;
+}
+#endif
+
+#ifdef TLS_KEYSHARE_POOL
+static void *_private_tls_keyshare_fill(void *arg) {
+#ifdef SCHED_IDLE
+    // refill only with the cpu time the handshakes leave, so it never delays one
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+    pthread_mutex_lock(&_private_tls_keyshare_lock);
+    while (1) {
+        struct TLSKeySharePool *pool = NULL;
+        unsigned int i;
+        // refill the emptiest pool first, so a burst on one curve is served before the rest are topped up
+        for (i = 0; i < TLS_KEYSHARE_POOLS; i++) {
+            if ((_private_tls_keyshare_pools[i].count < _private_tls_keyshare_depth) && ((!pool) || (_private_tls_keyshare_pools[i].count < pool->count)))
+                pool = &_private_tls_keyshare_pools[i];
+        }
+        if (!pool) {
+            pthread_cond_wait(&_private_tls_keyshare_cond, &_private_tls_keyshare_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&_private_tls_keyshare_lock);
+        void *key = _private_tls_keyshare_generate(pool->curve);
+        pthread_mutex_lock(&_private_tls_keyshare_lock);
+        if (!key) {
+            // handshakes keep generating their own keys
+            DEBUG_PRINT("Error generating pooled key, pool stopped\n");
+            break;
+        }
+        pool->keys[(pool->head + pool->count) % _private_tls_keyshare_depth] = key;
+        pool->count++;
+    }
+    pthread_mutex_unlock(&_private_tls_keyshare_lock);
+    return NULL;
+}
+#endif
+
+int tls_keyshare_pool_start(unsigned int depth) {
+#ifdef TLS_KEYSHARE_POOL
+    pthread_t thread;
+    unsigned int i;
+    if (!depth)
+        return 0;
+    if (depth > TLS_KEYSHARE_POOL_MAX)
+        return -1;
+    pthread_mutex_lock(&_private_tls_keyshare_lock);
+    if (_private_tls_keyshare_depth) {
+        pthread_mutex_unlock(&_private_tls_keyshare_lock);
+        return 0;
+    }
+    tls_init();
+    for (i = 0; i < TLS_KEYSHARE_POOLS; i++) {
+        _private_tls_keyshare_pools[i].keys = (void **)TLS_MALLOC(depth * sizeof(void *));
+        if (!_private_tls_keyshare_pools[i].keys) {
+            pthread_mutex_unlock(&_private_tls_keyshare_lock);
+            return -1;
+        }
+    }
+    // the filler must see the depth as soon as it takes the lock, or it waits for a pop that never comes
+    _private_tls_keyshare_depth = depth;
+    if (pthread_create(&thread, NULL, _private_tls_keyshare_fill, NULL)) {
+        _private_tls_keyshare_depth = 0;
+        pthread_mutex_unlock(&_private_tls_keyshare_lock);
+        return -1;
+    }
+    pthread_detach(thread);
+    pthread_mutex_unlock(&_private_tls_keyshare_lock);
+    return 0;
+#else
+    return depth ? -1 : 0;
+#endif
+}
+
+int tls_keyshare_pool_stats(unsigned int index, const char **curve, unsigned int *depth, unsigned long *popped, unsigned long *exhausted) {
+#ifdef TLS_KEYSHARE_POOL
+    if (index >= TLS_KEYSHARE_POOLS)
+        return 0;
+    pthread_mutex_lock(&_private_tls_keyshare_lock);
+    if (!_private_tls_keyshare_depth) {
+        pthread_mutex_unlock(&_private_tls_keyshare_lock);
+        return 0;
+    }
+    if (curve)
+        *curve = _private_tls_keyshare_pools[index].curve->name;
+    if (depth)
+        *depth = _private_tls_keyshare_pools[index].count;
+    if (popped)
+        *popped = _private_tls_keyshare_pools[index].popped;
+    if (exhausted)
+        *exhausted = _private_tls_keyshare_pools[index].exhausted;
+    pthread_mutex_unlock(&_private_tls_keyshare_lock);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef TLS_FORWARD_SECRECY
+// context->ecc_dhe = fresh ephemeral key of the curve, from the pool when there is one ready
+int _private_tls_ecc_dhe_make(struct TLSContext *context, const struct ECCCurveParameters *curve) {
+    _private_tls_ecc_dhe_free(context);
+    context->ecc_dhe = (ecc_key *)_private_tls_keyshare_pop(curve);
+    if (!context->ecc_dhe)
+        context->ecc_dhe = (ecc_key *)_private_tls_keyshare_generate(curve);
+    if (!context->ecc_dhe) {
+        DEBUG_PRINT("Error generating ECC DHE key\n");
+        return TLS_GENERIC_ERROR;
+    }
+    return 0;
+}
+
+#ifdef TLS_CURVE25519
+// fresh x25519 secret and its public key, from the pool when there is one ready
+int _private_tls_x25519_make(unsigned char *secret, unsigned char *public_key) {
+    unsigned char *key = (unsigned char *)_private_tls_keyshare_pop(&x25519);
+    if (!key)
+        key = (unsigned char *)_private_tls_keyshare_generate(&x25519);
+    if (!key)
+        return TLS_GENERIC_ERROR;
+    memcpy(secret, key, 32);
+    if (public_key)
+        memcpy(public_key, key + 32, 32);
+    zeromem(key, 64);
+    TLS_FREE(key);
+    return 0;
+}
+#endif
+#endif
+
 const char *tls_alpn(struct TLSContext *context) {
     if (!context)
         return NULL;
@@ -4574,6 +5678,7 @@ void tls_destroy_context(struct TLSContext *context) {
     TLS_FREE(context->tls_buffer);
     TLS_FREE(context->application_buffer);
     // zero out the keys before free
+    memset(context->resumable_master_key, 0, sizeof(context->resumable_master_key));
     if ((context->exportable_keys) && (context->exportable_size))
         memset(context->exportable_keys, 0, context->exportable_size);
     TLS_FREE(context->exportable_keys);
@@ -4596,6 +5701,8 @@ void tls_destroy_context(struct TLSContext *context) {
 #ifdef TLS_CURVE25519
     TLS_FREE(context->client_secret);
 #endif
+    // the record buffers the connection kept for itself, in one go
+    _private_tls_arena_release(context);
     TLS_FREE(context);
 }
 
@@ -4645,6 +5752,8 @@ void _private_tls_reset_context(struct TLSContext *context) {
     _private_tls_destroy_hash(context);
     TLS_FREE(context->application_buffer);
     context->application_buffer = NULL;
+    context->application_buffer_len = 0;
+    context->application_buffer_start = 0;
     // zero out the keys before free
     if ((context->exportable_keys) && (context->exportable_size))
         memset(context->exportable_keys, 0, context->exportable_size);
@@ -4664,6 +5773,60 @@ void _private_tls_reset_context(struct TLSContext *context) {
 }
 #endif
 
+static int _private_tls_is_ecdsa_cipher(unsigned short cipher) {
+#ifdef TLS_ECDSA_SUPPORTED
+    switch (cipher) {
+        case TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA:
+        case TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA:
+        case TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256:
+        case TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA384:
+        case TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256:
+        case TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384:
+#ifdef TLS_WITH_CHACHA20_POLY1305
+        case TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256:
+#endif
+            return 1;
+    }
+#endif
+    return 0;
+}
+
+#ifdef TLS_ECDSA_SUPPORTED
+// hash that goes with the curve of the ECDSA key, 0 if the client did not offer that scheme
+static int _private_tls_ecdsa_hash(struct TLSContext *context) {
+    int hash_type;
+    unsigned char bit;
+    if (!context->ec_private_key)
+        return 0;
+    switch (context->ec_private_key->ec_algorithm) {
+        case 24:
+            hash_type = sha384;
+            bit = 2;
+            break;
+        case 25:
+            hash_type = sha512;
+            bit = 4;
+            break;
+        default:
+            hash_type = sha256;
+            bit = 1;
+    }
+    // no signature_algorithms extension: nothing to check against
+    if ((!context->peer_sig_algorithms) || (context->peer_ecdsa_hashes & bit))
+        return hash_type;
+    return 0;
+}
+#endif
+
+// a server that only has an ECDSA key cannot authenticate with RSA
+static int _private_tls_can_sign_rsa(struct TLSContext *context) {
+#ifdef TLS_ECDSA_SUPPORTED
+    if ((context->is_server) && (!context->private_key) && (context->ec_private_key))
+        return 0;
+#endif
+    return 1;
+}
+
 int tls_cipher_supported(struct TLSContext *context, unsigned short cipher) {
     if (!context)
         return 0;
@@ -4712,7 +5875,7 @@ int tls_cipher_supported(struct TLSContext *context, unsigned short cipher) {
 #endif
         case TLS_RSA_WITH_AES_128_CBC_SHA:
         case TLS_RSA_WITH_AES_256_CBC_SHA:
-            return 1;
+            return _private_tls_can_sign_rsa(context);
 #ifdef TLS_FORWARD_SECRECY
         case TLS_DHE_RSA_WITH_AES_128_CBC_SHA256:
         case TLS_DHE_RSA_WITH_AES_256_CBC_SHA256:
@@ -4731,7 +5894,7 @@ int tls_cipher_supported(struct TLSContext *context, unsigned short cipher) {
         case TLS_RSA_WITH_AES_256_CBC_SHA256:
         case TLS_RSA_WITH_AES_256_GCM_SHA384:
             if ((context->version == TLS_V12) || (context->version == DTLS_V12))
-                return 1;
+                return _private_tls_can_sign_rsa(context);
             return 0;
     }
     return 0;
@@ -4775,7 +5938,7 @@ int tls_cipher_is_fs(struct TLSContext *context, unsigned short cipher) {
         case TLS_DHE_RSA_WITH_AES_256_CBC_SHA:
         case TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA:
         case TLS_ECDHE_RSA_WITH_AES_256_CBC_SHA:
-            return 1;
+            return _private_tls_can_sign_rsa(context);
         case TLS_DHE_RSA_WITH_AES_128_CBC_SHA256:
         case TLS_DHE_RSA_WITH_AES_256_CBC_SHA256:
         case TLS_DHE_RSA_WITH_AES_128_GCM_SHA256:
@@ -4788,7 +5951,7 @@ int tls_cipher_is_fs(struct TLSContext *context, unsigned short cipher) {
         case TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256:
 #endif
             if ((context->version == TLS_V12) || (context->version == DTLS_V12))
-                return 1;
+                return _private_tls_can_sign_rsa(context);
             break;
     }
     return 0;
@@ -4796,6 +5959,9 @@ int tls_cipher_is_fs(struct TLSContext *context, unsigned short cipher) {
 
 #ifdef WITH_KTLS
 int _private_tls_prefer_ktls(struct TLSContext *context, unsigned short cipher) {
+    // only contexts that may be handed to the kernel (exportable keys) prefer kTLS ciphers
+    if (!context->exportable)
+        return 0;
     if ((context->version == TLS_V13) || (context->version == DTLS_V13) || ((context->version != TLS_V12) && (context->version != DTLS_V12)))
         return 0;
 
@@ -4808,11 +5974,63 @@ int _private_tls_prefer_ktls(struct TLSContext *context, unsigned short cipher)
             break;
         case TLS_DHE_RSA_WITH_AES_128_GCM_SHA256:
         case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
-            return 1;
+            return _private_tls_can_sign_rsa(context);
+    }
+    return 0;
+}
+#endif
+
+// AES-GCM is only fast with AES-NI; without it ChaCha20-Poly1305 wins by far
+int _private_tls_aes_is_fast() {
+#ifdef LTC_AES_NI
+    return aesni_enabled();
+#else
+    return 0;
+#endif
+}
+
+int _private_tls_prefer_aead(struct TLSContext *context, unsigned short cipher) {
+    int aes = _private_tls_aes_is_fast();
+    if (!tls_cipher_is_fs(context, cipher))
+        return 0;
+
+    switch (cipher) {
+#ifdef WITH_TLS_13
+        case TLS_AES_128_GCM_SHA256:
+        case TLS_AES_256_GCM_SHA384:
+#endif
+        case TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256:
+        case TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384:
+        case TLS_DHE_RSA_WITH_AES_128_GCM_SHA256:
+        case TLS_DHE_RSA_WITH_AES_256_GCM_SHA384:
+        case TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256:
+        case TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384:
+            return aes;
+#ifdef TLS_WITH_CHACHA20_POLY1305
+#ifdef WITH_TLS_13
+        case TLS_CHACHA20_POLY1305_SHA256:
+#endif
+        case TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256:
+        case TLS_DHE_RSA_WITH_CHACHA20_POLY1305_SHA256:
+        case TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256:
+            return !aes;
+#endif
     }
     return 0;
 }
-#endif
+
+// first cipher of the client that passes test, only those authenticated with ECDSA if ecdsa is set
+static int _private_tls_first_cipher(struct TLSContext *context, const unsigned char *buf, int buf_len, int (*test)(struct TLSContext *, unsigned short), int ecdsa) {
+    int i;
+    for (i = 0; i < buf_len; i+=2) {
+        unsigned short cipher = ntohs(*(unsigned short *)&buf[i]);
+        if ((ecdsa) && (!_private_tls_is_ecdsa_cipher(cipher)))
+            continue;
+        if (test(context, cipher))
+            return cipher;
+    }
+    return TLS_NO_COMMON_CIPHER;
+}
 
 int tls_choose_cipher(struct TLSContext *context, const unsigned char *buf, int buf_len, int *scsv_set) {
     int i;
@@ -4822,23 +6040,23 @@ int tls_choose_cipher(struct TLSContext *context, const unsigned char *buf, int
         return 0;
     int selected_cipher = TLS_NO_COMMON_CIPHER;
 #ifdef TLS_FORWARD_SECRECY
+    int ecdsa = 0;
+#ifdef TLS_ECDSA_SUPPORTED
+    // with both certificates, ECDSA suites go first: signing costs a fraction of a RSA signature
+    if ((context->private_key) && (context->ec_private_key))
+        ecdsa = 1;
+#endif
+    for (; (ecdsa >= 0) && (selected_cipher == TLS_NO_COMMON_CIPHER); ecdsa--) {
 #ifdef WITH_KTLS
-    for (i = 0; i < buf_len; i+=2) {
-        unsigned short cipher = ntohs(*(unsigned short *)&buf[i]);
-        if (_private_tls_prefer_ktls(context, cipher)) {
-            selected_cipher = cipher;
-            break;
-        }
-    }
+        // the kernel only takes AES-GCM, not worth it when AES itself is slow
+        if (_private_tls_aes_is_fast())
+            selected_cipher = _private_tls_first_cipher(context, buf, buf_len, _private_tls_prefer_ktls, ecdsa);
 #endif
-    if (selected_cipher == TLS_NO_COMMON_CIPHER) {
-        for (i = 0; i < buf_len; i+=2) {
-            unsigned short cipher = ntohs(*(unsigned short *)&buf[i]);
-            if (tls_cipher_is_fs(context, cipher)) {
-                selected_cipher = cipher;
-                break;
-            }
-        }
+        // then the AEAD this CPU runs fastest, in the order of the client
+        if (selected_cipher == TLS_NO_COMMON_CIPHER)
+            selected_cipher = _private_tls_first_cipher(context, buf, buf_len, _private_tls_prefer_aead, ecdsa);
+        if (selected_cipher == TLS_NO_COMMON_CIPHER)
+            selected_cipher = _private_tls_first_cipher(context, buf, buf_len, tls_cipher_is_fs, ecdsa);
     }
 #endif
     for (i = 0; i < buf_len; i+=2) {
@@ -5107,21 +6325,15 @@ int _private_tls_dh_make_key(int keysize, DHKey *key, const char *pbuf, const ch
 int tls_is_ecdsa(struct TLSContext *context) {
     if (!context)
         return 0;
-    switch (context->cipher) {
-        case TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA:
-        case TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA:
-        case TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256:
-        case TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA384:
-        case TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256:
-        case TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384:
-#ifdef TLS_WITH_CHACHA20_POLY1305
-        case TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256:
-#endif
-            return 1;
-    }
+    if (_private_tls_is_ecdsa_cipher(context->cipher))
+        return 1;
 #ifdef WITH_TLS_13
-    if (context->ec_private_key)
+    if ((context->ec_private_key) && ((context->version == TLS_V13) || (context->version == DTLS_V13) || (!context->is_server))) {
+        // with a RSA certificate as well, use the ECDSA one only if the client accepts it
+        if ((context->is_server) && (context->private_key))
+            return _private_tls_ecdsa_hash(context) != 0;
         return 1;
+    }
 #endif
     return 0;
 }
@@ -5287,14 +6499,7 @@ struct TLSPacket *tls_build_server_key_exchange(struct TLSContext *context, int
         tls_packet_uint8(packet, 3);
         tls_packet_uint16(packet, context->curve->iana);
         tls_init();
-        _private_tls_ecc_dhe_create(context);
-        
-        ltc_ecc_set_type *dp = (ltc_ecc_set_type *)&context->curve->dp;
-        
-        if (ecc_make_key_ex(NULL, find_prng("sprng"), context->ecc_dhe, dp)) {
-            TLS_FREE(context->ecc_dhe);
-            context->ecc_dhe = NULL;
-            DEBUG_PRINT("Error generating ECC key\n");
+        if (_private_tls_ecc_dhe_make(context, context->curve)) {
             TLS_FREE(packet);
             return NULL;
         }
@@ -5334,8 +6539,12 @@ struct TLSPacket *tls_build_server_key_exchange(struct TLSContext *context, int
             
 #ifdef TLS_ECDSA_SUPPORTED
             if (tls_is_ecdsa(context)) {
-                if ((context->version == TLS_V13) || (context->version == DTLS_V13) || (context->version == TLS_V12) || (context->version == DTLS_V12))
-                    hash_algorithm = sha512;
+                // the hash of the curve, as a 1.3 signature scheme would use it
+                if ((context->version == TLS_V13) || (context->version == DTLS_V13) || (context->version == TLS_V12) || (context->version == DTLS_V12)) {
+                    hash_algorithm = _private_tls_ecdsa_hash(context);
+                    if (!hash_algorithm)
+                        hash_algorithm = sha256;
+                }
                 tls_packet_uint8(packet, hash_algorithm);
                 tls_packet_uint8(packet, ecdsa);
             } else
@@ -5452,7 +6661,9 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
         // session size
         tls_packet_uint8(packet, 0);
 #else
-        _private_tls_set_session_id(context);
+        // a resumed session keeps the id sent by the client
+        if (!context->resumed)
+            _private_tls_set_session_id(context);
         // session size
         tls_packet_uint8(packet, context->session_size);
         if (context->session_size)
@@ -5741,6 +6952,8 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                     // secp256r1 produces 65 bytes export
                     extension_len += 103;
 #endif
+                    // the schemes left out of signature_algorithms
+                    extension_len -= 2 * (TLS_CLIENT_SCHEMES - _private_tls_client_schemes(context, NULL));
                 }
 #endif
                 tls_packet_uint16(packet, extension_len);
@@ -5837,15 +7050,10 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
 
                     }
 
-                    static const unsigned char basepoint[32] = {9};
-
-                    tls_random(context->client_secret, 32);
-
-                    context->client_secret[0] &= 248;
-                    context->client_secret[31] &= 127;
-                    context->client_secret[31] |= 64;
-
-                    curve25519(shared_key, context->client_secret, basepoint);
+                    if (_private_tls_x25519_make(context->client_secret, shared_key)) {
+                        TLS_FREE(packet);
+                        return NULL;
+                    }
 
                     tls_packet_uint16(packet, (unsigned short)x25519.iana);
                     tls_packet_uint16(packet, shared_key_short);
@@ -5856,13 +7064,7 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
                     tls_packet_uint16(packet, shared_key_short + 6);
                     tls_packet_uint16(packet, shared_key_short + 4);
 
-                    _private_tls_ecc_dhe_create(context);      
-                    ltc_ecc_set_type *dp = (ltc_ecc_set_type *)&secp256r1.dp;
-        
-                    if (ecc_make_key_ex(NULL, find_prng("sprng"), context->ecc_dhe, dp)) {
-                        TLS_FREE(context->ecc_dhe);
-                        context->ecc_dhe = NULL;
-                        DEBUG_PRINT("Error generating ECC key\n");
+                    if (_private_tls_ecc_dhe_make(context, &secp256r1)) {
                         TLS_FREE(packet);
                         return NULL;
                     }
@@ -5882,20 +7084,14 @@ struct TLSPacket *tls_build_hello(struct TLSContext *context, int tls13_downgrad
             }
             if (!context->is_server) {
                 // signature algorithms
+                unsigned short schemes[TLS_CLIENT_SCHEMES];
+                int schemes_count = _private_tls_client_schemes(context, schemes);
+                int i;
                 tls_packet_uint16(packet, 0x0D);
-                tls_packet_uint16(packet, 24);
-                tls_packet_uint16(packet, 22);
-                tls_packet_uint16(packet, 0x0403);
-                tls_packet_uint16(packet, 0x0503);
-                tls_packet_uint16(packet, 0x0603);
-                tls_packet_uint16(packet, 0x0804);
-                tls_packet_uint16(packet, 0x0805);
-                tls_packet_uint16(packet, 0x0806);
-                tls_packet_uint16(packet, 0x0401);
-                tls_packet_uint16(packet, 0x0501);
-                tls_packet_uint16(packet, 0x0601);
-                tls_packet_uint16(packet, 0x0203);
-                tls_packet_uint16(packet, 0x0201);
+                tls_packet_uint16(packet, schemes_count * 2 + 2);
+                tls_packet_uint16(packet, schemes_count * 2);
+                for (i = 0; i < schemes_count; i++)
+                    tls_packet_uint16(packet, schemes[i]);
             }
         }
 #endif
@@ -5956,7 +7152,7 @@ struct TLSPacket *tls_certificate_request(struct TLSContext *context) {
             // ecdsa_secp384r1_sha384
             tls_packet_uint16(packet, 0x0503);
             // ecdsa_secp521r1_sha512
-            tls_packet_uint16(packet, 0x0604);
+            tls_packet_uint16(packet, 0x0603);
             // rsa_pss_rsae_sha256
             tls_packet_uint16(packet, 0x0804);
             // rsa_pss_rsae_sha384
@@ -6217,22 +7413,16 @@ int _private_tls_parse_key_share(struct TLSContext *context, const unsigned char
             if ((context->is_server) && (!tls_random(context->local_random, TLS_SERVER_RANDOM_SIZE)))
                 return TLS_GENERIC_ERROR;
             unsigned char secret[32];
-            static const unsigned char basepoint[32] = {9};
 
             if ((context->is_server) || (!context->client_secret)) {
-                tls_random(secret, 32);
-
-                secret[0] &= 248;
-                secret[31] &= 127;
-                secret[31] |= 64;
-
                 // use finished key to store public key
                 TLS_FREE(context->finished_key);
                 context->finished_key = (unsigned char *)TLS_MALLOC(32);
                 if (!context->finished_key)
                     return TLS_GENERIC_ERROR;
 
-                curve25519(context->finished_key, secret, basepoint);
+                if (_private_tls_x25519_make(secret, context->finished_key))
+                    return TLS_GENERIC_ERROR;
 
                 TLS_FREE(context->premaster_key);
                 context->premaster_key = (unsigned char *)TLS_MALLOC(32);
@@ -6258,15 +7448,8 @@ int _private_tls_parse_key_share(struct TLSContext *context, const unsigned char
             return 0;
         }
 #endif
-        if (context->is_server) {
-            _private_tls_ecc_dhe_create(context);
-            if (ecc_make_key_ex(NULL, find_prng("sprng"), context->ecc_dhe, (ltc_ecc_set_type *)&context->curve->dp)) {
-                TLS_FREE(context->ecc_dhe);
-                context->ecc_dhe = NULL;
-                DEBUG_PRINT("Error generating ECC DHE key\n");
-                return TLS_GENERIC_ERROR;
-            }
-        }
+        if ((context->is_server) && (_private_tls_ecc_dhe_make(context, context->curve)))
+            return TLS_GENERIC_ERROR;
 
         ltc_ecc_set_type *dp = (ltc_ecc_set_type *)&context->curve->dp;
 
@@ -6328,6 +7511,33 @@ int _private_tls_parse_key_share(struct TLSContext *context, const unsigned char
 }
 #endif
 
+int _private_tls_resume_session(struct TLSContext *context, const unsigned char *cipher_buffer, int cipher_len) {
+    int i;
+    if ((!context->resumable_session_size) || (context->dtls) || (context->version != TLS_V12))
+        return 0;
+    if ((context->session_size != context->resumable_session_size) || (memcmp(context->session, context->resumable_session, context->session_size)))
+        return 0;
+    // the client must still offer the cipher of the session
+    for (i = 0; i < cipher_len; i += 2) {
+        if (ntohs(*(unsigned short *)&cipher_buffer[i]) == context->resumable_cipher)
+            break;
+    }
+    if (i >= cipher_len)
+        return 0;
+    TLS_FREE(context->master_key);
+    context->master_key = (unsigned char *)TLS_MALLOC(TLS_MASTER_SECRET_SIZE);
+    if (!context->master_key) {
+        context->master_key_len = 0;
+        return 0;
+    }
+    memcpy(context->master_key, context->resumable_master_key, TLS_MASTER_SECRET_SIZE);
+    context->master_key_len = TLS_MASTER_SECRET_SIZE;
+    context->cipher = context->resumable_cipher;
+    context->resumed = 1;
+    DEBUG_PRINT("RESUMING SESSION, CIPHER: %s\n", tls_cipher_name(context));
+    return 1;
+}
+
 int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int buf_len, unsigned int *write_packets, unsigned int *dtls_verified) {
     *write_packets = 0;
     *dtls_verified = 0;
@@ -6579,6 +7789,29 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             if (extension_type == 0x0D) {
                 // supported signatures
                 DEBUG_DUMP_HEX_LABEL("SUPPORTED SIGNATURES", &buf[res], extension_len);
+#ifdef TLS_ECDSA_SUPPORTED
+                if ((context->is_server) && (extension_len > 2)) {
+                    unsigned short sig_len = ntohs(*(unsigned short *)&buf[res]);
+                    int i;
+                    if (sig_len > extension_len - 2)
+                        sig_len = extension_len - 2;
+                    context->peer_sig_algorithms = 1;
+                    context->peer_ecdsa_hashes = 0;
+                    for (i = 0; i + 1 < sig_len; i += 2) {
+                        switch (ntohs(*(unsigned short *)&buf[res + 2 + i])) {
+                            case 0x0403:
+                                context->peer_ecdsa_hashes |= 1;
+                                break;
+                            case 0x0503:
+                                context->peer_ecdsa_hashes |= 2;
+                                break;
+                            case 0x0603:
+                                context->peer_ecdsa_hashes |= 4;
+                                break;
+                        }
+                    }
+                }
+#endif
             } else
             if (extension_type == 0x0B) {
                 // supported point formats
@@ -6589,12 +7822,12 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             if (extension_type == 0x2B) {
                 // supported versions
                 if ((context->is_server) && (buf[res] == extension_len - 1)) {
-                    if (extension_len > 4) {
+                    // a client that only speaks TLS 1.3 sends a single version
+                    if ((extension_len >= 3) && ((!context->max_version) || (context->max_version >= TLS_V13))) {
                         DEBUG_DUMP_HEX_LABEL("SUPPORTED VERSIONS", &buf[res], extension_len);
                         int i;
                         int limit = (int)buf[res];
                         if (limit == extension_len - 1) {
-                            limit--;
                             for (i = 1; i < limit; i += 2) {
                                 if ((ntohs(*(unsigned short *)&buf[res + i]) == TLS_V13) || (ntohs(*(unsigned short *)&buf[res + i]) == 0x7F1C)) {
                                     context->version = TLS_V13;
@@ -6653,6 +7886,12 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
     }
     if (buf_len != res)
         return TLS_NEED_MORE_DATA;
+    if ((context->is_server) && (!context->dtls) && (((context->min_version) && (context->version < context->min_version)) || ((context->max_version) && (context->version > context->max_version)))) {
+        DEBUG_PRINT("VERSION %x OUT OF RANGE\n", (int)context->version);
+        _private_tls_write_packet(tls_build_alert(context, 1, protocol_version));
+        context->critical_error = 1;
+        return TLS_NOT_SAFE;
+    }
     if ((context->is_server) && (cipher_buffer) && (cipher_len)) {
         int cipher = tls_choose_cipher(context, cipher_buffer, cipher_len, &scsv_set);
         if (cipher < 0) {
@@ -6666,6 +7905,8 @@ int tls_parse_hello(struct TLSContext *context, const unsigned char *buf, int bu
             return TLS_NOT_SAFE;
         }
         context->cipher = cipher;
+        if (_private_tls_resume_session(context, cipher_buffer, cipher_len))
+            *write_packets = 6;
     }
 #ifdef WITH_TLS_13
     if (!context->is_server) {
@@ -6715,11 +7956,16 @@ int tls_parse_certificate(struct TLSContext *context, const unsigned char *buf,
     }
 #ifdef WITH_TLS_13
     if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
+        CHECK_SIZE(1, buf_len - res, TLS_NEED_MORE_DATA)
         int context_size = buf[res];
         res++;
         // must be 0
         if (context_size)
             res += context_size;
+        // the request context is not part of the certificate list
+        if (size_of_all_certificates < (unsigned int)context_size + 1)
+            return TLS_BROKEN_PACKET;
+        size_of_all_certificates -= context_size + 1;
     }
 #endif
 
@@ -6783,9 +8029,10 @@ int tls_parse_certificate(struct TLSContext *context, const unsigned char *buf,
             if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
                 if (remaining >= 2) {
                     // ignore extensions
-                    remaining -= 2;
                     unsigned short size = ntohs(*(unsigned short *)&buf[res2]);
-                    if ((size) && (size >= remaining)) {
+                    res2 += 2;
+                    remaining -= 2;
+                    if ((size) && (size <= remaining)) {
                         res2 += size;
                         remaining -= size;
                     }
@@ -7118,12 +8365,8 @@ int tls_parse_server_key_exchange(struct TLSContext *context, const unsigned cha
                 DEBUG_PRINT("ERROR IN TLS_MALLOC");
                 return TLS_GENERIC_ERROR;
             }
-            
-            tls_random(context->client_secret, 32);
-
-            context->client_secret[0] &= 248;
-            context->client_secret[31] &= 127;
-            context->client_secret[31] |= 64;
+            if (_private_tls_x25519_make(context->client_secret, NULL))
+                return TLS_GENERIC_ERROR;
 
             TLS_FREE(context->premaster_key);
             context->premaster_key = (unsigned char *)TLS_MALLOC(32);
@@ -7136,15 +8379,8 @@ int tls_parse_server_key_exchange(struct TLSContext *context, const unsigned cha
 #endif
         {
             tls_init();
-            _private_tls_ecc_dhe_create(context);
-        
-            ltc_ecc_set_type *dp = (ltc_ecc_set_type *)&curve->dp;
-            if (ecc_make_key_ex(NULL, find_prng("sprng"), context->ecc_dhe, dp)) {
-                TLS_FREE(context->ecc_dhe);
-                context->ecc_dhe = NULL;
-                DEBUG_PRINT("Error generating ECC key\n");
+            if (_private_tls_ecc_dhe_make(context, curve))
                 return TLS_GENERIC_ERROR;
-            }
         
             TLS_FREE(context->premaster_key);
             context->premaster_key_len = 0;
@@ -7301,7 +8537,7 @@ int tls_parse_finished(struct TLSContext *context, const unsigned char *buf, int
         }
         TLS_FREE(out);
     }
-    if (context->is_server)
+    if ((context->is_server) && (!context->resumed))
         *write_packets = 3;
     else
         context->connection_status = 0xFF;
@@ -7342,11 +8578,11 @@ int tls_parse_verify_tls13(struct TLSContext *context, const unsigned char *buf,
 
     // first 64 bytes to 0x20 (32)
     memset(signing_data, 0x20, 64);
-    // context string 33 bytes
+    // context string 33 bytes, of the peer that signed
     if (context->is_server)
-        memcpy(signing_data + 64, "TLS 1.3, server CertificateVerify", 33);
-    else
         memcpy(signing_data + 64, "TLS 1.3, client CertificateVerify", 33);
+    else
+        memcpy(signing_data + 64, "TLS 1.3, server CertificateVerify", 33);
     // a single 0 byte separator
     signing_data[97] = 0;
     signing_data_len = 98;
@@ -7356,7 +8592,10 @@ int tls_parse_verify_tls13(struct TLSContext *context, const unsigned char *buf,
     unsigned short signature = ntohs(*(unsigned short *)&buf[3]);
     unsigned short signature_size = ntohs(*(unsigned short *)&buf[5]);
     int valid = 0;
-    CHECK_SIZE(7 + size, buf_len, TLS_NEED_MORE_DATA)
+    // size counts the algorithm and the length of the signature too
+    CHECK_SIZE(3 + size, buf_len, TLS_NEED_MORE_DATA)
+    if ((unsigned int)signature_size + 4 > size)
+        return TLS_BROKEN_PACKET;
     switch (signature) {
 #ifdef TLS_ECDSA_SUPPORTED
         case 0x0403:
@@ -7373,16 +8612,29 @@ int tls_parse_verify_tls13(struct TLSContext *context, const unsigned char *buf,
             break;
 #endif
         case 0x0804:
+            // rsa_pss_rsae_sha256
             valid = _private_tls_verify_rsa(context, sha256, buf + 7, signature_size, signing_data, signing_data_len);
             break;
+        case 0x0805:
+            // rsa_pss_rsae_sha384
+            valid = _private_tls_verify_rsa(context, sha384, buf + 7, signature_size, signing_data, signing_data_len);
+            break;
+        case 0x0806:
+            // rsa_pss_rsae_sha512
+            valid = _private_tls_verify_rsa(context, sha512, buf + 7, signature_size, signing_data, signing_data_len);
+            break;
         default:
             DEBUG_PRINT("Unsupported signature: %x\n", (int)signature);
             return TLS_UNSUPPORTED_CERTIFICATE;
     }
     if (valid != 1) {
         DEBUG_PRINT("Signature FAILED!\n");
+        if (context->is_server)
+            context->client_verified = 0;
         return TLS_DECRYPTION_FAILED;
     }
+    if (context->is_server)
+        context->client_verified = 1;
     return buf_len;
 }
 #endif
@@ -7615,8 +8867,27 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
  #ifdef WITH_TLS_13
                 if ((!context->is_server) && ((context->version == TLS_V13) || (context->version == DTLS_V13))) {
                     update_hash = 0;
-                    DEBUG_PRINT("<= SENDING FINISHED\n");
                     _private_tls_update_hash(context, buf, payload_size + 1);
+                    // the application secrets hash the transcript up to here, not the certificate of the client
+                    TLS_FREE(context->server_finished_hash);
+                    context->server_finished_hash = (unsigned char *)TLS_MALLOC(_private_tls_mac_length(context));
+                    if (context->server_finished_hash)
+                        _private_tls_get_hash(context, context->server_finished_hash);
+                    if (context->client_verified == 2) {
+                        // the server sent a certificate request: certificate (maybe empty) and proof of its key
+                        DEBUG_PRINT("<= SENDING CERTIFICATE\n");
+                        _private_tls_write_packet(tls_build_certificate(context));
+                        context->client_verified = 0;
+                        if ((context->client_certificates_count) && ((context->private_key)
+#ifdef TLS_ECDSA_SUPPORTED
+                            || (context->ec_private_key)
+#endif
+                        )) {
+                            DEBUG_PRINT("<= SENDING CERTIFICATE VERIFY\n");
+                            _private_tls_write_packet(tls_build_certificate_verify(context));
+                        }
+                    }
+                    DEBUG_PRINT("<= SENDING FINISHED\n");
                     _private_tls_write_packet(tls_build_finished(context));
                     _private_tls13_key(context, 0);
                     context->connection_status = 0xFF;
@@ -7692,15 +8963,21 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
         
         // except renegotiation
         switch (write_packets) {
-            case 1:
+            case 1: {
+                int sent_certificate = 0;
                 if (context->client_verified == 2) {
                     DEBUG_PRINT("<= Building CERTIFICATE \n");
                     _private_tls_write_packet(tls_build_certificate(context));
                     context->client_verified = 0;
+                    sent_certificate = (context->client_certificates_count) && (context->private_key);
                 }
                 // client handshake
                 DEBUG_PRINT("<= Building KEY EXCHANGE\n");
                 _private_tls_write_packet(tls_build_client_key_exchange(context));
+                if ((sent_certificate) && ((context->version == TLS_V12) || (context->version == DTLS_V12))) {
+                    DEBUG_PRINT("<= Building CERTIFICATE VERIFY\n");
+                    _private_tls_write_packet(_private_tls_build_client_verify12(context));
+                }
                 DEBUG_PRINT("<= Building CHANGE CIPHER SPEC\n");
                 _private_tls_write_packet(tls_build_change_cipher_spec(context));
                 context->cipher_spec_set = 1;
@@ -7730,6 +9007,7 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                 }
 #endif
                 break;
+            }
             case 2:
                 // server handshake
                 if ((context->dtls) && (dtls_cookie_verified == 0)) {
@@ -7786,6 +9064,22 @@ int tls_parse_payload(struct TLSContext *context, const unsigned char *buf, int
                 _private_tls_write_packet(tls_build_finished(context));
                 context->connection_status = 0xFF;
                 break;
+            case 6:
+                // abbreviated handshake (resumed session): server hello, change cipher spec and finished
+                DEBUG_PRINT("<= SENDING SERVER HELLO (RESUMED SESSION)\n");
+                _private_tls_write_packet(tls_build_hello(context, 0));
+                if (!_private_tls_expand_key(context)) {
+                    _private_tls_write_packet(tls_build_alert(context, 1, internal_error));
+                    context->critical_error = 1;
+                    return TLS_GENERIC_ERROR;
+                }
+                _private_tls_write_packet(tls_build_change_cipher_spec(context));
+                context->cipher_spec_set = 1;
+                _private_tls_write_packet(tls_build_finished(context));
+                // the change cipher spec of the client enables decryption
+                context->cipher_spec_set = 0;
+                context->connection_status = 2;
+                break;
             case 4:
                 // dtls only
                 context->dtls_seq = 1;
@@ -7886,7 +9180,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
             return TLS_BROKEN_PACKET;
         }
-        pt = (unsigned char *)TLS_MALLOC(length);
+        pt = (unsigned char *)_private_tls_arena_malloc(context, length);
         if (!pt) {
             DEBUG_PRINT("Error in TLS_MALLOC (%i bytes)\n", (int)length);
             _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
@@ -7943,7 +9237,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
 #endif
             if (pt_length < 0) {
                 DEBUG_PRINT("Invalid packet length");
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
             }
@@ -7952,7 +9246,6 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             
             int res0 = gcm_add_iv(&context->crypto.ctx_remote.aes_gcm_remote, iv, 12);
             int res1 = gcm_add_aad(&context->crypto.ctx_remote.aes_gcm_remote, aad, aad_size);
-            memset(pt, 0, length);
             DEBUG_PRINT("PT SIZE: %i\n", pt_length);
             int res2 = gcm_process(&context->crypto.ctx_remote.aes_gcm_remote, pt, pt_length, buf + header_size + delta, GCM_DECRYPT);
             unsigned char tag[32];
@@ -7970,7 +9263,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", pt_length);
                 DEBUG_DUMP_HEX_LABEL("TAG RECEIVED", buf + header_size + delta + pt_length, taglen);
                 DEBUG_DUMP_HEX_LABEL("TAG COMPUTED", tag, taglen);
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 _private_tls_write_packet(tls_build_alert(context, 1, bad_record_mac));
                 return TLS_INTEGRITY_FAILED;
@@ -7988,7 +9281,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             aad_size = 16;
             if (pt_length < 0) {
                 DEBUG_PRINT("Invalid packet length");
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
             }
@@ -8052,7 +9345,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", length);
                 DEBUG_DUMP_HEX_LABEL("POLY1305 TAG RECEIVED", buf + header_size + pt_length, POLY1305_TAGLEN);
                 DEBUG_DUMP_HEX_LABEL("POLY1305 TAG COMPUTED", mac_tag, POLY1305_TAGLEN);
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
 
                 // silently ignore packet for DTLS
                 if (context->dtls)
@@ -8066,7 +9359,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
         } else {
             int err = _private_tls_crypto_decrypt(context, buf + header_size, pt, length);
             if (err) {
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
                 DEBUG_PRINT("Decryption error %i\n", (int)err);
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 return TLS_BROKEN_PACKET;
@@ -8081,7 +9374,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 int limit = length - 1;
                 for (i = length - padding; i < limit; i++) {
                     if (pt[i] != padding_byte) {
-                        TLS_FREE(pt);
+                        _private_tls_arena_free(context, pt);
                         DEBUG_PRINT("BROKEN PACKET (POODLE ?)\n");
                         _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                         _private_tls_write_packet(tls_build_alert(context, 1, decrypt_error));
@@ -8111,7 +9404,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             
             unsigned int mac_size = _private_tls_mac_length(context);
             if ((length < mac_size) || (!mac_size)) {
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
                 DEBUG_PRINT("BROKEN PACKET\n");
                 _private_random_sleep(context, TLS_MAX_ERROR_SLEEP_uS);
                 _private_tls_write_packet(tls_build_alert(context, 1, decrypt_error));
@@ -8130,7 +9423,7 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("INTEGRITY CHECK FAILED (msg length %i)\n", length);
                 DEBUG_DUMP_HEX_LABEL("HMAC RECEIVED", message_hmac, mac_size);
                 DEBUG_DUMP_HEX_LABEL("HMAC COMPUTED", hmac_out, hmac_out_len);
-                TLS_FREE(pt);
+                _private_tls_arena_free(context, pt);
 
                 // silently ignore packet for DTLS
                 if (context->dtls)
@@ -8165,7 +9458,14 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
                 DEBUG_PRINT("APPLICATION DATA MESSAGE (TLS VERSION: %x):\n", (int)context->version);
                 DEBUG_DUMP(ptr, length);
                 DEBUG_PRINT("\n");
-                _private_tls_write_app_data(context, ptr, length);
+                if ((pt) && (length) && (!context->application_buffer)) {
+                    // nothing unread: the decrypted record becomes the buffer of tls_read, without a copy
+                    context->application_buffer = pt;
+                    context->application_buffer_start = (unsigned int)(ptr - pt);
+                    context->application_buffer_len = length;
+                    pt = NULL;
+                } else
+                    _private_tls_write_app_data(context, ptr, length);
             }
             break;
             // handshake
@@ -8213,10 +9513,10 @@ int tls_parse_message(struct TLSContext *context, unsigned char *buf, int buf_le
             break;
         default:
             DEBUG_PRINT("NOT UNDERSTOOD MESSAGE TYPE: %x\n", (int)type);
-            TLS_FREE(pt);
+            _private_tls_arena_free(context, pt);
             return TLS_NOT_UNDERSTOOD;
     }
-    TLS_FREE(pt);
+    _private_tls_arena_free(context, pt);
     
     if (payload_res < 0)
         return payload_res;
@@ -8856,10 +10156,17 @@ int tls_load_certificates(struct TLSContext *context, const unsigned char *pem_b
                     cert->priv = NULL;
                     cert->priv_len = 0;
                 }
-                context->certificates = (struct TLSCertificate **)TLS_REALLOC(context->certificates, (context->certificates_count + 1) * sizeof(struct TLSCertificate *));
-                context->certificates[context->certificates_count] = cert;
-                context->certificates_count++;
-                DEBUG_PRINT("Loaded certificate: %i\n", (int)context->certificates_count);
+                if (context->is_server) {
+                    context->certificates = (struct TLSCertificate **)TLS_REALLOC(context->certificates, (context->certificates_count + 1) * sizeof(struct TLSCertificate *));
+                    context->certificates[context->certificates_count] = cert;
+                    context->certificates_count++;
+                } else {
+                    // a client sends its own chain as client_certificates, certificates receives the one of the server
+                    context->client_certificates = (struct TLSCertificate **)TLS_REALLOC(context->client_certificates, (context->client_certificates_count + 1) * sizeof(struct TLSCertificate *));
+                    context->client_certificates[context->client_certificates_count] = cert;
+                    context->client_certificates_count++;
+                }
+                DEBUG_PRINT("Loaded certificate: %i\n", (int)(context->is_server ? context->certificates_count : context->client_certificates_count));
             } else {
                 DEBUG_PRINT("WARNING - certificate version error (v%i)\n", (int)cert->version);
                 tls_destroy_certificate(cert);
@@ -8867,7 +10174,7 @@ int tls_load_certificates(struct TLSContext *context, const unsigned char *pem_b
         }
         TLS_FREE(data);
     } while (1);
-    return context->certificates_count;
+    return context->is_server ? context->certificates_count : context->client_certificates_count;
 }
 
 int tls_load_private_key(struct TLSContext *context, const unsigned char *pem_buffer, int pem_size) {
@@ -8938,6 +10245,30 @@ int tls_clear_certificates(struct TLSContext *context) {
     return 0;
 }
 
+// TLS 1.2 client: proves it owns the key of its certificate by signing the handshake up to the client key exchange
+struct TLSPacket *_private_tls_build_client_verify12(struct TLSContext *context) {
+    unsigned char hash[TLS_MAX_HASH_SIZE];
+    unsigned char out[TLS_MAX_RSA_KEY];
+    unsigned long out_len = TLS_MAX_RSA_KEY;
+    int hash_len = _private_tls_get_hash(context, hash);
+    unsigned int hash_type = (hash_len == TLS_SHA384_MAC_SIZE) ? sha384 : sha256;
+    if ((hash_len <= 0) || (_private_tls_sign_rsa_digest(context, hash_type, hash, hash_len, out, &out_len) != 1)) {
+        DEBUG_PRINT("CANNOT SIGN CERTIFICATE VERIFY\n");
+        return NULL;
+    }
+    struct TLSPacket *packet = tls_create_packet(context, TLS_HANDSHAKE, context->version, 0);
+    if (packet) {
+        tls_packet_uint8(packet, 0x0F);
+        tls_packet_uint24(packet, out_len + 4);
+        tls_packet_uint8(packet, hash_type);
+        tls_packet_uint8(packet, rsa);
+        tls_packet_uint16(packet, out_len);
+        tls_packet_append(packet, out, out_len);
+        tls_packet_update(packet);
+    }
+    return packet;
+}
+
 #ifdef WITH_TLS_13
 struct TLSPacket *tls_build_certificate_verify(struct TLSContext *context) {
     struct TLSPacket *packet = tls_create_packet(context, TLS_HANDSHAKE, context->version, 0);
@@ -9104,14 +10435,18 @@ struct TLSPacket *tls_build_certificate(struct TLSContext *context) {
             }
         }
     } else {
-        tls_packet_uint24(packet, all_certificate_size);
+        // no certificate: the context (1.3) and an empty list, not an empty message
 #ifdef WITH_TLS_13
-        if ((context->version == TLS_V13) || (context->version == DTLS_V13))
+        if ((context->version == TLS_V13) || (context->version == DTLS_V13)) {
+            tls_packet_uint24(packet, 4);
             tls_packet_uint8(packet, 0);
+        } else
 #endif
+            tls_packet_uint24(packet, 3);
 
         if (context->dtls)
-            _private_dtls_handshake_data(context, packet, all_certificate_size);
+            _private_dtls_handshake_data(context, packet, 3);
+        tls_packet_uint24(packet, 0);
     }
     tls_packet_update(packet);
     if (context->dtls)
@@ -9187,7 +10522,11 @@ struct TLSPacket *tls_build_finished(struct TLSContext *context) {
             hmac_done(&hmac, out, &out_size);
         } else
 #endif
-        {
+        if (context->resumed) {
+            // abbreviated handshake: the client finished message comes after this one
+            hash_len = _private_tls_get_hash(context, hash);
+            _private_tls_prf(context, out, TLS_MIN_FINISHED_OPAQUE_LEN, context->master_key, context->master_key_len, (unsigned char *)"server finished", 15, hash, hash_len, NULL, 0);
+        } else {
             hash_len = _private_tls_done_hash(context, hash);
             _private_tls_prf(context, out, TLS_MIN_FINISHED_OPAQUE_LEN, context->master_key, context->master_key_len, (unsigned char *)"server finished", 15, hash, hash_len, NULL, 0);
             _private_tls_destroy_hash(context);
@@ -9205,11 +10544,6 @@ struct TLSPacket *tls_build_finished(struct TLSContext *context) {
             DEBUG_DUMP_HEX_LABEL("HS FINISH", context->finished_key, hash_len);
             DEBUG_DUMP_HEX_LABEL("HS REMOTE FINISH", context->remote_finished_key, hash_len);
 
-            TLS_FREE(context->server_finished_hash);
-            context->server_finished_hash = (unsigned char *)TLS_MALLOC(hash_len);
-            if (context->server_finished_hash)
-                memcpy(context->server_finished_hash, hash, hash_len);
-
             out_size = hash_len;
             hmac_state hmac;
             hmac_init(&hmac, _private_tls_get_hash_idx(context), context->finished_key, hash_len);
@@ -9293,14 +10627,30 @@ int tls_write(struct TLSContext *context, const unsigned char *data, unsigned in
     if (context->connection_status != 0xFF)
         return TLS_UNEXPECTED_MESSAGE;
 #endif
-    if (len > TLS_MAXTLS_APP_SIZE)
-        len = TLS_MAXTLS_APP_SIZE;
+    unsigned int record_size = tls_record_size(context);
+    if (len > record_size)
+        len = record_size;
     int actually_written = _private_tls_write_packet(tls_build_message(context, data, len));
     if (actually_written <= 0)
         return actually_written;
+    // the size used tells how many records the stream has grown for since it was idle
+    context->write_records = record_size / TLS_RECORD_SIZE_MIN;
+    context->last_write = time(NULL);
     return len;
 }
 
+unsigned int tls_record_size(struct TLSContext *context) {
+    if ((!context) || (!context->write_records))
+        return TLS_RECORD_SIZE_MIN;
+    // an idle connection has an idle congestion window too
+    if (time(NULL) - context->last_write > TLS_RECORD_IDLE)
+        return TLS_RECORD_SIZE_MIN;
+    // one more segment with each record, as the congestion window opens
+    if (context->write_records >= TLS_MAXTLS_APP_SIZE / TLS_RECORD_SIZE_MIN)
+        return TLS_MAXTLS_APP_SIZE;
+    return (context->write_records + 1) * TLS_RECORD_SIZE_MIN;
+}
+
 struct TLSPacket *tls_build_alert(struct TLSContext *context, char critical, unsigned char code) {
     struct TLSPacket *packet = tls_create_packet(context, TLS_ALERT, context->version, 0);
     tls_packet_uint8(packet, critical ? TLS_ALERT_CRITICAL : TLS_ALERT_WARNING);
@@ -9321,32 +10671,8 @@ int _private_tls_read_from_file(const char *fname, void *buf, int max_len) {
     return 0;
 }
 
-int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify) {
-    if (!context)
-        return TLS_GENERIC_ERROR;
-
-    if (context->critical_error)
-        return TLS_BROKEN_CONNECTION;
-
-    if (buf_len <= 0) {
-        DEBUG_PRINT("tls_consume_stream called with buf_len %i\n", buf_len);
-        return 0;
-    }
-
-    if (!buf) {
-        DEBUG_PRINT("tls_consume_stream called NULL buffer\n");
-        context->critical_error = 1;
-        return TLS_NO_MEMORY;
-    }
-
-    unsigned int orig_len = context->message_buffer_len;
-    context->message_buffer_len += buf_len;
-    context->message_buffer = (unsigned char *)TLS_REALLOC(context->message_buffer, context->message_buffer_len);
-    if (!context->message_buffer) {
-        context->message_buffer_len = 0;
-        return TLS_NO_MEMORY;
-    }
-    memcpy(context->message_buffer + orig_len, buf, buf_len);
+// parses every whole record of the receive buffer and keeps the rest for the next call
+static int _private_tls_consume_message_buffer(struct TLSContext *context, tls_validation_function certificate_verify) {
     unsigned int index = 0;
     unsigned int tls_buffer_len = context->message_buffer_len;
     int err_flag = 0;
@@ -9385,7 +10711,8 @@ int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int
     if (err_flag) {
         DEBUG_PRINT("ERROR IN CONSUME: %i\n", err_flag);
         context->message_buffer_len = 0;
-        TLS_FREE(context->message_buffer);
+        context->message_buffer_size = 0;
+        _private_tls_arena_free(context, context->message_buffer);
         context->message_buffer = NULL;
         return err_flag;
     }
@@ -9394,14 +10721,83 @@ int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int
         if (context->message_buffer_len) {
             // no realloc here
             memmove(context->message_buffer, context->message_buffer + index, context->message_buffer_len);
-        } else {
-            TLS_FREE(context->message_buffer);
-            context->message_buffer = NULL;
         }
     }
+    // an empty buffer goes back, idle connections keep none
+    if (!context->message_buffer_len) {
+        context->message_buffer_size = 0;
+        _private_tls_arena_free(context, context->message_buffer);
+        context->message_buffer = NULL;
+    }
     return index;
 }
 
+int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify) {
+    if (!context)
+        return TLS_GENERIC_ERROR;
+
+    if (context->critical_error)
+        return TLS_BROKEN_CONNECTION;
+
+    if (buf_len <= 0) {
+        DEBUG_PRINT("tls_consume_stream called with buf_len %i\n", buf_len);
+        return 0;
+    }
+
+    if (!buf) {
+        DEBUG_PRINT("tls_consume_stream called NULL buffer\n");
+        context->critical_error = 1;
+        return TLS_NO_MEMORY;
+    }
+
+    unsigned int orig_len = context->message_buffer_len;
+    if (context->message_buffer_size - orig_len < (unsigned int)buf_len) {
+        context->message_buffer = (unsigned char *)TLS_REALLOC(context->message_buffer, orig_len + buf_len);
+        if (!context->message_buffer) {
+            context->message_buffer_len = 0;
+            context->message_buffer_size = 0;
+            return TLS_NO_MEMORY;
+        }
+        context->message_buffer_size = orig_len + buf_len;
+    }
+    memcpy(context->message_buffer + orig_len, buf, buf_len);
+    context->message_buffer_len += buf_len;
+    return _private_tls_consume_message_buffer(context, certificate_verify);
+}
+
+unsigned char *tls_stream_buffer(struct TLSContext *context, unsigned int *size) {
+    if ((!context) || (!size) || (context->critical_error))
+        return NULL;
+    unsigned int len = context->message_buffer_len;
+    if (context->message_buffer_size - len < TLS_STREAM_RESERVE) {
+        unsigned char *new_buffer;
+        if (context->message_buffer)
+            new_buffer = (unsigned char *)TLS_REALLOC(context->message_buffer, len + TLS_STREAM_RESERVE);
+        else
+            new_buffer = (unsigned char *)_private_tls_arena_malloc(context, TLS_STREAM_RESERVE);
+        if (!new_buffer)
+            return NULL;
+        context->message_buffer = new_buffer;
+        context->message_buffer_size = len + TLS_STREAM_RESERVE;
+    }
+    *size = context->message_buffer_size - len;
+    return context->message_buffer + len;
+}
+
+int tls_consume_stream_buffer(struct TLSContext *context, unsigned int len, tls_validation_function certificate_verify) {
+    if (!context)
+        return TLS_GENERIC_ERROR;
+
+    if (context->critical_error)
+        return TLS_BROKEN_CONNECTION;
+
+    if ((!context->message_buffer) || (len > context->message_buffer_size - context->message_buffer_len))
+        return len ? TLS_GENERIC_ERROR : 0;
+
+    context->message_buffer_len += len;
+    return _private_tls_consume_message_buffer(context, certificate_verify);
+}
+
 void tls_close_notify(struct TLSContext *context) {
     if ((!context) || (context->critical_error))
         return;
@@ -9535,7 +10931,7 @@ int tls_export_context(struct TLSContext *context, unsigned char *buffer, unsign
     tls_packet_append(packet, context->message_buffer, context->message_buffer_len);
     
     tls_packet_uint32(packet, context->application_buffer_len);
-    tls_packet_append(packet, context->application_buffer, context->application_buffer_len);
+    tls_packet_append(packet, context->application_buffer + context->application_buffer_start, context->application_buffer_len);
     tls_packet_uint8(packet, context->dtls);
     if (context->dtls) {
         tls_packet_uint16(packet, context->dtls_epoch_local);
@@ -9728,6 +11124,7 @@ struct TLSContext *tls_import_context(const unsigned char *buffer, unsigned int
             if (context->message_buffer) {
                 memcpy(context->message_buffer, &buffer[buf_pos], message_buffer_len);
                 context->message_buffer_len = message_buffer_len;
+                context->message_buffer_size = message_buffer_len;
             }
             buf_pos += message_buffer_len;
         }
@@ -10013,10 +11410,12 @@ int tls_remote_error(struct TLSContext *context) {
 
 int tls_context_check_client_certificate(char *pkey, struct TLSContext *ctx)
 {
+    // the client must also have proven it owns the key of the certificate
+    if ( ctx->client_certificates_count < 1 || ctx->client_verified != 1 )
+        return 0;
     if ( !pkey )
-        return ctx->client_certificates_count >= 1;
-    return ctx->client_certificates_count >= 1 
-           && memcmp(pkey, ctx->client_certificates[0]->pk, ctx->client_certificates[0]->pk_len) == 0;
+        return 1;
+    return memcmp(pkey, ctx->client_certificates[0]->pk, ctx->client_certificates[0]->pk_len) == 0;
 }
 
 char *get_client_public_key(struct TLSContext *ctx)
@@ -10026,6 +11425,52 @@ char *get_client_public_key(struct TLSContext *ctx)
     return (char *) ctx->client_certificates[0]->pk;
 }
 
+int tls_set_resumable_session(struct TLSContext *context, struct TLSContext *established)
+{
+    if ((!context) || (!established) || (!context->is_server) || (context->connection_status))
+        return TLS_GENERIC_ERROR;
+    if ((established->connection_status != 0xFF) || (established->version != TLS_V12) || (!established->session_size) ||
+        (!established->master_key) || (established->master_key_len != TLS_MASTER_SECRET_SIZE))
+        return TLS_FEATURE_NOT_SUPPORTED;
+    memcpy(context->resumable_session, established->session, established->session_size);
+    context->resumable_session_size = established->session_size;
+    context->resumable_cipher = established->cipher;
+    memcpy(context->resumable_master_key, established->master_key, TLS_MASTER_SECRET_SIZE);
+    return 0;
+}
+
+int tls_set_version_range(struct TLSContext *context, unsigned short min_version, unsigned short max_version)
+{
+    if ((!context) || (!context->is_server) || (context->dtls) || ((min_version) && (max_version) && (min_version > max_version)))
+        return TLS_GENERIC_ERROR;
+    context->min_version = min_version;
+    context->max_version = max_version;
+    // the version a server starts from is the highest before TLS 1.3, the client extension moves it up
+    if (max_version)
+        context->version = (max_version < TLS_V12) ? max_version : TLS_V12;
+    return 0;
+}
+
+int tls_session_resumed(struct TLSContext *context)
+{
+    return (context) && (context->resumed);
+}
+
+int tls_set_signature_schemes(struct TLSContext *context, unsigned char schemes)
+{
+    if ((!context) || (context->is_server) || (schemes & ~(TLS_SIGN_RSA | TLS_SIGN_ECDSA)))
+        return TLS_GENERIC_ERROR;
+    context->sign_schemes = schemes;
+    return 0;
+}
+
+int tls_peer_is_ecdsa(struct TLSContext *context)
+{
+    if ((!context) || (context->is_server) || (!context->certificates_count) || (!context->certificates[0]))
+        return 0;
+    return context->certificates[0]->ec_algorithm != 0;
+}
+
 #ifdef SSL_COMPATIBLE_INTERFACE
 
 int  SSL_library_init() {
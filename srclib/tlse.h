@@ -1,6 +1,8 @@
 #ifndef TLSE_H
 #define TLSE_H
 
+#include <stddef.h>
+
 // #define DEBUG
 
 // define TLS_LEGACY_SUPPORT to support TLS 1.1/1.0 (legacy)
@@ -189,6 +191,7 @@ struct TLSCertificate;
 #define TLS_CLIENT_RANDOM_SIZE      32
 #define TLS_SERVER_RANDOM_SIZE      32
 #define TLS_MAX_SESSION_ID          32
+#define TLS_MASTER_SECRET_SIZE      48
 
 struct TLSCertificate {
     unsigned short version;
@@ -264,6 +267,24 @@ int tls_packet_uint16(struct TLSPacket *packet, unsigned short i);
 int tls_packet_uint32(struct TLSPacket *packet, unsigned int i);
 int tls_packet_uint24(struct TLSPacket *packet, unsigned int i);
 int tls_random(unsigned char *key, int len);
+/*
+  Per-thread ChaCha20 generator: seeded from getrandom(), reseeded every MiB of output and after
+  fork(). Build with -DTLS_USE_RANDOM_SOURCE=tls_drbg_random so that tls_random and libtomcrypt's
+  sprng use it instead of opening /dev/urandom on every call. Returns 1 on success.
+*/
+int tls_drbg_random(unsigned char *key, int len);
+/*
+  Allocator for TLS_MALLOC, TLS_CALLOC, TLS_REALLOC and TLS_FREE when tlse is built with
+  TLS_SLAB_ALLOCATOR: blocks up to 20 KiB come from size classes carved out of 64 KiB chunks,
+  with a cache per thread in front of the shared classes; larger ones go to malloc, and from
+  64 KiB (the contexts) to their own mapping. Blocks may be freed by any thread. Each
+  connection also keeps a few of its freed record buffers for its next records, dropped once
+  it has nothing pending and released by tls_destroy_context.
+*/
+void *tls_slab_malloc(size_t size);
+void *tls_slab_calloc(size_t count, size_t size);
+void *tls_slab_realloc(void *ptr, size_t size);
+void tls_slab_free(void *ptr);
 
 /*
   Get encrypted data to write, if any. Once you've sent all of it, call
@@ -273,6 +294,9 @@ const unsigned char *tls_get_write_buffer(struct TLSContext *context, unsigned i
 
 void tls_buffer_clear(struct TLSContext *context);
 
+/* Drops the first len bytes of the write buffer, once they have been sent. */
+void tls_buffer_shift(struct TLSContext *context, unsigned int len);
+
 /* Returns 1 for established, 0 for not established yet, and -1 for a critical error. */
 int tls_established(struct TLSContext *context);
 
@@ -340,6 +364,13 @@ struct TLSPacket *tls_build_done(struct TLSContext *context);
 struct TLSPacket *tls_build_message(struct TLSContext *context, const unsigned char *data, unsigned int len);
 int tls_client_connect(struct TLSContext *context);
 int tls_write(struct TLSContext *context, const unsigned char *data, unsigned int len);
+
+/*
+  Payload of the next record built by tls_write(). Records start at about one TCP segment,
+  grow by one segment with every record up to 16 KiB and start small again after a second
+  without writing, so the first bytes of a stream do not wait for a whole record.
+*/
+unsigned int tls_record_size(struct TLSContext *context);
 struct TLSPacket *tls_build_alert(struct TLSContext *context, char critical, unsigned char code);
 
 /*
@@ -358,6 +389,16 @@ struct TLSPacket *tls_build_alert(struct TLSContext *context, char critical, uns
   non-NULL.
  */
 int tls_consume_stream(struct TLSContext *context, const unsigned char *buf, int buf_len, tls_validation_function certificate_verify);
+
+/*
+  Like tls_consume_stream(), without copying the data: tls_stream_buffer() returns where the
+  next bytes of the stream must be written, after those not processed yet, and its size
+  (room for a whole record at least). Once len bytes have been written there (e.g. by recv),
+  tls_consume_stream_buffer() processes them. Call it with len 0 if nothing was received,
+  so that an empty buffer is released. Returns the same as tls_consume_stream().
+*/
+unsigned char *tls_stream_buffer(struct TLSContext *context, unsigned int *size);
+int tls_consume_stream_buffer(struct TLSContext *context, unsigned int len, tls_validation_function certificate_verify);
 void tls_close_notify(struct TLSContext *context);
 void tls_alert(struct TLSContext *context, unsigned char critical, int code);
 
@@ -386,6 +427,55 @@ int tls_add_alpn(struct TLSContext *context, const char *alpn);
 int tls_alpn_contains(struct TLSContext *context, const char *alpn, unsigned char alpn_size);
 const char *tls_alpn(struct TLSContext *context);
 char *get_client_public_key(struct TLSContext *ctx);
+/*
+  Allows the client of a new server context to resume the TLS 1.2 session of an established
+  one (same session id, master secret and cipher) with an abbreviated handshake.
+  Must be called before the handshake starts. Returns 0 on success.
+*/
+int tls_set_resumable_session(struct TLSContext *context, struct TLSContext *established);
+/*
+  Limits the versions a server context accepts (TLS_V10 to TLS_V13, 0 for no limit).
+  Clients out of the range get a protocol_version alert. Returns 0 on success.
+*/
+int tls_set_version_range(struct TLSContext *context, unsigned short min_version, unsigned short max_version);
+/*
+  Limits the signature schemes a TLS 1.3 client offers to the families in schemes
+  (TLS_SIGN_RSA, TLS_SIGN_ECDSA), so that a server with both certificates has to use
+  that one. 0 offers every scheme. Call it before tls_client_connect. Returns 0 on success.
+*/
+#define TLS_SIGN_RSA    1
+#define TLS_SIGN_ECDSA  2
+int tls_set_signature_schemes(struct TLSContext *context, unsigned char schemes);
+/*
+  Client side: 1 if the certificate of the server has an EC key, once it has been received.
+*/
+int tls_peer_is_ecdsa(struct TLSContext *context);
+/*
+  Starts a background thread that keeps up to depth ephemeral key pairs ready for every
+  key exchange curve (x25519, secp256r1, secp384r1), so handshakes pop one instead of
+  generating it. Handshakes generate their own key when the pool of the curve is empty.
+  Call it once after tls_init(). Returns 0 on success (or if depth is 0).
+*/
+int tls_keyshare_pool_start(unsigned int depth);
+/*
+  Curve name, keys ready, keys taken and handshakes that found it empty for the pool number
+  index. Returns 0 if there is no such pool.
+*/
+int tls_keyshare_pool_stats(unsigned int index, const char **curve, unsigned int *depth, unsigned long *popped, unsigned long *exhausted);
+/*
+  Private key step of a RSA signature of the handshake (ServerKeyExchange or CertificateVerify).
+  An executor set with tls_set_sign_executor gets every job and must return once
+  tls_sign_jobs_run has run it, on any thread. Without executor jobs run in the handshake thread.
+*/
+struct TLSSignJob;
+typedef void (*tls_sign_executor)(struct TLSSignJob *job);
+void tls_set_sign_executor(tls_sign_executor executor);
+typedef void (*tls_sign_done)(int index, void *arg);
+// runs count jobs in order, importing the private key once for consecutive jobs with the same key;
+// done (may be NULL) is called with the index of every job as soon as it finishes
+void tls_sign_jobs_run(struct TLSSignJob **jobs, int count, tls_sign_done done, void *arg);
+// 1 if the handshake of the context resumed a previous session
+int tls_session_resumed(struct TLSContext *context);
 // useful when renewing certificates for servers, without the need to restart the server
 int tls_clear_certificates(struct TLSContext *context);
 int tls_make_ktls(struct TLSContext *context, int socket);